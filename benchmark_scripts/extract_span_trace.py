@@ -0,0 +1,76 @@
+# Imports
+
+from pathlib import Path
+import sys
+import getopt
+import json
+
+# Constants
+
+# marker lines printed by vPrintSpanTrace() around each trace
+trace_begin = 'SPAN_TRACE_BEGIN'
+trace_end = 'SPAN_TRACE_END'
+
+def main(argv):
+    input_file = None
+    output_dir = Path().absolute()
+
+    try:
+        opts, args = getopt.getopt(argv,"hi:o:",["input_file=","output_dir="])
+    except getopt.GetoptError:
+        print('extract_span_trace.py -i <input_file> [-o <output_dir>]')
+        sys.exit(2)
+
+    for opt, arg in opts:
+        if opt == '-i':
+            input_file = Path(arg)
+        elif opt == '-o':
+            output_dir = Path(arg)
+        else:
+            print('extract_span_trace.py -i <input_file> [-o <output_dir>]')
+            sys.exit(2)
+
+    if input_file is None:
+        print('extract_span_trace.py -i <input_file> [-o <output_dir>]')
+        sys.exit(2)
+
+    traces = extract_traces(input_file)
+    if len(traces) == 0:
+        print('No span traces in {}'.format(input_file.name))
+        return
+
+    for i, trace in enumerate(traces):
+        output_file = output_dir / '{}_trace_{}.json'.format(input_file.stem, i)
+        with open(output_file, 'w') as fout:
+            json.dump(trace, fout)
+        print('{}: {} events'.format(output_file.name, len(trace['traceEvents'])))
+
+def extract_traces(input_file):
+    '''
+    Extract each block between SPAN_TRACE_BEGIN and SPAN_TRACE_END
+
+    The server's stdout may have other output (e.g., NetworkInterface messages)
+    interleaved, so only lines that look like part of the JSON are kept.
+
+    returns
+    -------
+    traces : list of dicts in Chrome trace-event format
+    '''
+    traces = []
+    block = None
+
+    with open(input_file) as fin:
+        for line in fin:
+            line = line.strip()
+            if line == trace_begin:
+                block = ''
+            elif line == trace_end and block is not None:
+                traces.append(json.loads(block))
+                block = None
+            elif block is not None and (line.startswith('{') or line.startswith(']')):
+                block += line
+
+    return traces
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
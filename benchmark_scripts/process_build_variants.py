@@ -0,0 +1,140 @@
+# Imports
+
+import pandas as pd
+import numpy as np
+from io import StringIO
+from pathlib import Path
+import re
+import sys
+import getopt
+
+# Constants
+
+# Rows compared between variants: server time to process each request and
+# client time for each request/reply round trip
+benchmark_types = ['REQUEST_PROCESSING_MICROBENCHMARK', 'MAX_PROCESSING_MACROBENCHMARK']
+
+# output files are named <benchmark>_<date>_<time>.txt
+benchmark_name_pattern = re.compile(r'^(modbus_\w+?_(?:micro|macro)benchmark_\d+)_\d{4}-\d{2}-\d{2}_')
+
+# benchmark name parts of the capability shims, longest first
+shim_parts = ['_object_network_caps', '_network_caps', '_object_caps']
+
+def usage():
+    print('process_build_variants.py -d <results_dir> [-b <baseline_variant>]')
+    print('results_dir holds a directory of run_loopback_bench.sh output per variant')
+
+def main(argv):
+    input_dir = None
+    baseline = 'default'
+
+    try:
+        opts, args = getopt.getopt(argv,"hd:b:",["input_dir=","baseline="])
+    except getopt.GetoptError:
+        usage()
+        sys.exit(2)
+
+    for opt, arg in opts:
+        if opt == '-d':
+            input_dir = Path(arg)
+        elif opt == '-b':
+            baseline = arg
+        else:
+            usage()
+            sys.exit(2)
+
+    if input_dir is None:
+        usage()
+        sys.exit(2)
+
+    df = extract_variants(input_dir)
+    if df is None:
+        print('No benchmark output in ' + str(input_dir))
+        sys.exit(1)
+
+    gms = variant_gms(df)
+    print('Geometric mean over Modbus functions of the median time')
+    print(gms.to_string())
+
+    if baseline in gms.columns:
+        print()
+        print('Change (%) against ' + baseline)
+        print(compare_variants(gms, baseline).to_string())
+
+    overheads = shim_overheads(gms)
+    if len(overheads) > 0:
+        print()
+        print('Shim overhead (%) against the configuration without shims, per variant')
+        print(overheads.to_string())
+
+def extract_variants(input_dir):
+    '''
+    returns
+    -------
+    df : DataFrame of every sample, with its variant (the subdirectory) and
+         benchmark (the output file name without the date)
+    '''
+    dfs = []
+    for variant_dir in sorted(p for p in input_dir.iterdir() if p.is_dir()):
+        for file in sorted(variant_dir.glob('*.txt')):
+            match = benchmark_name_pattern.match(file.name)
+            if match is None:
+                continue
+
+            csv = 'benchmark_type,modbus_function_name,time_diff\n'
+            with open(file) as fin:
+                for line in fin:
+                    if any(line.startswith(t) for t in benchmark_types):
+                        csv += line.replace(', ', ',')
+
+            df = pd.read_csv(StringIO(csv)).dropna()
+            df['variant'] = variant_dir.name
+            df['benchmark'] = match.group(1)
+            dfs.append(df)
+
+    if len(dfs) == 0:
+        return None
+
+    df = pd.concat(dfs, ignore_index=True)
+    return df if len(df) > 0 else None
+
+def variant_gms(df):
+    '''
+    Geometric mean (over Modbus functions) of the median time for each
+    function, indexed by benchmark with a column per variant
+    '''
+    medians = df.groupby(['benchmark', 'variant', 'modbus_function_name'])['time_diff'].median()
+    medians = medians[medians > 0]
+    gms = np.exp(np.log(medians).groupby(['benchmark', 'variant']).mean())
+    variants = list(dict.fromkeys(df['variant']))
+    return gms.unstack('variant')[[v for v in variants if v in gms.index.get_level_values('variant')]]
+
+def compare_variants(gms, baseline):
+    '''
+    Change (%) of every other variant against the baseline
+    '''
+    change = pd.DataFrame(index=gms.index)
+    for variant in gms.columns:
+        if variant != baseline:
+            change[variant] = ((gms[variant] - gms[baseline]) / gms[baseline]) * 100
+    return change
+
+def shim_overheads(gms):
+    '''
+    Overhead (%) of each shim configuration against the same benchmark
+    without shims, per variant.  If a variant shrinks the overhead, that
+    part of it was call and inlining cost across the library boundaries.
+    '''
+    rows = {}
+    for benchmark in gms.index:
+        for part in shim_parts:
+            if part in benchmark:
+                base = benchmark.replace(part, '')
+                if base in gms.index:
+                    rows[benchmark] = ((gms.loc[benchmark] - gms.loc[base]) / gms.loc[base]) * 100
+                break
+
+    return pd.DataFrame(rows).T
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
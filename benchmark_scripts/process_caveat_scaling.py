@@ -0,0 +1,141 @@
+# Imports
+
+import pandas as pd
+from io import StringIO
+from pathlib import Path
+import sys
+import getopt
+
+# Constants
+
+# Rows printed by modbus_caveat_benchmark
+benchmark_type = 'CAVEAT_SCALING'
+
+columns = ['benchmark_type', 'format', 'caveats', 'caveat_length', 'token_bytes', 'result',
+           'iterations', 'mean_ns', 'p50_ns', 'p99_ns', 'cycles', 'instructions',
+           'allocations', 'bytes', 'peak_live_bytes']
+
+# the client shim adds a function and an address caveat to every token,
+# so every delegation step after that adds at least one caveat
+shim_caveats = 2
+
+def usage():
+    print('process_caveat_scaling.py -i <input_file> [-b <p99_budget_us>] [-o <plot_file>]')
+
+def main(argv):
+    input_file = None
+    budget_us = None
+    plot_file = None
+
+    try:
+        opts, args = getopt.getopt(argv,"hi:b:o:",["input=","budget=","output="])
+    except getopt.GetoptError:
+        usage()
+        sys.exit(2)
+
+    for opt, arg in opts:
+        if opt == '-i':
+            input_file = Path(arg)
+        elif opt == '-b':
+            budget_us = float(arg)
+        elif opt == '-o':
+            plot_file = Path(arg)
+        else:
+            usage()
+            sys.exit(2)
+
+    if input_file is None:
+        usage()
+        sys.exit(2)
+
+    df = extract_caveat_scaling(input_file)
+    if df is None:
+        print('No ' + benchmark_type + ' rows in ' + str(input_file))
+        sys.exit(1)
+
+    print(df.to_string(index=False))
+
+    print()
+    print(cost_per_caveat(df).to_string(index=False))
+
+    if budget_us is not None:
+        print()
+        print(budget_summary(df, budget_us).to_string(index=False))
+
+    if plot_file is not None:
+        plot_caveat_scaling(df, plot_file)
+
+def extract_caveat_scaling(input_file):
+    '''
+    returns
+    -------
+    df : DataFrame with one row per (format, caveat length, caveats)
+    '''
+    csv = ','.join(columns) + '\n'
+    with open(input_file) as fin:
+        for line in fin:
+            if line.startswith(benchmark_type):
+                csv += line.replace(', ', ',')
+
+    df = pd.read_csv(StringIO(csv), na_values=['NA'])
+    if len(df) == 0:
+        return None
+
+    return df.drop(columns=['benchmark_type']).sort_values(['format', 'caveat_length', 'caveats'])
+
+def cost_per_caveat(df):
+    '''
+    Least-squares slope and intercept of the mean verification time against
+    the number of caveats, over the tokens the shim accepted
+    '''
+    rows = []
+    for (fmt, length), group in df[df['result'] == 'PASS'].groupby(['format', 'caveat_length']):
+        if len(group) < 2:
+            continue
+        x = group['caveats']
+        y = group['mean_ns']
+        slope = ((x - x.mean()) * (y - y.mean())).sum() / ((x - x.mean()) ** 2).sum()
+        rows.append({'format': fmt, 'caveat_length': length,
+                     'ns_per_caveat': slope, 'ns_at_0_caveats': y.mean() - slope * x.mean(),
+                     'bytes_per_caveat': (group['token_bytes'].diff() / x.diff()).mean(),
+                     'max_accepted_caveats': x.max()})
+
+    return pd.DataFrame(rows)
+
+def budget_summary(df, budget_us):
+    '''
+    The deepest delegation chain (caveats added after the shim's own) whose
+    p99 verification time fits in the budget, for each format and length
+    '''
+    rows = []
+    for (fmt, length), group in df.groupby(['format', 'caveat_length']):
+        ok = group[(group['result'] == 'PASS') & (group['p99_ns'] <= budget_us * 1000)]
+        depth = (ok['caveats'].max() - shim_caveats) if len(ok) else None
+        rows.append({'format': fmt, 'caveat_length': length,
+                     'p99_budget_us': budget_us, 'max_added_caveats': depth})
+
+    return pd.DataFrame(rows)
+
+def plot_caveat_scaling(df, plot_file):
+    import matplotlib.pyplot as plt
+
+    # prefer cycles when the hardware counters were available
+    cost = 'cycles' if df['cycles'].notna().any() else 'mean_ns'
+
+    fig, axes = plt.subplots(1, 3, figsize=(15, 4))
+    for (fmt, length), group in df[df['result'] == 'PASS'].groupby(['format', 'caveat_length']):
+        label = '{} ({} chars)'.format(fmt, length)
+        axes[0].plot(group['caveats'], group[cost], marker='o', label=label)
+        axes[1].plot(group['caveats'], group['allocations'], marker='o', label=label)
+        axes[2].plot(group['caveats'], group['bytes'], marker='o', label=label)
+
+    axes[0].set_ylabel('Cycles per verification' if cost == 'cycles' else 'Mean verification time (ns)')
+    axes[1].set_ylabel('Allocations per verification')
+    axes[2].set_ylabel('Bytes allocated per verification')
+    for ax in axes:
+        ax.set_xlabel('Caveats')
+    axes[0].legend()
+    fig.savefig(plot_file, bbox_inches='tight')
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -0,0 +1,120 @@
+# Imports
+
+import pandas as pd
+from io import StringIO
+from pathlib import Path
+import sys
+import getopt
+
+# Constants
+
+# Heap profile rows printed by vPrintHeapProfile()
+heap_profile_types = [
+    'HEAP_REQUESTS_PROFILE',
+    'HEAP_ALLOCATIONS_PROFILE',
+    'HEAP_FREES_PROFILE',
+    'HEAP_BYTES_PROFILE',
+    'HEAP_PEAK_LIVE_BYTES_PROFILE',
+    'HEAP_CALL_SITE_ALLOCATIONS_PROFILE',
+    'HEAP_CALL_SITE_BYTES_PROFILE',
+]
+
+# number of call sites to display for each benchmark
+num_call_sites = 10
+
+def main(argv):
+    input_dir = None
+    benchmark_names = None
+
+    try:
+        opts, args = getopt.getopt(argv,"hd:b:",["input_dir=","benchmarks="])
+    except getopt.GetoptError:
+        print('process_heap_profile.py -d <input_dir> [-b <benchmark,...>]')
+        sys.exit(2)
+
+    for opt, arg in opts:
+        if opt == '-d':
+            input_dir = Path(arg)
+        elif opt == '-b':
+            benchmark_names = arg.split(',')
+        else:
+            print('process_heap_profile.py -d <input_dir> [-b <benchmark,...>]')
+            sys.exit(2)
+
+    if input_dir is None:
+        print('process_heap_profile.py -d <input_dir> [-b <benchmark,...>]')
+        sys.exit(2)
+
+    # by default, group output files by everything before the trailing run number
+    if benchmark_names is None:
+        benchmark_names = sorted({f.stem.rsplit('_', 1)[0] for f in input_dir.glob('*.txt')})
+
+    for benchmark_name in benchmark_names:
+        df = extract_heap_profile(input_dir, benchmark_name)
+        if df is None:
+            continue
+
+        print()
+        print(benchmark_name)
+        print()
+        print(per_function_summary(df))
+        print()
+        print(per_call_site_summary(df).head(num_call_sites))
+
+def extract_heap_profile(input_dir, benchmark_name):
+    '''
+    Extract the heap profile rows from all output files for a benchmark
+
+    returns
+    -------
+    df : DataFrame with 'benchmark_type', 'modbus_function_name' and 'value' columns
+    '''
+    csv = 'benchmark_type,modbus_function_name,value\n'
+    for benchmark_output_file in sorted(input_dir.glob(benchmark_name + '_*.txt')):
+        with open(benchmark_output_file) as fin:
+            for line in fin:
+                if line.split(',')[0] in heap_profile_types:
+                    csv += line.replace(', ', ',')
+
+    df = pd.read_csv(StringIO(csv))
+    if len(df) == 0:
+        return None
+
+    return df.dropna()
+
+def per_function_summary(df):
+    '''
+    Summarise the heap profile per Modbus function, normalised per request
+    (summed over all runs; peak live bytes is the maximum over all runs)
+    '''
+    df = df[~df['benchmark_type'].str.startswith('HEAP_CALL_SITE')]
+
+    totals = df[df['benchmark_type'] != 'HEAP_PEAK_LIVE_BYTES_PROFILE'].pivot_table(
+            index='modbus_function_name', columns='benchmark_type',
+            values='value', aggfunc='sum')
+    peaks = df[df['benchmark_type'] == 'HEAP_PEAK_LIVE_BYTES_PROFILE'].pivot_table(
+            index='modbus_function_name', values='value', aggfunc='max')
+
+    summary = pd.DataFrame(index=totals.index)
+    summary['requests'] = totals['HEAP_REQUESTS_PROFILE']
+    summary['allocs/request'] = totals['HEAP_ALLOCATIONS_PROFILE'] / totals['HEAP_REQUESTS_PROFILE']
+    summary['frees/request'] = totals['HEAP_FREES_PROFILE'] / totals['HEAP_REQUESTS_PROFILE']
+    summary['bytes/request'] = totals['HEAP_BYTES_PROFILE'] / totals['HEAP_REQUESTS_PROFILE']
+    summary['peak_live_bytes'] = peaks['value']
+
+    return summary
+
+def per_call_site_summary(df):
+    '''
+    Summarise allocations per (function, call site), most allocations first
+    '''
+    df = df[df['benchmark_type'].str.startswith('HEAP_CALL_SITE')]
+
+    summary = df.pivot_table(index='modbus_function_name', columns='benchmark_type',
+            values='value', aggfunc='sum')
+    summary.columns = ['allocations', 'bytes']
+
+    return summary.sort_values('allocations', ascending=False)
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
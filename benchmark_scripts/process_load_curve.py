@@ -0,0 +1,119 @@
+# Imports
+
+import pandas as pd
+from io import StringIO
+from pathlib import Path
+import sys
+import getopt
+
+# Constants
+
+# Rows printed by the open-loop load generator (modbus_test_client -r)
+benchmark_type = 'LOADGEN_OPEN_LOOP'
+
+columns = ['benchmark_type', 'rate', 'thread', 'modbus_function_name', 'requests', 'errors',
+           'throughput', 'mean_us', 'p50_us', 'p99_us', 'p999_us', 'max_us']
+
+# latency columns shown in the curve
+latency_columns = ['mean_us', 'p50_us', 'p99_us', 'p999_us', 'max_us']
+
+def usage():
+    print('process_load_curve.py -i <input_file> [-f <function>] [-s <p99_sla_us>] [-o <plot_file>]')
+
+def main(argv):
+    input_file = None
+    function_name = 'ALL'
+    sla_us = None
+    plot_file = None
+
+    try:
+        opts, args = getopt.getopt(argv,"hi:f:s:o:",["input=","function=","sla=","output="])
+    except getopt.GetoptError:
+        usage()
+        sys.exit(2)
+
+    for opt, arg in opts:
+        if opt == '-i':
+            input_file = Path(arg)
+        elif opt == '-f':
+            function_name = arg
+        elif opt == '-s':
+            sla_us = float(arg)
+        elif opt == '-o':
+            plot_file = Path(arg)
+        else:
+            usage()
+            sys.exit(2)
+
+    if input_file is None:
+        usage()
+        sys.exit(2)
+
+    df = extract_load_curve(input_file, function_name)
+    if df is None:
+        print('No ' + benchmark_type + ' rows for ' + function_name + ' in ' + str(input_file))
+        sys.exit(1)
+
+    print(df.to_string(index=False))
+
+    if sla_us is not None:
+        print()
+        print(sla_summary(df, sla_us))
+
+    if plot_file is not None:
+        plot_load_curve(df, function_name, sla_us, plot_file)
+
+def extract_load_curve(input_file, function_name):
+    '''
+    Extract the merged (thread ALL) rows for one function at each target rate
+
+    returns
+    -------
+    df : DataFrame indexed by target rate with achieved throughput, errors and latencies
+    '''
+    csv = ','.join(columns) + '\n'
+    with open(input_file) as fin:
+        for line in fin:
+            if line.startswith(benchmark_type):
+                csv += line.replace(', ', ',')
+
+    df = pd.read_csv(StringIO(csv))
+    df = df[(df['thread'] == 'ALL') & (df['modbus_function_name'] == function_name)]
+    if len(df) == 0:
+        return None
+
+    return df[['rate', 'throughput', 'requests', 'errors'] + latency_columns].sort_values('rate')
+
+def sla_summary(df, sla_us):
+    '''
+    The highest target rate whose p99 meets the SLA.  Latencies are measured
+    from the intended send time, so a rate the server can't keep up with
+    shows up as a growing p99 rather than a lower send rate.
+    '''
+    ok = df[(df['p99_us'] <= sla_us) & (df['errors'] == 0)]
+    if len(ok) == 0:
+        return 'No target rate meets p99 <= {:.0f} us'.format(sla_us)
+
+    best = ok.iloc[-1]
+    return 'Highest rate meeting p99 <= {:.0f} us: {:.0f} req/s (achieved {:.1f} req/s, p99 {:.1f} us)'.format(
+            sla_us, best['rate'], best['throughput'], best['p99_us'])
+
+def plot_load_curve(df, function_name, sla_us, plot_file):
+    import matplotlib.pyplot as plt
+
+    fig, ax = plt.subplots()
+    for column in ['p50_us', 'p99_us', 'p999_us']:
+        ax.plot(df['throughput'], df[column], marker='o', label=column.replace('_us', ''))
+
+    if sla_us is not None:
+        ax.axhline(sla_us, color='grey', linestyle='--', label='p99 SLA')
+
+    ax.set_xlabel('Throughput (req/s)')
+    ax.set_ylabel('Latency from intended send time (us)')
+    ax.set_yscale('log')
+    ax.set_title(function_name)
+    ax.legend()
+    fig.savefig(plot_file, bbox_inches='tight')
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
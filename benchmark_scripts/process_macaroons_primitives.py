@@ -0,0 +1,94 @@
+# Imports
+
+import pandas as pd
+from pathlib import Path
+import sys
+import getopt
+
+# Constants
+
+# columns written by run_macaroons_bench.sh
+columns = ['date', 'host', 'revision', 'operation', 'iterations', 'ns_per_op', 'min_ns_per_op',
+           'allocations_per_op', 'bytes_per_op']
+
+metrics = ['ns_per_op', 'min_ns_per_op', 'allocations_per_op', 'bytes_per_op']
+
+def usage():
+    print('process_macaroons_primitives.py -i <history_file> [-m <metric>] [-H <host>] [-b <baseline_revision>]')
+    print('metrics: ' + ', '.join(metrics) + ' (default: ns_per_op)')
+
+def main(argv):
+    input_file = None
+    metric = 'ns_per_op'
+    host = None
+    baseline = None
+
+    try:
+        opts, args = getopt.getopt(argv,"hi:m:H:b:",["input=","metric=","host=","baseline="])
+    except getopt.GetoptError:
+        usage()
+        sys.exit(2)
+
+    for opt, arg in opts:
+        if opt == '-i':
+            input_file = Path(arg)
+        elif opt == '-m':
+            metric = arg
+        elif opt == '-H':
+            host = arg
+        elif opt == '-b':
+            baseline = arg
+        else:
+            usage()
+            sys.exit(2)
+
+    if input_file is None or metric not in metrics:
+        usage()
+        sys.exit(2)
+
+    df = pd.read_csv(input_file, skipinitialspace=True)
+    if host is not None:
+        df = df[df['host'] == host]
+
+    if len(df) == 0:
+        print('No results in ' + str(input_file))
+        sys.exit(1)
+
+    # only compare runs on the same host
+    if df['host'].nunique() > 1:
+        print('Results from several hosts, pick one with -H: ' + ', '.join(df['host'].unique()))
+        sys.exit(1)
+
+    history = revision_history(df, metric)
+    print(history.to_string())
+
+    if len(history.columns) > 1:
+        print()
+        print(compare_revisions(history, baseline).to_string())
+
+def revision_history(df, metric):
+    '''
+    returns
+    -------
+    df : DataFrame of the metric, indexed by operation, with a column per
+         revision in the order they were benchmarked (the median if a
+         revision was benchmarked more than once)
+    '''
+    revisions = list(dict.fromkeys(df['revision']))
+    history = df.pivot_table(index='operation', columns='revision', values=metric, aggfunc='median')
+    return history[revisions]
+
+def compare_revisions(history, baseline):
+    '''
+    Change (%) of the latest revision against the baseline
+    (default: the revision before it)
+    '''
+    latest = history.columns[-1]
+    if baseline is None:
+        baseline = history.columns[-2]
+
+    change = ((history[latest] - history[baseline]) / history[baseline]) * 100
+    return pd.DataFrame({baseline: history[baseline], latest: history[latest], 'change (%)': change})
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
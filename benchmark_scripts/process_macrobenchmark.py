@@ -17,6 +17,14 @@ this_dir = Path().absolute()
 # This designates the throughput test in the macrobenchmark file
 benchmark_type = 'MAX_PROCESSING_MACROBENCHMARK'
 
+# With network caps, MAX_PROCESSING is split into the Macaroon (token) write
+# and the request itself (data)
+token_benchmark_type = 'TOKEN_ROUND_TRIP_MACROBENCHMARK'
+data_benchmark_type = 'DATA_ROUND_TRIP_MACROBENCHMARK'
+
+# the client records each request's time_diff in nanoseconds
+time_unit = 'ns'
+
 # number of requests made by the client to server during the macrobenchmark
 num_reqs = 1;
 
@@ -122,6 +130,15 @@ def main(argv):
     print("Variant:\t10ms network latency")
     display_data(benchmark_type, benchmark_data, benchmark_names_network_caps_10ms)
 
+    for variant, names in [("0ms network latency", benchmark_names_network_caps_0ms),
+                           ("10ms network latency", benchmark_names_network_caps_10ms)]:
+        for (breakdown, breakdown_type) in [("token", token_benchmark_type),
+                                            ("data", data_benchmark_type)]:
+            print()
+            print("Comparing:\tbase + net | base + CHERI + net | base + CHERI + obj + net")
+            print("Variant:\t{}, {} round trip".format(variant, breakdown))
+            display_data(breakdown_type, benchmark_data, names)
+
 
 def display_data(benchmark_type, benchmark_data, benchmark_names):
     '''
@@ -134,10 +151,13 @@ def display_data(benchmark_type, benchmark_data, benchmark_names):
         return
 
     print()
+    print('Geometric mean time per request (' + time_unit + ')')
     print(gms['mean']/num_reqs)
     print()
+    print('Standard deviation (' + time_unit + ')')
     print(sds['mean'])
     print()
+    print('Overhead against the baseline (%)')
     print(overheads['mean'])
 
 def extract_benchmark_data(input_dir, benchmark_names):
@@ -172,6 +192,8 @@ def benchmark_output_file_to_df(file):
             if line.startswith('REQUEST_PROCESSING_MICROBENCHMARK') or \
             line.startswith('SPARE_PROCESSING_MICROBENCHMARK') or \
             line.startswith('MAX_PROCESSING_MACROBENCHMARK') or \
+            line.startswith('TOKEN_ROUND_TRIP_MACROBENCHMARK') or \
+            line.startswith('DATA_ROUND_TRIP_MACROBENCHMARK') or \
             line.startswith('benchmark_type') or \
             line.startswith('MODBUS_FC') or \
             line.startswith('modbus_function_name'):
@@ -274,8 +296,16 @@ def get_gms_and_overheads(benchmark_type, benchmark_data, benchmark_names):
 
         df = benchmark_data[benchmark_name]
 
+        # without the baseline there is nothing to compare against, but
+        # other missing benchmarks (e.g., CHERI runs on a non-CHERI host)
+        # are just left out
         if len(df) == 0:
-            return (None, None, None)
+            if benchmark_name == benchmark_names[0]:
+                return (None, None, None)
+            del gms[benchmark_name]
+            del sds[benchmark_name]
+            del overheads[benchmark_name]
+            continue
 
         for modbus_function_name in df.modbus_function_name.value_counts().index:
             print("Processing: {} in {}".format(modbus_function_name, benchmark_name))
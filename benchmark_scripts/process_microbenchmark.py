@@ -17,6 +17,11 @@ this_dir = Path().absolute()
 # This designates the throughput test in the microbenchmark file
 benchmark_type = 'REQUEST_PROCESSING_MICROBENCHMARK'
 
+# Servers built with runtime capability modes also time batches of direct and
+# indirect (function table) calls to an empty shim
+dispatch_benchmark_type = 'CAPS_DISPATCH_MICROBENCHMARK'
+dispatch_batch = 1000 # modbusCAPS_DISPATCH_BATCH in ModbusCapsModes.h
+
 # names of benchmark applications
 benchmark_names = [
     'modbus_nocheri_microbenchmark_20',
@@ -118,6 +123,8 @@ def main(argv):
     print("100ms execution period")
     display_data(benchmark_type, benchmark_data, benchmark_names_network_caps_100ms)
 
+    display_dispatch_overhead(benchmark_data)
+
 def display_data(benchmark_type, benchmark_data, benchmark_names):
     '''
     This is a display wrapper for get_gms_and_overheads
@@ -133,6 +140,33 @@ def display_data(benchmark_type, benchmark_data, benchmark_names):
     print()
     print(overheads['mean'])
 
+def display_dispatch_overhead(benchmark_data):
+    '''
+    Cost per call of dispatching the shims through the function table of a
+    runtime capability mode, for the benchmarks that recorded it
+    '''
+    rows = []
+    for benchmark_name, df in benchmark_data.items():
+        if len(df) == 0:
+            continue
+        df = df[df['benchmark_type'] == dispatch_benchmark_type]
+        if len(df) == 0:
+            continue
+        medians = df.groupby('modbus_function_name')['time_diff'].median() / dispatch_batch
+        rows.append({'benchmark': benchmark_name,
+                     'direct_call': medians.get('direct_call'),
+                     'indirect_call': medians.get('indirect_call')})
+
+    if len(rows) == 0:
+        return
+
+    df = pd.DataFrame(rows).set_index('benchmark')
+    df['dispatch_overhead'] = df['indirect_call'] - df['direct_call']
+
+    print()
+    print("Dispatch cost per call (median; cycles, or ns on Linux hosts)")
+    print(df)
+
 def extract_benchmark_data(input_dir, benchmark_names):
     '''
     Extract all data from all benchmark files in input_dir to dataframes in a dict
@@ -165,6 +199,7 @@ def benchmark_output_file_to_df(file):
             if line.startswith('REQUEST_PROCESSING_MICROBENCHMARK') or \
             line.startswith('SPARE_PROCESSING_MICROBENCHMARK') or \
             line.startswith('MAX_PROCESSING_MACROBENCHMARK') or \
+            line.startswith(dispatch_benchmark_type) or \
             line.startswith('benchmark_type'):
                 csv += line.replace(', ', ',') # remove any spaces after commas in the csv
 
@@ -263,8 +298,15 @@ def get_gms_and_overheads(benchmark_type, benchmark_data, benchmark_names):
 
         df = benchmark_data[benchmark_name]
 
+        # without the baseline there is nothing to compare against, but
+        # other missing benchmarks (e.g., CHERI runs on a non-CHERI host)
+        # are just left out
         if len(df) == 0:
-            return (None, None)
+            if benchmark_name == benchmark_names[0]:
+                return (None, None)
+            del gms[benchmark_name]
+            del overheads[benchmark_name]
+            continue
 
         for modbus_function_name in df.modbus_function_name.value_counts().index:
             # print("Processing: {} in {}".format(modbus_function_name, benchmark_name))
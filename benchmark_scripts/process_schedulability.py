@@ -0,0 +1,247 @@
+# Imports
+
+import pandas as pd
+from pathlib import Path
+import sys
+import getopt
+import math
+
+from process_microbenchmark import benchmark_output_file_to_df, benchmark_names
+
+# Constants
+
+# This designates the request processing cost in the microbenchmark file
+benchmark_type = 'REQUEST_PROCESSING_MICROBENCHMARK'
+
+# The server's cycle counter frequency (configCPU_CLOCK_HZ), used to convert
+# REQUEST_PROCESSING samples from cycles to seconds
+default_cpu_clock_hz = 100e6
+
+# The unit of the samples, from the 'Time unit:' line the runners write
+# (cycles on FreeRTOS, ns on the host server), or -u for older files
+time_unit_header = 'Time unit:'
+time_units = ['cycles', 'ns']
+
+# Fraction of each execution period that must stay spare (e.g., for the
+# IP task and jitter) for a configuration to count as schedulable
+default_margin = 0.2
+
+# The high-percentile cost that is reported next to the worst case
+percentile = 0.99
+
+# Default rate at which each client polls the server (polls/s)
+default_client_poll_rate = 1.0
+
+# The token write that precedes every request when using network capabilities
+token_function_name = 'MODBUS_FC_WRITE_STRING'
+
+def usage():
+    print('process_schedulability.py -d <input_dir> [-m <mix_file>] [-u cycles|ns] '
+          '[-f <cpu_clock_hz>] [-s <margin>] [-r <client_poll_rate>] [-b <benchmark,...>]')
+
+def main(argv):
+    input_dir = None
+    mix_file = None
+    cpu_clock_hz = default_cpu_clock_hz
+    time_unit = None
+    margin = default_margin
+    client_poll_rate = default_client_poll_rate
+    names = benchmark_names
+
+    try:
+        opts, args = getopt.getopt(argv,"hd:m:u:f:s:r:b:",
+                ["input_dir=","mix=","time_unit=","cpu_clock_hz=","margin=","client_poll_rate=","benchmarks="])
+    except getopt.GetoptError:
+        usage()
+        sys.exit(2)
+
+    for opt, arg in opts:
+        if opt == '-d':
+            input_dir = Path(arg)
+        elif opt == '-m':
+            mix_file = Path(arg)
+        elif opt == '-u':
+            time_unit = arg
+        elif opt == '-f':
+            cpu_clock_hz = float(arg)
+        elif opt == '-s':
+            margin = float(arg)
+        elif opt == '-r':
+            client_poll_rate = float(arg)
+        elif opt == '-b':
+            names = arg.split(',')
+        else:
+            usage()
+            sys.exit(2)
+
+    if input_dir is None or (time_unit is not None and time_unit not in time_units):
+        usage()
+        sys.exit(2)
+
+    mix = read_mix(mix_file) if mix_file is not None else None
+
+    for benchmark_name in names:
+        df = extract_request_costs(input_dir, benchmark_name, time_unit)
+        if df is None:
+            continue
+
+        # samples per second
+        samples_hz = cpu_clock_hz if df['time_unit'].iloc[0] == 'cycles' else 1e9
+
+        exec_period_ms = int(benchmark_name.rsplit('_', 1)[1])
+        report(benchmark_name, df, exec_period_ms, samples_hz, margin,
+               client_poll_rate, mix)
+
+def read_mix(mix_file):
+    '''
+    Read a request mix: one '<modbus_function_name> <weight>' per line.
+    Weights are normalised, so they can be counts or fractions.
+    '''
+    mix = {}
+    with open(mix_file) as fin:
+        for line in fin:
+            line = line.split('#')[0].strip()
+            if len(line) == 0:
+                continue
+            (name, weight) = line.split()
+            mix[name] = float(weight)
+
+    total = sum(mix.values())
+    return {name: weight / total for (name, weight) in mix.items()}
+
+def read_time_unit(benchmark_output_file):
+    '''
+    The unit of the samples in an output file, from its header, or None
+    '''
+    with open(benchmark_output_file) as fin:
+        for line in fin:
+            if line.startswith(time_unit_header):
+                return line[len(time_unit_header):].strip()
+
+    return None
+
+def extract_request_costs(input_dir, benchmark_name, time_unit):
+    '''
+    Extract the REQUEST_PROCESSING samples for one benchmark, with the
+    unit of each in a 'time_unit' column.  Samples in cycles and in ns
+    are never mixed, and a file without a 'Time unit:' line needs -u.
+    '''
+    frames = []
+    for benchmark_output_file in sorted(input_dir.glob(benchmark_name + '_*.txt')):
+        df = benchmark_output_file_to_df(benchmark_output_file)
+        if df is None:
+            continue
+
+        file_time_unit = read_time_unit(benchmark_output_file)
+        if file_time_unit is None:
+            file_time_unit = time_unit
+        elif time_unit is not None and file_time_unit != time_unit:
+            sys.exit('{} is in {}, not {}'.format(benchmark_output_file, file_time_unit, time_unit))
+
+        if file_time_unit not in time_units:
+            sys.exit('{} has no time unit, so give one with -u cycles|ns'.format(benchmark_output_file))
+
+        df = df[df['benchmark_type'] == benchmark_type].copy()
+        df['time_unit'] = file_time_unit
+        frames.append(df)
+
+    if len(frames) == 0:
+        return None
+
+    df = pd.concat(frames, ignore_index = True)
+    if df['time_unit'].nunique() > 1:
+        sys.exit('{} has samples in both cycles and ns'.format(benchmark_name))
+
+    return df
+
+def function_costs(df, samples_hz):
+    '''
+    Worst-case and high-percentile cost per Modbus function, in seconds.
+
+    Unlike process_microbenchmark.py, outliers are not removed: the worst
+    case is exactly what schedulability depends on.
+    '''
+    costs = df.groupby('modbus_function_name')['time_diff'].agg(
+            samples = 'count',
+            p50 = 'median',
+            p99 = lambda s: s.quantile(percentile),
+            wcet = 'max')
+
+    for column in ['p50', 'p99', 'wcet']:
+        costs[column] = costs[column] / samples_hz
+
+    return costs
+
+def report(benchmark_name, df, exec_period_ms, samples_hz, margin,
+           client_poll_rate, mix):
+    '''
+    Print the utilisation and headroom of each function, and the maximum
+    safe poll rate for the request mix.
+
+    The server processes at most one request per execution period, then
+    blocks in vTaskDelayUntil(), so a request is schedulable when its cost
+    fits in the period minus the margin.  With network capabilities each poll
+    is two requests (the token write, then the request itself).
+    '''
+    period = exec_period_ms / 1e3
+    budget = period * (1 - margin)
+    network_caps = 'network_caps' in benchmark_name
+    requests_per_poll = 2 if network_caps else 1
+
+    costs = function_costs(df, samples_hz)
+    costs['utilisation_p99'] = costs['p99'] / period
+    costs['utilisation_wcet'] = costs['wcet'] / period
+    costs['headroom_wcet'] = 1 - costs['utilisation_wcet']
+    costs['schedulable'] = costs['wcet'] <= budget
+
+    print()
+    print('{} (execution period {} ms, margin {:.0%})'.format(benchmark_name, exec_period_ms, margin))
+    print()
+    print(costs.to_string(formatters = {
+        'p50': '{:.1e}'.format, 'p99': '{:.1e}'.format, 'wcet': '{:.1e}'.format,
+        'utilisation_p99': '{:.2%}'.format, 'utilisation_wcet': '{:.2%}'.format,
+        'headroom_wcet': '{:.2%}'.format}))
+
+    # by default, poll every measured function equally often
+    if mix is None:
+        mix = {name: 1 / len(costs.index) for name in costs.index
+               if name != token_function_name}
+        total = sum(mix.values())
+        mix = {name: weight / total for (name, weight) in mix.items()}
+
+    missing = [name for name in mix if name not in costs.index]
+    if len(missing) > 0:
+        print()
+        print('No samples for {}, skipping the mix'.format(', '.join(missing)))
+        return
+
+    # cost of the requests in one poll (token write + request for network caps)
+    token_wcet = costs.loc[token_function_name, 'wcet'] if network_caps else 0
+    token_p99 = costs.loc[token_function_name, 'p99'] if network_caps else 0
+    mix_wcet = max(costs.loc[name, 'wcet'] for name in mix)
+    mix_p99 = sum(weight * costs.loc[name, 'p99'] for (name, weight) in mix.items())
+    worst_request = max(mix_wcet, token_wcet)
+
+    # the period, not the cost, bounds the rate while every request fits
+    if worst_request <= budget:
+        safe_poll_rate = 1 / (period * requests_per_poll)
+    else:
+        safe_poll_rate = 0
+
+    # the shortest whole-tick period (1 ms) that would fit the worst request
+    min_period_ms = max(1, math.ceil(worst_request / (1 - margin) * 1e3))
+
+    print()
+    print('Request mix: {}'.format(', '.join('{} {:.0%}'.format(n, w) for (n, w) in mix.items())))
+    print('Requests per poll:              {}'.format(requests_per_poll))
+    print('Mean p99 cost per poll:         {:.3e} s'.format(mix_p99 + token_p99))
+    print('Worst-case request cost:        {:.3e} s'.format(worst_request))
+    print('Utilisation per poll (p99):     {:.2%}'.format((mix_p99 + token_p99) / (period * requests_per_poll)))
+    print('Max safe poll rate:             {:.2f} polls/s'.format(safe_poll_rate))
+    print('Clients at {:g} polls/s:          {}'.format(client_poll_rate,
+        math.floor(safe_poll_rate / client_poll_rate)))
+    print('Shortest schedulable period:    {} ms ({:.2f} polls/s)'.format(
+        min_period_ms, 1e3 / (min_period_ms * requests_per_poll)))
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -0,0 +1,97 @@
+#!/bin/bash
+set -e
+set -u
+
+# Build the host servers and benchmark clients as several variants, run the
+# loopback benchmarks (run_loopback_bench.sh) against each, and compare them
+# with process_build_variants.py:
+#   default: separate static libraries, no cross-module optimisation
+#   lto: link-time optimisation (waf configure --lto)
+#   pgo: LTO plus profile-guided optimisation, trained on the benchmark
+#        client workload (--pgo=generate, a training run, then --pgo=use)
+#
+# The instrumented and optimised pgo builds share their build directories,
+# since GCC matches profiles to object files by path.  With clang, the raw
+# profiles are merged with llvm-profdata.
+#
+# Settings for run_loopback_bench.sh (CONFIGS, BENCHMARKS, ITERATIONS, ...)
+# are passed on from the environment.
+
+REPO_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_ROOT=${BUILD_ROOT:-${REPO_DIR}/build_variants}
+RESULTS_ROOT=${RESULTS_ROOT:-${REPO_DIR}/results/variants_$(date +"%Y-%m-%d_%H-%M-%S")}
+PGO_DIR=${PGO_DIR:-${BUILD_ROOT}/pgo_profiles}
+
+# variants to build and benchmark, in order
+VARIANTS=${VARIANTS:-"default lto pgo"}
+
+# the same optimisation level for every variant, so they only differ in
+# LTO and PGO
+export CFLAGS=${CFLAGS:--O2}
+
+# client iterations per configuration for the pgo training run
+TRAIN_RUNS=${TRAIN_RUNS:-20}
+
+declare -A variant_options=( [default]="" [lto]="--lto" [pgo]="--lto --pgo=use --pgo-dir=${PGO_DIR}" )
+
+# configure and build one endpoint
+# $1 = build directory, $2 = endpoint, $3... = configure options
+waf_build () {
+    local out=$1
+    local endpoint=$2
+    shift 2
+
+    (cd ${REPO_DIR} && python3 waf configure --target linux --endpoint ${endpoint} -o ${out} "$@" \
+        && python3 waf build)
+}
+
+# $1 = variant, $2... = configure options
+build_variant () {
+    local variant=$1
+    shift
+
+    waf_build ${BUILD_ROOT}/${variant}_server server "$@"
+    waf_build ${BUILD_ROOT}/${variant}_client client "$@"
+}
+
+# $1 = variant, $2 = results directory
+bench_variant () {
+    SERVER_BUILD_DIR=${BUILD_ROOT}/$1_server CLIENT_BUILD_DIR=${BUILD_ROOT}/$1_client \
+        RESULTS_DIR=$2 ${REPO_DIR}/benchmark_scripts/run_loopback_bench.sh
+}
+
+# build the instrumented pgo variant and record profiles with the
+# benchmark workload (the results of the training run are discarded)
+pgo_train () {
+    local training_results=$(mktemp -d)
+
+    rm -rf ${PGO_DIR}
+    mkdir -p ${PGO_DIR}
+    build_variant pgo --lto --pgo=generate --pgo-dir=${PGO_DIR}
+
+    echo "Training: pgo"
+    ITERATIONS=1 DISCARD_RUNS=1 BENCHMARK_RUNS=${TRAIN_RUNS} bench_variant pgo ${training_results}
+    rm -rf ${training_results}
+
+    if ${CC:-gcc} --version | grep -q clang; then
+        llvm-profdata merge -o ${PGO_DIR}/default.profdata ${PGO_DIR}/*.profraw
+    fi
+}
+
+mkdir -p ${BUILD_ROOT} ${RESULTS_ROOT}
+
+for variant in ${VARIANTS}; do
+    echo "*****************************"
+    echo "*** VARIANT ${variant} ***"
+    echo "*****************************"
+
+    if [ "${variant}" == "pgo" ]; then
+        pgo_train
+    fi
+
+    build_variant ${variant} ${variant_options[$variant]}
+    bench_variant ${variant} ${RESULTS_ROOT}/${variant}
+done
+
+echo "Results in ${RESULTS_ROOT}"
+echo "Compare with: python3 ${REPO_DIR}/benchmark_scripts/process_build_variants.py -d ${RESULTS_ROOT}"
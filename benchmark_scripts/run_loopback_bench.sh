@@ -0,0 +1,317 @@
+#!/bin/bash
+set -e
+set -u
+
+# Run the micro- and macrobenchmarks against Modbus servers built for the
+# host, over loopback, so no FPGA, tap0 interface or root is needed.
+#
+# Build the host servers and the benchmark clients first, e.g.:
+#   python3 waf configure --target linux --endpoint server -o build_server && python3 waf build
+#   python3 waf configure --target linux --endpoint client -o build_client && python3 waf build
+#
+# Output files are named like the FPGA runs (e.g.,
+# modbus_nocheri_network_caps_microbenchmark_20_<date>.txt), so
+# process_microbenchmark.py and process_macrobenchmark.py can be pointed at
+# RESULTS_DIR.  Every setting below can be overridden from the environment.
+#
+# With RUNTIME=1, a single modbus_host_server_runtime runs every
+# configuration back to back, switching capability mode at run time (-c),
+# instead of starting a separately built server for each one.
+
+REPO_DIR=$(cd "$(dirname "$0")/.." && pwd)
+SERVER_BUILD_DIR=${SERVER_BUILD_DIR:-${REPO_DIR}/build_server}
+CLIENT_BUILD_DIR=${CLIENT_BUILD_DIR:-${REPO_DIR}/build_client}
+RESULTS_DIR=${RESULTS_DIR:-${REPO_DIR}/results/loopback_$(date +"%Y-%m-%d_%H-%M-%S")}
+
+# the ABI in the output file names: nocheri, or purecap for a CHERI host
+ABI=${ABI:-nocheri}
+
+# configurations: base, obj, net, obj_net (obj is a pass-through without CHERI)
+CONFIGS=${CONFIGS:-"base net"}
+
+# 1 = run all configurations in one server, selecting them at run time
+RUNTIME=${RUNTIME:-0}
+
+# benchmarks: micro (server request processing), macro (client round trips)
+BENCHMARKS=${BENCHMARKS:-"micro macro"}
+
+# execution periods (ms) for the microbenchmark
+EXEC_PERIODS=${EXEC_PERIODS:-"20 100"}
+
+# simulated network delays (ms) for the macrobenchmark
+NETWORK_DELAYS=${NETWORK_DELAYS:-"0 10"}
+
+# number of times to loop through the whole matrix
+ITERATIONS=${ITERATIONS:-1}
+
+# client iterations for the warm-up session (discarded) and the measured one
+DISCARD_RUNS=${DISCARD_RUNS:-1}
+BENCHMARK_RUNS=${BENCHMARK_RUNS:-10}
+
+# 1 = simulate network delay with netem on the loopback interface of a
+# network namespace (needs sudo), rather than sleeping in the server.
+# Either way, each request/reply round trip is delayed twice.
+NETEM=${NETEM:-0}
+NETNS=modcap_bench
+
+# optional CPUs to pin the server and client to (e.g., SERVER_CPU=2 CLIENT_CPU=3)
+SERVER_CPU=${SERVER_CPU:-}
+CLIENT_CPU=${CLIENT_CPU:-}
+
+# give up on a server that hasn't finished after this many seconds
+SERVER_TIMEOUT=${SERVER_TIMEOUT:-600}
+
+# the clients connect to 127.0.0.1:1502 ("qemu")
+PORT=1502
+
+# server/client suffixes and output file name parts for each configuration
+declare -A server_suffix=( [base]="" [obj]="_object_caps" [net]="_network_caps" [obj_net]="_object_network_caps" )
+declare -A name_part=( [base]="" [obj]="_object_caps" [net]="_network_caps" [obj_net]="_object_network_caps" )
+declare -A client=( [base]="modbus_test_client_bench" [obj]="modbus_test_client_bench"
+                    [net]="modbus_test_client_network_caps_bench" [obj_net]="modbus_test_client_network_caps_bench" )
+
+# run a command in the namespace and/or pinned to a CPU, as configured
+# $1 = cpu (may be empty)
+# $2... = command
+wrap () {
+    local cpu=$1
+    shift
+    local cmd=("$@")
+    if [ -n "${cpu}" ]; then
+        cmd=(taskset -c "${cpu}" "${cmd[@]}")
+    fi
+    if [ "${NETEM}" -eq 1 ]; then
+        cmd=(sudo ip netns exec ${NETNS} "${cmd[@]}")
+    fi
+    "${cmd[@]}"
+}
+
+# set up the namespace with a delay of $1 ms on its loopback interface
+netem_setup () {
+    [ "${NETEM}" -eq 1 ] || return 0
+    sudo ip netns del ${NETNS} 2> /dev/null || true
+    sudo ip netns add ${NETNS}
+    sudo ip netns exec ${NETNS} ip link set lo up
+    if [ "$1" -gt 0 ]; then
+        sudo ip netns exec ${NETNS} tc qdisc add dev lo root netem delay ${1}ms
+    fi
+}
+
+netem_teardown () {
+    [ "${NETEM}" -eq 1 ] || return 0
+    sudo ip netns del ${NETNS} 2> /dev/null || true
+}
+
+# start a modbus server in the background and wait until it is listening
+# $1 = the modbus server
+# $2 = server output file
+# $3 = the number of client sessions (a warm-up and a measured one per
+#      configuration)
+# $4... = server options
+server_start () {
+    local server=$1
+    local output=$2
+    local sessions=$3
+    shift 3
+
+    wrap "${SERVER_CPU}" timeout ${SERVER_TIMEOUT} \
+        ${SERVER_BUILD_DIR}/${server} -p ${PORT} -n ${sessions} "$@" > ${output} &
+    server_pid=$!
+
+    until grep -q MODBUS_HOST_SERVER_READY ${output} 2> /dev/null; do
+        if ! kill -0 ${server_pid} 2> /dev/null; then
+            echo "${server} failed to start"
+            return 1
+        fi
+        sleep 0.05
+    done
+}
+
+# start a modbus client on the host
+# $1 = the modbus client
+# $2 = the number of iterations
+# $3 = filename to direct output
+client_run () {
+    wrap "${CLIENT_CPU}" ${CLIENT_BUILD_DIR}/$1 qemu $2 >> $3
+}
+
+# write the run details at the top of an output file
+# $1 = filename
+write_header () {
+    echo "$(basename $1)" > $1
+    echo "Iterations: ${ITERATIONS}" >> $1
+    echo "Discarded runs: ${DISCARD_RUNS}" >> $1
+    echo "Benchmark runs: ${BENCHMARK_RUNS}" >> $1
+    echo "Time unit: ns" >> $1
+    echo "Host: $(uname -srm)" >> $1
+    echo "Revision: $(git -C ${REPO_DIR} rev-parse --short HEAD 2> /dev/null || echo unknown)" >> $1
+}
+
+# the server prints its samples at the end of each client session, so
+# keep only the output after the warm-up session ended
+# $1 = server output, $2 = filename
+keep_measured_session () {
+    awk 'found; /^MODBUS_HOST_SERVER_SESSION_END/ { found = 1 }' $1 >> $2
+}
+
+# as keep_measured_session, for one configuration of a runtime server
+# $1 = server output, $2 = configuration, $3 = filename
+keep_measured_session_runtime () {
+    awk -v mode=$2 '/^MODBUS_CAPS_MODE / { current = ($2 == mode); found = 0; next }
+        current && found; current && /^MODBUS_HOST_SERVER_SESSION_END/ { found = 1 }' $1 >> $3
+}
+
+# $1 = configuration, $2 = execution period
+micro_run () {
+    local name=modbus_${ABI}${name_part[$1]}_microbenchmark_$2
+    local filename=${RESULTS_DIR}/${name}_$(date +"%Y-%m-%d_%T").txt
+    local server_output=$(mktemp)
+
+    echo "Testing: ${name}"
+    netem_setup 0
+    server_start modbus_host_server${server_suffix[$1]}_micro ${server_output} 2 -e $2
+
+    client_run ${client[$1]} ${DISCARD_RUNS} /dev/null
+    client_run ${client[$1]} ${BENCHMARK_RUNS} /dev/null
+    wait ${server_pid}
+
+    write_header ${filename}
+    keep_measured_session ${server_output} ${filename}
+    rm -f ${server_output}
+    netem_teardown
+}
+
+# $1 = configuration, $2 = network delay
+macro_run () {
+    local name=modbus_${ABI}${name_part[$1]}_macrobenchmark_$2
+    local filename=${RESULTS_DIR}/${name}_$(date +"%Y-%m-%d_%T").txt
+    local server_output=$(mktemp)
+    local server_delay=$2
+
+    echo "Testing: ${name}"
+    if [ "${NETEM}" -eq 1 ]; then
+        server_delay=0
+    fi
+    netem_setup $2
+    server_start modbus_host_server${server_suffix[$1]} ${server_output} 2 -d ${server_delay}
+
+    client_run ${client[$1]} ${DISCARD_RUNS} /dev/null
+    write_header ${filename}
+    client_run ${client[$1]} ${BENCHMARK_RUNS} ${filename}
+    wait ${server_pid}
+
+    rm -f ${server_output}
+    netem_teardown
+}
+
+# every configuration in one runtime server
+# $1 = execution period
+micro_runtime_run () {
+    local configs=(${CONFIGS})
+    local modes=$(IFS=,; echo "${configs[*]}")
+    local server_output=$(mktemp)
+
+    echo "Testing: ${CONFIGS} (runtime), execution period $1"
+    netem_setup 0
+    server_start modbus_host_server_runtime_micro ${server_output} $(( 2 * ${#configs[@]} )) \
+        -e $1 -c ${modes}
+
+    for config in "${configs[@]}"; do
+        client_run ${client[$config]} ${DISCARD_RUNS} /dev/null
+        client_run ${client[$config]} ${BENCHMARK_RUNS} /dev/null
+    done
+    wait ${server_pid}
+
+    for config in "${configs[@]}"; do
+        local name=modbus_${ABI}${name_part[$config]}_microbenchmark_$1
+        local filename=${RESULTS_DIR}/${name}_$(date +"%Y-%m-%d_%T").txt
+        write_header ${filename}
+        keep_measured_session_runtime ${server_output} ${config} ${filename}
+    done
+    rm -f ${server_output}
+    netem_teardown
+}
+
+# every configuration in one runtime server
+# $1 = network delay
+macro_runtime_run () {
+    local configs=(${CONFIGS})
+    local modes=$(IFS=,; echo "${configs[*]}")
+    local server_output=$(mktemp)
+    local server_delay=$1
+
+    echo "Testing: ${CONFIGS} (runtime), network delay $1"
+    if [ "${NETEM}" -eq 1 ]; then
+        server_delay=0
+    fi
+    netem_setup $1
+    server_start modbus_host_server_runtime ${server_output} $(( 2 * ${#configs[@]} )) \
+        -d ${server_delay} -c ${modes}
+
+    for config in "${configs[@]}"; do
+        local name=modbus_${ABI}${name_part[$config]}_macrobenchmark_$1
+        local filename=${RESULTS_DIR}/${name}_$(date +"%Y-%m-%d_%T").txt
+        client_run ${client[$config]} ${DISCARD_RUNS} /dev/null
+        write_header ${filename}
+        client_run ${client[$config]} ${BENCHMARK_RUNS} ${filename}
+    done
+    wait ${server_pid}
+
+    rm -f ${server_output}
+    netem_teardown
+}
+
+# every (benchmark, configuration, parameter) combination, or with RUNTIME=1
+# every (benchmark, parameter) combination
+runs=()
+for benchmark in ${BENCHMARKS}; do
+    if [ "${RUNTIME}" -eq 1 ]; then
+        if [ "${benchmark}" == "micro" ]; then
+            for period in ${EXEC_PERIODS}; do
+                runs+=("micro_runtime_run ${period}")
+            done
+        else
+            for delay in ${NETWORK_DELAYS}; do
+                runs+=("macro_runtime_run ${delay}")
+            done
+        fi
+        continue
+    fi
+
+    for config in ${CONFIGS}; do
+        if [ "${benchmark}" == "micro" ]; then
+            for period in ${EXEC_PERIODS}; do
+                runs+=("micro_run ${config} ${period}")
+            done
+        else
+            for delay in ${NETWORK_DELAYS}; do
+                runs+=("macro_run ${config} ${delay}")
+            done
+        fi
+    done
+done
+
+mkdir -p ${RESULTS_DIR}
+trap 'netem_teardown; kill $(jobs -p) 2> /dev/null || true' EXIT
+
+# iterate over the matrix ITERATIONS times
+loop_iterations=0
+while [ ${loop_iterations} -lt ${ITERATIONS} ]; do
+
+    echo "*****************************"
+    echo "*** BEGINNING ITERATION ${loop_iterations} ***"
+    echo "*****************************"
+
+    # go through the runs in normal and then reverse order
+    for (( idx=0 ; idx<${#runs[@]} ; idx++ )) ; do
+        ${runs[idx]}
+    done
+
+    for (( idx=${#runs[@]}-1 ; idx>=0 ; idx-- )) ; do
+        ${runs[idx]}
+    done
+
+    (( loop_iterations+=1 ))
+done
+
+echo "Results in ${RESULTS_DIR}"
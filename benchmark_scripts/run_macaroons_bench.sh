@@ -0,0 +1,50 @@
+#!/bin/bash
+set -e
+set -u
+
+# Run the libmacaroons primitive benchmark (modbus_macaroons_benchmark, from
+# python3 waf configure --target linux --endpoint server) and append the
+# results to a history file, keyed by the revisions of this repository and
+# of libmacaroons, so the crypto path can be tracked commit over commit.
+#
+# The history file is CSV with the columns
+# date, host, revision, operation, iterations, ns_per_op, min_ns_per_op,
+#     allocations_per_op, bytes_per_op
+# see process_macaroons_primitives.py.  Settings can be overridden from the
+# environment.
+
+REPO_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=${BUILD_DIR:-${REPO_DIR}/build_server}
+HISTORY_FILE=${HISTORY_FILE:-${REPO_DIR}/results/macaroons_primitives.csv}
+ITERATIONS=${ITERATIONS:-10000}
+REPEATS=${REPEATS:-5}
+
+# optional CPU to pin the benchmark to
+BENCH_CPU=${BENCH_CPU:-}
+
+# <revision>[-dirty]
+# $1 = git directory
+git_revision () {
+    local revision=$(git -C $1 rev-parse --short HEAD 2> /dev/null || echo unknown)
+    if ! git -C $1 diff --quiet HEAD 2> /dev/null; then
+        revision=${revision}-dirty
+    fi
+    echo ${revision}
+}
+
+revision=$(git_revision ${REPO_DIR})+libmacaroons.$(git_revision ${REPO_DIR}/libmacaroons)
+date=$(date +"%Y-%m-%d_%T")
+host=$(uname -n)
+
+cmd=(${BUILD_DIR}/modbus_macaroons_benchmark -i ${ITERATIONS} -k ${REPEATS} -r ${revision})
+if [ -n "${BENCH_CPU}" ]; then
+    cmd=(taskset -c ${BENCH_CPU} "${cmd[@]}")
+fi
+
+mkdir -p $(dirname ${HISTORY_FILE})
+if [ ! -f ${HISTORY_FILE} ]; then
+    echo "date, host, revision, operation, iterations, ns_per_op, min_ns_per_op, allocations_per_op, bytes_per_op" > ${HISTORY_FILE}
+fi
+
+echo "Benchmarking libmacaroons at ${revision}"
+"${cmd[@]}" | grep "^MACAROONS_PRIMITIVE" | sed "s/^MACAROONS_PRIMITIVE, /${date}, ${host}, /" | tee -a ${HISTORY_FILE}
@@ -83,6 +83,7 @@ combined_run () {
     echo "Iterations: ${ITERATIONS}" >> ${filename}
     echo "Discarded runs: ${DISCARD_RUNS}" >> ${filename}
     echo "Benchmark runs: ${BENCHMARK_RUNS}" >> ${filename}
+    echo "Time unit: cycles" >> ${filename}
 
     # run the modbus client on the host
     echo "Starting client for benchmark runs"
@@ -104,6 +105,69 @@ fpga_kill () {
     kill $( ps -a | grep ssith_aws_fpga | xargs | cut -d' ' -f1 )
 }
 
+# elf name parts and clients for the modes of a runtime modbus server
+declare -A mode_part=( [base]="" [objstubs]="-objstubs" [obj]="-obj" [net]="-net" [obj_net]="-obj-net" )
+declare -A mode_client=( [base]=modbus_test_client_bench [objstubs]=modbus_test_client_bench
+                         [obj]=modbus_test_client_bench [net]=modbus_test_client_network_caps_bench
+                         [obj_net]=modbus_test_client_network_caps_bench )
+
+# run every capability mode of a modbus server built with the "runtime"
+# option, after a single FPGA reset.  The server moves to the next mode
+# after every two client sessions (discarded and benchmark runs), in the
+# order it prints on its MODBUS_CAPS_SCHEDULE line.  The output for each
+# mode is saved as if from the separately built elf, e.g.,
+# ...-purecap-runtime-micro-... becomes ...-purecap-obj-net-micro-...
+# $1 = the modbus server elf
+runtime_run () {
+    # establish the output filename for the whole run
+    date=`date +"%Y-%m-%d_%T"`
+    raw_filename=${1}_${date}.txt
+
+    # reset the fpga
+    echo "Resetting the FPGA"
+    fpga_reset
+
+    # run the modbus server on the fpga
+    echo "Starting the fpga"
+    fpga_run ${1} ${raw_filename} &
+
+    # let the modbus server finish initialising
+    sleep 10
+
+    modes=$( grep -m1 "^MODBUS_CAPS_SCHEDULE" ${raw_filename} | cut -d' ' -f2 | tr -d '\r' | tr ',' ' ' )
+    for mode in ${modes}; do
+        filename=${1/-runtime/${mode_part[$mode]}}_${date}.txt
+        echo "Testing mode: ${mode}"
+
+        # these runs warm up the cache and the output will be discarded
+        echo "Starting client for discard runs"
+        client_run ${mode_client[$mode]} ${DISCARD_RUNS}
+        sleep 5
+
+        # only keep what the server prints from here on
+        offset=$( wc -c < ${raw_filename} )
+
+        # output details of this test run to the file
+        echo "${filename}" >> ${filename}
+        echo "Iterations: ${ITERATIONS}" >> ${filename}
+        echo "Discarded runs: ${DISCARD_RUNS}" >> ${filename}
+        echo "Benchmark runs: ${BENCHMARK_RUNS}" >> ${filename}
+        echo "Time unit: cycles" >> ${filename}
+
+        echo "Starting client for benchmark runs"
+        sync
+        client_run ${mode_client[$mode]} ${BENCHMARK_RUNS}
+        sleep 5
+
+        tail -c +$(( offset + 1 )) ${raw_filename} >> ${filename}
+    done
+
+    echo "Killing the FPGA"
+    fpga_kill
+
+    stty sane
+}
+
 # modbus server elfs that don't use network capabilities
 modbus_servers_no_network_caps=(
     # "RISC-V-Generic_main_modbus-nocheri-micro-execperiod_100"
@@ -124,6 +188,13 @@ modbus_servers_network_caps=(
     # "RISC-V-Generic_main_modbus-purecap-obj-net-micro-execperiod_20"
 )
 
+# modbus server elfs built with the "runtime" option, each of which runs
+# every capability mode compiled into it (see runtime_run)
+modbus_servers_runtime=(
+    # "RISC-V-Generic_main_modbus-purecap-runtime-micro-execperiod_100"
+    # "RISC-V-Generic_main_modbus-purecap-runtime-micro-execperiod_20"
+)
+
 # modbus client executable to communicate without network capabilities
 modbus_client_no_network_caps=modbus_test_client_bench
 
@@ -170,6 +241,14 @@ while [ ${loop_iterations} -lt ${ITERATIONS} ]; do
         sleep 5
     done
 
+    # execute runtime modbus servers, each with all its clients
+    for (( idx=0 ; idx<${#modbus_servers_runtime[@]} ; idx++ )) ; do
+        echo "Testing: ${modbus_servers_runtime[idx]}"
+        runtime_run ${modbus_servers_runtime[idx]}
+
+        sleep 5
+    done
+
     (( loop_iterations+=1 ))
 done
 
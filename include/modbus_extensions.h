@@ -0,0 +1,165 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_EXTENSIONS_H_
+#define _MODBUS_EXTENSIONS_H_
+
+/*************
+ * DEFINITIONS
+ ************/
+
+/**
+ * Requests beyond the standard function codes, shared by the server
+ * (ModbusSubscriptions.h, ModbusBatchRead.h) and the client library
+ * (modbus_client_subscribe.h, modbus_client_batch.h).
+ *
+ * libmodbus only frames the standard function codes, so rather than new
+ * function codes, each operation is a MODBUS_FC_WRITE_AND_READ_REGISTERS
+ * request to a reserved address: the written registers are the
+ * parameters, and the read registers the result (padded with zeros to the
+ * number requested).  The server answers these itself, before the
+ * capability shims and modbus_process_request(), so the reserved
+ * addresses must not be used by the mapping.
+ *
+ * Report-by-exception subscriptions:
+ *
+ * A client subscribes to an address range once, and from then on asks for
+ * the subscriptions that changed since a sequence number, rather than
+ * reading every range on every poll.  With network capabilities, only the
+ * subscription carries a Macaroon (authorising a read of the range); the
+ * changes are returned to the connection that subscribed without another
+ * verification.
+ *
+ * SUBSCRIBE
+ *   write: table, addr, nb
+ *   read (MODBUS_SUBSCRIBE_RESULT_NB): id, sequence (high, low)
+ *   table is one of MODBUS_SUBSCRIPTION_*; nb is at most
+ *   MODBUS_MAX_SUBSCRIBE_BITS or MODBUS_MAX_SUBSCRIBE_REGISTERS
+ *
+ * UNSUBSCRIBE
+ *   write: id
+ *   read (1): id
+ *
+ * CHANGES_SINCE
+ *   write: sequence (high, low)
+ *   read (MODBUS_CHANGES_RESULT_NB): sequence (high, low), count, more,
+ *   then count entries of: id, values
+ *   values are nb registers, or nb bits packed 16 to a register (bit i
+ *   in bit i % 16 of register i / 16)
+ *
+ * Sequence numbers start at 1 and are bumped by every write that changes
+ * a subscribed range.  A subscription is also marked changed when it is
+ * made, so asking for the changes since 0 returns every subscription.
+ * If the changes don't all fit in one reply, more is 1 and the sequence
+ * returned is older than the entries left out, so asking again with it
+ * returns the rest.
+ *
+ * A subscription lasts as long as the capability that authorised it: once
+ * its key is retired or replaced, the next CHANGES_SINCE releases it and
+ * is answered with ILLEGAL_DATA_ADDRESS (the changes to the others are
+ * returned by asking again), and UNSUBSCRIBE of it with
+ * ILLEGAL_DATA_ADDRESS.
+ *
+ * Exceptions: ILLEGAL_DATA_VALUE for a malformed request or when there
+ * are no free subscriptions, ILLEGAL_DATA_ADDRESS for a range outside the
+ * mapping, an unknown id or released subscriptions.
+ * */
+
+#ifndef MODBUS_SUBSCRIBE_ADDRESS
+#define MODBUS_SUBSCRIBE_ADDRESS 0xFFF0
+#endif
+
+#ifndef MODBUS_UNSUBSCRIBE_ADDRESS
+#define MODBUS_UNSUBSCRIBE_ADDRESS 0xFFF1
+#endif
+
+#ifndef MODBUS_CHANGES_SINCE_ADDRESS
+#define MODBUS_CHANGES_SINCE_ADDRESS 0xFFF2
+#endif
+
+/**
+ * Batch reads:
+ *
+ * A client reads several ranges, from any of the tables, with a single
+ * request and reply.  With network capabilities, the request is
+ * authorised by a single Macaroon (see network_caps_build_batch_token()),
+ * whose caveats are the read function of every table in the batch and
+ * the set of address ranges, rather than a single range covering them
+ * all.  The address set caveat groups the ranges by table, sorted and
+ * merged (e.g., "addresses = c:0-2;h:10-14,500-502"), so it doesn't
+ * depend on the order of the items.
+ *
+ * BATCH_READ
+ *   write: items of: table, addr, nb (at most MODBUS_MAX_BATCH_ITEMS)
+ *   read: the values of every item in turn, as for CHANGES_SINCE
+ *   the values must fit in the number of registers read (at most
+ *   MODBUS_MAX_WR_READ_REGISTERS)
+ *
+ * Exceptions: as for subscriptions.  No item is read unless every item
+ * is valid and the batch is authorised; a batch whose ranges can't be
+ * stated in one caveat is answered with ILLEGAL_DATA_VALUE.
+ * */
+
+#ifndef MODBUS_BATCH_READ_ADDRESS
+#define MODBUS_BATCH_READ_ADDRESS 0xFFF3
+#endif
+
+/* the table numbers of subscriptions and batch items */
+#define MODBUS_SUBSCRIPTION_COILS 0
+#define MODBUS_SUBSCRIPTION_DISCRETE_INPUTS 1
+#define MODBUS_SUBSCRIPTION_HOLDING_REGISTERS 2
+#define MODBUS_SUBSCRIPTION_INPUT_REGISTERS 3
+
+#define MODBUS_SUBSCRIBE_PARAMS_NB 3
+#define MODBUS_SUBSCRIBE_RESULT_NB 3
+#define MODBUS_CHANGES_SINCE_PARAMS_NB 2
+
+/* the most registers a write and read request can read */
+#define MODBUS_CHANGES_RESULT_NB 125
+
+/* the sequence, count and more flag ahead of the entries */
+#define MODBUS_CHANGES_HEADER_NB 4
+
+/* a subscription's entry (id and values) must fit in a single reply */
+#define MODBUS_MAX_SUBSCRIBE_REGISTERS (MODBUS_CHANGES_RESULT_NB - MODBUS_CHANGES_HEADER_NB - 1)
+#define MODBUS_MAX_SUBSCRIBE_BITS (16 * MODBUS_MAX_SUBSCRIBE_REGISTERS)
+
+/* table, addr, nb */
+#define MODBUS_BATCH_ITEM_NB 3
+
+/* the longest address set caveat (with its NUL) authorising a batch */
+#define MODBUS_BATCH_CAVEAT_LENGTH 256
+
+/*
+ * as many items as an address set caveat can always state: after
+ * "addresses = " (12 characters), four table names and the ";" between
+ * them (11), each item's range takes at most "65535-65535," (12).  That's
+ * fewer than a write and read request can write.
+ */
+#define MODBUS_MAX_BATCH_ITEMS ((MODBUS_BATCH_CAVEAT_LENGTH - 1 - 12 - 11) / 12)
+
+#endif /* _MODBUS_EXTENSIONS_H_ */
@@ -0,0 +1,212 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_CLIENT_ASYNC_H_
+#define _MODBUS_CLIENT_ASYNC_H_
+
+#include <stdint.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+/*************
+ * DEFINITIONS
+ ************/
+
+/**
+ * A non-blocking, pipelined Modbus/TCP client on top of a connected
+ * libmodbus context.
+ *
+ * Requests are submitted without waiting for the previous reply.  Each is
+ * sent with its own MBAP transaction identifier, and replies are matched
+ * to requests by that identifier, so up to max_in_flight requests can be
+ * outstanding on the one socket.  Requests beyond that are queued and sent
+ * as replies come back.
+ *
+ * Progress is only made inside modbus_async_poll() and modbus_async_wait(),
+ * which send queued requests, read replies and run completion callbacks.
+ * A client must only be used from one thread, and ctx must not be used for
+ * synchronous requests while asynchronous ones are outstanding.
+ *
+ * The *_network_caps variants send the request's Macaroon (a WRITE_STRING,
+ * see network_caps_build_token()) immediately ahead of the request itself,
+ * without waiting for the server to acknowledge the token, so a token and
+ * its request cost one round trip rather than two.  The server verifies
+ * each request against the token written just before it, which holds as
+ * long as every request on the connection carries its own token.
+ * */
+typedef struct modbus_async modbus_async_t;
+typedef struct modbus_async_request modbus_async_request_t;
+
+/* called from modbus_async_poll()/modbus_async_wait() when a request completes */
+typedef void (*modbus_async_callback_t)(modbus_async_request_t *request, void *user_data);
+
+typedef enum {
+    MODBUS_ASYNC_QUEUED,
+    MODBUS_ASYNC_IN_FLIGHT,
+    MODBUS_ASYNC_DONE,
+    MODBUS_ASYNC_FAILED
+} modbus_async_status_t;
+
+/* default number of requests outstanding on the socket at once */
+#define MODBUS_ASYNC_DEFAULT_IN_FLIGHT 16
+
+/*****************
+ * ASYNC FUNCTIONS
+ ****************/
+
+/**
+ * Creates an asynchronous client for ctx, which must already be connected
+ * (modbus_connect(), or a connected socket given to modbus_set_socket()).
+ * The response timeout of ctx applies to each request from when it is
+ * sent.
+ *
+ * Returns NULL on failure.
+ * */
+modbus_async_t *modbus_async_new(modbus_t *ctx, int max_in_flight);
+
+/**
+ * Fails any outstanding requests (without running their callbacks) and
+ * frees the client.  Handles not yet released stay valid and must still be
+ * passed to modbus_async_release().  ctx is left open, but replies to the
+ * outstanding requests may still arrive on it.
+ * */
+void modbus_async_free(modbus_async_t *async);
+
+/**
+ * Submit a request.  dest/src must remain valid until the request
+ * completes.  callback may be NULL.
+ *
+ * Returns a handle, owned by the caller until passed to
+ * modbus_async_release(), or NULL on failure.
+ * */
+modbus_async_request_t *modbus_async_read_bits(modbus_async_t *async, int addr, int nb,
+        uint8_t *dest, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_read_input_bits(modbus_async_t *async, int addr, int nb,
+        uint8_t *dest, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_read_registers(modbus_async_t *async, int addr, int nb,
+        uint16_t *dest, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_read_input_registers(modbus_async_t *async, int addr, int nb,
+        uint16_t *dest, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_write_bit(modbus_async_t *async, int addr, int status,
+        modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_write_register(modbus_async_t *async, int addr,
+        const uint16_t value, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_write_bits(modbus_async_t *async, int addr, int nb,
+        const uint8_t *src, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_write_registers(modbus_async_t *async, int addr, int nb,
+        const uint16_t *src, modbus_async_callback_t callback, void *user_data);
+
+/**
+ * Read the server's string (e.g., its Macaroon, for
+ * initialise_client_network_caps()) into dest, which must hold
+ * MODBUS_MAX_STRING_LENGTH bytes.  dest is NUL-terminated, and the
+ * result is the string's length, as modbus_read_string().
+ * */
+modbus_async_request_t *modbus_async_read_string(modbus_async_t *async, uint8_t *dest,
+        modbus_async_callback_t callback, void *user_data);
+
+modbus_async_request_t *modbus_async_read_bits_network_caps(modbus_async_t *async, int addr, int nb,
+        uint8_t *dest, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_read_input_bits_network_caps(modbus_async_t *async, int addr, int nb,
+        uint8_t *dest, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_read_registers_network_caps(modbus_async_t *async, int addr, int nb,
+        uint16_t *dest, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_read_input_registers_network_caps(modbus_async_t *async, int addr, int nb,
+        uint16_t *dest, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_write_bit_network_caps(modbus_async_t *async, int addr, int status,
+        modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_write_register_network_caps(modbus_async_t *async, int addr,
+        const uint16_t value, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_write_bits_network_caps(modbus_async_t *async, int addr, int nb,
+        const uint8_t *src, modbus_async_callback_t callback, void *user_data);
+modbus_async_request_t *modbus_async_write_registers_network_caps(modbus_async_t *async, int addr, int nb,
+        const uint16_t *src, modbus_async_callback_t callback, void *user_data);
+
+/**
+ * Sends queued requests, then waits up to timeout_ms (0 = don't wait,
+ * -1 = until something happens) for replies, completing requests and
+ * running their callbacks.
+ *
+ * Returns the number of requests completed (successfully or not), or -1
+ * if the connection failed, in which case every outstanding request has
+ * failed.
+ * */
+int modbus_async_poll(modbus_async_t *async, int timeout_ms);
+
+/**
+ * Polls until every one of the nb requests has completed, or timeout_ms
+ * has passed (-1 = no limit).
+ *
+ * Returns 0 once all have completed, or -1 on timeout or connection failure.
+ * */
+int modbus_async_wait(modbus_async_t *async, modbus_async_request_t **requests, int nb, int timeout_ms);
+
+/**
+ * Polls until no requests are queued or in flight.  As modbus_async_wait().
+ * */
+int modbus_async_wait_all(modbus_async_t *async, int timeout_ms);
+
+/* the number of requests queued or in flight */
+int modbus_async_pending(modbus_async_t *async);
+
+/**
+ * For callers with their own event loop: the socket to wait on, whether
+ * to wait for it to be writable as well as readable, and how long until
+ * the next response timeout (-1 if nothing is in flight).  Call
+ * modbus_async_poll() with timeout 0 when the socket is ready or the
+ * timeout has passed.
+ * */
+int modbus_async_get_socket(modbus_async_t *async);
+int modbus_async_want_write(modbus_async_t *async);
+int modbus_async_timeout_ms(modbus_async_t *async);
+
+/*******************
+ * REQUEST FUNCTIONS
+ ******************/
+
+modbus_async_status_t modbus_async_status(const modbus_async_request_t *request);
+
+/**
+ * Returns what the equivalent synchronous libmodbus call would have, once
+ * the request is DONE or FAILED: e.g., the number of registers read, or -1
+ * with modbus_async_errno() holding the error (e.g., ETIMEDOUT, or
+ * MODBUS_ENOBASE + the exception code from the server).
+ * */
+int modbus_async_result(const modbus_async_request_t *request);
+int modbus_async_errno(const modbus_async_request_t *request);
+
+/* the time from submission to completion, in nanoseconds */
+uint64_t modbus_async_latency(const modbus_async_request_t *request);
+
+/**
+ * Releases a handle.  A request still queued or in flight is completed
+ * in the background, without its callback.
+ * */
+void modbus_async_release(modbus_async_request_t *request);
+
+#endif /* _MODBUS_CLIENT_ASYNC_H_ */
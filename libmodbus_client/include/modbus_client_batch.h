@@ -0,0 +1,61 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_CLIENT_BATCH_H_
+#define _MODBUS_CLIENT_BATCH_H_
+
+#include <stdint.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+/* for the batch read protocol */
+#include "modbus_extensions.h"
+
+#include "modbus_client_plan.h"
+
+/**************
+ * BATCH READS
+ *************/
+
+/**
+ * Reads every tag with a single request to a server built with
+ * MODBUS_BATCH_READ (see modbus_extensions.h), in one round trip however
+ * scattered the tags are.  With network caps, the request is authorised
+ * by a single Macaroon whose address set caveat lists each tag's range,
+ * rather than one range spanning them all.
+ *
+ * At most MODBUS_MAX_BATCH_ITEMS tags, whose values (with bits packed 16
+ * to a register) fit in MODBUS_MAX_WR_READ_REGISTERS registers.
+ *
+ * Returns 0, or -1 with errno set (EMBMDATA if the tags don't fit in a
+ * batch, or in the Macaroon authorising it); no dest is written unless
+ * every tag was read.
+ * */
+int modbus_read_batch(modbus_t *ctx, const modbus_tag_t *tags, int nb_tags, int network_caps);
+
+#endif /* _MODBUS_CLIENT_BATCH_H_ */
@@ -0,0 +1,130 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_CLIENT_PLAN_H_
+#define _MODBUS_CLIENT_PLAN_H_
+
+#include <stdint.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+#include "modbus_client_async.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+typedef enum {
+    MODBUS_TABLE_COILS,
+    MODBUS_TABLE_DISCRETE_INPUTS,
+    MODBUS_TABLE_HOLDING_REGISTERS,
+    MODBUS_TABLE_INPUT_REGISTERS
+} modbus_table_t;
+
+/**
+ * A tag to read: nb bits or registers from addr in table, into dest
+ * (uint8_t[nb] for bits, one per byte as modbus_read_bits(), or
+ * uint16_t[nb] for registers).
+ * */
+typedef struct {
+    modbus_table_t table;
+    int addr;
+    int nb;
+    void *dest;
+} modbus_tag_t;
+
+/**
+ * A read plan merges the tags in each table into as few blocks as fit in
+ * a single read request (MODBUS_MAX_READ_BITS or MODBUS_MAX_READ_REGISTERS).
+ * Tags that overlap, or are separated by at most gap unrequested addresses,
+ * are read in the same block; a larger gap costs more bytes per reply but
+ * fewer requests (and, with network caps, fewer Macaroons).
+ *
+ * Executing the plan reads each block once, then copies each tag's part
+ * of its block into its dest.
+ * */
+typedef struct modbus_read_plan modbus_read_plan_t;
+
+/**************
+ * PLANNING
+ *************/
+
+/**
+ * Plans reads of nb_tags tags.  The tags are copied, so only each dest
+ * must outlive the plan.
+ *
+ * Returns NULL on failure, e.g., with errno EMBMDATA if a tag is longer
+ * than a single read request allows.
+ * */
+modbus_read_plan_t *modbus_read_plan_new(const modbus_tag_t *tags, int nb_tags, int gap);
+void modbus_read_plan_free(modbus_read_plan_t *plan);
+
+/* the number of read requests the plan makes */
+int modbus_read_plan_blocks(const modbus_read_plan_t *plan);
+
+/* the table, address and length of a block */
+void modbus_read_plan_block(const modbus_read_plan_t *plan, int block, modbus_table_t *table,
+        int *addr, int *nb);
+
+/***********
+ * EXECUTION
+ **********/
+
+/**
+ * Reads every block one after another, with the synchronous libmodbus
+ * calls (or their network caps variants, with one Macaroon per block),
+ * and scatters the results to the tags.
+ *
+ * Returns 0, or -1 with errno set by the first block that failed; the
+ * tags in blocks after it are not updated.
+ * */
+int modbus_read_plan_execute(modbus_t *ctx, modbus_read_plan_t *plan, int network_caps);
+
+/**
+ * As modbus_read_plan_execute(), but every block is submitted to async at
+ * once and pipelined, then waited for (each is bounded by the response
+ * timeout).  Tags in blocks that succeeded are updated even if others fail.
+ *
+ * Returns 0, or -1 with errno set by a block that failed.
+ * */
+int modbus_read_plan_execute_async(modbus_async_t *async, modbus_read_plan_t *plan, int network_caps);
+
+/**
+ * For callers driving the asynchronous client themselves: submit the read
+ * of one block, then once it has completed, pass the request to
+ * modbus_read_plan_complete_block() to scatter the block to its tags.
+ *
+ * complete returns 0, or -1 with errno set if the read failed.  Neither
+ * releases the request.
+ * */
+modbus_async_request_t *modbus_read_plan_submit_block(modbus_async_t *async, modbus_read_plan_t *plan,
+        int block, int network_caps, modbus_async_callback_t callback, void *user_data);
+int modbus_read_plan_complete_block(modbus_read_plan_t *plan, int block,
+        const modbus_async_request_t *request);
+
+#endif /* _MODBUS_CLIENT_PLAN_H_ */
@@ -0,0 +1,132 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_CLIENT_SCAN_H_
+#define _MODBUS_CLIENT_SCAN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "modbus_client_plan.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+/**
+ * A scan engine polls groups of tags on many servers, each group at its
+ * own period, from a single epoll loop.
+ *
+ * Each server has one connection and one asynchronous client
+ * (modbus_client_async.h).  Connections are made without blocking the
+ * loop: the socket connects in the background, then, with network caps,
+ * the server's Macaroon is read (asynchronously) and kept as the client
+ * Macaroon for that connection; each request is sent with a token
+ * attenuated from it.  Scans due meanwhile wait for the connection.
+ *
+ * Each group is read with a read plan (modbus_client_plan.h).  Groups are
+ * kept in a heap ordered by their next deadline, and when due are issued
+ * in deadline order.  A server takes no more than its window of requests
+ * at once; groups due on a busy server wait, in deadline order, until
+ * replies free the window.
+ *
+ * A group's scan is missed when its next deadline arrives while the
+ * previous scan is still waiting or in flight: that period is skipped,
+ * rather than queueing scans faster than the server can answer them.
+ * */
+typedef struct modbus_scan modbus_scan_t;
+
+/**
+ * Called from modbus_scan_run() when a scan of a group has completed: rc
+ * is 0 once every tag has been updated, or -1 with err set if any read
+ * failed (the tags read successfully are still updated).
+ * */
+typedef void (*modbus_scan_callback_t)(int group, int rc, int err, void *user_data);
+
+typedef struct {
+    uint64_t scans;
+    uint64_t failed;
+    uint64_t missed;
+
+    /* from the deadline to when the scan was issued */
+    uint64_t total_lateness_ns;
+    uint64_t max_lateness_ns;
+
+    /* from issuing the scan to its last reply */
+    uint64_t total_duration_ns;
+    uint64_t max_duration_ns;
+} modbus_scan_stats_t;
+
+/**************
+ * SCAN ENGINE
+ *************/
+
+modbus_scan_t *modbus_scan_new(void);
+
+/* closes every connection */
+void modbus_scan_free(modbus_scan_t *scan);
+
+/**
+ * Starts connecting to a server (and, with network caps, reading its
+ * Macaroon), which completes in modbus_scan_run().  A window of 0 uses
+ * MODBUS_ASYNC_DEFAULT_IN_FLIGHT.
+ *
+ * Returns the server's index, or -1 on failure (e.g., an invalid ip).
+ * */
+int modbus_scan_add_server(modbus_scan_t *scan, const char *ip, int port, int network_caps, int window);
+
+/**
+ * Adds a group of tags on a server, read every period_ms.  The tags are
+ * planned with gap as modbus_read_plan_new(); each dest must stay valid
+ * until the engine is freed.  callback may be NULL.  The first scan is due
+ * as soon as the engine runs.
+ *
+ * Returns the group's index, or -1 on failure.
+ * */
+int modbus_scan_add_group(modbus_scan_t *scan, int server, const modbus_tag_t *tags, int nb_tags,
+        int gap, uint32_t period_ms, modbus_scan_callback_t callback, void *user_data);
+
+/**
+ * Runs the engine for duration_ms (-1 = until modbus_scan_stop() is
+ * called from a callback).  A server whose connection fails is reconnected
+ * when its next group is due; scans on it fail until then.
+ *
+ * Returns 0, or -1 if the event loop failed.
+ * */
+int modbus_scan_run(modbus_scan_t *scan, int duration_ms);
+void modbus_scan_stop(modbus_scan_t *scan);
+
+void modbus_scan_get_stats(modbus_scan_t *scan, int group, modbus_scan_stats_t *stats);
+
+/**
+ * Prints a row per group:
+ * SCAN, server, group, period_ms, blocks, scans, failed, missed,
+ * mean_lateness_us, max_lateness_us, mean_duration_us, max_duration_us
+ * */
+void modbus_scan_print_stats(modbus_scan_t *scan, FILE *out);
+
+#endif /* _MODBUS_CLIENT_SCAN_H_ */
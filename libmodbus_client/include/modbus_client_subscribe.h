@@ -0,0 +1,108 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_CLIENT_SUBSCRIBE_H_
+#define _MODBUS_CLIENT_SUBSCRIBE_H_
+
+#include <stdint.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+/* for the subscription protocol */
+#include "modbus_extensions.h"
+
+#include "modbus_client_plan.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+/**
+ * Report-by-exception reads from a server built with MODBUS_SUBSCRIPTIONS
+ * (see modbus_extensions.h).
+ *
+ * Each tag is subscribed to once, then modbus_poll_changes() asks the
+ * server for the subscriptions that changed since the last poll, and
+ * copies their values to their dests: a poll of unchanged tags is a
+ * single short round trip, however many tags there are.  With network
+ * caps, a Macaroon for a read of the tag is sent only when subscribing.
+ *
+ * Subscriptions belong to the connection, so they are lost if it is
+ * closed; subscribe again after reconnecting.
+ * */
+typedef struct modbus_subscriptions modbus_subscriptions_t;
+
+/******************
+ * SUBSCRIPTIONS
+ *****************/
+
+/**
+ * Track the subscriptions made over ctx, which must stay connected while
+ * they are in use.
+ *
+ * Returns NULL on failure.
+ * */
+modbus_subscriptions_t *modbus_subscriptions_new(modbus_t *ctx, int network_caps);
+
+/* doesn't unsubscribe; the server releases subscriptions when ctx closes */
+void modbus_subscriptions_free(modbus_subscriptions_t *subs);
+
+/**
+ * Subscribe to tag.  dest must outlive the subscription; it is written
+ * by modbus_poll_changes(), starting with the first poll.  A tag may be
+ * at most MODBUS_MAX_SUBSCRIBE_BITS or MODBUS_MAX_SUBSCRIBE_REGISTERS
+ * long.
+ *
+ * Returns the subscription id, or -1 with errno set (e.g., EMBXILADD if
+ * the tag is outside the server's mapping).
+ * */
+int modbus_subscribe(modbus_subscriptions_t *subs, const modbus_tag_t *tag);
+
+/**
+ * Returns 0, or -1 with errno set (EMBXILADD if the server had released
+ * the subscription, which is then dropped here too)
+ * */
+int modbus_unsubscribe(modbus_subscriptions_t *subs, int id);
+
+/**
+ * Ask for every subscription that changed since the last poll (or was
+ * made since), and copy their values to their dests.  The ids of up to
+ * max_ids of them are written to ids, which may be NULL.
+ *
+ * Returns the number of subscriptions updated, or -1 with errno set; on
+ * failure, the changes are asked for again by the next poll.  EMBXILADD
+ * means the server released some subscriptions (e.g., the key that
+ * authorised them was retired): modbus_unsubscribe() finds which, and
+ * they must be made again.
+ * */
+int modbus_poll_changes(modbus_subscriptions_t *subs, int *ids, int max_ids);
+
+/* the server sequence number the last poll was up to date with */
+uint32_t modbus_subscriptions_sequence(const modbus_subscriptions_t *subs);
+
+#endif /* _MODBUS_CLIENT_SUBSCRIBE_H_ */
@@ -0,0 +1,1185 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+/* for network_caps_build_token() */
+#include "modbus_network_caps.h"
+
+#include "modbus_client_async.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+/* transaction id, protocol id, length, unit id */
+#define MBAP_LENGTH 7
+
+/* function code, address and length ahead of the string */
+#define WRITE_STRING_HEADER_LENGTH 5
+
+/* function code and length ahead of the string */
+#define READ_STRING_HEADER_LENGTH 3
+
+/**
+ * The longest request sent is a WRITE_STRING carrying a Macaroon, and
+ * the longest reply a READ_STRING carrying one
+ * */
+#define ASYNC_MAX_ADU_LENGTH (MBAP_LENGTH + WRITE_STRING_HEADER_LENGTH + MODBUS_MAX_STRING_LENGTH)
+
+#define ASYNC_TX_LENGTH (8 * ASYNC_MAX_ADU_LENGTH)
+#define ASYNC_RX_LENGTH (4 * ASYNC_MAX_ADU_LENGTH)
+
+struct modbus_async_request {
+    modbus_async_t *async;
+
+    /* the next request in the send queue */
+    modbus_async_request_t *next;
+
+    /**
+     * A request sent with network caps points to the WRITE_STRING carrying
+     * its Macaroon (token), and the token back to it (parent), until one of
+     * them completes.  Tokens are internal and freed when they complete.
+     * */
+    modbus_async_request_t *token;
+    modbus_async_request_t *parent;
+    int internal;
+    int token_err;
+
+    int released;
+
+    int function;
+    int addr;
+    int nb;
+    uint8_t *dest_bits;
+    uint16_t *dest_registers;
+    uint8_t *dest_string;
+
+    modbus_async_status_t status;
+    int rc;
+    int err;
+
+    modbus_async_callback_t callback;
+    void *user_data;
+
+    uint64_t submit_time;
+    uint64_t deadline;
+    uint64_t complete_time;
+
+    int adu_length;
+    uint8_t adu[ASYNC_MAX_ADU_LENGTH];
+};
+
+struct modbus_async {
+    modbus_t *ctx;
+    int s;
+    int unit;
+    uint16_t next_tid;
+    uint64_t response_timeout;
+
+    /* submitted requests not yet sent, in order */
+    modbus_async_request_t *queue_head;
+    modbus_async_request_t *queue_tail;
+
+    /* requests sent and awaiting a reply, matched by transaction id */
+    modbus_async_request_t **in_flight;
+    int nb_in_flight;
+    int max_in_flight;
+
+    /* user requests queued or in flight */
+    int pending;
+
+    /* set once the connection has failed */
+    int err;
+
+    /* don't run callbacks (modbus_async_free()) */
+    int closing;
+
+    int tx_length;
+    uint8_t tx[ASYNC_TX_LENGTH];
+    int rx_length;
+    uint8_t rx[ASYNC_RX_LENGTH];
+};
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void put_uint16(uint8_t *buf, uint16_t value)
+{
+    buf[0] = value >> 8;
+    buf[1] = value & 0xFF;
+}
+
+static uint16_t get_uint16(const uint8_t *buf)
+{
+    return (buf[0] << 8) | buf[1];
+}
+
+static void free_request(modbus_async_request_t *request)
+{
+    if (request->token != NULL)
+    {
+        free(request->token);
+    }
+
+    free(request);
+}
+
+/**
+ * Completes a request: records the result, unlinks it from its token or
+ * parent, and runs its callback.
+ *
+ * Returns 1 if a user request completed, 0 for a token.
+ * */
+static int complete_request(modbus_async_t *async, modbus_async_request_t *request, int rc, int err)
+{
+    request->complete_time = now_ns();
+
+    if (request->internal)
+    {
+        if (request->parent != NULL)
+        {
+            request->parent->token = NULL;
+            if (rc == -1)
+            {
+                request->parent->token_err = err;
+            }
+        }
+
+        free(request);
+        return 0;
+    }
+
+    if (request->token != NULL)
+    {
+        request->token->parent = NULL;
+        request->token = NULL;
+    }
+
+    /* the server won't have authorised a request whose Macaroon failed */
+    if (request->token_err != 0)
+    {
+        rc = -1;
+        err = request->token_err;
+    }
+
+    request->rc = rc;
+    request->err = (rc == -1) ? err : 0;
+    request->status = (rc == -1) ? MODBUS_ASYNC_FAILED : MODBUS_ASYNC_DONE;
+    async->pending--;
+
+    if (request->released)
+    {
+        free_request(request);
+    }
+    else if (request->callback != NULL && !async->closing)
+    {
+        request->callback(request, request->user_data);
+    }
+
+    return 1;
+}
+
+static void remove_in_flight(modbus_async_t *async, int i)
+{
+    async->nb_in_flight--;
+    async->in_flight[i] = async->in_flight[async->nb_in_flight];
+}
+
+/**
+ * Fails every outstanding request once the connection has failed
+ * */
+static void fail_all(modbus_async_t *async, int err)
+{
+    async->err = err;
+
+    /* tokens first, so their parents fail with the connection error */
+    for (int i = 0; i < async->nb_in_flight; ++i)
+    {
+        if (async->in_flight[i]->internal)
+        {
+            complete_request(async, async->in_flight[i], -1, err);
+            remove_in_flight(async, i--);
+        }
+    }
+
+    while (async->nb_in_flight > 0)
+    {
+        complete_request(async, async->in_flight[0], -1, err);
+        remove_in_flight(async, 0);
+    }
+
+    while (async->queue_head != NULL)
+    {
+        modbus_async_request_t *request = async->queue_head;
+        async->queue_head = request->next;
+        if (request->token != NULL)
+        {
+            free(request->token);
+            request->token = NULL;
+        }
+        complete_request(async, request, -1, err);
+    }
+
+    async->queue_tail = NULL;
+    async->tx_length = 0;
+    async->rx_length = 0;
+}
+
+/*********************
+ * REQUEST CONSTRUCTION
+ ********************/
+
+static modbus_async_request_t *new_request(modbus_async_t *async, int function, int addr, int nb,
+        modbus_async_callback_t callback, void *user_data)
+{
+    modbus_async_request_t *request = calloc(1, sizeof(modbus_async_request_t));
+    if (request == NULL)
+    {
+        return NULL;
+    }
+
+    request->async = async;
+    request->function = function;
+    request->addr = addr;
+    request->nb = nb;
+    request->status = MODBUS_ASYNC_QUEUED;
+    request->callback = callback;
+    request->user_data = user_data;
+    request->submit_time = now_ns();
+
+    return request;
+}
+
+/**
+ * Writes the MBAP header ahead of the PDU already in request->adu.  The
+ * transaction id is filled in when the request is sent.
+ * */
+static void frame_request(modbus_async_t *async, modbus_async_request_t *request, int pdu_length)
+{
+    put_uint16(request->adu, 0);
+    put_uint16(request->adu + 2, 0);
+    put_uint16(request->adu + 4, pdu_length + 1);
+    request->adu[6] = async->unit;
+    request->adu_length = MBAP_LENGTH + pdu_length;
+}
+
+/**
+ * Builds the WRITE_STRING carrying the Macaroon for a request.  The PDU
+ * must match modbus_write_string() in our libmodbus fork: the function
+ * code, a zero address, the string length, then the string.
+ * */
+static modbus_async_request_t *new_token(modbus_async_t *async, int function, int addr, int nb)
+{
+    modbus_async_request_t *token = new_request(async, MODBUS_FC_WRITE_STRING, 0, 0, NULL, NULL);
+    if (token == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t *pdu = token->adu + MBAP_LENGTH;
+    int length = network_caps_build_token(async->ctx, function, addr, nb,
+            pdu + WRITE_STRING_HEADER_LENGTH, MODBUS_MAX_STRING_LENGTH);
+    if (length == -1)
+    {
+        free(token);
+        return NULL;
+    }
+
+    pdu[0] = MODBUS_FC_WRITE_STRING;
+    put_uint16(pdu + 1, 0);
+    put_uint16(pdu + 3, length);
+
+    token->internal = 1;
+    token->nb = length;
+    frame_request(async, token, WRITE_STRING_HEADER_LENGTH + length);
+
+    return token;
+}
+
+static int async_send(modbus_async_t *async);
+
+/**
+ * Queues a framed request (and its token for network caps), then sends
+ * what the window allows.
+ * */
+static modbus_async_request_t *submit_request(modbus_async_t *async, modbus_async_request_t *request,
+        int network_caps, int token_nb)
+{
+    if (async->err != 0)
+    {
+        free(request);
+        errno = async->err;
+        return NULL;
+    }
+
+    if (network_caps)
+    {
+        request->token = new_token(async, request->function, request->addr, token_nb);
+        if (request->token == NULL)
+        {
+            free(request);
+            return NULL;
+        }
+        request->token->parent = request;
+    }
+
+    if (async->queue_tail == NULL)
+    {
+        async->queue_head = request;
+    }
+    else
+    {
+        async->queue_tail->next = request;
+    }
+    async->queue_tail = request;
+    async->pending++;
+
+    if (async_send(async) == -1)
+    {
+        fail_all(async, errno);
+    }
+
+    return request;
+}
+
+static modbus_async_request_t *submit_read(modbus_async_t *async, int function, int addr, int nb,
+        int max_nb, uint8_t *dest_bits, uint16_t *dest_registers, int network_caps,
+        modbus_async_callback_t callback, void *user_data)
+{
+    if (async == NULL || nb < 1 || nb > max_nb)
+    {
+        errno = EMBMDATA;
+        return NULL;
+    }
+
+    modbus_async_request_t *request = new_request(async, function, addr, nb, callback, user_data);
+    if (request == NULL)
+    {
+        return NULL;
+    }
+    request->dest_bits = dest_bits;
+    request->dest_registers = dest_registers;
+
+    uint8_t *pdu = request->adu + MBAP_LENGTH;
+    pdu[0] = function;
+    put_uint16(pdu + 1, addr);
+    put_uint16(pdu + 3, nb);
+    frame_request(async, request, 5);
+
+    return submit_request(async, request, network_caps, nb);
+}
+
+static modbus_async_request_t *submit_write_single(modbus_async_t *async, int function, int addr,
+        uint16_t value, int network_caps, modbus_async_callback_t callback, void *user_data)
+{
+    if (async == NULL)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    modbus_async_request_t *request = new_request(async, function, addr, 1, callback, user_data);
+    if (request == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t *pdu = request->adu + MBAP_LENGTH;
+    pdu[0] = function;
+    put_uint16(pdu + 1, addr);
+    put_uint16(pdu + 3, value);
+    frame_request(async, request, 5);
+
+    /* as the synchronous client, single writes are authorised with nb = 0 */
+    return submit_request(async, request, network_caps, 0);
+}
+
+static modbus_async_request_t *submit_write_bits(modbus_async_t *async, int addr, int nb,
+        const uint8_t *src, int network_caps, modbus_async_callback_t callback, void *user_data)
+{
+    if (async == NULL || nb < 1 || nb > MODBUS_MAX_WRITE_BITS)
+    {
+        errno = EMBMDATA;
+        return NULL;
+    }
+
+    modbus_async_request_t *request = new_request(async, MODBUS_FC_WRITE_MULTIPLE_COILS, addr, nb,
+            callback, user_data);
+    if (request == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t *pdu = request->adu + MBAP_LENGTH;
+    int byte_count = (nb + 7) / 8;
+    pdu[0] = MODBUS_FC_WRITE_MULTIPLE_COILS;
+    put_uint16(pdu + 1, addr);
+    put_uint16(pdu + 3, nb);
+    pdu[5] = byte_count;
+    memset(pdu + 6, 0, byte_count);
+    for (int i = 0; i < nb; ++i)
+    {
+        if (src[i])
+        {
+            pdu[6 + i / 8] |= 1 << (i % 8);
+        }
+    }
+    frame_request(async, request, 6 + byte_count);
+
+    return submit_request(async, request, network_caps, nb);
+}
+
+static modbus_async_request_t *submit_write_registers(modbus_async_t *async, int addr, int nb,
+        const uint16_t *src, int network_caps, modbus_async_callback_t callback, void *user_data)
+{
+    if (async == NULL || nb < 1 || nb > MODBUS_MAX_WRITE_REGISTERS)
+    {
+        errno = EMBMDATA;
+        return NULL;
+    }
+
+    modbus_async_request_t *request = new_request(async, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, nb,
+            callback, user_data);
+    if (request == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t *pdu = request->adu + MBAP_LENGTH;
+    pdu[0] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+    put_uint16(pdu + 1, addr);
+    put_uint16(pdu + 3, nb);
+    pdu[5] = nb * 2;
+    for (int i = 0; i < nb; ++i)
+    {
+        put_uint16(pdu + 6 + 2 * i, src[i]);
+    }
+    frame_request(async, request, 6 + nb * 2);
+
+    return submit_request(async, request, network_caps, nb);
+}
+
+/**
+ * Builds a READ_STRING.  The PDU must match modbus_read_string() in our
+ * libmodbus fork: the function code, then a zero address and length.
+ * */
+static modbus_async_request_t *submit_read_string(modbus_async_t *async, uint8_t *dest,
+        modbus_async_callback_t callback, void *user_data)
+{
+    if (async == NULL || dest == NULL)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    modbus_async_request_t *request = new_request(async, MODBUS_FC_READ_STRING, 0, 0, callback, user_data);
+    if (request == NULL)
+    {
+        return NULL;
+    }
+    request->dest_string = dest;
+
+    uint8_t *pdu = request->adu + MBAP_LENGTH;
+    pdu[0] = MODBUS_FC_READ_STRING;
+    put_uint16(pdu + 1, 0);
+    put_uint16(pdu + 3, 0);
+    frame_request(async, request, 5);
+
+    return submit_request(async, request, 0, 0);
+}
+
+/***********
+ * TRANSPORT
+ **********/
+
+/**
+ * Moves queued requests into the window and the transmit buffer.  A request
+ * and its token are always sent back to back.
+ * */
+static void dispatch_requests(modbus_async_t *async)
+{
+    while (async->queue_head != NULL)
+    {
+        modbus_async_request_t *request = async->queue_head;
+        modbus_async_request_t *token = request->token;
+        int slots = (token != NULL) ? 2 : 1;
+        int length = request->adu_length + ((token != NULL) ? token->adu_length : 0);
+
+        if (async->nb_in_flight + slots > async->max_in_flight ||
+                async->tx_length + length > ASYNC_TX_LENGTH)
+        {
+            return;
+        }
+
+        async->queue_head = request->next;
+        if (async->queue_head == NULL)
+        {
+            async->queue_tail = NULL;
+        }
+        request->next = NULL;
+
+        uint64_t deadline = now_ns() + async->response_timeout;
+        modbus_async_request_t *frames[2] = { token, request };
+        for (int i = 0; i < 2; ++i)
+        {
+            if (frames[i] == NULL)
+            {
+                continue;
+            }
+
+            put_uint16(frames[i]->adu, async->next_tid++);
+            frames[i]->deadline = deadline;
+            frames[i]->status = MODBUS_ASYNC_IN_FLIGHT;
+            memcpy(async->tx + async->tx_length, frames[i]->adu, frames[i]->adu_length);
+            async->tx_length += frames[i]->adu_length;
+            async->in_flight[async->nb_in_flight++] = frames[i];
+        }
+    }
+}
+
+/**
+ * Sends as much as the socket will take without blocking
+ *
+ * Returns 0, or -1 if the connection failed.
+ * */
+static int async_send(modbus_async_t *async)
+{
+    for (;;)
+    {
+        dispatch_requests(async);
+        if (async->tx_length == 0)
+        {
+            return 0;
+        }
+
+        ssize_t n = send(async->s, async->tx, async->tx_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        async->tx_length -= n;
+        memmove(async->tx, async->tx + n, async->tx_length);
+    }
+}
+
+/**
+ * Decodes the reply to a request as the synchronous libmodbus call would
+ *
+ * Returns the result, or -1 with *err set.
+ * */
+static int decode_reply(modbus_async_request_t *request, const uint8_t *pdu, int pdu_length, int *err)
+{
+    if (pdu[0] == (request->function | 0x80))
+    {
+        *err = (pdu_length >= 2) ? MODBUS_ENOBASE + pdu[1] : EMBBADDATA;
+        return -1;
+    }
+
+    *err = EMBBADDATA;
+    if (pdu[0] != request->function)
+    {
+        return -1;
+    }
+
+    switch (request->function)
+    {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            {
+                int byte_count = (request->nb + 7) / 8;
+                if (pdu_length < 2 + byte_count || pdu[1] != byte_count)
+                {
+                    return -1;
+                }
+
+                for (int i = 0; i < request->nb; ++i)
+                {
+                    request->dest_bits[i] = (pdu[2 + i / 8] >> (i % 8)) & 1;
+                }
+                return request->nb;
+            }
+
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            {
+                int byte_count = request->nb * 2;
+                if (pdu_length < 2 + byte_count || pdu[1] != byte_count)
+                {
+                    return -1;
+                }
+
+                for (int i = 0; i < request->nb; ++i)
+                {
+                    request->dest_registers[i] = get_uint16(pdu + 2 + 2 * i);
+                }
+                return request->nb;
+            }
+
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            return (pdu_length >= 5) ? 1 : -1;
+
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            return (pdu_length >= 5) ? get_uint16(pdu + 3) : -1;
+
+        case MODBUS_FC_WRITE_STRING:
+            return request->nb;
+
+        case MODBUS_FC_READ_STRING:
+            {
+                /* the string's length, then the string (not terminated) */
+                int length = (pdu_length >= READ_STRING_HEADER_LENGTH) ? get_uint16(pdu + 1) : -1;
+                if (length < 0 || length >= MODBUS_MAX_STRING_LENGTH ||
+                        pdu_length < READ_STRING_HEADER_LENGTH + length)
+                {
+                    return -1;
+                }
+
+                memcpy(request->dest_string, pdu + READ_STRING_HEADER_LENGTH, length);
+                request->dest_string[length] = '\0';
+                return length;
+            }
+    }
+
+    return -1;
+}
+
+/**
+ * Completes the request a reply is for.  Replies that match nothing in
+ * flight (e.g., to a request that already timed out) are dropped.
+ * */
+static int handle_reply(modbus_async_t *async, const uint8_t *adu, int adu_length)
+{
+    uint16_t tid = get_uint16(adu);
+
+    for (int i = 0; i < async->nb_in_flight; ++i)
+    {
+        modbus_async_request_t *request = async->in_flight[i];
+        if (get_uint16(request->adu) != tid)
+        {
+            continue;
+        }
+
+        remove_in_flight(async, i);
+
+        int err = 0;
+        int rc = decode_reply(request, adu + MBAP_LENGTH, adu_length - MBAP_LENGTH, &err);
+        return complete_request(async, request, rc, err);
+    }
+
+    return 0;
+}
+
+/**
+ * Reads whatever has arrived and completes the requests it replies to
+ *
+ * Returns the number completed, or -1 if the connection failed.
+ * */
+static int async_receive(modbus_async_t *async)
+{
+    int completed = 0;
+
+    for (;;)
+    {
+        ssize_t n = recv(async->s, async->rx + async->rx_length, ASYNC_RX_LENGTH - async->rx_length,
+                MSG_DONTWAIT);
+        if (n == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? completed : -1;
+        }
+        async->rx_length += n;
+
+        /* complete every whole ADU in the buffer */
+        int offset = 0;
+        while (async->rx_length - offset >= MBAP_LENGTH)
+        {
+            uint8_t *adu = async->rx + offset;
+            int length = get_uint16(adu + 4);
+            if (length < 2 || length > ASYNC_MAX_ADU_LENGTH - 6)
+            {
+                errno = EMBBADDATA;
+                return -1;
+            }
+
+            if (async->rx_length - offset < 6 + length)
+            {
+                break;
+            }
+
+            completed += handle_reply(async, adu, 6 + length);
+            offset += 6 + length;
+        }
+
+        async->rx_length -= offset;
+        memmove(async->rx, async->rx + offset, async->rx_length);
+    }
+}
+
+/**
+ * Fails the requests in flight past their response timeout
+ *
+ * Returns the number of user requests failed, and sets *next to the
+ * earliest remaining deadline (or UINT64_MAX).
+ * */
+static int expire_requests(modbus_async_t *async, uint64_t now, uint64_t *next)
+{
+    int completed = 0;
+    *next = UINT64_MAX;
+
+    for (int i = 0; i < async->nb_in_flight; ++i)
+    {
+        modbus_async_request_t *request = async->in_flight[i];
+        if (request->deadline > now)
+        {
+            if (request->deadline < *next)
+            {
+                *next = request->deadline;
+            }
+            continue;
+        }
+
+        remove_in_flight(async, i--);
+        completed += complete_request(async, request, -1, ETIMEDOUT);
+    }
+
+    return completed;
+}
+
+/*****************
+ * ASYNC FUNCTIONS
+ ****************/
+
+modbus_async_t *modbus_async_new(modbus_t *ctx, int max_in_flight)
+{
+    if (ctx == NULL || modbus_get_socket(ctx) == -1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (max_in_flight <= 0)
+    {
+        max_in_flight = MODBUS_ASYNC_DEFAULT_IN_FLIGHT;
+    }
+
+    /* a network caps request needs a slot for its token too */
+    if (max_in_flight < 2)
+    {
+        max_in_flight = 2;
+    }
+
+    modbus_async_t *async = calloc(1, sizeof(modbus_async_t));
+    if (async == NULL)
+    {
+        return NULL;
+    }
+
+    async->in_flight = calloc(max_in_flight, sizeof(modbus_async_request_t *));
+    if (async->in_flight == NULL)
+    {
+        free(async);
+        return NULL;
+    }
+
+    uint32_t to_sec;
+    uint32_t to_usec;
+    modbus_get_response_timeout(ctx, &to_sec, &to_usec);
+
+    async->ctx = ctx;
+    async->s = modbus_get_socket(ctx);
+    async->unit = (modbus_get_slave(ctx) < 0) ? MODBUS_TCP_SLAVE : modbus_get_slave(ctx);
+    async->response_timeout = (uint64_t)to_sec * 1000000000ULL + (uint64_t)to_usec * 1000ULL;
+    async->max_in_flight = max_in_flight;
+
+    return async;
+}
+
+void modbus_async_free(modbus_async_t *async)
+{
+    if (async == NULL)
+    {
+        return;
+    }
+
+    async->closing = 1;
+    fail_all(async, ECONNABORTED);
+
+    free(async->in_flight);
+    free(async);
+}
+
+modbus_async_request_t *modbus_async_read_bits(modbus_async_t *async, int addr, int nb,
+        uint8_t *dest, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read(async, MODBUS_FC_READ_COILS, addr, nb, MODBUS_MAX_READ_BITS,
+            dest, NULL, 0, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_read_input_bits(modbus_async_t *async, int addr, int nb,
+        uint8_t *dest, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read(async, MODBUS_FC_READ_DISCRETE_INPUTS, addr, nb, MODBUS_MAX_READ_BITS,
+            dest, NULL, 0, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_read_registers(modbus_async_t *async, int addr, int nb,
+        uint16_t *dest, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read(async, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb, MODBUS_MAX_READ_REGISTERS,
+            NULL, dest, 0, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_read_input_registers(modbus_async_t *async, int addr, int nb,
+        uint16_t *dest, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read(async, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb, MODBUS_MAX_READ_REGISTERS,
+            NULL, dest, 0, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_write_bit(modbus_async_t *async, int addr, int status,
+        modbus_async_callback_t callback, void *user_data)
+{
+    return submit_write_single(async, MODBUS_FC_WRITE_SINGLE_COIL, addr, status ? 0xFF00 : 0,
+            0, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_write_register(modbus_async_t *async, int addr,
+        const uint16_t value, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_write_single(async, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, value,
+            0, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_write_bits(modbus_async_t *async, int addr, int nb,
+        const uint8_t *src, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_write_bits(async, addr, nb, src, 0, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_write_registers(modbus_async_t *async, int addr, int nb,
+        const uint16_t *src, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_write_registers(async, addr, nb, src, 0, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_read_string(modbus_async_t *async, uint8_t *dest,
+        modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read_string(async, dest, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_read_bits_network_caps(modbus_async_t *async, int addr, int nb,
+        uint8_t *dest, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read(async, MODBUS_FC_READ_COILS, addr, nb, MODBUS_MAX_READ_BITS,
+            dest, NULL, 1, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_read_input_bits_network_caps(modbus_async_t *async, int addr, int nb,
+        uint8_t *dest, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read(async, MODBUS_FC_READ_DISCRETE_INPUTS, addr, nb, MODBUS_MAX_READ_BITS,
+            dest, NULL, 1, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_read_registers_network_caps(modbus_async_t *async, int addr, int nb,
+        uint16_t *dest, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read(async, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb, MODBUS_MAX_READ_REGISTERS,
+            NULL, dest, 1, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_read_input_registers_network_caps(modbus_async_t *async, int addr, int nb,
+        uint16_t *dest, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_read(async, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb, MODBUS_MAX_READ_REGISTERS,
+            NULL, dest, 1, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_write_bit_network_caps(modbus_async_t *async, int addr, int status,
+        modbus_async_callback_t callback, void *user_data)
+{
+    return submit_write_single(async, MODBUS_FC_WRITE_SINGLE_COIL, addr, status ? 0xFF00 : 0,
+            1, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_write_register_network_caps(modbus_async_t *async, int addr,
+        const uint16_t value, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_write_single(async, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, value,
+            1, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_write_bits_network_caps(modbus_async_t *async, int addr, int nb,
+        const uint8_t *src, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_write_bits(async, addr, nb, src, 1, callback, user_data);
+}
+
+modbus_async_request_t *modbus_async_write_registers_network_caps(modbus_async_t *async, int addr, int nb,
+        const uint16_t *src, modbus_async_callback_t callback, void *user_data)
+{
+    return submit_write_registers(async, addr, nb, src, 1, callback, user_data);
+}
+
+int modbus_async_poll(modbus_async_t *async, int timeout_ms)
+{
+    int completed = 0;
+    uint64_t next_deadline;
+
+    if (async->err != 0)
+    {
+        errno = async->err;
+        return -1;
+    }
+
+    if (async_send(async) == -1)
+    {
+        fail_all(async, errno);
+        return -1;
+    }
+
+    completed += expire_requests(async, now_ns(), &next_deadline);
+    if (async->nb_in_flight == 0 && async->tx_length == 0)
+    {
+        return completed;
+    }
+
+    /* don't sleep past the next response timeout */
+    if (next_deadline != UINT64_MAX)
+    {
+        uint64_t now = now_ns();
+        int until_deadline = (next_deadline > now) ?
+            (int)((next_deadline - now + 999999) / 1000000) : 0;
+        if (timeout_ms < 0 || until_deadline < timeout_ms)
+        {
+            timeout_ms = until_deadline;
+        }
+    }
+
+    if (completed > 0)
+    {
+        timeout_ms = 0;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = async->s;
+    pfd.events = POLLIN | ((async->tx_length > 0) ? POLLOUT : 0);
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR)
+    {
+        fail_all(async, errno);
+        return -1;
+    }
+
+    int rc = async_receive(async);
+    if (rc == -1 || async_send(async) == -1)
+    {
+        fail_all(async, errno);
+        return -1;
+    }
+    completed += rc;
+
+    completed += expire_requests(async, now_ns(), &next_deadline);
+
+    return completed;
+}
+
+/**
+ * Polls until done(async, requests, nb) or timeout_ms has passed
+ * */
+static int wait_until(modbus_async_t *async, modbus_async_request_t **requests, int nb, int timeout_ms,
+        int (*done)(modbus_async_t *, modbus_async_request_t **, int))
+{
+    uint64_t deadline = (timeout_ms < 0) ? UINT64_MAX : now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+
+    while (!done(async, requests, nb))
+    {
+        int poll_timeout = -1;
+        if (deadline != UINT64_MAX)
+        {
+            uint64_t now = now_ns();
+            if (now >= deadline)
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            poll_timeout = (int)((deadline - now + 999999) / 1000000);
+        }
+
+        if (modbus_async_poll(async, poll_timeout) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int requests_done(modbus_async_t *async, modbus_async_request_t **requests, int nb)
+{
+    for (int i = 0; i < nb; ++i)
+    {
+        if (requests[i]->status == MODBUS_ASYNC_QUEUED || requests[i]->status == MODBUS_ASYNC_IN_FLIGHT)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int all_done(modbus_async_t *async, modbus_async_request_t **requests, int nb)
+{
+    return async->pending == 0;
+}
+
+int modbus_async_wait(modbus_async_t *async, modbus_async_request_t **requests, int nb, int timeout_ms)
+{
+    return wait_until(async, requests, nb, timeout_ms, requests_done);
+}
+
+int modbus_async_wait_all(modbus_async_t *async, int timeout_ms)
+{
+    return wait_until(async, NULL, 0, timeout_ms, all_done);
+}
+
+int modbus_async_pending(modbus_async_t *async)
+{
+    return async->pending;
+}
+
+int modbus_async_get_socket(modbus_async_t *async)
+{
+    return async->s;
+}
+
+int modbus_async_want_write(modbus_async_t *async)
+{
+    return async->tx_length > 0;
+}
+
+int modbus_async_timeout_ms(modbus_async_t *async)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < async->nb_in_flight; ++i)
+    {
+        if (async->in_flight[i]->deadline < next)
+        {
+            next = async->in_flight[i]->deadline;
+        }
+    }
+
+    if (next == UINT64_MAX)
+    {
+        return -1;
+    }
+
+    uint64_t now = now_ns();
+    return (next > now) ? (int)((next - now + 999999) / 1000000) : 0;
+}
+
+/*******************
+ * REQUEST FUNCTIONS
+ ******************/
+
+modbus_async_status_t modbus_async_status(const modbus_async_request_t *request)
+{
+    return request->status;
+}
+
+int modbus_async_result(const modbus_async_request_t *request)
+{
+    return request->rc;
+}
+
+int modbus_async_errno(const modbus_async_request_t *request)
+{
+    return request->err;
+}
+
+uint64_t modbus_async_latency(const modbus_async_request_t *request)
+{
+    if (request->status != MODBUS_ASYNC_DONE && request->status != MODBUS_ASYNC_FAILED)
+    {
+        return 0;
+    }
+
+    return request->complete_time - request->submit_time;
+}
+
+void modbus_async_release(modbus_async_request_t *request)
+{
+    if (request == NULL)
+    {
+        return;
+    }
+
+    if (request->status == MODBUS_ASYNC_DONE || request->status == MODBUS_ASYNC_FAILED)
+    {
+        free_request(request);
+    }
+    else
+    {
+        request->released = 1;
+    }
+}
@@ -0,0 +1,189 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <errno.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+#include "modbus_network_caps.h"
+#include "modbus_client_batch.h"
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static int is_bit_table(modbus_table_t table)
+{
+    return table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_INPUTS;
+}
+
+/* the registers a tag's values take in the reply */
+static int values_length(const modbus_tag_t *tag)
+{
+    return is_bit_table(tag->table) ? (tag->nb + 15) / 16 : tag->nb;
+}
+
+/* the read function a batch item of table is authorised as */
+static int read_function(modbus_table_t table)
+{
+    switch (table)
+    {
+        case MODBUS_TABLE_COILS:
+            return MODBUS_FC_READ_COILS;
+        case MODBUS_TABLE_DISCRETE_INPUTS:
+            return MODBUS_FC_READ_DISCRETE_INPUTS;
+        case MODBUS_TABLE_HOLDING_REGISTERS:
+            return MODBUS_FC_READ_HOLDING_REGISTERS;
+        default:
+            return MODBUS_FC_READ_INPUT_REGISTERS;
+    }
+}
+
+/* the server's table numbers */
+static int batch_table(modbus_table_t table)
+{
+    switch (table)
+    {
+        case MODBUS_TABLE_COILS:
+            return MODBUS_SUBSCRIPTION_COILS;
+        case MODBUS_TABLE_DISCRETE_INPUTS:
+            return MODBUS_SUBSCRIPTION_DISCRETE_INPUTS;
+        case MODBUS_TABLE_HOLDING_REGISTERS:
+            return MODBUS_SUBSCRIPTION_HOLDING_REGISTERS;
+        default:
+            return MODBUS_SUBSCRIPTION_INPUT_REGISTERS;
+    }
+}
+
+/**
+ * Copies a tag's values from the reply to its dest, unpacking bits
+ * (16 to a register) to one per byte, as modbus_read_bits()
+ * */
+static void unpack_values(const modbus_tag_t *tag, const uint16_t *values)
+{
+    if (is_bit_table(tag->table))
+    {
+        uint8_t *dest = (uint8_t *)tag->dest;
+        for (int i = 0; i < tag->nb; ++i)
+        {
+            dest[i] = (values[i / 16] >> (i % 16)) & 1;
+        }
+    }
+    else
+    {
+        memcpy(tag->dest, values, tag->nb * sizeof(uint16_t));
+    }
+}
+
+/**
+ * Sends a Macaroon authorising a read of every tag, for the batch read
+ * that follows it
+ * */
+static int send_batch_token(modbus_t *ctx, const modbus_tag_t *tags, int nb_tags)
+{
+    network_caps_range_t ranges[MODBUS_MAX_BATCH_ITEMS];
+    uint8_t msg[MODBUS_MAX_STRING_LENGTH];
+
+    for (int i = 0; i < nb_tags; ++i)
+    {
+        ranges[i].function = read_function(tags[i].table);
+        ranges[i].addr = (uint16_t)tags[i].addr;
+        ranges[i].nb = tags[i].nb;
+    }
+
+    int msg_length = network_caps_build_batch_token(ctx, ranges, nb_tags, msg, sizeof(msg));
+    if (msg_length == -1)
+    {
+        return -1;
+    }
+
+    return (modbus_write_string(ctx, msg, msg_length) == msg_length) ? 0 : -1;
+}
+
+/**************
+ * BATCH READS
+ *************/
+
+int modbus_read_batch(modbus_t *ctx, const modbus_tag_t *tags, int nb_tags, int network_caps)
+{
+    uint16_t params[MODBUS_BATCH_ITEM_NB * MODBUS_MAX_BATCH_ITEMS];
+    uint16_t values[MODBUS_MAX_WR_READ_REGISTERS];
+    int read_nb = 0;
+
+    if (nb_tags < 1 || nb_tags > MODBUS_MAX_BATCH_ITEMS)
+    {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    for (int i = 0; i < nb_tags; ++i)
+    {
+        const modbus_tag_t *tag = &tags[i];
+
+        if (tag->table < MODBUS_TABLE_COILS || tag->table > MODBUS_TABLE_INPUT_REGISTERS ||
+                tag->nb < 1 || tag->addr < 0 || tag->addr + tag->nb > MODBUS_BATCH_READ_ADDRESS ||
+                tag->dest == NULL)
+        {
+            errno = EMBMDATA;
+            return -1;
+        }
+
+        read_nb += values_length(tag);
+        if (read_nb > MODBUS_MAX_WR_READ_REGISTERS)
+        {
+            errno = EMBMDATA;
+            return -1;
+        }
+
+        params[MODBUS_BATCH_ITEM_NB * i] = (uint16_t)batch_table(tag->table);
+        params[MODBUS_BATCH_ITEM_NB * i + 1] = (uint16_t)tag->addr;
+        params[MODBUS_BATCH_ITEM_NB * i + 2] = (uint16_t)tag->nb;
+    }
+
+    if (network_caps && send_batch_token(ctx, tags, nb_tags) == -1)
+    {
+        return -1;
+    }
+
+    if (modbus_write_and_read_registers(ctx,
+                MODBUS_BATCH_READ_ADDRESS, MODBUS_BATCH_ITEM_NB * nb_tags, params,
+                MODBUS_BATCH_READ_ADDRESS, read_nb, values) == -1)
+    {
+        return -1;
+    }
+
+    const uint16_t *value = values;
+    for (int i = 0; i < nb_tags; ++i)
+    {
+        unpack_values(&tags[i], value);
+        value += values_length(&tags[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,400 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+#include "modbus_network_caps.h"
+#include "modbus_client_plan.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+/* Modbus addresses are 16 bits */
+#define MODBUS_ADDRESS_SPACE 0x10000
+
+typedef struct {
+    modbus_table_t table;
+    int addr;
+    int nb;
+
+    /* uint8_t[nb] for bits, uint16_t[nb] for registers */
+    void *buf;
+} read_block_t;
+
+struct modbus_read_plan {
+    /* the tags, sorted by table and address */
+    modbus_tag_t *tags;
+    int nb_tags;
+
+    /* the block each tag is read in */
+    int *tag_block;
+
+    read_block_t *blocks;
+    int nb_blocks;
+};
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static int is_bit_table(modbus_table_t table)
+{
+    return table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_INPUTS;
+}
+
+/* the most a single read request of table can return */
+static int max_read(modbus_table_t table)
+{
+    return is_bit_table(table) ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+}
+
+static size_t element_size(modbus_table_t table)
+{
+    return is_bit_table(table) ? sizeof(uint8_t) : sizeof(uint16_t);
+}
+
+static int compare_tags(const void *a, const void *b)
+{
+    const modbus_tag_t *x = (const modbus_tag_t *)a;
+    const modbus_tag_t *y = (const modbus_tag_t *)b;
+
+    if (x->table != y->table)
+    {
+        return (x->table > y->table) - (x->table < y->table);
+    }
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int valid_tag(const modbus_tag_t *tag)
+{
+    return tag->table >= MODBUS_TABLE_COILS && tag->table <= MODBUS_TABLE_INPUT_REGISTERS &&
+        tag->nb >= 1 && tag->nb <= max_read(tag->table) &&
+        tag->addr >= 0 && tag->addr + tag->nb <= MODBUS_ADDRESS_SPACE &&
+        tag->dest != NULL;
+}
+
+/**
+ * Copies each tag in a block from the block's buffer to its dest
+ * */
+static void scatter_block(modbus_read_plan_t *plan, int block)
+{
+    read_block_t *read_block = &plan->blocks[block];
+    size_t size = element_size(read_block->table);
+
+    for (int i = 0; i < plan->nb_tags; ++i)
+    {
+        if (plan->tag_block[i] != block)
+        {
+            continue;
+        }
+
+        modbus_tag_t *tag = &plan->tags[i];
+        memcpy(tag->dest, (uint8_t *)read_block->buf + (tag->addr - read_block->addr) * size,
+                tag->nb * size);
+    }
+}
+
+static int read_block(modbus_t *ctx, read_block_t *block, int network_caps)
+{
+    switch (block->table)
+    {
+        case MODBUS_TABLE_COILS:
+            return network_caps ?
+                modbus_read_bits_network_caps(ctx, block->addr, block->nb, block->buf) :
+                modbus_read_bits(ctx, block->addr, block->nb, block->buf);
+        case MODBUS_TABLE_DISCRETE_INPUTS:
+            return network_caps ?
+                modbus_read_input_bits_network_caps(ctx, block->addr, block->nb, block->buf) :
+                modbus_read_input_bits(ctx, block->addr, block->nb, block->buf);
+        case MODBUS_TABLE_HOLDING_REGISTERS:
+            return network_caps ?
+                modbus_read_registers_network_caps(ctx, block->addr, block->nb, block->buf) :
+                modbus_read_registers(ctx, block->addr, block->nb, block->buf);
+        case MODBUS_TABLE_INPUT_REGISTERS:
+            return network_caps ?
+                modbus_read_input_registers_network_caps(ctx, block->addr, block->nb, block->buf) :
+                modbus_read_input_registers(ctx, block->addr, block->nb, block->buf);
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/**************
+ * PLANNING
+ *************/
+
+modbus_read_plan_t *modbus_read_plan_new(const modbus_tag_t *tags, int nb_tags, int gap)
+{
+    if (tags == NULL || nb_tags <= 0 || gap < 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    for (int i = 0; i < nb_tags; ++i)
+    {
+        if (!valid_tag(&tags[i]))
+        {
+            errno = EMBMDATA;
+            return NULL;
+        }
+    }
+
+    modbus_read_plan_t *plan = calloc(1, sizeof(modbus_read_plan_t));
+    if (plan == NULL)
+    {
+        return NULL;
+    }
+
+    plan->tags = malloc(nb_tags * sizeof(modbus_tag_t));
+    plan->tag_block = malloc(nb_tags * sizeof(int));
+    plan->blocks = calloc(nb_tags, sizeof(read_block_t));
+    if (plan->tags == NULL || plan->tag_block == NULL || plan->blocks == NULL)
+    {
+        modbus_read_plan_free(plan);
+        return NULL;
+    }
+
+    memcpy(plan->tags, tags, nb_tags * sizeof(modbus_tag_t));
+    plan->nb_tags = nb_tags;
+    qsort(plan->tags, nb_tags, sizeof(modbus_tag_t), compare_tags);
+
+    /**
+     * In address order, extend the current block over each tag that starts
+     * within gap of its end, as long as the block still fits in one
+     * request; otherwise start a new block at the tag
+     * */
+    for (int i = 0; i < nb_tags; ++i)
+    {
+        modbus_tag_t *tag = &plan->tags[i];
+        read_block_t *block = (plan->nb_blocks > 0) ? &plan->blocks[plan->nb_blocks - 1] : NULL;
+
+        if (block != NULL && block->table == tag->table &&
+                tag->addr <= block->addr + block->nb + gap)
+        {
+            int end = block->addr + block->nb;
+            if (tag->addr + tag->nb > end)
+            {
+                end = tag->addr + tag->nb;
+            }
+
+            if (end - block->addr <= max_read(tag->table))
+            {
+                block->nb = end - block->addr;
+                plan->tag_block[i] = plan->nb_blocks - 1;
+                continue;
+            }
+        }
+
+        block = &plan->blocks[plan->nb_blocks];
+        block->table = tag->table;
+        block->addr = tag->addr;
+        block->nb = tag->nb;
+        plan->tag_block[i] = plan->nb_blocks++;
+    }
+
+    for (int i = 0; i < plan->nb_blocks; ++i)
+    {
+        read_block_t *block = &plan->blocks[i];
+        block->buf = calloc(block->nb, element_size(block->table));
+        if (block->buf == NULL)
+        {
+            modbus_read_plan_free(plan);
+            return NULL;
+        }
+    }
+
+    return plan;
+}
+
+void modbus_read_plan_free(modbus_read_plan_t *plan)
+{
+    if (plan == NULL)
+    {
+        return;
+    }
+
+    if (plan->blocks != NULL)
+    {
+        for (int i = 0; i < plan->nb_blocks; ++i)
+        {
+            free(plan->blocks[i].buf);
+        }
+    }
+
+    free(plan->blocks);
+    free(plan->tag_block);
+    free(plan->tags);
+    free(plan);
+}
+
+int modbus_read_plan_blocks(const modbus_read_plan_t *plan)
+{
+    return plan->nb_blocks;
+}
+
+void modbus_read_plan_block(const modbus_read_plan_t *plan, int block, modbus_table_t *table,
+        int *addr, int *nb)
+{
+    *table = plan->blocks[block].table;
+    *addr = plan->blocks[block].addr;
+    *nb = plan->blocks[block].nb;
+}
+
+/***********
+ * EXECUTION
+ **********/
+
+int modbus_read_plan_execute(modbus_t *ctx, modbus_read_plan_t *plan, int network_caps)
+{
+    for (int i = 0; i < plan->nb_blocks; ++i)
+    {
+        if (read_block(ctx, &plan->blocks[i], network_caps) != plan->blocks[i].nb)
+        {
+            return -1;
+        }
+
+        scatter_block(plan, i);
+    }
+
+    return 0;
+}
+
+modbus_async_request_t *modbus_read_plan_submit_block(modbus_async_t *async, modbus_read_plan_t *plan,
+        int block, int network_caps, modbus_async_callback_t callback, void *user_data)
+{
+    read_block_t *read_block = &plan->blocks[block];
+
+    switch (read_block->table)
+    {
+        case MODBUS_TABLE_COILS:
+            return network_caps ?
+                modbus_async_read_bits_network_caps(async, read_block->addr, read_block->nb,
+                        read_block->buf, callback, user_data) :
+                modbus_async_read_bits(async, read_block->addr, read_block->nb,
+                        read_block->buf, callback, user_data);
+        case MODBUS_TABLE_DISCRETE_INPUTS:
+            return network_caps ?
+                modbus_async_read_input_bits_network_caps(async, read_block->addr, read_block->nb,
+                        read_block->buf, callback, user_data) :
+                modbus_async_read_input_bits(async, read_block->addr, read_block->nb,
+                        read_block->buf, callback, user_data);
+        case MODBUS_TABLE_HOLDING_REGISTERS:
+            return network_caps ?
+                modbus_async_read_registers_network_caps(async, read_block->addr, read_block->nb,
+                        read_block->buf, callback, user_data) :
+                modbus_async_read_registers(async, read_block->addr, read_block->nb,
+                        read_block->buf, callback, user_data);
+        case MODBUS_TABLE_INPUT_REGISTERS:
+            return network_caps ?
+                modbus_async_read_input_registers_network_caps(async, read_block->addr, read_block->nb,
+                        read_block->buf, callback, user_data) :
+                modbus_async_read_input_registers(async, read_block->addr, read_block->nb,
+                        read_block->buf, callback, user_data);
+    }
+
+    errno = EINVAL;
+    return NULL;
+}
+
+int modbus_read_plan_complete_block(modbus_read_plan_t *plan, int block,
+        const modbus_async_request_t *request)
+{
+    if (modbus_async_status(request) != MODBUS_ASYNC_DONE ||
+            modbus_async_result(request) != plan->blocks[block].nb)
+    {
+        errno = (modbus_async_errno(request) != 0) ? modbus_async_errno(request) : EMBBADDATA;
+        return -1;
+    }
+
+    scatter_block(plan, block);
+    return 0;
+}
+
+int modbus_read_plan_execute_async(modbus_async_t *async, modbus_read_plan_t *plan, int network_caps)
+{
+    int err = 0;
+    int nb_requests = 0;
+    modbus_async_request_t **requests = calloc(plan->nb_blocks, sizeof(modbus_async_request_t *));
+    int *request_block = calloc(plan->nb_blocks, sizeof(int));
+
+    if (requests == NULL || request_block == NULL)
+    {
+        free(requests);
+        free(request_block);
+        return -1;
+    }
+
+    for (int i = 0; i < plan->nb_blocks; ++i)
+    {
+        modbus_async_request_t *request = modbus_read_plan_submit_block(async, plan, i, network_caps,
+                NULL, NULL);
+        if (request == NULL)
+        {
+            err = errno;
+            continue;
+        }
+
+        request_block[nb_requests] = i;
+        requests[nb_requests++] = request;
+    }
+
+    /* every request completes by its response timeout, so this returns */
+    if (modbus_async_wait(async, requests, nb_requests, -1) == -1 && err == 0)
+    {
+        err = errno;
+    }
+
+    for (int i = 0; i < nb_requests; ++i)
+    {
+        if (modbus_read_plan_complete_block(plan, request_block[i], requests[i]) == -1 && err == 0)
+        {
+            err = errno;
+        }
+
+        modbus_async_release(requests[i]);
+    }
+
+    free(requests);
+    free(request_block);
+
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
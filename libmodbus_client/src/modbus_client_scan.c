@@ -0,0 +1,959 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+#include "modbus_network_caps.h"
+#include "modbus_client_async.h"
+#include "modbus_client_scan.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+#define SCAN_MAX_EVENTS 64
+
+/* how long to wait before trying to reconnect to a server */
+#define SCAN_RECONNECT_INTERVAL_NS 1000000000ULL
+
+typedef struct scan_server scan_server_t;
+typedef struct scan_group scan_group_t;
+
+typedef enum {
+    SCAN_IDLE,
+    SCAN_WAITING,
+    SCAN_IN_FLIGHT
+} scan_state_t;
+
+typedef enum {
+    SCAN_DISCONNECTED,
+    /* waiting for the socket to connect */
+    SCAN_CONNECTING,
+    /* reading the server's Macaroon */
+    SCAN_AUTHORISING,
+    SCAN_CONNECTED
+} scan_link_t;
+
+typedef struct {
+    scan_group_t *group;
+    int block;
+    int done;
+    modbus_async_request_t *request;
+} scan_block_t;
+
+struct scan_group {
+    int index;
+    scan_server_t *server;
+
+    modbus_read_plan_t *plan;
+    int nb_blocks;
+    scan_block_t *blocks;
+
+    uint64_t period;
+
+    /* when the next scan is due */
+    uint64_t deadline;
+
+    /* the scan waiting or in flight: when it was due and issued */
+    scan_state_t state;
+    uint64_t scan_deadline;
+    uint64_t issued;
+    int outstanding;
+    int err;
+
+    /* in the server's waiting queue */
+    scan_group_t *next_waiting;
+
+    modbus_scan_callback_t callback;
+    void *user_data;
+    modbus_scan_stats_t stats;
+};
+
+struct scan_server {
+    int index;
+    char *ip;
+    int port;
+    int network_caps;
+    int window;
+
+    /* NULL while disconnected */
+    modbus_t *ctx;
+    modbus_async_t *async;
+    scan_link_t link;
+    uint32_t events;
+    uint64_t next_connect;
+    uint64_t connect_deadline;
+
+    /* why the server was disconnected, failing the scans on it */
+    int link_err;
+
+    /* the server's Macaroon, read when connecting */
+    modbus_async_request_t *macaroon_request;
+    uint8_t macaroon[MODBUS_MAX_STRING_LENGTH];
+
+    /* groups due, in deadline order */
+    scan_group_t *waiting_head;
+    scan_group_t *waiting_tail;
+};
+
+struct modbus_scan {
+    int epfd;
+    int stopped;
+
+    scan_server_t **servers;
+    int nb_servers;
+
+    scan_group_t **groups;
+    int nb_groups;
+
+    /* every group, as a binary min-heap on deadline */
+    scan_group_t **heap;
+    int heap_size;
+};
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void heap_swap(modbus_scan_t *scan, int i, int j)
+{
+    scan_group_t *group = scan->heap[i];
+    scan->heap[i] = scan->heap[j];
+    scan->heap[j] = group;
+}
+
+static void heap_push(modbus_scan_t *scan, scan_group_t *group)
+{
+    int i = scan->heap_size++;
+    scan->heap[i] = group;
+
+    while (i > 0 && scan->heap[(i - 1) / 2]->deadline > scan->heap[i]->deadline)
+    {
+        heap_swap(scan, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static scan_group_t *heap_pop(modbus_scan_t *scan)
+{
+    scan_group_t *top = scan->heap[0];
+    int i = 0;
+
+    scan->heap[0] = scan->heap[--scan->heap_size];
+    for (;;)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+
+        if (left < scan->heap_size && scan->heap[left]->deadline < scan->heap[smallest]->deadline)
+        {
+            smallest = left;
+        }
+        if (right < scan->heap_size && scan->heap[right]->deadline < scan->heap[smallest]->deadline)
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            break;
+        }
+
+        heap_swap(scan, i, smallest);
+        i = smallest;
+    }
+
+    return top;
+}
+
+/**
+ * Records the end of a group's scan and runs its callback
+ * */
+static void finish_scan(scan_group_t *group)
+{
+    uint64_t duration = now_ns() - group->issued;
+    int err = group->err;
+
+    group->stats.total_duration_ns += duration;
+    if (duration > group->stats.max_duration_ns)
+    {
+        group->stats.max_duration_ns = duration;
+    }
+    if (err != 0)
+    {
+        group->stats.failed++;
+    }
+
+    group->state = SCAN_IDLE;
+    group->err = 0;
+
+    if (group->callback != NULL)
+    {
+        group->callback(group->index, (err != 0) ? -1 : 0, err, group->user_data);
+    }
+}
+
+/**
+ * Fails a scan that could not be issued
+ * */
+static void fail_scan(scan_group_t *group, int err)
+{
+    group->issued = now_ns();
+    group->stats.scans++;
+    group->err = err;
+    finish_scan(group);
+}
+
+/**
+ * The asynchronous client's completion callback for each block of a scan
+ * */
+static void block_done(modbus_async_request_t *request, void *user_data)
+{
+    scan_block_t *scan_block = (scan_block_t *)user_data;
+    scan_group_t *group = scan_block->group;
+
+    if (modbus_read_plan_complete_block(group->plan, scan_block->block, request) == -1 &&
+            group->err == 0)
+    {
+        group->err = errno;
+    }
+
+    modbus_async_release(request);
+    scan_block->request = NULL;
+    scan_block->done = 1;
+
+    if (--group->outstanding == 0)
+    {
+        finish_scan(group);
+    }
+}
+
+/*************
+ * CONNECTIONS
+ ************/
+
+static void set_events(modbus_scan_t *scan, scan_server_t *server)
+{
+    uint32_t events = EPOLLIN | (modbus_async_want_write(server->async) ? EPOLLOUT : 0);
+    if (events == server->events)
+    {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = server;
+    epoll_ctl(scan->epfd, EPOLL_CTL_MOD, modbus_async_get_socket(server->async), &event);
+    server->events = events;
+}
+
+static void disconnect_server(modbus_scan_t *scan, scan_server_t *server)
+{
+    if (server->ctx == NULL)
+    {
+        return;
+    }
+
+    epoll_ctl(scan->epfd, EPOLL_CTL_DEL, modbus_get_socket(server->ctx), NULL);
+
+    if (server->async != NULL)
+    {
+        /* fails anything outstanding without callbacks, so finish those scans here */
+        modbus_async_free(server->async);
+        server->async = NULL;
+
+        if (server->macaroon_request != NULL)
+        {
+            modbus_async_release(server->macaroon_request);
+            server->macaroon_request = NULL;
+        }
+
+        for (int i = 0; i < scan->nb_groups; ++i)
+        {
+            scan_group_t *group = scan->groups[i];
+            if (group->server != server || group->state != SCAN_IN_FLIGHT)
+            {
+                continue;
+            }
+
+            for (int j = 0; j < group->nb_blocks; ++j)
+            {
+                if (group->blocks[j].request != NULL)
+                {
+                    modbus_async_release(group->blocks[j].request);
+                    group->blocks[j].request = NULL;
+                }
+            }
+            if (group->err == 0)
+            {
+                group->err = ECONNRESET;
+            }
+            group->outstanding = 0;
+            finish_scan(group);
+        }
+    }
+
+    if (server->network_caps)
+    {
+        free_client_network_caps(server->ctx);
+    }
+    modbus_close(server->ctx);
+    modbus_free(server->ctx);
+    server->ctx = NULL;
+    server->link = SCAN_DISCONNECTED;
+    server->next_connect = now_ns() + SCAN_RECONNECT_INTERVAL_NS;
+}
+
+/**
+ * Drops a connection (or an attempt to make one), recording err to fail
+ * the scans on the server with until it is back
+ * */
+static int connection_failed(modbus_scan_t *scan, scan_server_t *server, int err)
+{
+    disconnect_server(scan, server);
+    server->link_err = err;
+    errno = err;
+    return -1;
+}
+
+/**
+ * Starts connecting to a server, as modbus_connect() but without waiting:
+ * the socket is watched for EPOLLOUT, then finish_connect() completes the
+ * connection
+ * */
+static int connect_server(modbus_scan_t *scan, scan_server_t *server)
+{
+    struct sockaddr_in addr;
+    uint32_t to_sec;
+    uint32_t to_usec;
+    int enable = 1;
+
+    server->next_connect = now_ns() + SCAN_RECONNECT_INTERVAL_NS;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server->port);
+    if (inet_pton(AF_INET, server->ip, &addr.sin_addr) != 1)
+    {
+        server->link_err = EINVAL;
+        errno = EINVAL;
+        return -1;
+    }
+
+    server->ctx = modbus_new_tcp(server->ip, server->port);
+    if (server->ctx == NULL)
+    {
+        server->link_err = errno;
+        return -1;
+    }
+    server->link = SCAN_CONNECTING;
+
+    /* owned by ctx from here, so closed with it */
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s == -1)
+    {
+        return connection_failed(scan, server, errno);
+    }
+    modbus_set_socket(server->ctx, s);
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS)
+    {
+        return connection_failed(scan, server, errno);
+    }
+
+    /* as modbus_connect(), give up after the response timeout */
+    modbus_get_response_timeout(server->ctx, &to_sec, &to_usec);
+    server->connect_deadline = now_ns() + (uint64_t)to_sec * 1000000000ULL + (uint64_t)to_usec * 1000ULL;
+
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.ptr = server;
+    if (epoll_ctl(scan->epfd, EPOLL_CTL_ADD, s, &event) == -1)
+    {
+        return connection_failed(scan, server, errno);
+    }
+    server->events = EPOLLOUT;
+
+    return 0;
+}
+
+/**
+ * Once the server's Macaroon has been read, keeps it as the client
+ * Macaroon for the connection, which is then ready for scans
+ *
+ * Returns 0 once the server is connected or while the Macaroon is being
+ * read, or -1 if it couldn't be read.
+ * */
+static int authorise_server(scan_server_t *server)
+{
+    modbus_async_request_t *request = server->macaroon_request;
+    modbus_async_status_t status = modbus_async_status(request);
+
+    if (status == MODBUS_ASYNC_QUEUED || status == MODBUS_ASYNC_IN_FLIGHT)
+    {
+        return 0;
+    }
+
+    int rc = modbus_async_result(request);
+    int err = modbus_async_errno(request);
+    modbus_async_release(request);
+    server->macaroon_request = NULL;
+
+    if (rc == -1)
+    {
+        errno = err;
+        return -1;
+    }
+    if (initialise_client_network_caps(server->ctx, (char *)server->macaroon, rc) == -1)
+    {
+        return -1;
+    }
+
+    server->link = SCAN_CONNECTED;
+    server->link_err = 0;
+
+    return 0;
+}
+
+/**
+ * Completes a connection once its socket is writable: starts the
+ * asynchronous client and, with network caps, reads the server's Macaroon
+ * with it before any scan is issued
+ * */
+static void finish_connect(modbus_scan_t *scan, scan_server_t *server)
+{
+    int s = modbus_get_socket(server->ctx);
+    int err = 0;
+    socklen_t err_length = sizeof(err);
+
+    if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &err_length) == -1)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        connection_failed(scan, server, err);
+        return;
+    }
+
+    /* a request with network caps takes a second slot for its token */
+    server->async = modbus_async_new(server->ctx, server->network_caps ? 2 * server->window : server->window);
+    if (server->async == NULL)
+    {
+        connection_failed(scan, server, errno);
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = server;
+    if (epoll_ctl(scan->epfd, EPOLL_CTL_MOD, s, &event) == -1)
+    {
+        connection_failed(scan, server, errno);
+        return;
+    }
+    server->events = EPOLLIN;
+
+    if (!server->network_caps)
+    {
+        server->link = SCAN_CONNECTED;
+        server->link_err = 0;
+        return;
+    }
+
+    server->link = SCAN_AUTHORISING;
+    memset(server->macaroon, 0, sizeof(server->macaroon));
+    server->macaroon_request = modbus_async_read_string(server->async, server->macaroon, NULL, NULL);
+    if (server->macaroon_request == NULL || authorise_server(server) == -1)
+    {
+        connection_failed(scan, server, errno);
+    }
+}
+
+/**
+ * Completes what has arrived from a server, dropping the connection if
+ * it failed
+ * */
+static void poll_server(modbus_scan_t *scan, scan_server_t *server)
+{
+    if (modbus_async_poll(server->async, 0) == -1 ||
+            (server->link == SCAN_AUTHORISING && authorise_server(server) == -1))
+    {
+        connection_failed(scan, server, errno);
+    }
+}
+
+/**********
+ * SCANNING
+ *********/
+
+/**
+ * Submits every block of a group's scan
+ * */
+static void issue_scan(scan_group_t *group)
+{
+    scan_server_t *server = group->server;
+    uint64_t now = now_ns();
+    uint64_t lateness = (now > group->scan_deadline) ? now - group->scan_deadline : 0;
+
+    group->state = SCAN_IN_FLIGHT;
+    group->issued = now;
+    group->err = 0;
+    group->stats.scans++;
+    group->stats.total_lateness_ns += lateness;
+    if (lateness > group->stats.max_lateness_ns)
+    {
+        group->stats.max_lateness_ns = lateness;
+    }
+
+    /* hold the scan open until every block is submitted, in case a block
+     * completes (or the connection fails) during submission */
+    group->outstanding = group->nb_blocks + 1;
+
+    for (int i = 0; i < group->nb_blocks; ++i)
+    {
+        scan_block_t *scan_block = &group->blocks[i];
+        scan_block->done = 0;
+        scan_block->request = NULL;
+
+        modbus_async_request_t *request = modbus_read_plan_submit_block(server->async, group->plan, i,
+                server->network_caps, block_done, scan_block);
+        if (request == NULL)
+        {
+            if (group->err == 0)
+            {
+                group->err = errno;
+            }
+            group->outstanding--;
+        }
+        else if (!scan_block->done)
+        {
+            scan_block->request = request;
+        }
+    }
+
+    if (--group->outstanding == 0)
+    {
+        finish_scan(group);
+    }
+}
+
+/**
+ * Issues the groups waiting on a server, in deadline order, while its
+ * window has room.  A group larger than the window is issued once the
+ * server is idle.
+ * */
+static void issue_waiting(modbus_scan_t *scan, scan_server_t *server)
+{
+    while (server->waiting_head != NULL)
+    {
+        scan_group_t *group = server->waiting_head;
+
+        if (server->link != SCAN_CONNECTED)
+        {
+            if (server->link == SCAN_DISCONNECTED && now_ns() >= server->next_connect)
+            {
+                connect_server(scan, server);
+            }
+
+            /* scans wait while the connection is made */
+            if (server->link != SCAN_DISCONNECTED)
+            {
+                return;
+            }
+
+            /* fail every waiting scan until the server is back */
+            int err = (server->link_err != 0) ? server->link_err : ENOTCONN;
+            while (server->waiting_head != NULL)
+            {
+                group = server->waiting_head;
+                server->waiting_head = group->next_waiting;
+                fail_scan(group, err);
+            }
+            server->waiting_tail = NULL;
+            return;
+        }
+
+        int pending = modbus_async_pending(server->async);
+        if (pending > 0 && pending + group->nb_blocks > server->window)
+        {
+            return;
+        }
+
+        server->waiting_head = group->next_waiting;
+        if (server->waiting_head == NULL)
+        {
+            server->waiting_tail = NULL;
+        }
+        group->next_waiting = NULL;
+
+        issue_scan(group);
+    }
+}
+
+/**
+ * Queues every group now due on its server, in deadline order, and
+ * schedules its next scan.  A group still busy with its last scan misses
+ * this one.
+ * */
+static void schedule_due(modbus_scan_t *scan, uint64_t now)
+{
+    while (scan->heap_size > 0 && scan->heap[0]->deadline <= now)
+    {
+        scan_group_t *group = heap_pop(scan);
+
+        if (group->state != SCAN_IDLE)
+        {
+            group->stats.missed++;
+        }
+        else
+        {
+            scan_server_t *server = group->server;
+
+            group->state = SCAN_WAITING;
+            group->scan_deadline = group->deadline;
+            if (server->waiting_tail == NULL)
+            {
+                server->waiting_head = group;
+            }
+            else
+            {
+                server->waiting_tail->next_waiting = group;
+            }
+            server->waiting_tail = group;
+        }
+
+        /* skip (and count) any further periods that have already passed */
+        group->deadline += group->period;
+        if (group->deadline <= now)
+        {
+            uint64_t skipped = (now - group->deadline) / group->period + 1;
+            group->stats.missed += skipped;
+            group->deadline += skipped * group->period;
+        }
+
+        heap_push(scan, group);
+    }
+}
+
+/**************
+ * SCAN ENGINE
+ *************/
+
+modbus_scan_t *modbus_scan_new(void)
+{
+    modbus_scan_t *scan = calloc(1, sizeof(modbus_scan_t));
+    if (scan == NULL)
+    {
+        return NULL;
+    }
+
+    scan->epfd = epoll_create1(0);
+    if (scan->epfd == -1)
+    {
+        free(scan);
+        return NULL;
+    }
+
+    return scan;
+}
+
+void modbus_scan_free(modbus_scan_t *scan)
+{
+    if (scan == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < scan->nb_servers; ++i)
+    {
+        disconnect_server(scan, scan->servers[i]);
+        free(scan->servers[i]->ip);
+        free(scan->servers[i]);
+    }
+
+    for (int i = 0; i < scan->nb_groups; ++i)
+    {
+        modbus_read_plan_free(scan->groups[i]->plan);
+        free(scan->groups[i]->blocks);
+        free(scan->groups[i]);
+    }
+
+    close(scan->epfd);
+    free(scan->servers);
+    free(scan->groups);
+    free(scan->heap);
+    free(scan);
+}
+
+int modbus_scan_add_server(modbus_scan_t *scan, const char *ip, int port, int network_caps, int window)
+{
+    scan_server_t **servers = realloc(scan->servers, (scan->nb_servers + 1) * sizeof(scan_server_t *));
+    if (servers == NULL)
+    {
+        return -1;
+    }
+    scan->servers = servers;
+
+    scan_server_t *server = calloc(1, sizeof(scan_server_t));
+    if (server == NULL)
+    {
+        return -1;
+    }
+
+    server->index = scan->nb_servers;
+    server->ip = strdup(ip);
+    server->port = port;
+    server->network_caps = network_caps;
+    server->window = (window > 0) ? window : MODBUS_ASYNC_DEFAULT_IN_FLIGHT;
+
+    if (server->ip == NULL || connect_server(scan, server) == -1)
+    {
+        free(server->ip);
+        free(server);
+        return -1;
+    }
+
+    scan->servers[scan->nb_servers++] = server;
+    return server->index;
+}
+
+int modbus_scan_add_group(modbus_scan_t *scan, int server, const modbus_tag_t *tags, int nb_tags,
+        int gap, uint32_t period_ms, modbus_scan_callback_t callback, void *user_data)
+{
+    if (server < 0 || server >= scan->nb_servers || period_ms == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    scan_group_t **groups = realloc(scan->groups, (scan->nb_groups + 1) * sizeof(scan_group_t *));
+    if (groups == NULL)
+    {
+        return -1;
+    }
+    scan->groups = groups;
+
+    scan_group_t **heap = realloc(scan->heap, (scan->nb_groups + 1) * sizeof(scan_group_t *));
+    if (heap == NULL)
+    {
+        return -1;
+    }
+    scan->heap = heap;
+
+    scan_group_t *group = calloc(1, sizeof(scan_group_t));
+    if (group == NULL)
+    {
+        return -1;
+    }
+
+    group->plan = modbus_read_plan_new(tags, nb_tags, gap);
+    if (group->plan == NULL)
+    {
+        free(group);
+        return -1;
+    }
+
+    group->nb_blocks = modbus_read_plan_blocks(group->plan);
+    group->blocks = calloc(group->nb_blocks, sizeof(scan_block_t));
+    if (group->blocks == NULL)
+    {
+        modbus_read_plan_free(group->plan);
+        free(group);
+        return -1;
+    }
+
+    for (int i = 0; i < group->nb_blocks; ++i)
+    {
+        group->blocks[i].group = group;
+        group->blocks[i].block = i;
+    }
+
+    group->index = scan->nb_groups;
+    group->server = scan->servers[server];
+    group->period = (uint64_t)period_ms * 1000000ULL;
+    group->deadline = now_ns();
+    group->state = SCAN_IDLE;
+    group->callback = callback;
+    group->user_data = user_data;
+
+    scan->groups[scan->nb_groups++] = group;
+    heap_push(scan, group);
+
+    return group->index;
+}
+
+int modbus_scan_run(modbus_scan_t *scan, int duration_ms)
+{
+    struct epoll_event events[SCAN_MAX_EVENTS];
+    uint64_t end = (duration_ms < 0) ? UINT64_MAX : now_ns() + (uint64_t)duration_ms * 1000000ULL;
+
+    scan->stopped = 0;
+
+    while (!scan->stopped)
+    {
+        uint64_t now = now_ns();
+        if (now >= end)
+        {
+            break;
+        }
+
+        schedule_due(scan, now);
+        for (int i = 0; i < scan->nb_servers; ++i)
+        {
+            issue_waiting(scan, scan->servers[i]);
+        }
+
+        /* sleep until the next group is due, the run ends, or a response times out */
+        now = now_ns();
+        uint64_t wake = end;
+        if (scan->heap_size > 0 && scan->heap[0]->deadline < wake)
+        {
+            wake = scan->heap[0]->deadline;
+        }
+        int timeout = (wake == UINT64_MAX) ? -1 :
+            (wake > now) ? (int)((wake - now + 999999) / 1000000) : 0;
+
+        for (int i = 0; i < scan->nb_servers; ++i)
+        {
+            scan_server_t *server = scan->servers[i];
+            if (server->link == SCAN_CONNECTING)
+            {
+                int connect_timeout = (server->connect_deadline > now) ?
+                    (int)((server->connect_deadline - now + 999999) / 1000000) : 0;
+                if (timeout == -1 || connect_timeout < timeout)
+                {
+                    timeout = connect_timeout;
+                }
+                continue;
+            }
+            if (server->async == NULL)
+            {
+                continue;
+            }
+
+            set_events(scan, server);
+            int server_timeout = modbus_async_timeout_ms(server->async);
+            if (server_timeout != -1 && (timeout == -1 || server_timeout < timeout))
+            {
+                timeout = server_timeout;
+            }
+        }
+
+        int nb_events = epoll_wait(scan->epfd, events, SCAN_MAX_EVENTS, timeout);
+        if (nb_events == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        for (int i = 0; i < nb_events; ++i)
+        {
+            scan_server_t *server = (scan_server_t *)events[i].data.ptr;
+            if (server->link == SCAN_CONNECTING)
+            {
+                finish_connect(scan, server);
+            }
+            else if (server->async != NULL)
+            {
+                poll_server(scan, server);
+            }
+        }
+
+        /* expire connection attempts and requests past their timeouts */
+        now = now_ns();
+        for (int i = 0; i < scan->nb_servers; ++i)
+        {
+            scan_server_t *server = scan->servers[i];
+            if (server->link == SCAN_CONNECTING && now >= server->connect_deadline)
+            {
+                connection_failed(scan, server, ETIMEDOUT);
+            }
+            else if (server->async != NULL && modbus_async_timeout_ms(server->async) == 0)
+            {
+                poll_server(scan, server);
+            }
+        }
+    }
+
+    return 0;
+}
+
+void modbus_scan_stop(modbus_scan_t *scan)
+{
+    scan->stopped = 1;
+}
+
+void modbus_scan_get_stats(modbus_scan_t *scan, int group, modbus_scan_stats_t *stats)
+{
+    *stats = scan->groups[group]->stats;
+}
+
+void modbus_scan_print_stats(modbus_scan_t *scan, FILE *out)
+{
+    for (int i = 0; i < scan->nb_groups; ++i)
+    {
+        scan_group_t *group = scan->groups[i];
+        modbus_scan_stats_t *stats = &group->stats;
+        uint64_t scans = (stats->scans > 0) ? stats->scans : 1;
+
+        fprintf(out, "SCAN, %d, %d, %llu, %d, %llu, %llu, %llu, %.1f, %.1f, %.1f, %.1f\n",
+                group->server->index, group->index,
+                (unsigned long long)(group->period / 1000000ULL), group->nb_blocks,
+                (unsigned long long)stats->scans,
+                (unsigned long long)stats->failed,
+                (unsigned long long)stats->missed,
+                (double)stats->total_lateness_ns / scans / 1e3,
+                (double)stats->max_lateness_ns / 1e3,
+                (double)stats->total_duration_ns / scans / 1e3,
+                (double)stats->max_duration_ns / 1e3);
+    }
+}
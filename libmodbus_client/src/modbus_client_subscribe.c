@@ -0,0 +1,322 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+#include "modbus_network_caps.h"
+#include "modbus_client_subscribe.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+typedef struct {
+    int in_use;
+    modbus_table_t table;
+    int nb;
+    void *dest;
+} subscription_t;
+
+struct modbus_subscriptions {
+    modbus_t *ctx;
+    int network_caps;
+
+    /* indexed by the server's subscription id */
+    subscription_t *subscriptions;
+    int nb_subscriptions;
+
+    uint32_t since;
+};
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static int is_bit_table(modbus_table_t table)
+{
+    return table == MODBUS_TABLE_COILS || table == MODBUS_TABLE_DISCRETE_INPUTS;
+}
+
+static int max_subscribe(modbus_table_t table)
+{
+    return is_bit_table(table) ? MODBUS_MAX_SUBSCRIBE_BITS : MODBUS_MAX_SUBSCRIBE_REGISTERS;
+}
+
+/* the registers a subscription's values take in a reply */
+static int values_length(const subscription_t *subscription)
+{
+    return is_bit_table(subscription->table) ? (subscription->nb + 15) / 16 : subscription->nb;
+}
+
+/* the read function a subscription to table is authorised as */
+static int read_function(modbus_table_t table)
+{
+    switch (table)
+    {
+        case MODBUS_TABLE_COILS:
+            return MODBUS_FC_READ_COILS;
+        case MODBUS_TABLE_DISCRETE_INPUTS:
+            return MODBUS_FC_READ_DISCRETE_INPUTS;
+        case MODBUS_TABLE_HOLDING_REGISTERS:
+            return MODBUS_FC_READ_HOLDING_REGISTERS;
+        default:
+            return MODBUS_FC_READ_INPUT_REGISTERS;
+    }
+}
+
+/* the server's table numbers */
+static int subscription_table(modbus_table_t table)
+{
+    switch (table)
+    {
+        case MODBUS_TABLE_COILS:
+            return MODBUS_SUBSCRIPTION_COILS;
+        case MODBUS_TABLE_DISCRETE_INPUTS:
+            return MODBUS_SUBSCRIPTION_DISCRETE_INPUTS;
+        case MODBUS_TABLE_HOLDING_REGISTERS:
+            return MODBUS_SUBSCRIPTION_HOLDING_REGISTERS;
+        default:
+            return MODBUS_SUBSCRIPTION_INPUT_REGISTERS;
+    }
+}
+
+/**
+ * Copies a subscription's values from a reply to its dest, unpacking
+ * bits (16 to a register) to one per byte, as modbus_read_bits()
+ * */
+static void unpack_values(const subscription_t *subscription, const uint16_t *values)
+{
+    if (is_bit_table(subscription->table))
+    {
+        uint8_t *dest = (uint8_t *)subscription->dest;
+        for (int i = 0; i < subscription->nb; ++i)
+        {
+            dest[i] = (values[i / 16] >> (i % 16)) & 1;
+        }
+    }
+    else
+    {
+        memcpy(subscription->dest, values, subscription->nb * sizeof(uint16_t));
+    }
+}
+
+/**
+ * Sends a Macaroon authorising a read of tag, for the subscription
+ * request that follows it
+ * */
+static int send_subscribe_token(modbus_t *ctx, const modbus_tag_t *tag)
+{
+    uint8_t msg[MODBUS_MAX_STRING_LENGTH];
+
+    int msg_length = network_caps_build_token(ctx, read_function(tag->table),
+            (uint16_t)tag->addr, tag->nb, msg, sizeof(msg));
+    if (msg_length == -1)
+    {
+        return -1;
+    }
+
+    return (modbus_write_string(ctx, msg, msg_length) == msg_length) ? 0 : -1;
+}
+
+/******************
+ * SUBSCRIPTIONS
+ *****************/
+
+modbus_subscriptions_t *modbus_subscriptions_new(modbus_t *ctx, int network_caps)
+{
+    modbus_subscriptions_t *subs = (modbus_subscriptions_t *)calloc(1, sizeof(modbus_subscriptions_t));
+    if (subs == NULL)
+    {
+        return NULL;
+    }
+
+    subs->ctx = ctx;
+    subs->network_caps = network_caps;
+
+    return subs;
+}
+
+void modbus_subscriptions_free(modbus_subscriptions_t *subs)
+{
+    if (subs == NULL)
+    {
+        return;
+    }
+
+    free(subs->subscriptions);
+    free(subs);
+}
+
+int modbus_subscribe(modbus_subscriptions_t *subs, const modbus_tag_t *tag)
+{
+    uint16_t params[MODBUS_SUBSCRIBE_PARAMS_NB];
+    uint16_t result[MODBUS_SUBSCRIBE_RESULT_NB];
+
+    if (tag->table < MODBUS_TABLE_COILS || tag->table > MODBUS_TABLE_INPUT_REGISTERS ||
+            tag->nb < 1 || tag->nb > max_subscribe(tag->table) ||
+            tag->addr < 0 || tag->addr + tag->nb > MODBUS_SUBSCRIBE_ADDRESS ||
+            tag->dest == NULL)
+    {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    if (subs->network_caps && send_subscribe_token(subs->ctx, tag) == -1)
+    {
+        return -1;
+    }
+
+    params[0] = (uint16_t)subscription_table(tag->table);
+    params[1] = (uint16_t)tag->addr;
+    params[2] = (uint16_t)tag->nb;
+
+    if (modbus_write_and_read_registers(subs->ctx,
+                MODBUS_SUBSCRIBE_ADDRESS, MODBUS_SUBSCRIBE_PARAMS_NB, params,
+                MODBUS_SUBSCRIBE_ADDRESS, MODBUS_SUBSCRIBE_RESULT_NB, result) == -1)
+    {
+        return -1;
+    }
+
+    int id = result[0];
+    if (id >= subs->nb_subscriptions)
+    {
+        subscription_t *subscriptions = (subscription_t *)realloc(subs->subscriptions,
+                (id + 1) * sizeof(subscription_t));
+        if (subscriptions == NULL)
+        {
+            /* the server keeps it until the connection closes */
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memset(&subscriptions[subs->nb_subscriptions], 0,
+                (id + 1 - subs->nb_subscriptions) * sizeof(subscription_t));
+        subs->subscriptions = subscriptions;
+        subs->nb_subscriptions = id + 1;
+    }
+
+    subscription_t *subscription = &subs->subscriptions[id];
+    subscription->in_use = 1;
+    subscription->table = tag->table;
+    subscription->nb = tag->nb;
+    subscription->dest = tag->dest;
+
+    return id;
+}
+
+int modbus_unsubscribe(modbus_subscriptions_t *subs, int id)
+{
+    uint16_t param = (uint16_t)id;
+    uint16_t result;
+
+    if (id < 0 || id >= subs->nb_subscriptions || !subs->subscriptions[id].in_use)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (modbus_write_and_read_registers(subs->ctx,
+                MODBUS_UNSUBSCRIBE_ADDRESS, 1, &param,
+                MODBUS_UNSUBSCRIBE_ADDRESS, 1, &result) == -1)
+    {
+        if (errno == EMBXILADD)
+        {
+            /* the server had released it */
+            subs->subscriptions[id].in_use = 0;
+        }
+        return -1;
+    }
+
+    subs->subscriptions[id].in_use = 0;
+
+    return 0;
+}
+
+int modbus_poll_changes(modbus_subscriptions_t *subs, int *ids, int max_ids)
+{
+    uint16_t reply[MODBUS_CHANGES_RESULT_NB];
+    int updated = 0;
+    int more;
+
+    do
+    {
+        uint16_t params[MODBUS_CHANGES_SINCE_PARAMS_NB] = {
+            (uint16_t)(subs->since >> 16),
+            (uint16_t)(subs->since & 0xFFFF)
+        };
+
+        if (modbus_write_and_read_registers(subs->ctx,
+                    MODBUS_CHANGES_SINCE_ADDRESS, MODBUS_CHANGES_SINCE_PARAMS_NB, params,
+                    MODBUS_CHANGES_SINCE_ADDRESS, MODBUS_CHANGES_RESULT_NB, reply) == -1)
+        {
+            return -1;
+        }
+
+        uint32_t sequence = ((uint32_t)reply[0] << 16) | reply[1];
+        int count = reply[2];
+        int used = MODBUS_CHANGES_HEADER_NB;
+        more = reply[3];
+
+        for (int i = 0; i < count; ++i)
+        {
+            int id = (used < MODBUS_CHANGES_RESULT_NB) ? reply[used] : -1;
+
+            /* an entry for a subscription this set doesn't know can't be
+             * skipped, since its length is unknown */
+            if (id < 0 || id >= subs->nb_subscriptions || !subs->subscriptions[id].in_use ||
+                    used + 1 + values_length(&subs->subscriptions[id]) > MODBUS_CHANGES_RESULT_NB)
+            {
+                errno = EMBBADDATA;
+                return -1;
+            }
+
+            subscription_t *subscription = &subs->subscriptions[id];
+            unpack_values(subscription, &reply[used + 1]);
+            used += 1 + values_length(subscription);
+
+            if (ids != NULL && updated < max_ids)
+            {
+                ids[updated] = id;
+            }
+            updated += 1;
+        }
+
+        subs->since = sequence;
+    } while (more);
+
+    return updated;
+}
+
+uint32_t modbus_subscriptions_sequence(const modbus_subscriptions_t *subs)
+{
+    return subs->since;
+}
@@ -38,6 +38,12 @@
 /* Macaroons */
 #include "macaroons/macaroons.h"
 
+/* Span trace markers (empty unless MODBUS_SPAN_TRACE) */
+#include "spantrace.h"
+
+/* Metrics updates (empty unless MODBUS_METRICS) */
+#include "modbus_metrics.h"
+
 #if defined(__freertos__)
 /* FreeRTOS */
 #include "FreeRTOS.h"
@@ -47,17 +53,66 @@
  * DEFINITIONS
  ************/
 
+/* the root key derived from a key (HMAC-SHA256) */
+#define NETWORK_CAPS_DERIVED_KEY_LENGTH 32
+
+/**
+ * nb addresses from addr, accessed by function, for requests that access
+ * several ranges at once (e.g., a batch read), authorised by a single
+ * Macaroon with an address set caveat
+ * */
+typedef struct {
+    int function;
+    uint16_t addr;
+    int nb;
+} network_caps_range_t;
+
+/**
+ * A received request to verify with modbus_verify_requests_network_caps():
+ * the serialised Macaroon sent with it (e.g., its connection's
+ * tab_string) and the addresses it accesses (see
+ * network_caps_request_range())
+ * */
+typedef struct {
+    const uint8_t *tab_string;
+    network_caps_range_t range;
+} network_caps_request_t;
+
 /******************
  * SERVER FUNCTIONS
  *****************/
+int network_caps_derive_root_key(const unsigned char *key, size_t key_sz, unsigned char *derived_key);
+/**
+ * The keyring has a single writer: keys are initialised, added and
+ * retired from task context (never from an interrupt handler), one call
+ * at a time.  A call made while another is changing the keyring returns
+ * -1 rather than waiting.  Requests may be verified from any task while
+ * the keyring changes; verification never waits for a writer.
+ * */
 int initialise_server_network_caps(modbus_t *ctx, const char *location, const char *key, const char *id);
+int network_caps_add_key(modbus_t *ctx, const char *location, const char *key, const char *id);
+int network_caps_retire_key(modbus_t *ctx, const char *id);
+uint32_t network_caps_keyring_epoch(void);
 int modbus_receive_network_caps(modbus_t *ctx, uint8_t *req);
 int modbus_preprocess_request_network_caps(modbus_t *ctx, uint8_t *req, modbus_mapping_t *mb_mapping);
+int modbus_verify_network_caps(modbus_t *ctx, uint8_t *tab_string, int function, uint16_t addr, int nb);
+int modbus_verify_batch_network_caps(modbus_t *ctx, uint8_t *tab_string,
+        const network_caps_range_t *ranges, int nb_ranges);
+int network_caps_request_range(modbus_t *ctx, uint8_t *req, network_caps_range_t *range);
+int modbus_verify_requests_network_caps(modbus_t *ctx, const network_caps_request_t *requests,
+        int nb_requests, int *verdicts);
+void network_caps_clear_policy_cache(void);
 
 /******************
  * CLIENT FUNCTIONS
  *****************/
 int initialise_client_network_caps(modbus_t *ctx, char *serialised_macaroon, int serialised_macaroon_length);
+void free_client_network_caps(modbus_t *ctx);
+uint64_t network_caps_last_token_time(modbus_t *ctx);
+int network_caps_build_token(modbus_t *ctx, int function, uint16_t addr, int nb,
+        uint8_t *buf, int max_length);
+int network_caps_build_batch_token(modbus_t *ctx, const network_caps_range_t *ranges, int nb_ranges,
+        uint8_t *buf, int max_length);
 int modbus_read_bits_network_caps(modbus_t *ctx, int addr, int nb, uint8_t *dest);
 int modbus_read_input_bits_network_caps(modbus_t *ctx, int addr, int nb, uint8_t *dest);
 int modbus_read_registers_network_caps(modbus_t *ctx, int addr, int nb, uint16_t *dest);
@@ -27,21 +27,46 @@
 
 #include "modbus_network_caps.h"
 
+/* the batch read item limit follows from the address set caveat's */
+#include "modbus_extensions.h"
+
+/* libmacaroons internals (macaroon_hmac()) */
+#include "port.h"
+
+/* signatures computed several at a time, for batch verification */
+#include "network_caps_hmac.h"
+
+#include <errno.h>
+#if !defined(__freertos__)
+#include <time.h>
+#endif
+
 /**
- * Variables to hold Macaroon properties for either
- * the Modbus client or Modbus server
+ * Variables to hold Macaroon properties for the Modbus client
+ * (the server's keys are in the keyring)
  */
-static unsigned char *key_;
-static size_t key_sz_;
+static struct macaroon *client_macaroon_;
+/* the context client_macaroon_ was copied from */
+static modbus_t *client_macaroon_ctx_;
 
-static unsigned char *id_;
-static size_t id_sz_;
+/**
+ * Client Macaroons for each context, so a client can hold several
+ * connections (e.g., one per thread), each with its own Macaroon.
+ *
+ * Slots are claimed with a compare-and-swap on ctx and the Macaroon is
+ * published with a release store, so lookups never take a lock.  A context
+ * without a slot falls back to client_macaroon_.
+ * */
+#define MAX_CLIENT_CONTEXTS 256
 
-static unsigned char *location_;
-static size_t location_sz_;
+typedef struct {
+    modbus_t *ctx;
+    struct macaroon *macaroon;
+    /* duration of the last send_network_caps() on ctx */
+    uint64_t token_time;
+} client_context_t;
 
-static struct macaroon *client_macaroon_;
-static struct macaroon *server_macaroon_;
+static client_context_t client_contexts_[MAX_CLIENT_CONTEXTS];
 
 /***********
  * CONSTANTS
@@ -51,11 +76,131 @@ static struct macaroon *server_macaroon_;
 #define MAX_CAVEAT_LENGTH 40
 #define FUNCTION_CAVEAT_TOKEN "function = "
 #define ADDRESS_CAVEAT_TOKEN "address = "
+#define ADDRESS_SET_CAVEAT_TOKEN "addresses = "
+
+/* an address set caveat lists several ranges, so may be longer */
+#define MAX_ADDRESS_SET_CAVEAT_LENGTH MODBUS_BATCH_CAVEAT_LENGTH
 
 /******************
  * HELPER FUNCTIONS
  *****************/
 
+/**
+ * Derives the root key of Macaroons created with key, as
+ * macaroon_create() and macaroon_verify() do, so it can be passed to
+ * macaroon_verify_raw()
+ *
+ * derived_key must hold NETWORK_CAPS_DERIVED_KEY_LENGTH bytes
+ * */
+int network_caps_derive_root_key(const unsigned char *key, size_t key_sz, unsigned char *derived_key)
+{
+    unsigned char generator[NETWORK_CAPS_DERIVED_KEY_LENGTH];
+
+    memset(generator, 0, sizeof(generator));
+    memcpy(generator, "macaroons-key-generator", sizeof("macaroons-key-generator"));
+
+    return macaroon_hmac(generator, sizeof(generator), key, key_sz, derived_key);
+}
+
+/*
+ * Returns the bit of function in a function caveat's bitfield, or 0 if
+ * it can't have one (e.g., an unknown function code from a request)
+ */
+static uint32_t function_bit(int function)
+{
+    if (function < 0 || function >= 32)
+    {
+        return 0;
+    }
+
+    return 1u << function;
+}
+
+/*
+ * Sets functions to the bitfield of every function in ranges
+ *
+ * Returns -1 if one of them can't be stated in a function caveat
+ */
+static int range_functions(const network_caps_range_t *ranges, int nb_ranges, uint32_t *functions)
+{
+    *functions = 0;
+
+    for (int i = 0; i < nb_ranges; ++i)
+    {
+        uint32_t bit = function_bit(ranges[i].function);
+        if (bit == 0)
+        {
+            return -1;
+        }
+        *functions |= bit;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the slot for ctx, claiming a free one if claim is set,
+ * or NULL if there is none
+ */
+static client_context_t *find_client_context(modbus_t *ctx, int claim)
+{
+    for (size_t i = 0; i < MAX_CLIENT_CONTEXTS; ++i)
+    {
+        if (__atomic_load_n(&client_contexts_[i].ctx, __ATOMIC_ACQUIRE) == ctx)
+        {
+            return &client_contexts_[i];
+        }
+    }
+
+    if (!claim)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < MAX_CLIENT_CONTEXTS; ++i)
+    {
+        modbus_t *expected = NULL;
+        if (__atomic_compare_exchange_n(&client_contexts_[i].ctx, &expected, ctx,
+                    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            return &client_contexts_[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Timestamps for the token round trip: cycles on FreeRTOS and
+ * nanoseconds (CLOCK_MONOTONIC) on Linux hosts
+ */
+static uint64_t client_timestamp(void)
+{
+#if defined(__freertos__)
+    return get_cycle_count();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/*
+ * Returns the Macaroon held for ctx, or the default client Macaroon
+ */
+static struct macaroon *get_client_macaroon(modbus_t *ctx)
+{
+    client_context_t *client_context = find_client_context(ctx, 0);
+    struct macaroon *macaroon = NULL;
+
+    if (client_context != NULL)
+    {
+        macaroon = __atomic_load_n(&client_context->macaroon, __ATOMIC_ACQUIRE);
+    }
+
+    return (macaroon != NULL) ? macaroon : client_macaroon_;
+}
+
 /*
  * Takes a bitfield representing a composite of one or more function codes and
  * creates a string in the form "function = [integer]" where [integer] is the
@@ -136,7 +281,7 @@ static unsigned char *create_function_caveat_from_fc_array(int *function_codes,
  */
 static unsigned char *create_function_caveat_from_fc(int function_code)
 {
-    return create_function_caveat_from_bitfield(1 << function_code);
+    return create_function_caveat_from_bitfield(function_bit(function_code));
 }
 
 // Below function extracts characters present in src
@@ -161,35 +306,48 @@ static char *substr(const char *src, int m, int n)
     return dest;
 }
 
+/*
+ * Returns the bitfield of a function caveat
+ */
+static int parse_function_caveat(const unsigned char *function_caveat)
+{
+    int token_length = strnlen(FUNCTION_CAVEAT_TOKEN, MAX_CAVEAT_LENGTH);
+    char *fc_str = substr((char *)function_caveat, token_length,
+            strnlen((char *)function_caveat, MAX_CAVEAT_LENGTH));
+    int fc = atoi(fc_str);
+#if defined(__freertos__)
+    vPortFree(fc_str);
+#else
+    free(fc_str);
+#endif
+
+    return fc;
+}
+
 /**
  * Verifies that the function caveats are not mutually exclusive
  * e.g., that we don't have both READ-ONLY and WRITE-ONLY
+ *
+ * The functions every caveat allows are returned in allowed
  * */
-static int check_function_caveats(unsigned char *first_party_caveats[], int num_caveats)
+static int check_function_caveats(unsigned char *first_party_caveats[], int num_caveats, uint32_t *allowed)
 {
     int token_length = strnlen(FUNCTION_CAVEAT_TOKEN, MAX_CAVEAT_LENGTH);
     unsigned char *tmp;
-    int tmp_length;
-    char *fc_str;
 
     uint32_t fc = 0xFFFFFFFF;
     for (int i = 0; i < num_caveats; ++i)
     {
         tmp = first_party_caveats[i];
-        tmp_length = strnlen((char *)tmp, MAX_CAVEAT_LENGTH);
 
         if (strncmp((char *)tmp, FUNCTION_CAVEAT_TOKEN, token_length) == 0)
         {
-            fc_str = substr((char *)tmp, token_length, tmp_length);
-            fc &= atoi(fc_str);
-#if defined(__freertos__)
-            vPortFree(fc_str);
-#else
-            free(fc_str);
-#endif
+            fc &= parse_function_caveat(tmp);
         }
     }
 
+    *allowed = fc;
+
     if (fc > 0)
     {
         return 0;
@@ -209,7 +367,7 @@ static int check_function_caveats(unsigned char *first_party_caveats[], int num_
  * */
 static unsigned char *create_address_caveat(uint16_t min_address, uint16_t max_address)
 {
-    uint32_t address_composed = (min_address << 16) + max_address;
+    uint32_t address_composed = ((uint32_t)min_address << 16) + max_address;
     char address_composed_string[MAX_CAVEAT_LENGTH];
 #if defined(__freertos__)
     char *address_caveat = (char *)pvPortMalloc(MAX_CAVEAT_LENGTH * sizeof(char));
@@ -218,234 +376,892 @@ static unsigned char *create_address_caveat(uint16_t min_address, uint16_t max_a
 #endif
 
     strncpy(address_caveat, ADDRESS_CAVEAT_TOKEN, MAX_CAVEAT_LENGTH);
-    snprintf(address_composed_string, MAX_CAVEAT_LENGTH, "%d", address_composed);
+    snprintf(address_composed_string, MAX_CAVEAT_LENGTH, "%u", (unsigned int)address_composed);
     strncat(address_caveat, address_composed_string,
             MAX_CAVEAT_LENGTH - strnlen(ADDRESS_CAVEAT_TOKEN, MAX_CAVEAT_LENGTH));
 
     return (unsigned char *)address_caveat;
 }
 
+static uint16_t find_max_address(int function, uint16_t addr, int nb);
+
 /**
- * Verifies that the addresses in the request are not excluded by
- * address caveats
+ * Address set caveats
+ *
+ * addresses = c:min-max,min-max;h:min-max,...
+ *
+ * For each table (c coils, d discrete inputs, h holding registers,
+ * i input registers), the ranges a token may access, in the same units
+ * as address caveats.  Tables are listed in that order, at most once,
+ * and each table's ranges are sorted and disjoint, so the same set of
+ * requests always gives the same caveat.  A request to a table that
+ * isn't listed is refused; functions without a table aren't restricted.
+ *
+ * The server compiles each address set caveat into sorted interval
+ * arrays the first time it sees it, and caches them, so a request is
+ * checked with a binary search rather than by parsing the caveat.
  * */
-static int check_address_caveats(unsigned char *first_party_caveats[], int num_caveats, unsigned char *address_request)
-{
-    unsigned char *fpc;
-    int fpc_length;
-    char *ar_str;
-
-    /* convert address request to an int */
-    int token_length = strnlen(ADDRESS_CAVEAT_TOKEN, MAX_CAVEAT_LENGTH);
-    ar_str = substr((char *)address_request, token_length, strnlen((char *)address_request, MAX_CAVEAT_LENGTH));
-    uint32_t ar = atoi(ar_str);
-#if defined(__freertos__)
-    vPortFree(ar_str);
-#else
-    free(ar_str);
-#endif
-
-    uint16_t ar_min = (0xFFFF0000 & ar) >> 16;
-    uint16_t ar_max = 0x0000FFFF & ar;
+#define NUM_ADDRESS_TABLES 4
+#define MAX_ADDRESS_SET_INTERVALS 64
+#define ADDRESS_SET_CACHE_SIZE 8
+
+static const char address_table_names_[NUM_ADDRESS_TABLES] = { 'c', 'd', 'h', 'i' };
+
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+} address_interval_t;
+
+typedef struct {
+    address_interval_t intervals[MAX_ADDRESS_SET_INTERVALS];
+    /* table t's intervals are [table_start[t], table_start[t + 1]) */
+    uint8_t table_start[NUM_ADDRESS_TABLES + 1];
+} address_set_t;
+
+typedef struct {
+    /* FNV-1a hash of caveat */
+    uint32_t hash;
+    /* empty if the slot is unused */
+    char caveat[MAX_ADDRESS_SET_CAVEAT_LENGTH];
+    address_set_t set;
+} address_set_cache_entry_t;
+
+/* the server verifies one request at a time, so the cache isn't locked */
+static address_set_cache_entry_t address_set_cache_[ADDRESS_SET_CACHE_SIZE];
+static int address_set_cache_next_;
 
-    uint32_t ac;
-    uint16_t ac_min;
-    uint16_t ac_max;
+/*
+ * FNV-1a hash of the first length bytes of data
+ */
+static uint32_t hash_bytes(const uint8_t *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
 
-    /**
-     * iterate through all address caveats, extract min and max
-     *
-     * if the requested address min and max are outside the bounds
-     * of any caveat, return -1.  otherwise return 0.
-     * */
-    for (int i = 0; i < num_caveats; ++i)
+    for (size_t i = 0; i < length; ++i)
     {
-        fpc = first_party_caveats[i];
-        fpc_length = strnlen((char *)fpc, MAX_CAVEAT_LENGTH);
-
-        if (strncmp((char *)fpc, ADDRESS_CAVEAT_TOKEN, token_length) == 0)
-        {
-            ac = atoi(substr((char *)fpc, token_length, strnlen((char *)fpc, MAX_CAVEAT_LENGTH)));
-            ac_min = (0xFFFF0000 & ac) >> 16;
-            ac_max = 0x0000FFFF & ac;
-
-            if (ar_min < ac_min || ar_max > ac_max)
-            {
-                return -1;
-            }
-        }
+        hash = (hash ^ data[i]) * 16777619u;
     }
 
-    return 0;
+    return hash;
 }
 
-/**
- * Based on function, address, and number, calculate
- * the maximum address expected to be accessed.
- *
- * For bitwise operations (e.g., read_bits), round up
- * to the nearest byte
- * */
-static uint16_t find_max_address(int function, uint16_t addr, int nb)
+/*
+ * Returns the table function accesses, or -1 if it has none
+ */
+static int address_table(int function)
 {
-    uint16_t addr_max;
-
     switch (function)
     {
         case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_WRITE_SINGLE_COIL:
         case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            return 0;
         case MODBUS_FC_READ_DISCRETE_INPUTS:
-            addr_max = addr + (nb / 8) + ((nb % 8) ? 1 : 0);
-            break;
+            return 1;
         case MODBUS_FC_READ_HOLDING_REGISTERS:
-        case MODBUS_FC_READ_INPUT_REGISTERS:
-        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
-        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
-            addr_max = addr + (nb * 2);
-            break;
-        case MODBUS_FC_WRITE_SINGLE_COIL:
-        case MODBUS_FC_REPORT_SLAVE_ID:
-        case MODBUS_FC_READ_EXCEPTION_STATUS:
-            addr_max = addr;
-            break;
         case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
         case MODBUS_FC_MASK_WRITE_REGISTER:
-            addr_max = addr + 2;
-            break;
-        case MODBUS_FC_WRITE_STRING:
-            addr_max = addr + nb;
-            break;
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            return 2;
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return 3;
         default:
-            addr_max = addr;
+            return -1;
     }
-
-    return addr_max;
 }
 
-/******************
- * CLIENT FUNCTIONS
- *****************/
-int initialise_client_network_caps(modbus_t *ctx, char *serialised_macaroon, int serialised_macaroon_length)
+/*
+ * Compiles the ranges (in any order, possibly overlapping) into set,
+ * sorted and merged.  Returns -1 if there are more than
+ * MAX_ADDRESS_SET_INTERVALS ranges with a table.
+ */
+static int compile_address_ranges(const network_caps_range_t *ranges, int nb_ranges, address_set_t *set)
 {
-    enum macaroon_returncode err = MACAROON_SUCCESS;
+    int tables[MAX_ADDRESS_SET_INTERVALS];
+    address_interval_t intervals[MAX_ADDRESS_SET_INTERVALS];
+    int nb_intervals = 0;
 
-    if (modbus_get_debug(ctx))
+    /* insertion sort by (table, min): batches are short */
+    for (int i = 0; i < nb_ranges; ++i)
     {
-        print_shim_info("macaroons_shim", __FUNCTION__);
+        int table = address_table(ranges[i].function);
+        address_interval_t interval;
+        int j;
+
+        if (table == -1)
+        {
+            continue;
+        }
+        if (nb_intervals == MAX_ADDRESS_SET_INTERVALS)
+        {
+            return -1;
+        }
+
+        interval.min = ranges[i].addr;
+        interval.max = find_max_address(ranges[i].function, ranges[i].addr, ranges[i].nb);
+        if (interval.max < interval.min)
+        {
+            /* wrapped past the last address */
+            interval.max = 0xFFFF;
+        }
+
+        for (j = nb_intervals; j > 0 && (tables[j - 1] > table ||
+                    (tables[j - 1] == table && intervals[j - 1].min > interval.min)); --j)
+        {
+            tables[j] = tables[j - 1];
+            intervals[j] = intervals[j - 1];
+        }
+        tables[j] = table;
+        intervals[j] = interval;
+        nb_intervals += 1;
     }
 
-    /**
-     * Deserialise the string into a Macaroon
-     * */
-    client_macaroon_ = macaroon_deserialize(serialised_macaroon,
-            serialised_macaroon_length, &err);
-    if (err != MACAROON_SUCCESS)
+    /* merge the intervals that overlap or touch */
+    int nb_merged = 0;
+    int table = 0;
+    for (int i = 0; i < nb_intervals; ++i)
     {
-        if (modbus_get_debug(ctx))
+        for (; table <= tables[i]; ++table)
         {
-            printf("Failed to deserialise the server macaroon from the queue\n");
-            printf("err: %d\n", err);
+            set->table_start[table] = nb_merged;
         }
-        return -1;
+
+        if (nb_merged > set->table_start[tables[i]] &&
+                intervals[i].min <= (uint32_t)set->intervals[nb_merged - 1].max + 1)
+        {
+            if (intervals[i].max > set->intervals[nb_merged - 1].max)
+            {
+                set->intervals[nb_merged - 1].max = intervals[i].max;
+            }
+        }
+        else
+        {
+            set->intervals[nb_merged] = intervals[i];
+            nb_merged += 1;
+        }
+    }
+
+    for (; table <= NUM_ADDRESS_TABLES; ++table)
+    {
+        set->table_start[table] = nb_merged;
     }
 
     return 0;
 }
 
-static int send_network_caps(modbus_t *ctx, int function, uint16_t addr, int nb)
+/*
+ * Verifies that function's table in set has a range containing
+ * ar_min to ar_max (functions without a table are always allowed)
+ */
+static int check_address_set(const address_set_t *set, int function, uint16_t ar_min, uint16_t ar_max)
 {
-    int rc;
-    struct macaroon *temp_macaroon;
-    enum macaroon_returncode err = MACAROON_SUCCESS;
+    int table = address_table(function);
 
-    if (modbus_get_debug(ctx))
+    if (table == -1)
     {
-        print_shim_info("macaroons_shim", __FUNCTION__);
+        return 0;
     }
 
-    if (client_macaroon_ == NULL)
+    /* find the last range starting at or before ar_min */
+    int lo = set->table_start[table];
+    int hi = set->table_start[table + 1];
+    while (lo < hi)
     {
-        if (modbus_get_debug(ctx))
+        int mid = lo + (hi - lo) / 2;
+        if (set->intervals[mid].min <= ar_min)
         {
-            printf("> Macaroon not initialised\n");
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
         }
-        return -1;
     }
 
-    /* add the function as a caveat to a temporary Macaroon*/
-    unsigned char *function_caveat = create_function_caveat_from_fc(function);
-    temp_macaroon = macaroon_add_first_party_caveat(
-            client_macaroon_,
-            function_caveat,
-            strnlen((char *)function_caveat, MAX_CAVEAT_LENGTH),
-            &err);
-#if defined(__freertos__)
-    vPortFree(function_caveat);
-#else
-    free(function_caveat);
-#endif
-
-    if (err != MACAROON_SUCCESS)
+    if (lo == set->table_start[table] || ar_max > set->intervals[lo - 1].max)
     {
         return -1;
     }
 
-    /* add the address range as a caveat to a temporary Macaroon*/
-    uint16_t addr_max = find_max_address(function, addr, nb);
-    unsigned char *address_caveat = create_address_caveat(addr, addr_max);
-    temp_macaroon = macaroon_add_first_party_caveat(
-            temp_macaroon,
-            address_caveat,
-            strnlen((char *)address_caveat, MAX_CAVEAT_LENGTH),
-            &err);
-    if (err != MACAROON_SUCCESS)
-    {
-        return -1;
-    }
+    return 0;
+}
 
-    /* serialise the Macaroon and send it to the server */
-    if (modbus_get_debug(ctx))
-    {
-        /* inspect the Macaroon */
-        int buf_sz = macaroon_inspect_size_hint(temp_macaroon);
+/*
+ * Writes the address set caveat of a compiled set, returning NULL if it
+ * would be longer than MAX_ADDRESS_SET_CAVEAT_LENGTH
+ */
+static unsigned char *format_address_set(const address_set_t *set)
+{
 #if defined(__freertos__)
-        char *buf = (char *)pvPortMalloc(buf_sz * sizeof(unsigned char));
+    char *address_set_caveat = (char *)pvPortMalloc(MAX_ADDRESS_SET_CAVEAT_LENGTH * sizeof(char));
 #else
-        char *buf = (char *)malloc(buf_sz * sizeof(unsigned char));
+    char *address_set_caveat = (char *)malloc(MAX_ADDRESS_SET_CAVEAT_LENGTH * sizeof(char));
 #endif
-        macaroon_inspect(temp_macaroon, buf, buf_sz, &err);
-        if (err != MACAROON_SUCCESS)
-        {
-            return -1;
-        }
+    int length = snprintf(address_set_caveat, MAX_ADDRESS_SET_CAVEAT_LENGTH, "%s", ADDRESS_SET_CAVEAT_TOKEN);
+    int first_table = 1;
 
-        printf("> sending Macaroon\n");
-        printf("%s\n", buf);
-        printf("%s\n", DISPLAY_MARKER);
+    for (int table = 0; table < NUM_ADDRESS_TABLES; ++table)
+    {
+        for (int i = set->table_start[table];
+                i < set->table_start[table + 1] && length < MAX_ADDRESS_SET_CAVEAT_LENGTH; ++i)
+        {
+            if (i == set->table_start[table])
+            {
+                length += snprintf(address_set_caveat + length, MAX_ADDRESS_SET_CAVEAT_LENGTH - length,
+                        "%s%c:", first_table ? "" : ";", address_table_names_[table]);
+                first_table = 0;
+            }
+            else
+            {
+                length += snprintf(address_set_caveat + length, MAX_ADDRESS_SET_CAVEAT_LENGTH - length,
+                        ",");
+            }
+
+            if (length < MAX_ADDRESS_SET_CAVEAT_LENGTH)
+            {
+                length += snprintf(address_set_caveat + length, MAX_ADDRESS_SET_CAVEAT_LENGTH - length,
+                        "%u-%u", (unsigned int)set->intervals[i].min, (unsigned int)set->intervals[i].max);
+            }
+        }
+    }
+
+    if (length >= MAX_ADDRESS_SET_CAVEAT_LENGTH)
+    {
+#if defined(__freertos__)
+        vPortFree(address_set_caveat);
+#else
+        free(address_set_caveat);
+#endif
+        return NULL;
+    }
+
+    return (unsigned char *)address_set_caveat;
+}
+
+/**
+ * Create an address set caveat, from the range each request accesses
+ *
+ * The ranges may be in any order and may overlap; they are sorted and
+ * merged, so the server can build the same caveat from the same requests.
+ *
+ * Returns NULL if there are more than MAX_ADDRESS_SET_INTERVALS ranges,
+ * or the caveat would be longer than MAX_ADDRESS_SET_CAVEAT_LENGTH
+ * */
+static unsigned char *create_address_set_caveat(const network_caps_range_t *ranges, int nb_ranges)
+{
+    address_set_t set;
+
+    if (compile_address_ranges(ranges, nb_ranges, &set) != 0)
+    {
+        return NULL;
+    }
+
+    return format_address_set(&set);
+}
+
+/*
+ * Parses an unsigned 16-bit number, returning the character after it,
+ * or NULL if there isn't one
+ */
+static const char *parse_address(const char *str, uint16_t *address)
+{
+    char *end;
+
+    if (*str < '0' || *str > '9')
+    {
+        return NULL;
+    }
+
+    unsigned long value = strtoul(str, &end, 10);
+    if (value > 0xFFFF)
+    {
+        return NULL;
+    }
+
+    *address = (uint16_t)value;
+    return end;
+}
+
+/*
+ * Compiles the ranges of an address set caveat (after the token) into
+ * set, returning -1 if it's malformed, or its tables or ranges aren't
+ * in order
+ */
+static int compile_address_set(const char *ranges, address_set_t *set)
+{
+    const char *p = ranges;
+    int nb_intervals = 0;
+    int table = 0;
+
+    while (*p != '\0')
+    {
+        /* the table */
+        int group_table = -1;
+        for (int t = table; t < NUM_ADDRESS_TABLES; ++t)
+        {
+            if (*p == address_table_names_[t])
+            {
+                group_table = t;
+                break;
+            }
+        }
+        if (group_table == -1 || p[1] != ':')
+        {
+            return -1;
+        }
+        p += 2;
+
+        for (; table <= group_table; ++table)
+        {
+            set->table_start[table] = nb_intervals;
+        }
+
+        /* its ranges */
+        while (1)
+        {
+            address_interval_t *interval = &set->intervals[nb_intervals];
+
+            if (nb_intervals == MAX_ADDRESS_SET_INTERVALS ||
+                    (p = parse_address(p, &interval->min)) == NULL || *p != '-' ||
+                    (p = parse_address(p + 1, &interval->max)) == NULL ||
+                    interval->max < interval->min)
+            {
+                return -1;
+            }
+
+            if (nb_intervals > set->table_start[group_table] &&
+                    interval->min <= set->intervals[nb_intervals - 1].max)
+            {
+                /* unsorted or overlapping */
+                return -1;
+            }
+            nb_intervals += 1;
+
+            if (*p != ',')
+            {
+                break;
+            }
+            ++p;
+        }
+
+        if (*p == ';')
+        {
+            ++p;
+            if (*p == '\0')
+            {
+                return -1;
+            }
+        }
+        else if (*p != '\0')
+        {
+            return -1;
+        }
+    }
+
+    for (; table <= NUM_ADDRESS_TABLES; ++table)
+    {
+        set->table_start[table] = nb_intervals;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the compiled address set for caveat, compiling and caching it
+ * if it hasn't been seen, or NULL if it's malformed
+ */
+static const address_set_t *find_address_set(const char *caveat)
+{
+    size_t length = strnlen(caveat, MAX_ADDRESS_SET_CAVEAT_LENGTH);
+
+    if (length == MAX_ADDRESS_SET_CAVEAT_LENGTH)
+    {
+        return NULL;
+    }
+
+    uint32_t hash = hash_bytes((const uint8_t *)caveat, length);
+
+    for (int i = 0; i < ADDRESS_SET_CACHE_SIZE; ++i)
+    {
+        if (address_set_cache_[i].hash == hash && address_set_cache_[i].caveat[0] != '\0' &&
+                strcmp(address_set_cache_[i].caveat, caveat) == 0)
+        {
+            return &address_set_cache_[i].set;
+        }
+    }
+
+    /* replace the slots in turn */
+    address_set_cache_entry_t *entry = &address_set_cache_[address_set_cache_next_];
+    address_set_cache_next_ = (address_set_cache_next_ + 1) % ADDRESS_SET_CACHE_SIZE;
+
+    if (compile_address_set(caveat + strlen(ADDRESS_SET_CAVEAT_TOKEN), &entry->set) != 0)
+    {
+        entry->caveat[0] = '\0';
+        return NULL;
+    }
+
+    memcpy(entry->caveat, caveat, length + 1);
+    entry->hash = hash;
+
+    return &entry->set;
+}
+
+/**
+ * Verifies that the addresses in the request are within one of the
+ * ranges of its table in every address set caveat
+ * */
+static int check_address_set_caveats(unsigned char *first_party_caveats[], int num_caveats,
+        int function, uint16_t ar_min, uint16_t ar_max)
+{
+    int token_length = strnlen(ADDRESS_SET_CAVEAT_TOKEN, MAX_CAVEAT_LENGTH);
+
+    for (int i = 0; i < num_caveats; ++i)
+    {
+        const char *fpc = (const char *)first_party_caveats[i];
+
+        if (strncmp(fpc, ADDRESS_SET_CAVEAT_TOKEN, token_length) != 0)
+        {
+            continue;
+        }
+
+        const address_set_t *set = find_address_set(fpc);
+        if (set == NULL || check_address_set(set, function, ar_min, ar_max) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the composed minimum and maximum addresses of an address caveat
+ */
+static uint32_t parse_address_caveat(const unsigned char *address_caveat)
+{
+    int token_length = strnlen(ADDRESS_CAVEAT_TOKEN, MAX_CAVEAT_LENGTH);
+    char *ac_str = substr((char *)address_caveat, token_length,
+            strnlen((char *)address_caveat, MAX_CAVEAT_LENGTH));
+    uint32_t ac = strtoul(ac_str, NULL, 10);
+#if defined(__freertos__)
+    vPortFree(ac_str);
+#else
+    free(ac_str);
+#endif
+
+    return ac;
+}
+
+/**
+ * Verifies that the addresses in the request are not excluded by
+ * address caveats
+ * */
+static int check_address_caveats(unsigned char *first_party_caveats[], int num_caveats,
+        uint16_t ar_min, uint16_t ar_max)
+{
+    unsigned char *fpc;
+    int token_length = strnlen(ADDRESS_CAVEAT_TOKEN, MAX_CAVEAT_LENGTH);
+
+    uint32_t ac;
+    uint16_t ac_min;
+    uint16_t ac_max;
+
+    /**
+     * iterate through all address caveats, extract min and max
+     *
+     * if the requested address min and max are outside the bounds
+     * of any caveat, return -1.  otherwise return 0.
+     * */
+    for (int i = 0; i < num_caveats; ++i)
+    {
+        fpc = first_party_caveats[i];
+
+        if (strncmp((char *)fpc, ADDRESS_CAVEAT_TOKEN, token_length) == 0)
+        {
+            ac = parse_address_caveat(fpc);
+            ac_min = (0xFFFF0000 & ac) >> 16;
+            ac_max = 0x0000FFFF & ac;
+
+            if (ar_min < ac_min || ar_max > ac_max)
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Based on function, address, and number, calculate
+ * the maximum address expected to be accessed.
+ *
+ * For bitwise operations (e.g., read_bits), round up
+ * to the nearest byte
+ * */
+static uint16_t find_max_address(int function, uint16_t addr, int nb)
+{
+    uint16_t addr_max;
+
+    switch (function)
+    {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            addr_max = addr + (nb / 8) + ((nb % 8) ? 1 : 0);
+            break;
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            addr_max = addr + (nb * 2);
+            break;
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+        case MODBUS_FC_REPORT_SLAVE_ID:
+        case MODBUS_FC_READ_EXCEPTION_STATUS:
+            addr_max = addr;
+            break;
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        case MODBUS_FC_MASK_WRITE_REGISTER:
+            addr_max = addr + 2;
+            break;
+        case MODBUS_FC_WRITE_STRING:
+            addr_max = addr + nb;
+            break;
+        default:
+            addr_max = addr;
+    }
+
+    return addr_max;
+}
+
+/******************
+ * CLIENT FUNCTIONS
+ *****************/
+int initialise_client_network_caps(modbus_t *ctx, char *serialised_macaroon, int serialised_macaroon_length)
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    /**
+     * Deserialise the string into a Macaroon
+     * */
+    struct macaroon *macaroon = macaroon_deserialize(serialised_macaroon,
+            serialised_macaroon_length, &err);
+    if (err != MACAROON_SUCCESS)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("Failed to deserialise the server macaroon from the queue\n");
+            printf("err: %d\n", err);
+        }
+        return -1;
+    }
+
+    /**
+     * Hold the Macaroon for this context.  A copy of the first Macaroon
+     * initialised is also the default for contexts without their own,
+     * and follows that context when it is initialised again.
+     * */
+    client_context_t *client_context = find_client_context(ctx, 1);
+    if (client_context == NULL)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("Too many client contexts\n");
+        }
+        macaroon_destroy(macaroon);
+        return -1;
+    }
 
+    struct macaroon *old_macaroon = __atomic_exchange_n(&client_context->macaroon,
+            macaroon, __ATOMIC_ACQ_REL);
+    if (old_macaroon != NULL)
+    {
+        macaroon_destroy(old_macaroon);
+    }
+
+    modbus_t *expected = NULL;
+    if (__atomic_compare_exchange_n(&client_macaroon_ctx_, &expected, ctx,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == ctx)
+    {
+        struct macaroon *default_macaroon = macaroon_copy(macaroon, &err);
+        if (err != MACAROON_SUCCESS)
+        {
+            return -1;
+        }
+
+        old_macaroon = __atomic_exchange_n(&client_macaroon_, default_macaroon, __ATOMIC_ACQ_REL);
+        if (old_macaroon != NULL)
+        {
+            macaroon_destroy(old_macaroon);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Releases the Macaroon held for ctx.  Call before modbus_free(ctx), and
+ * only once no other thread is using ctx.  If the default Macaroon was
+ * copied from ctx, it is released too, so contexts without their own
+ * Macaroon must not be in use.
+ * */
+void free_client_network_caps(modbus_t *ctx)
+{
+    client_context_t *client_context = find_client_context(ctx, 0);
+    if (client_context == NULL)
+    {
+        return;
+    }
+
+    struct macaroon *macaroon = __atomic_exchange_n(&client_context->macaroon,
+            NULL, __ATOMIC_ACQ_REL);
+
+    if (macaroon != NULL)
+    {
+        macaroon_destroy(macaroon);
+    }
+
+    /* don't keep signing with the Macaroon of a closed connection */
+    modbus_t *expected = ctx;
+    if (__atomic_compare_exchange_n(&client_macaroon_ctx_, &expected, NULL,
+                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        macaroon = __atomic_exchange_n(&client_macaroon_, NULL, __ATOMIC_ACQ_REL);
+        if (macaroon != NULL)
+        {
+            macaroon_destroy(macaroon);
+        }
+    }
+
+    __atomic_store_n(&client_context->token_time, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&client_context->ctx, NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the time the last shim call on ctx spent building and sending
+ * its Macaroon, up to and including the server's reply to the token write
+ * (nanoseconds on Linux hosts, cycles on FreeRTOS).  The rest of the shim
+ * call is the data round trip.
+ *
+ * Returns 0 if ctx has no Macaroon of its own.
+ * */
+uint64_t network_caps_last_token_time(modbus_t *ctx)
+{
+    client_context_t *client_context = find_client_context(ctx, 0);
+    if (client_context == NULL)
+    {
+        return 0;
+    }
+
+    return __atomic_load_n(&client_context->token_time, __ATOMIC_RELAXED);
+}
+
+static int send_macaroon(modbus_t *ctx, int function, uint16_t addr, int nb);
+
+/*
+ * Sends the Macaroon for a request and records how long that took
+ */
+static int send_network_caps(modbus_t *ctx, int function, uint16_t addr, int nb)
+{
+    client_context_t *client_context = find_client_context(ctx, 0);
+    uint64_t start = client_timestamp();
+
+    int rc = send_macaroon(ctx, function, addr, nb);
+
+    if (client_context != NULL)
+    {
+        __atomic_store_n(&client_context->token_time, client_timestamp() - start,
+                __ATOMIC_RELAXED);
+    }
+
+    return rc;
+}
+
+/**
+ * Builds a Macaroon: the client Macaroon for ctx, attenuated with
+ * function_caveat and address_caveat (both freed here), serialised into
+ * buf.
+ * */
+static int build_token(modbus_t *ctx, unsigned char *function_caveat, unsigned char *address_caveat,
+        uint8_t *buf, int max_length)
+{
+    struct macaroon *temp_macaroon;
+    struct macaroon *client_macaroon = get_client_macaroon(ctx);
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (client_macaroon == NULL)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("> Macaroon not initialised\n");
+        }
+#if defined(__freertos__)
+        vPortFree(function_caveat);
+        vPortFree(address_caveat);
+#else
+        free(function_caveat);
+        free(address_caveat);
+#endif
+        return -1;
+    }
+
+    /* add the function as a caveat to a temporary Macaroon*/
+    temp_macaroon = macaroon_add_first_party_caveat(
+            client_macaroon,
+            function_caveat,
+            strnlen((char *)function_caveat, MAX_CAVEAT_LENGTH),
+            &err);
+#if defined(__freertos__)
+    vPortFree(function_caveat);
+#else
+    free(function_caveat);
+#endif
+
+    if (err != MACAROON_SUCCESS)
+    {
+#if defined(__freertos__)
+        vPortFree(address_caveat);
+#else
+        free(address_caveat);
+#endif
+        return -1;
+    }
+
+    /* add the address range(s) as a caveat to a temporary Macaroon*/
+    struct macaroon *function_macaroon = temp_macaroon;
+    temp_macaroon = macaroon_add_first_party_caveat(
+            function_macaroon,
+            address_caveat,
+            strnlen((char *)address_caveat, MAX_ADDRESS_SET_CAVEAT_LENGTH),
+            &err);
+    macaroon_destroy(function_macaroon);
 #if defined(__freertos__)
-        vPortFree(buf);
+    vPortFree(address_caveat);
 #else
-        free(buf);
+    free(address_caveat);
 #endif
+
+    if (err != MACAROON_SUCCESS)
+    {
+        return -1;
     }
 
-    int msg_length = macaroon_serialize_size_hint(temp_macaroon, MACAROON_V1);
+    if (modbus_get_debug(ctx))
+    {
+        /* inspect the Macaroon */
+        int buf_sz = macaroon_inspect_size_hint(temp_macaroon);
+#if defined(__freertos__)
+        char *inspect_buf = (char *)pvPortMalloc(buf_sz * sizeof(unsigned char));
+#else
+        char *inspect_buf = (char *)malloc(buf_sz * sizeof(unsigned char));
+#endif
+        macaroon_inspect(temp_macaroon, inspect_buf, buf_sz, &err);
+        if (err == MACAROON_SUCCESS)
+        {
+            printf("> sending Macaroon\n");
+            printf("%s\n", inspect_buf);
+            printf("%s\n", DISPLAY_MARKER);
+        }
+
 #if defined(__freertos__)
-    unsigned char *msg = (unsigned char *)pvPortMalloc(msg_length * sizeof(unsigned char));
+        vPortFree(inspect_buf);
 #else
-    unsigned char *msg = (unsigned char *)malloc(msg_length * sizeof(unsigned char));
+        free(inspect_buf);
 #endif
+    }
+
+    /* serialise the Macaroon (the server reads it up to the first NUL,
+     * so the unused end of the size hint is zeroed) */
+    int msg_length = macaroon_serialize_size_hint(temp_macaroon, MACAROON_V1);
+    if (msg_length > max_length)
+    {
+        macaroon_destroy(temp_macaroon);
+        return -1;
+    }
+
+    memset(buf, 0, msg_length);
+    macaroon_serialize(temp_macaroon, MACAROON_V1, buf, msg_length, &err);
+    macaroon_destroy(temp_macaroon);
 
-    macaroon_serialize(temp_macaroon, MACAROON_V1, msg, msg_length, &err);
     if (err != MACAROON_SUCCESS)
     {
         return -1;
     }
 
-    rc = modbus_write_string(ctx, msg, msg_length);
+    return msg_length;
+}
 
-    macaroon_destroy(temp_macaroon);
+/**
+ * Builds the Macaroon for a request: the client Macaroon for ctx, attenuated
+ * with the function and the address range as caveats, serialised into buf.
+ *
+ * Returns the serialised length, or -1 on failure (including if buf is
+ * shorter than max_length).
+ * */
+int network_caps_build_token(modbus_t *ctx, int function, uint16_t addr, int nb,
+        uint8_t *buf, int max_length)
+{
+    uint16_t addr_max = find_max_address(function, addr, nb);
+
+    return build_token(ctx, create_function_caveat_from_fc(function),
+            create_address_caveat(addr, addr_max), buf, max_length);
+}
+
+/**
+ * As network_caps_build_token(), for a request accessing every one of
+ * ranges (e.g., a batch read): the caveats are every function in ranges,
+ * and the set of their address ranges.
+ *
+ * Returns -1, with errno set to EMBMDATA, if the ranges don't fit in a
+ * single caveat.
+ * */
+int network_caps_build_batch_token(modbus_t *ctx, const network_caps_range_t *ranges, int nb_ranges,
+        uint8_t *buf, int max_length)
+{
+    uint32_t functions;
+
+    if (range_functions(ranges, nb_ranges, &functions) != 0)
+    {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    unsigned char *address_caveat = create_address_set_caveat(ranges, nb_ranges);
+    if (address_caveat == NULL)
+    {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    return build_token(ctx, create_function_caveat_from_bitfield(functions), address_caveat,
+            buf, max_length);
+}
+
+static int send_macaroon(modbus_t *ctx, int function, uint16_t addr, int nb)
+{
+    int rc;
+    uint8_t msg[MODBUS_MAX_STRING_LENGTH];
+
+    int msg_length = network_caps_build_token(ctx, function, addr, nb, msg, sizeof(msg));
+    if (msg_length == -1)
+    {
+        return -1;
+    }
+
+    /* send the Macaroon to the server */
+    rc = modbus_write_string(ctx, msg, msg_length);
 
     if (rc == msg_length)
     {
@@ -483,320 +1299,974 @@ int modbus_read_bits_network_caps(modbus_t *ctx, int addr, int nb, uint8_t *dest
         print_shim_info("macaroons_shim", __FUNCTION__);
     }
 
-    if (send_network_caps(ctx, MODBUS_FC_READ_COILS, addr, nb) == 0)
+    if (send_network_caps(ctx, MODBUS_FC_READ_COILS, addr, nb) == 0)
+    {
+        return modbus_read_bits(ctx, addr, nb, dest);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_read_input_bits()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_READ_DISCRETE_INPUTS command
+ * 2. Same as modbus_read_bits but reads the remote device input table
+ * */
+int modbus_read_input_bits_network_caps(modbus_t *ctx, int addr, int nb, uint8_t *dest)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (send_network_caps(ctx, MODBUS_FC_READ_DISCRETE_INPUTS, addr, nb) == 0)
+    {
+        return modbus_read_input_bits(ctx, addr, nb, dest);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_read_registers()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_READ_HOLDING_REGISTERS command
+ * 2. Reads the holding registers of remote device and put the data into an
+ *    array
+ * */
+int modbus_read_registers_network_caps(modbus_t *ctx, int addr, int nb, uint16_t *dest)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (send_network_caps(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb) == 0)
+    {
+        return modbus_read_registers(ctx, addr, nb, dest);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_read_input_registers()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_READ_INPUT_REGISTERS command
+ * 2. Reads the holding registers of remote device and put the data into an
+ *    array
+ * */
+int modbus_read_input_registers_network_caps(modbus_t *ctx, int addr, int nb, uint16_t *dest)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (send_network_caps(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb) == 0)
+    {
+        return modbus_read_input_registers(ctx, addr, nb, dest);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_write_bit()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_WRITE_SINGLE_COIL command
+ * 2. Turns ON or OFF a single bit of the remote device
+ * */
+int modbus_write_bit_network_caps(modbus_t *ctx, int addr, int status)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (send_network_caps(ctx, MODBUS_FC_WRITE_SINGLE_COIL, addr, 0) == 0)
+    {
+        return modbus_write_bit(ctx, addr, status);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_write_register()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_WRITE_SINGLE_REGISTER command
+ * 2. Writes a value in one register of the remote device
+ * */
+int modbus_write_register_network_caps(modbus_t *ctx, int addr, const uint16_t value)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (send_network_caps(ctx, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, 0) == 0)
+    {
+        return modbus_write_register(ctx, addr, value);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_write_bits()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_WRITE_SINGLE_COIL command
+ * 2. Write the bits of the array in the remote device
+ * */
+int modbus_write_bits_network_caps(modbus_t *ctx, int addr, int nb, const uint8_t *src)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (send_network_caps(ctx, MODBUS_FC_WRITE_MULTIPLE_COILS, addr, nb) == 0)
+    {
+        return modbus_write_bits(ctx, addr, nb, src);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_write_registers()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_WRITE_MULTIPLE_REGISTERS command
+ * 2. Write the values from the array to the registers of the remote device
+ * */
+int modbus_write_registers_network_caps(modbus_t *ctx, int addr, int nb, const uint16_t *data)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (send_network_caps(ctx, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, nb) == 0)
+    {
+        return modbus_write_registers(ctx, addr, nb, data);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_mask_write_register()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_MASK_WRITE_REGISTER command
+ * 2. I'm not actually sure what this does...
+ *    The unit test appears designed to fail
+ * */
+int modbus_mask_write_register_network_caps(modbus_t *ctx, int addr,
+        uint16_t and_mask, uint16_t or_mask)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    if (send_network_caps(ctx, MODBUS_FC_MASK_WRITE_REGISTER, addr, 0) == 0)
+    {
+        return modbus_mask_write_register(ctx, addr, and_mask, or_mask);
+    }
+
+    return -1;
+}
+
+/**
+ * Shim for modbus_write_and_read_registers()
+ *
+ * 1. Sends a Macaroon with the MODBUS_FC_WRITE_AND_READ_REGISTERS command
+ * 2. Write multiple registers from src array to remote device and read multiple
+ *    registers from remote device to dest array
+ * */
+int modbus_write_and_read_registers_network_caps(modbus_t *ctx, int write_addr,
+        int write_nb, const uint16_t *src,
+        int read_addr, int read_nb,
+        uint16_t *dest)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    /**
+     * send_network_caps() will create an address range caveat
+     * we need to find the entire range that this function is trying to access
+     * since there's no way to have disjoint caveats
+     * */
+    uint16_t write_addr_max = find_max_address(MODBUS_FC_WRITE_AND_READ_REGISTERS, write_addr, write_nb);
+    uint16_t read_addr_max = find_max_address(MODBUS_FC_WRITE_AND_READ_REGISTERS, read_addr, read_nb);
+    uint16_t addr = (write_addr < read_addr) ? write_addr : read_addr;
+    int nb = ((write_addr < read_addr) ? (read_addr_max - write_addr) : (write_addr_max - read_addr)) / 2;
+
+    if (send_network_caps(ctx, MODBUS_FC_WRITE_AND_READ_REGISTERS, addr, nb) == 0)
     {
-        return modbus_read_bits(ctx, addr, nb, dest);
+        return modbus_write_and_read_registers(ctx, write_addr, write_nb, src,
+                read_addr, read_nb, dest);
     }
 
     return -1;
 }
 
 /**
- * Shim for modbus_read_input_bits()
+ * Shim for modbus_report_slave_id()
  *
- * 1. Sends a Macaroon with the MODBUS_FC_READ_DISCRETE_INPUTS command
- * 2. Same as modbus_read_bits but reads the remote device input table
+ * 1. Sends a Macaroon with the MODBUS_FC_REPORT_SLAVE_ID command
+ * 2. Send a request to get the slave ID of the device (only available in
+ *    serial communication)
  * */
-int modbus_read_input_bits_network_caps(modbus_t *ctx, int addr, int nb, uint8_t *dest)
+int modbus_report_slave_id_network_caps(modbus_t *ctx, int max_dest,
+        uint8_t *dest)
 {
     if (modbus_get_debug(ctx))
     {
         print_shim_info("macaroons_shim", __FUNCTION__);
     }
 
-    if (send_network_caps(ctx, MODBUS_FC_READ_DISCRETE_INPUTS, addr, nb) == 0)
+    if (send_network_caps(ctx, MODBUS_FC_REPORT_SLAVE_ID, 0, 0) == 0)
     {
-        return modbus_read_input_bits(ctx, addr, nb, dest);
+        return modbus_report_slave_id(ctx, max_dest, dest);
     }
 
     return -1;
 }
 
+/* Receive the request from a modbus master */
+int modbus_receive_network_caps(modbus_t *ctx, uint8_t *req)
+{
+    return modbus_receive(ctx, req);
+}
+
+/******************
+ * SERVER FUNCTIONS
+ *****************/
+
 /**
- * Shim for modbus_read_registers()
+ * Server keyring
  *
- * 1. Sends a Macaroon with the MODBUS_FC_READ_HOLDING_REGISTERS command
- * 2. Reads the holding registers of remote device and put the data into an
- *    array
+ * The server may hold several root keys at once (e.g., while keys are
+ * rotated), each with its own identifier.  A Macaroon's identifier
+ * selects the key it is verified with, by probing a small table from
+ * the identifier's hash.  The derived root key and the serialised root
+ * Macaroon (read by clients with READ_STRING) are computed once, when
+ * the key is added.
+ *
+ * Keys are added and retired while requests are verified, by one writer
+ * at a time (see modbus_network_caps.h).  A key is built in a free slot,
+ * which readers skip, and published with a single store to the slot's
+ * in_use; a key that replaces another is published before the old one
+ * is retired.  Retiring a slot advances its generation before it's
+ * freed, and readers check the generation is unchanged once they've
+ * copied from a slot, so a copy that raced with retiring (and reusing)
+ * the slot is discarded rather than retried: readers never wait for a
+ * writer, however long the writer is preempted.  Retiring a key also
+ * advances the keyring epoch, so the cached policies of tokens verified
+ * before are no longer used.
  * */
-int modbus_read_registers_network_caps(modbus_t *ctx, int addr, int nb, uint16_t *dest)
+#ifndef NETWORK_CAPS_KEYRING_SIZE
+#define NETWORK_CAPS_KEYRING_SIZE 4
+#endif
+
+typedef struct {
+    /* 0 if the slot is unused, set once the key is complete */
+    int in_use;
+    /* advanced each time the slot is retired */
+    uint32_t generation;
+    uint32_t id_hash;
+    size_t id_sz;
+    unsigned char id[MAX_MACAROON_INITIALISATION_LENGTH];
+    unsigned char derived_key[NETWORK_CAPS_DERIVED_KEY_LENGTH];
+    /* the serialised root Macaroon, NUL-terminated */
+    uint8_t root_token[MODBUS_MAX_STRING_LENGTH];
+} network_caps_key_t;
+
+static network_caps_key_t keyring_[NETWORK_CAPS_KEYRING_SIZE];
+/* the slot of the key whose root Macaroon clients read, or -1 */
+static int current_key_ = -1;
+static uint32_t keyring_epoch_;
+/* set while a writer is changing the keyring */
+static unsigned char keyring_writer_;
+
+/*
+ * Claims the keyring for a writer.  Returns -1, without waiting, if
+ * another writer has it.
+ */
+static int keyring_write_begin(void)
 {
-    if (modbus_get_debug(ctx))
-    {
-        print_shim_info("macaroons_shim", __FUNCTION__);
-    }
+    return __atomic_test_and_set(&keyring_writer_, __ATOMIC_ACQUIRE) ? -1 : 0;
+}
 
-    if (send_network_caps(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb) == 0)
+static void keyring_write_end(void)
+{
+    __atomic_clear(&keyring_writer_, __ATOMIC_RELEASE);
+}
+
+/*
+ * Retires the key in slot: readers copying from it discard their copy,
+ * and the slot can be reused
+ */
+static void keyring_retire_slot(int slot)
+{
+    __atomic_add_fetch(&keyring_[slot].generation, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&keyring_[slot].in_use, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the slot holding the key for id, and the slot's generation,
+ * or -1.  Slots are probed from the id's hash; retired slots don't end
+ * the probe, so at most NETWORK_CAPS_KEYRING_SIZE slots are probed.
+ */
+static int keyring_find(const unsigned char *id, size_t id_sz, uint32_t id_hash, uint32_t *generation)
+{
+    for (int i = 0; i < NETWORK_CAPS_KEYRING_SIZE; ++i)
     {
-        return modbus_read_registers(ctx, addr, nb, dest);
+        int slot = (id_hash + i) % NETWORK_CAPS_KEYRING_SIZE;
+        const network_caps_key_t *key = &keyring_[slot];
+
+        *generation = __atomic_load_n(&key->generation, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&key->in_use, __ATOMIC_ACQUIRE) && key->id_hash == id_hash &&
+                key->id_sz == id_sz && memcmp(key->id, id, id_sz) == 0)
+        {
+            return slot;
+        }
     }
 
     return -1;
 }
 
-/**
- * Shim for modbus_read_input_registers()
- *
- * 1. Sends a Macaroon with the MODBUS_FC_READ_INPUT_REGISTERS command
- * 2. Reads the holding registers of remote device and put the data into an
- *    array
- * */
-int modbus_read_input_registers_network_caps(modbus_t *ctx, int addr, int nb, uint16_t *dest)
+/*
+ * Returns 0 if slot hasn't been retired since its generation was read
+ */
+static int keyring_check_slot(int slot, uint32_t generation)
 {
-    if (modbus_get_debug(ctx))
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&keyring_[slot].generation, __ATOMIC_RELAXED) == generation) ? 0 : -1;
+}
+
+/*
+ * Copies the derived root key for a Macaroon identifier, and the
+ * keyring epoch it belongs to.  Returns -1 if there is no such key, or
+ * it was retired while it was copied.
+ */
+static int keyring_derived_key(const unsigned char *id, size_t id_sz,
+        unsigned char *derived_key, uint32_t *epoch)
+{
+    uint32_t generation;
+
+    /* read first, so the key being retired meanwhile lapses the policy */
+    *epoch = __atomic_load_n(&keyring_epoch_, __ATOMIC_ACQUIRE);
+
+    int slot = keyring_find(id, id_sz, hash_bytes(id, id_sz), &generation);
+    if (slot == -1)
     {
-        print_shim_info("macaroons_shim", __FUNCTION__);
+        return -1;
     }
 
-    if (send_network_caps(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb) == 0)
+    memcpy(derived_key, keyring_[slot].derived_key, NETWORK_CAPS_DERIVED_KEY_LENGTH);
+
+    return keyring_check_slot(slot, generation);
+}
+
+/*
+ * Copies the current serialised root Macaroon into dest (of
+ * MODBUS_MAX_STRING_LENGTH bytes).  Returns -1, with dest empty, if
+ * there are no keys, or the key was retired while it was copied.
+ */
+static int keyring_root_token(uint8_t *dest)
+{
+    int slot = __atomic_load_n(&current_key_, __ATOMIC_ACQUIRE);
+
+    if (slot != -1)
     {
-        return modbus_read_input_registers(ctx, addr, nb, dest);
+        uint32_t generation = __atomic_load_n(&keyring_[slot].generation, __ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&keyring_[slot].in_use, __ATOMIC_ACQUIRE))
+        {
+            memcpy(dest, keyring_[slot].root_token, MODBUS_MAX_STRING_LENGTH);
+
+            if (keyring_check_slot(slot, generation) == 0)
+            {
+                return 0;
+            }
+        }
     }
 
+    dest[0] = '\0';
     return -1;
 }
 
 /**
- * Shim for modbus_write_bit()
+ * Adds a root key to the keyring (replacing any key with the same id),
+ * and makes its root Macaroon the one clients read.  Tokens from the
+ * other keys are still accepted until those keys are retired.
  *
- * 1. Sends a Macaroon with the MODBUS_FC_WRITE_SINGLE_COIL command
- * 2. Turns ON or OFF a single bit of the remote device
+ * The key is built in a free slot, so replacing a key needs one.
+ * Returns -1 if the keyring is full or another writer has it.
  * */
-int modbus_write_bit_network_caps(modbus_t *ctx, int addr, int status)
+int network_caps_add_key(modbus_t *ctx, const char *location, const char *key, const char *id)
 {
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+    uint32_t generation;
+
     if (modbus_get_debug(ctx))
     {
         print_shim_info("macaroons_shim", __FUNCTION__);
     }
 
-    if (send_network_caps(ctx, MODBUS_FC_WRITE_SINGLE_COIL, addr, 0) == 0)
+    if (keyring_write_begin() != 0)
     {
-        return modbus_write_bit(ctx, addr, status);
+        if (modbus_get_debug(ctx))
+        {
+            printf("Keyring busy\n");
+        }
+        return -1;
     }
 
-    return -1;
+    size_t key_sz = strnlen(key, MAX_MACAROON_INITIALISATION_LENGTH);
+    size_t id_sz = strnlen(id, MAX_MACAROON_INITIALISATION_LENGTH);
+    size_t location_sz = strnlen(location, MAX_MACAROON_INITIALISATION_LENGTH);
+    uint32_t id_hash = hash_bytes((const uint8_t *)id, id_sz);
+
+    /* the key this one replaces, and a free slot to build it in */
+    int old_slot = keyring_find((const unsigned char *)id, id_sz, id_hash, &generation);
+    int slot = -1;
+    for (int i = 0; slot == -1 && i < NETWORK_CAPS_KEYRING_SIZE; ++i)
+    {
+        int probe = (id_hash + i) % NETWORK_CAPS_KEYRING_SIZE;
+        if (!keyring_[probe].in_use)
+        {
+            slot = probe;
+        }
+    }
+
+    if (slot == -1)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("Keyring full\n");
+        }
+        keyring_write_end();
+        return -1;
+    }
+
+    /* readers skip the slot until it's in use */
+    network_caps_key_t *new_key = &keyring_[slot];
+    new_key->id_sz = id_sz;
+    new_key->id_hash = id_hash;
+    memcpy(new_key->id, id, id_sz);
+
+    int rc = network_caps_derive_root_key((const unsigned char *)key, key_sz, new_key->derived_key);
+
+    struct macaroon *root_macaroon = NULL;
+    if (rc == 0)
+    {
+        root_macaroon = macaroon_create((const unsigned char *)location, location_sz,
+                (const unsigned char *)key, key_sz, new_key->id, id_sz, &err);
+        rc = (err == MACAROON_SUCCESS) ? 0 : -1;
+    }
+
+    if (rc == 0)
+    {
+        /* the serialised Macaroon must fit in tab_string with its NUL */
+        size_t root_token_length = macaroon_serialize_size_hint(root_macaroon, MACAROON_V1);
+        if (root_token_length >= MODBUS_MAX_STRING_LENGTH)
+        {
+            rc = -1;
+        }
+        else
+        {
+            memset(new_key->root_token, 0, MODBUS_MAX_STRING_LENGTH);
+            macaroon_serialize(root_macaroon, MACAROON_V1,
+                    new_key->root_token, MODBUS_MAX_STRING_LENGTH, &err);
+            rc = (err == MACAROON_SUCCESS) ? 0 : -1;
+        }
+        macaroon_destroy(root_macaroon);
+    }
+
+    if (rc != 0)
+    {
+        if(modbus_get_debug(ctx)) {
+            printf("Failed to initialise Macaroon\n");
+            printf("err: %d\n", err);
+        }
+        keyring_write_end();
+        return -1;
+    }
+
+    /* publish the new key, then retire the old secret for this id */
+    __atomic_store_n(&new_key->in_use, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&current_key_, slot, __ATOMIC_RELEASE);
+    if (old_slot != -1)
+    {
+        keyring_retire_slot(old_slot);
+        __atomic_add_fetch(&keyring_epoch_, 1, __ATOMIC_RELEASE);
+    }
+
+    keyring_write_end();
+
+    return 0;
 }
 
 /**
- * Shim for modbus_write_register()
- *
- * 1. Sends a Macaroon with the MODBUS_FC_WRITE_SINGLE_REGISTER command
- * 2. Writes a value in one register of the remote device
+ * Retires the root key for id: tokens from it are no longer accepted,
+ * including tokens verified with it before (anything authorised by a
+ * token beyond its request, e.g. a subscription, must check
+ * network_caps_keyring_epoch()).  Returns -1 if there is no such key, or
+ * another writer has the keyring.
  * */
-int modbus_write_register_network_caps(modbus_t *ctx, int addr, const uint16_t value)
+int network_caps_retire_key(modbus_t *ctx, const char *id)
 {
+    size_t id_sz = strnlen(id, MAX_MACAROON_INITIALISATION_LENGTH);
+    uint32_t id_hash = hash_bytes((const uint8_t *)id, id_sz);
+    uint32_t generation;
+
     if (modbus_get_debug(ctx))
     {
         print_shim_info("macaroons_shim", __FUNCTION__);
     }
 
-    if (send_network_caps(ctx, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, 0) == 0)
+    if (keyring_write_begin() != 0)
     {
-        return modbus_write_register(ctx, addr, value);
+        return -1;
     }
 
-    return -1;
+    int slot = keyring_find((const unsigned char *)id, id_sz, id_hash, &generation);
+    if (slot == -1)
+    {
+        keyring_write_end();
+        return -1;
+    }
+
+    if (current_key_ == slot)
+    {
+        /* clients read another key's root Macaroon, if there is one */
+        int current_key = -1;
+        for (int i = 0; i < NETWORK_CAPS_KEYRING_SIZE; ++i)
+        {
+            if (i != slot && keyring_[i].in_use)
+            {
+                current_key = i;
+            }
+        }
+        __atomic_store_n(&current_key_, current_key, __ATOMIC_RELEASE);
+    }
+
+    keyring_retire_slot(slot);
+    __atomic_add_fetch(&keyring_epoch_, 1, __ATOMIC_RELEASE);
+
+    keyring_write_end();
+
+    return 0;
 }
 
 /**
- * Shim for modbus_write_bits()
+ * Verified token policies
  *
- * 1. Sends a Macaroon with the MODBUS_FC_WRITE_SINGLE_COIL command
- * 2. Write the bits of the array in the remote device
+ * When a token is verified in full, its caveats are compiled into a
+ * policy, cached against the serialised token: the functions every
+ * function caveat allows, the intersection of its address caveats, its
+ * compiled address set caveats, and the values its function and address
+ * caveats state.  A later request with the same token is authorised by
+ * the policy alone, by the same rules as full verification, without
+ * deserialising the token or recomputing its signature:
+ *
+ * - every function caveat allows the request's functions, and one
+ *   states exactly those functions
+ * - the request's ranges are within every address and address set
+ *   caveat, and one states exactly the request's addresses
+ *
+ * A caveat only states a value if it's written the way the server
+ * writes the request's own caveat, so a caveat that full verification
+ * wouldn't match never matches here either.  A request the policy
+ * doesn't authorise is verified in full.
+ *
+ * Tokens are matched by their exact bytes, so a different token (e.g.,
+ * after another WRITE_STRING) never matches, and a policy is only used
+ * in the keyring epoch it was verified in, so it lapses when any key is
+ * retired or replaced.
  * */
-int modbus_write_bits_network_caps(modbus_t *ctx, int addr, int nb, const uint8_t *src)
+#ifndef NETWORK_CAPS_POLICY_CACHE_SIZE
+#if defined(__freertos__)
+#define NETWORK_CAPS_POLICY_CACHE_SIZE 4
+#else
+/* a host server caches a batch of tokens at once (one per client) */
+#define NETWORK_CAPS_POLICY_CACHE_SIZE 32
+#endif
+#endif
+
+/* tokens with more address set caveats aren't cached */
+#define MAX_POLICY_ADDRESS_SETS 2
+
+typedef struct {
+    /* FNV-1a hash of token */
+    uint32_t hash;
+    /* the keyring epoch the token was verified in */
+    uint32_t epoch;
+    /* the serialised token, 0 length if the slot is unused */
+    size_t token_length;
+    uint8_t token[MODBUS_MAX_STRING_LENGTH];
+    /* bit n is set if every function caveat allows function n */
+    uint32_t allowed_functions;
+    /* the bitfields of the function caveats */
+    int stated_functions[MAX_CAVEATS];
+    int nb_stated_functions;
+    /* the addresses every address caveat allows */
+    uint16_t address_min;
+    uint16_t address_max;
+    /* the composed addresses of the address caveats */
+    uint32_t stated_addresses[MAX_CAVEATS];
+    int nb_stated_addresses;
+    /* the address set caveats, and whether each states its set */
+    address_set_t address_sets[MAX_POLICY_ADDRESS_SETS];
+    int address_set_stated[MAX_POLICY_ADDRESS_SETS];
+    int nb_address_sets;
+} network_caps_policy_t;
+
+static network_caps_policy_t policy_cache_[NETWORK_CAPS_POLICY_CACHE_SIZE];
+static int policy_cache_next_;
+
+/*
+ * Returns the policy for a previously verified token, or NULL
+ */
+static const network_caps_policy_t *find_policy(const uint8_t *token, size_t token_length, uint32_t hash)
 {
-    if (modbus_get_debug(ctx))
+    for (int i = 0; i < NETWORK_CAPS_POLICY_CACHE_SIZE; ++i)
     {
-        print_shim_info("macaroons_shim", __FUNCTION__);
+        network_caps_policy_t *policy = &policy_cache_[i];
+
+        if (policy->hash == hash && policy->token_length == token_length &&
+                token_length > 0 && memcmp(policy->token, token, token_length) == 0 &&
+                policy->epoch == __atomic_load_n(&keyring_epoch_, __ATOMIC_ACQUIRE))
+        {
+            return policy;
+        }
     }
 
-    if (send_network_caps(ctx, MODBUS_FC_WRITE_MULTIPLE_COILS, addr, nb) == 0)
+    return NULL;
+}
+
+/*
+ * Returns 1 if two compiled address sets hold the same ranges
+ */
+static int address_sets_equal(const address_set_t *a, const address_set_t *b)
+{
+    return memcmp(a->table_start, b->table_start, sizeof(a->table_start)) == 0 &&
+            memcmp(a->intervals, b->intervals,
+                    a->table_start[NUM_ADDRESS_TABLES] * sizeof(address_interval_t)) == 0;
+}
+
+/*
+ * Verifies that a request accessing every one of ranges, with the
+ * address caveat ar, is authorised by policy
+ */
+static int check_policy(const network_caps_policy_t *policy,
+        const network_caps_range_t *ranges, int nb_ranges, const unsigned char *ar)
+{
+    if (policy == NULL)
+    {
+        return -1;
+    }
+
+    /* functions: allowed by every caveat, and stated by one */
+    uint32_t required_functions;
+    if (range_functions(ranges, nb_ranges, &required_functions) != 0)
+    {
+        return -1;
+    }
+
+    if ((policy->allowed_functions & required_functions) != required_functions)
+    {
+        return -1;
+    }
+
+    int function_as_caveat = 0;
+    for (int i = 0; i < policy->nb_stated_functions && !function_as_caveat; ++i)
+    {
+        function_as_caveat = policy->stated_functions[i] == (int)required_functions;
+    }
+    if (!function_as_caveat)
+    {
+        return -1;
+    }
+
+    /* addresses: within every caveat */
+    for (int i = 0; i < nb_ranges; ++i)
+    {
+        uint16_t ar_max = find_max_address(ranges[i].function, ranges[i].addr, ranges[i].nb);
+
+        if (ranges[i].addr < policy->address_min || ar_max > policy->address_max)
+        {
+            return -1;
+        }
+
+        for (int j = 0; j < policy->nb_address_sets; ++j)
+        {
+            if (check_address_set(&policy->address_sets[j], ranges[i].function, ranges[i].addr, ar_max) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    /* and stated by one */
+    int address_as_caveat = 0;
+    if (strncmp((const char *)ar, ADDRESS_SET_CAVEAT_TOKEN, strlen(ADDRESS_SET_CAVEAT_TOKEN)) == 0)
+    {
+        address_set_t requested;
+
+        if (compile_address_ranges(ranges, nb_ranges, &requested) != 0)
+        {
+            return -1;
+        }
+
+        for (int i = 0; i < policy->nb_address_sets && !address_as_caveat; ++i)
+        {
+            address_as_caveat = policy->address_set_stated[i] &&
+                    address_sets_equal(&policy->address_sets[i], &requested);
+        }
+    }
+    else
     {
-        return modbus_write_bits(ctx, addr, nb, src);
+        uint32_t requested = parse_address_caveat(ar);
+
+        for (int i = 0; i < policy->nb_stated_addresses && !address_as_caveat; ++i)
+        {
+            address_as_caveat = policy->stated_addresses[i] == requested;
+        }
     }
 
-    return -1;
+    return address_as_caveat ? 0 : -1;
 }
 
-/**
- * Shim for modbus_write_registers()
- *
- * 1. Sends a Macaroon with the MODBUS_FC_WRITE_MULTIPLE_REGISTERS command
- * 2. Write the values from the array to the registers of the remote device
- * */
-int modbus_write_registers_network_caps(modbus_t *ctx, int addr, int nb, const uint16_t *data)
+/*
+ * Returns 1 if caveat is the caveat the server writes for value
+ */
+static int caveat_states(const unsigned char *caveat, unsigned char *value_caveat, size_t length)
 {
-    if (modbus_get_debug(ctx))
-    {
-        print_shim_info("macaroons_shim", __FUNCTION__);
-    }
+    int stated = value_caveat != NULL && strncmp((const char *)caveat, (const char *)value_caveat, length) == 0;
 
-    if (send_network_caps(ctx, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, nb) == 0)
-    {
-        return modbus_write_registers(ctx, addr, nb, data);
-    }
+#if defined(__freertos__)
+    vPortFree(value_caveat);
+#else
+    free(value_caveat);
+#endif
 
-    return -1;
+    return stated;
 }
 
-/**
- * Shim for modbus_mask_write_register()
- *
- * 1. Sends a Macaroon with the MODBUS_FC_MASK_WRITE_REGISTER command
- * 2. I'm not actually sure what this does...
- *    The unit test appears designed to fail
- * */
-int modbus_mask_write_register_network_caps(modbus_t *ctx, int addr,
-        uint16_t and_mask, uint16_t or_mask)
+/*
+ * Caches the policy of a token that has been verified, compiled from
+ * its first party caveats and the functions they allow
+ */
+static void add_policy(const uint8_t *token, size_t token_length, uint32_t hash, uint32_t epoch,
+        unsigned char *first_party_caveats[], int num_caveats, uint32_t allowed_functions)
 {
-    if (modbus_get_debug(ctx))
-    {
-        print_shim_info("macaroons_shim", __FUNCTION__);
-    }
+    /* replace the slots in turn */
+    network_caps_policy_t *policy = &policy_cache_[policy_cache_next_];
 
-    if (send_network_caps(ctx, MODBUS_FC_MASK_WRITE_REGISTER, addr, 0) == 0)
+    if (token_length == 0 || token_length > sizeof(policy->token))
     {
-        return modbus_mask_write_register(ctx, addr, and_mask, or_mask);
+        return;
     }
 
-    return -1;
-}
+    policy->token_length = 0;
+    policy->allowed_functions = allowed_functions;
+    policy->nb_stated_functions = 0;
+    policy->address_min = 0;
+    policy->address_max = 0xFFFF;
+    policy->nb_stated_addresses = 0;
+    policy->nb_address_sets = 0;
 
-/**
- * Shim for modbus_write_and_read_registers()
- *
- * 1. Sends a Macaroon with the MODBUS_FC_WRITE_AND_READ_REGISTERS command
- * 2. Write multiple registers from src array to remote device and read multiple
- *    registers from remote device to dest array
- * */
-int modbus_write_and_read_registers_network_caps(modbus_t *ctx, int write_addr,
-        int write_nb, const uint16_t *src,
-        int read_addr, int read_nb,
-        uint16_t *dest)
-{
-    if (modbus_get_debug(ctx))
+    for (int i = 0; i < num_caveats; ++i)
     {
-        print_shim_info("macaroons_shim", __FUNCTION__);
-    }
+        const unsigned char *fpc = first_party_caveats[i];
 
-    /**
-     * send_network_caps() will create an address range caveat
-     * we need to find the entire range that this function is trying to access
-     * since there's no way to have disjoint caveats
-     * */
-    uint16_t write_addr_max = find_max_address(MODBUS_FC_WRITE_AND_READ_REGISTERS, write_addr, write_nb);
-    uint16_t read_addr_max = find_max_address(MODBUS_FC_WRITE_AND_READ_REGISTERS, read_addr, read_nb);
-    uint16_t addr = (write_addr < read_addr) ? write_addr : read_addr;
-    int nb = ((write_addr < read_addr) ? (read_addr_max - write_addr) : (write_addr_max - read_addr)) / 2;
+        if (strncmp((const char *)fpc, FUNCTION_CAVEAT_TOKEN, strlen(FUNCTION_CAVEAT_TOKEN)) == 0)
+        {
+            int fc = parse_function_caveat(fpc);
 
-    if (send_network_caps(ctx, MODBUS_FC_WRITE_AND_READ_REGISTERS, addr, nb) == 0)
-    {
-        return modbus_write_and_read_registers(ctx, write_addr, write_nb, src,
-                read_addr, read_nb, dest);
+            if (caveat_states(fpc, create_function_caveat_from_bitfield(fc), MAX_CAVEAT_LENGTH))
+            {
+                policy->stated_functions[policy->nb_stated_functions++] = fc;
+            }
+        }
+        else if (strncmp((const char *)fpc, ADDRESS_CAVEAT_TOKEN, strlen(ADDRESS_CAVEAT_TOKEN)) == 0)
+        {
+            uint32_t ac = parse_address_caveat(fpc);
+            uint16_t ac_min = (0xFFFF0000 & ac) >> 16;
+            uint16_t ac_max = 0x0000FFFF & ac;
+
+            if (ac_min > policy->address_min)
+            {
+                policy->address_min = ac_min;
+            }
+            if (ac_max < policy->address_max)
+            {
+                policy->address_max = ac_max;
+            }
+
+            if (caveat_states(fpc, create_address_caveat(ac_min, ac_max), MAX_ADDRESS_SET_CAVEAT_LENGTH))
+            {
+                policy->stated_addresses[policy->nb_stated_addresses++] = ac;
+            }
+        }
+        else if (strncmp((const char *)fpc, ADDRESS_SET_CAVEAT_TOKEN, strlen(ADDRESS_SET_CAVEAT_TOKEN)) == 0)
+        {
+            const address_set_t *set = find_address_set((const char *)fpc);
+
+            if (set == NULL || policy->nb_address_sets == MAX_POLICY_ADDRESS_SETS)
+            {
+                return;
+            }
+
+            address_set_t *policy_set = &policy->address_sets[policy->nb_address_sets];
+            *policy_set = *set;
+            policy->address_set_stated[policy->nb_address_sets++] =
+                    caveat_states(fpc, format_address_set(policy_set), MAX_ADDRESS_SET_CAVEAT_LENGTH);
+        }
     }
 
-    return -1;
+    memcpy(policy->token, token, token_length);
+    policy->token_length = token_length;
+    policy->hash = hash;
+    policy->epoch = epoch;
+    policy_cache_next_ = (policy_cache_next_ + 1) % NETWORK_CAPS_POLICY_CACHE_SIZE;
 }
 
 /**
- * Shim for modbus_report_slave_id()
- *
- * 1. Sends a Macaroon with the MODBUS_FC_REPORT_SLAVE_ID command
- * 2. Send a request to get the slave ID of the device (only available in
- *    serial communication)
+ * Returns a number that changes whenever a key is retired or replaced,
+ * so whatever was authorised before then must be verified again
  * */
-int modbus_report_slave_id_network_caps(modbus_t *ctx, int max_dest,
-        uint8_t *dest)
+uint32_t network_caps_keyring_epoch(void)
 {
-    if (modbus_get_debug(ctx))
-    {
-        print_shim_info("macaroons_shim", __FUNCTION__);
-    }
-
-    if (send_network_caps(ctx, MODBUS_FC_REPORT_SLAVE_ID, 0, 0) == 0)
-    {
-        return modbus_report_slave_id(ctx, max_dest, dest);
-    }
-
-    return -1;
+    return __atomic_load_n(&keyring_epoch_, __ATOMIC_ACQUIRE);
 }
 
-/* Receive the request from a modbus master */
-int modbus_receive_network_caps(modbus_t *ctx, uint8_t *req)
+/**
+ * Forgets every verified token, so the next request with each is
+ * verified in full
+ * */
+void network_caps_clear_policy_cache(void)
 {
-    return modbus_receive(ctx, req);
+    memset(policy_cache_, 0, sizeof(policy_cache_));
+    policy_cache_next_ = 0;
 }
 
-/******************
- * SERVER FUNCTIONS
- *****************/
-
+/**
+ * Initialises the server with a single root key (see
+ * network_caps_add_key() to add more)
+ * */
 int initialise_server_network_caps(modbus_t *ctx, const char *location, const char *key, const char *id)
 {
-    enum macaroon_returncode err = MACAROON_SUCCESS;
-
     if (modbus_get_debug(ctx))
     {
         print_shim_info("macaroons_shim", __FUNCTION__);
     }
 
-    key_ = (unsigned char *)key;
-    key_sz_ = strnlen(key, MAX_MACAROON_INITIALISATION_LENGTH);
-
-    id_ = (unsigned char *)id;
-    id_sz_ = strnlen(id, MAX_MACAROON_INITIALISATION_LENGTH);
-
-    location_ = (unsigned char *)location;
-    location_sz_ = strnlen(location, MAX_MACAROON_INITIALISATION_LENGTH);
-
-    server_macaroon_ = macaroon_create(location_, location_sz_,
-            key_, key_sz_, id_, id_sz_, &err);
-    if (err != MACAROON_SUCCESS)
+    /* tokens verified with other keys aren't valid any more */
+    if (keyring_write_begin() != 0)
     {
-        if(modbus_get_debug(ctx)) {
-            printf("Failed to initialise Macaroon\n");
-            printf("err: %d\n", err);
-        }
         return -1;
     }
+    __atomic_store_n(&current_key_, -1, __ATOMIC_RELEASE);
+    for (int i = 0; i < NETWORK_CAPS_KEYRING_SIZE; ++i)
+    {
+        if (keyring_[i].in_use)
+        {
+            keyring_retire_slot(i);
+        }
+    }
+    __atomic_add_fetch(&keyring_epoch_, 1, __ATOMIC_RELEASE);
+    keyring_write_end();
+    network_caps_clear_policy_cache();
 
-    return 0;
+    return network_caps_add_key(ctx, location, key, id);
 }
 
-/**
- * Process an incoming Macaroon:
- * 1. Deserialise a string
- * 2. Check if it's a valid Macaroon
- * 3. Perform verification on the Macaroon
- * */
-static int process_network_caps(modbus_t *ctx, uint8_t *tab_string, int function, uint16_t addr, int nb)
+/*
+ * A token deserialised and checked against a request by check_token():
+ * everything but its signature
+ */
+typedef struct {
+    struct macaroon *M;
+    /* NUL-terminated copies of the first party caveats */
+    unsigned char *fpcs[MAX_CAVEATS];
+    size_t num_fpcs;
+    /* the identifier then the caveats, as signed */
+    const unsigned char *signed_data[1 + MAX_CAVEATS];
+    size_t signed_data_sz[1 + MAX_CAVEATS];
+    unsigned char derived_key[NETWORK_CAPS_DERIVED_KEY_LENGTH];
+    uint32_t key_epoch;
+    uint32_t allowed_functions;
+} network_caps_token_t;
+
+static void release_token(network_caps_token_t *token)
 {
-    if (modbus_get_debug(ctx))
+    for (size_t i = 0; i < token->num_fpcs; ++i)
     {
-        print_shim_info("macaroons_shim", __FUNCTION__);
+#if defined(__freertos__)
+        vPortFree(token->fpcs[i]);
+#else
+        free(token->fpcs[i]);
+#endif
     }
+    token->num_fpcs = 0;
 
-    enum macaroon_returncode err = MACAROON_SUCCESS;
+    if (token->M != NULL)
+    {
+        macaroon_destroy(token->M);
+        token->M = NULL;
+    }
+}
 
-    unsigned char *serialised_macaroon;
-    int serialised_macaroon_length;
+/*
+ * Deserialises a token and checks its caveats against a request
+ * accessing each of ranges, which the client must have stated as the
+ * caveats fc and ar:
+ * - the identifier names a key in the keyring
+ * - the fpcs aren't mutually exclusive (e.g., READ-ONLY and WRITE-ONLY)
+ * - the requested addresses are not out of range (based on caveats)
+ * - the requested function is one of the first party caveats
+ * - the requested address range is one of the first party caveats
+ *
+ * Returns 0 if the token passes, so only its signature is left to
+ * verify, or -1 with the reason it failed (either way, the caller
+ * releases the token with release_token())
+ */
+static int check_token(modbus_t *ctx, const uint8_t *serialised_macaroon, int serialised_macaroon_length,
+        const network_caps_range_t *ranges, int nb_ranges, const unsigned char *fc, const unsigned char *ar,
+        network_caps_token_t *token, MetricsVerificationFailure_t *reason)
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
 
-    serialised_macaroon = (unsigned char *)tab_string;
-    serialised_macaroon_length = strnlen((char *)serialised_macaroon, MODBUS_MAX_STRING_LENGTH);
+    uint32_t required_functions;
+    if (range_functions(ranges, nb_ranges, &required_functions) != 0)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("> Macaroon verification: FAIL\n");
+            printf("> FUNCTION CODE OUT OF RANGE\n");
+            printf("%s\n", DISPLAY_MARKER);
+        }
+        *reason = FUNCTION_NOT_CAVEAT;
+        return -1;
+    }
 
-    unsigned char *fc = create_function_caveat_from_fc(function);
     int function_as_caveat = 0;
-
-    uint16_t ar_max = find_max_address(function, addr, nb);
-    unsigned char *ar = create_address_caveat(addr, ar_max);
     int address_as_caveat = 0;
 
-    struct macaroon *M = NULL;
-    struct macaroon_verifier *V = macaroon_verifier_create();
-
     // try to deserialise the string into a Macaroon
-    M = macaroon_deserialize(serialised_macaroon, serialised_macaroon_length, &err);
+    SPAN_BEGIN("macaroon_deserialize");
+    token->M = macaroon_deserialize(serialised_macaroon, serialised_macaroon_length, &err);
+    SPAN_END("macaroon_deserialize");
 
     if (err != MACAROON_SUCCESS)
     {
@@ -806,30 +2276,39 @@ static int process_network_caps(modbus_t *ctx, uint8_t *tab_string, int function
             printf("> FAILED TO DESERIALISE\n");
             printf("%s\n", DISPLAY_MARKER);
         }
+        *reason = DESERIALISE_FAILURE;
         return -1;
     }
 
-    if (M == NULL)
+    if (token->M == NULL)
     {
         if (modbus_get_debug(ctx))
         {
             printf("> Macaroon verification: MACAROON NOT INITIALISED\n");
             printf("%s\n", DISPLAY_MARKER);
         }
+        *reason = DESERIALISE_FAILURE;
         return -1;
     }
 
-    /**
-     * - Confirm the fpcs aren't mutually exclusive (e.g., READ-ONLY and WRITE-ONLY)
-     * - Confirm requested addresses are not out of range (based on caveats)
-     * - Add all first party caveats to the verifier
-     * - Confirm that the requested function is one of the first party caveats
-     * - Confirm that the requested address range is one of the first party caveats
-     * - Verify the Macaroon
-     * */
+    /* the identifier selects the root key */
+    macaroon_identifier(token->M, &token->signed_data[0], &token->signed_data_sz[0]);
+    if (keyring_derived_key(token->signed_data[0], token->signed_data_sz[0],
+            token->derived_key, &token->key_epoch) != 0)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("> Macaroon verification: FAIL\n");
+            printf("> UNKNOWN KEY\n");
+            printf("%s\n", DISPLAY_MARKER);
+        }
+        *reason = UNKNOWN_KEY;
+        return -1;
+    }
 
     /* count fpcs */
-    uint32_t num_fpcs = macaroon_num_first_party_caveats(M);
+    SPAN_BEGIN("extract_caveats");
+    uint32_t num_fpcs = macaroon_num_first_party_caveats(token->M);
     if (num_fpcs > MAX_CAVEATS)
     {
         if (modbus_get_debug(ctx))
@@ -838,54 +2317,173 @@ static int process_network_caps(modbus_t *ctx, uint8_t *tab_string, int function
             printf("TOO MANY CAVEATS\n");
             printf("%s\n", DISPLAY_MARKER);
         }
+        SPAN_END("extract_caveats");
+        *reason = TOO_MANY_CAVEATS;
         return -1;
     }
 
     /* extract fpcs */
-    unsigned char *fpcs[MAX_CAVEATS];
     const unsigned char *fpc;
     size_t fpc_sz;
-    for (size_t i = 0; i < num_fpcs; ++i)
+    for (; token->num_fpcs < num_fpcs; ++token->num_fpcs)
     {
-        macaroon_first_party_caveat(M, i, &fpc, &fpc_sz);
+        size_t i = token->num_fpcs;
+        macaroon_first_party_caveat(token->M, i, &fpc, &fpc_sz);
+        token->signed_data[1 + i] = fpc;
+        token->signed_data_sz[1 + i] = fpc_sz;
 #if defined(__freertos__)
-        fpcs[i] = (unsigned char *)pvPortMalloc((fpc_sz + 1) * sizeof(unsigned char));
+        token->fpcs[i] = (unsigned char *)pvPortMalloc((fpc_sz + 1) * sizeof(unsigned char));
 #else
-        fpcs[i] = (unsigned char *)malloc((fpc_sz + 1) * sizeof(unsigned char));
+        token->fpcs[i] = (unsigned char *)malloc((fpc_sz + 1) * sizeof(unsigned char));
 #endif
-        memset(fpcs[i], 0, (fpc_sz + 1) * sizeof(unsigned char));
-        strncpy((char *)fpcs[i], (char *)fpc, fpc_sz);
+        memset(token->fpcs[i], 0, (fpc_sz + 1) * sizeof(unsigned char));
+        strncpy((char *)token->fpcs[i], (char *)fpc, fpc_sz);
     }
+    SPAN_END("extract_caveats");
 
     // functions: perform mutual exclusion check
-    if (check_function_caveats(fpcs, num_fpcs) != 0)
+    SPAN_BEGIN("check_function_caveats");
+    int function_rc = check_function_caveats(token->fpcs, num_fpcs, &token->allowed_functions);
+    SPAN_END("check_function_caveats");
+    if (function_rc != 0)
     {
         if (modbus_get_debug(ctx))
         {
             printf("> Function caveats are mutually exclusive\n");
             printf("%s\n", DISPLAY_MARKER);
         }
+        *reason = EXCLUSIVE_FUNCTION_CAVEATS;
         return -1;
     }
 
     // addresses: perform range check
-    if (check_address_caveats(fpcs, num_fpcs, ar) != 0)
+    SPAN_BEGIN("check_address_caveats");
+    int address_rc = 0;
+    for (int i = 0; i < nb_ranges && address_rc == 0; ++i)
+    {
+        uint16_t ar_max = find_max_address(ranges[i].function, ranges[i].addr, ranges[i].nb);
+        address_rc = check_address_caveats(token->fpcs, num_fpcs, ranges[i].addr, ar_max);
+        if (address_rc == 0)
+        {
+            address_rc = check_address_set_caveats(token->fpcs, num_fpcs, ranges[i].function, ranges[i].addr, ar_max);
+        }
+    }
+    SPAN_END("check_address_caveats");
+    if (address_rc != 0)
     {
         if (modbus_get_debug(ctx))
         {
             printf("> Requested addresses are out of range\n");
             printf("%s\n", DISPLAY_MARKER);
         }
+        *reason = ADDRESS_OUT_OF_RANGE;
+        return -1;
+    }
+
+    /* check if the requested function and address range are caveats */
+    for (size_t i = 0; i < num_fpcs; ++i)
+    {
+        if (strncmp((char *)token->fpcs[i], (char *)fc, MAX_CAVEAT_LENGTH) == 0)
+        {
+            function_as_caveat = 1;
+        }
+        else if (strncmp((char *)token->fpcs[i], (char *)ar, MAX_ADDRESS_SET_CAVEAT_LENGTH) == 0)
+        {
+            address_as_caveat = 1;
+        }
+    }
+
+    // confirm the requested function is a caveat, and that every other
+    // function caveat allows it
+    if (!function_as_caveat || (token->allowed_functions & required_functions) != required_functions)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("> Function not protected as a Macaroon caveat\n");
+            printf("%s\n", DISPLAY_MARKER);
+        }
+        *reason = FUNCTION_NOT_CAVEAT;
+        return -1;
+    }
+
+    // confirm the requested addresses is a caveat
+    if (!address_as_caveat)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("> Address range not protected as a Macaroon caveat\n");
+            printf("%s\n", DISPLAY_MARKER);
+        }
+        *reason = ADDRESS_NOT_CAVEAT;
         return -1;
     }
 
+    return 0;
+}
+
+/**
+ * Process an incoming Macaroon:
+ * 1. Deserialise a string
+ * 2. Check if it's a valid Macaroon
+ * 3. Perform verification on the Macaroon
+ *
+ * for a request accessing each of ranges, which the client must have
+ * stated as the caveats fc and ar (both freed here)
+ * */
+static int process_network_caps_ranges(modbus_t *ctx, uint8_t *tab_string,
+        const network_caps_range_t *ranges, int nb_ranges, unsigned char *fc, unsigned char *ar)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
+
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+    int rc = -1;
+
+    unsigned char *serialised_macaroon;
+    int serialised_macaroon_length;
+
+    /* released on every path, at cleanup */
+    network_caps_token_t token = { NULL };
+    struct macaroon_verifier *V = NULL;
+
+    serialised_macaroon = (unsigned char *)tab_string;
+    serialised_macaroon_length = strnlen((char *)serialised_macaroon, MODBUS_MAX_STRING_LENGTH);
+
+    // a token that has been verified is authorised by its policy
+    SPAN_BEGIN("check_policy");
+    uint32_t token_hash = hash_bytes(serialised_macaroon, serialised_macaroon_length);
+    int policy_rc = check_policy(find_policy(serialised_macaroon, serialised_macaroon_length, token_hash),
+            ranges, nb_ranges, ar);
+    SPAN_END("check_policy");
+    if (policy_rc == 0)
+    {
+        if (modbus_get_debug(ctx))
+        {
+            printf("> Macaroon verification: PASS (cached policy)\n");
+            printf("%s\n", DISPLAY_MARKER);
+        }
+        METRICS_VERIFICATION_SUCCESS();
+        rc = 0;
+        goto cleanup;
+    }
+
+    MetricsVerificationFailure_t reason;
+    if (check_token(ctx, serialised_macaroon, serialised_macaroon_length,
+            ranges, nb_ranges, fc, ar, &token, &reason) != 0)
+    {
+        METRICS_VERIFICATION_FAILURE(reason);
+        goto cleanup;
+    }
+
     /* add fpcs to the verifier */
-    for (size_t i = 0; i < num_fpcs; ++i)
+    V = macaroon_verifier_create();
+    for (size_t i = 0; i < token.num_fpcs; ++i)
     {
-        // add fpcs to verifier
         macaroon_verifier_satisfy_exact(
-                V, (const unsigned char *)fpcs[i],
-                strnlen((char *)fpcs[i], MAX_CAVEAT_LENGTH), &err);
+                V, (const unsigned char *)token.fpcs[i],
+                strnlen((char *)token.fpcs[i], MAX_ADDRESS_SET_CAVEAT_LENGTH), &err);
 
         if (err != MACAROON_SUCCESS)
         {
@@ -894,25 +2492,39 @@ static int process_network_caps(modbus_t *ctx, uint8_t *tab_string, int function
                 printf("> Failed to add caveat to verifier\n");
                 printf("%s\n", DISPLAY_MARKER);
             }
-            return -1;
+            METRICS_VERIFICATION_FAILURE(VERIFIER_CAVEAT_FAILURE);
+            goto cleanup;
         }
+    }
 
-        /* check if the requested function and address range are caveats */
-        if (strncmp((char *)fpcs[i], (char *)fc, MAX_CAVEAT_LENGTH) == 0)
-        {
-            function_as_caveat = 1;
-        }
-        else if (strncmp((char *)fpcs[i], (char *)ar, MAX_CAVEAT_LENGTH) == 0)
+    // perform verification
+    SPAN_BEGIN("macaroon_verify");
+    macaroon_verify_raw(V, token.M, token.derived_key, sizeof(token.derived_key), NULL, 0, &err);
+    SPAN_END("macaroon_verify");
+    if (err != MACAROON_SUCCESS)
+    {
+        if (modbus_get_debug(ctx))
         {
-            address_as_caveat = 1;
+            printf("> Macaroon verification: FAIL\n");
+            printf("%s\n", DISPLAY_MARKER);
         }
+        METRICS_VERIFICATION_FAILURE(SIGNATURE_FAILURE);
+        goto cleanup;
+    }
 
-#if defined(__freertos__)
-        vPortFree(fpcs[i]);
-#else
-        free(fpcs[i]);
-#endif
+    if (modbus_get_debug(ctx))
+    {
+        printf("> Macaroon verification: PASS\n");
+        printf("%s\n", DISPLAY_MARKER);
     }
+    METRICS_VERIFICATION_SUCCESS();
+
+    add_policy(serialised_macaroon, serialised_macaroon_length, token_hash, token.key_epoch,
+            token.fpcs, token.num_fpcs, token.allowed_functions);
+    rc = 0;
+
+cleanup:
+    release_token(&token);
 
 #if defined(__freertos__)
     vPortFree(fc);
@@ -922,50 +2534,58 @@ static int process_network_caps(modbus_t *ctx, uint8_t *tab_string, int function
     free(ar);
 #endif
 
-    // confirm the requested function is a caveat
-    if (!function_as_caveat)
+    if (V != NULL)
     {
-        if (modbus_get_debug(ctx))
-        {
-            printf("> Function not protected as a Macaroon caveat\n");
-            printf("%s\n", DISPLAY_MARKER);
-        }
-        return -1;
+        macaroon_verifier_destroy(V);
     }
 
-    // confirm the requested addresses is a caveat
-    if (!address_as_caveat)
-    {
-        if (modbus_get_debug(ctx))
-        {
-            printf("> Address range not protected as a Macaroon caveat\n");
-            printf("%s\n", DISPLAY_MARKER);
-        }
-        return -1;
-    }
+    return rc;
+}
 
-    // perform verification
-    macaroon_verify(V, M, key_, key_sz_, NULL, 0, &err);
-    if (err != MACAROON_SUCCESS)
-    {
-        if (modbus_get_debug(ctx))
-        {
-            printf("> Macaroon verification: FAIL\n");
-            printf("%s\n", DISPLAY_MARKER);
-        }
+/**
+ * Process an incoming Macaroon for a request for function on nb
+ * addresses from addr
+ * */
+static int process_network_caps(modbus_t *ctx, uint8_t *tab_string, int function, uint16_t addr, int nb)
+{
+    network_caps_range_t range = { function, addr, nb };
+    uint16_t ar_max = find_max_address(function, addr, nb);
 
-        return -1;
-    }
+    return process_network_caps_ranges(ctx, tab_string, &range, 1,
+            create_function_caveat_from_fc(function), create_address_caveat(addr, ar_max));
+}
 
-    if (modbus_get_debug(ctx))
+/*
+ * Sets range to the addresses a request for function on nb addresses from
+ * addr (and nb_wr from addr_wr) accesses, as its Macaroon must authorise
+ */
+static void request_range(int function, uint16_t addr, int nb, uint16_t addr_wr, int nb_wr,
+        network_caps_range_t *range)
+{
+    range->function = function;
+    range->addr = addr;
+    range->nb = nb;
+
+    /**
+     * process_network_caps() needs an address range, which is tricky
+     * for write_and_read_registers, since it has two ranges
+     *
+     * we need to find the entire range that the function is trying to access
+     * since there's no way to handle disjoint caveats
+     *
+     * based on modbus.c, addr = write_addr, nb = write_nb, addr_wr = read_addr, nb_wr = read_nb
+     * */
+    if (function == MODBUS_FC_WRITE_AND_READ_REGISTERS)
     {
-        printf("> Macaroon verification: PASS\n");
-        printf("%s\n", DISPLAY_MARKER);
+        uint16_t write_addr = addr;
+        uint16_t read_addr = addr_wr;
+        int write_nb = nb;
+        int read_nb = nb_wr;
+        uint16_t write_addr_max = find_max_address(MODBUS_FC_WRITE_AND_READ_REGISTERS, write_addr, write_nb);
+        uint16_t read_addr_max = find_max_address(MODBUS_FC_WRITE_AND_READ_REGISTERS, read_addr, read_nb);
+        range->addr = (write_addr < read_addr) ? write_addr : read_addr;
+        range->nb = ((write_addr < read_addr) ? (read_addr_max - write_addr) : (write_addr_max - read_addr)) / 2;
     }
-
-    macaroon_destroy(M);
-    macaroon_verifier_destroy(V);
-    return 0;
 }
 
 /**
@@ -1023,80 +2643,390 @@ int modbus_preprocess_request_network_caps(modbus_t *ctx, uint8_t *req, modbus_m
 
         case MODBUS_FC_READ_STRING:
             {
-                enum macaroon_returncode err = MACAROON_SUCCESS;
+                /**
+                 * Feed the current key's serialised root Macaroon (serialised
+                 * when the key was added) into tab_string then continue to
+                 * process the request
+                 * */
+                keyring_root_token(mb_mapping->tab_string);
+
+                if (modbus_get_debug(ctx))
+                {
+                    printf("%s\n", DISPLAY_MARKER);
+                }
+            }
+            break;
 
-                size_t serialised_macaroon_length;
-                unsigned char *serialised_macaroon;
+        default:
+            {
+                network_caps_range_t range;
+                request_range(function, addr, nb, addr_wr, nb_wr, &range);
 
                 /**
-                 * Serialise the server Macaroon and feed it into tab_string
-                 * then continue to process the request
+                 * Extract the previously-received Macaroon
+                 * If verification fails, return -1
                  * */
-                if (server_macaroon_ != NULL)
+                if (process_network_caps(ctx, mb_mapping->tab_string, range.function, range.addr, range.nb) != 0)
                 {
-                    serialised_macaroon_length = macaroon_serialize_size_hint(server_macaroon_, MACAROON_V1);
-#if defined(__freertos__)
-                    serialised_macaroon = (unsigned char *)pvPortMalloc(serialised_macaroon_length * sizeof(unsigned char));
-#else
-                    serialised_macaroon = (unsigned char *)malloc(serialised_macaroon_length * sizeof(unsigned char));
+                    return -1;
+                }
+            }
+    }
+
+    return 0;
+}
+
+/**
+ * Sets range to the addresses a received request accesses, as its
+ * Macaroon must authorise them (e.g., to verify a batch of requests with
+ * modbus_verify_requests_network_caps())
+ *
+ * Returns -1 if the request isn't verified against a Macaroon
+ * (WRITE_STRING, which sends one, or READ_STRING, which fetches one)
+ * */
+int network_caps_request_range(modbus_t *ctx, uint8_t *req, network_caps_range_t *range)
+{
+    int offset;
+    int slave_id;
+    int function;
+    uint16_t addr;
+    int nb;
+    uint16_t addr_wr;
+    int nb_wr;
+
+    modbus_decompose_request(ctx, req, &offset, &slave_id, &function, &addr, &nb, &addr_wr, &nb_wr);
+
+    if (function == MODBUS_FC_WRITE_STRING || function == MODBUS_FC_READ_STRING)
+    {
+        return -1;
+    }
+
+    request_range(function, addr, nb, addr_wr, nb_wr, range);
+
+    return 0;
+}
+
+/**
+ * Verifies the previously-received Macaroon in tab_string against a
+ * request for function on nb addresses from addr, for servers that answer
+ * some requests themselves (e.g., subscriptions) rather than through
+ * modbus_preprocess_request_network_caps()
+ * */
+int modbus_verify_network_caps(modbus_t *ctx, uint8_t *tab_string, int function, uint16_t addr, int nb)
+{
+    return process_network_caps(ctx, tab_string, function, addr, nb);
+}
+
+/**
+ * Verifies the previously-received Macaroon in tab_string against a
+ * request accessing every one of ranges (e.g., a batch read), which must
+ * have been built by network_caps_build_batch_token() for the same ranges
+ *
+ * Returns 0 if the request is authorised, or -1 if not, except that
+ * ranges no caveat can state (so no Macaroon authorises them) return
+ * MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, to answer the request with
+ * */
+int modbus_verify_batch_network_caps(modbus_t *ctx, uint8_t *tab_string,
+        const network_caps_range_t *ranges, int nb_ranges)
+{
+    uint32_t functions;
+
+    if (range_functions(ranges, nb_ranges, &functions) != 0)
+    {
+        return -1;
+    }
+
+    unsigned char *ar = create_address_set_caveat(ranges, nb_ranges);
+    if (ar == NULL)
+    {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    return process_network_caps_ranges(ctx, tab_string, ranges, nb_ranges,
+            create_function_caveat_from_bitfield(functions), ar);
+}
+
+/*
+ * Requests verified together by modbus_verify_requests_network_caps(): a few
+ * times the HMAC lanes, so lanes freed by short chains can be refilled
+ */
+#ifndef NETWORK_CAPS_BATCH_SIZE
+#define NETWORK_CAPS_BATCH_SIZE 32
 #endif
 
-                    macaroon_serialize(server_macaroon_, MACAROON_V1,
-                            serialised_macaroon, serialised_macaroon_length, &err);
+typedef struct {
+    network_caps_token_t tokens[NETWORK_CAPS_BATCH_SIZE];
+    network_caps_hmac_chain_t chains[NETWORK_CAPS_BATCH_SIZE];
+    /* the request each chain verifies */
+    int requests[NETWORK_CAPS_BATCH_SIZE];
+} network_caps_batch_t;
+
+/*
+ * Returns 1 if a checked token's signature is all macaroon_verify_raw()
+ * has left to verify, as for every token a server issues: it would also
+ * need discharges for third party caveats, and the verifier is satisfied
+ * with the first party caveats as C strings
+ */
+static int only_signature_left(const network_caps_token_t *token)
+{
+    if (macaroon_num_third_party_caveats(token->M) != 0)
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; i < token->num_fpcs; ++i)
+    {
+        if (strlen((const char *)token->fpcs[i]) != token->signed_data_sz[1 + i])
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Computes a chain with macaroon_hmac(), as macaroon_verify_raw() does
+ */
+static int hmac_chain(network_caps_hmac_chain_t *chain)
+{
+    unsigned char key[NETWORK_CAPS_HMAC_LENGTH];
+    unsigned char hmac[NETWORK_CAPS_HMAC_LENGTH];
+
+    memcpy(key, chain->key, sizeof(key));
+    for (size_t i = 0; i < chain->nb_messages; ++i)
+    {
+        if (macaroon_hmac(key, sizeof(key), chain->messages[i], chain->message_sz[i], hmac) != 0)
+        {
+            return -1;
+        }
+        memcpy(key, hmac, sizeof(key));
+    }
+    memcpy(chain->result, key, sizeof(key));
+
+    return 0;
+}
+
+/*
+ * Returns 1 if network_caps_hmac_chains() computes the same signatures
+ * as macaroon_hmac() (checked once), or 0 if a batch's signatures must
+ * be computed one at a time
+ */
+static int hmac_chains_usable(void)
+{
+    static int usable_;
+
+    int usable = __atomic_load_n(&usable_, __ATOMIC_ACQUIRE);
+    if (usable == 0)
+    {
+        /* the last is longer than a SHA-256 block */
+        static const char *messages[] = {
+            "network caps",
+            "function = 00000000000000000000000000001000",
+            "addresses = 3:0-99,3:200-299,4:0-99,4:200-299,4:400-499,4:600-699"
+        };
+        const unsigned char *message_ptrs[3];
+        size_t message_sz[3];
+        network_caps_hmac_chain_t lanes;
+        network_caps_hmac_chain_t scalar;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            message_ptrs[i] = (const unsigned char *)messages[i];
+            message_sz[i] = strlen(messages[i]);
+        }
+
+        for (int i = 0; i < NETWORK_CAPS_HMAC_LENGTH; ++i)
+        {
+            lanes.key[i] = (unsigned char)i;
+        }
+        lanes.messages = message_ptrs;
+        lanes.message_sz = message_sz;
+        lanes.nb_messages = 3;
+        scalar = lanes;
+
+        network_caps_hmac_chains(&lanes, 1);
+        usable = hmac_chain(&scalar) == 0 &&
+                memcmp(lanes.result, scalar.result, NETWORK_CAPS_HMAC_LENGTH) == 0 ? 1 : -1;
+        __atomic_store_n(&usable_, usable, __ATOMIC_RELEASE);
+    }
+
+    return usable == 1;
+}
+
+/*
+ * Compares signatures in constant time
+ */
+static int signatures_equal(const unsigned char *a, const unsigned char *b)
+{
+    unsigned char diff = 0;
+
+    for (int i = 0; i < NETWORK_CAPS_HMAC_LENGTH; ++i)
+    {
+        diff |= a[i] ^ b[i];
+    }
+
+    return diff == 0;
+}
+
+/**
+ * Verifies the Macaroons of a batch of requests (e.g., one from each of
+ * a server's clients) together, and sets verdicts[i] to 0 if requests[i]
+ * is authorised, or -1 if not
+ *
+ * Every token is checked as modbus_verify_network_caps() would, but the
+ * signatures are computed side by side, several HMAC chains at a time
+ * (see network_caps_hmac.c).  The tokens that pass are cached, so the
+ * requests then pass their own verification (e.g., by
+ * modbus_preprocess_request_network_caps()) without verifying the token
+ * again.  Nothing is recorded in the metrics here, since each request is
+ * counted when it's verified itself.
+ *
+ * Returns the number of requests authorised, or -1 if out of memory
+ * */
+int modbus_verify_requests_network_caps(modbus_t *ctx, const network_caps_request_t *requests,
+        int nb_requests, int *verdicts)
+{
+    if (modbus_get_debug(ctx))
+    {
+        print_shim_info("macaroons_shim", __FUNCTION__);
+    }
 
-                    if (err != MACAROON_SUCCESS)
-                    {
-                        printf("err: %d\n", err);
-                        return -1;
-                    }
-                    strncpy((char *)mb_mapping->tab_string, (char *)serialised_macaroon, serialised_macaroon_length);
 #if defined(__freertos__)
-                    vPortFree(serialised_macaroon);
+    network_caps_batch_t *batch = (network_caps_batch_t *)pvPortMalloc(sizeof(network_caps_batch_t));
 #else
-                    free(serialised_macaroon);
+    network_caps_batch_t *batch = (network_caps_batch_t *)malloc(sizeof(network_caps_batch_t));
 #endif
-                }
+    if (batch == NULL)
+    {
+        return -1;
+    }
 
-                if (modbus_get_debug(ctx))
+    int usable = hmac_chains_usable();
+    int nb_authorised = 0;
+
+    for (int first = 0; first < nb_requests; first += NETWORK_CAPS_BATCH_SIZE)
+    {
+        int last = first + NETWORK_CAPS_BATCH_SIZE < nb_requests ? first + NETWORK_CAPS_BATCH_SIZE : nb_requests;
+        int nb_chains = 0;
+
+        /* check everything but the signatures, as process_network_caps_ranges() */
+        SPAN_BEGIN("check_tokens");
+        for (int i = first; i < last; ++i)
+        {
+            const network_caps_range_t *range = &requests[i].range;
+            const uint8_t *token = requests[i].tab_string;
+            int token_length = strnlen((const char *)token, MODBUS_MAX_STRING_LENGTH);
+            uint16_t ar_max = find_max_address(range->function, range->addr, range->nb);
+            unsigned char *fc = create_function_caveat_from_fc(range->function);
+            unsigned char *ar = create_address_caveat(range->addr, ar_max);
+
+            verdicts[i] = -1;
+
+            if (check_policy(find_policy(token, token_length, hash_bytes(token, token_length)),
+                    range, 1, ar) == 0)
+            {
+                verdicts[i] = 0;
+                ++nb_authorised;
+            }
+            else
+            {
+                network_caps_token_t *checked = &batch->tokens[nb_chains];
+                network_caps_hmac_chain_t *chain = &batch->chains[nb_chains];
+                MetricsVerificationFailure_t reason;
+
+                checked->M = NULL;
+                checked->num_fpcs = 0;
+
+                if (check_token(ctx, token, token_length, range, 1, fc, ar, checked, &reason) == 0 &&
+                        only_signature_left(checked))
                 {
-                    printf("%s\n", DISPLAY_MARKER);
+                    memcpy(chain->key, checked->derived_key, NETWORK_CAPS_HMAC_LENGTH);
+                    chain->messages = checked->signed_data;
+                    chain->message_sz = checked->signed_data_sz;
+                    chain->nb_messages = 1 + checked->num_fpcs;
+                    batch->requests[nb_chains++] = i;
+                }
+                else
+                {
+                    release_token(checked);
                 }
             }
-            break;
 
-        default:
+#if defined(__freertos__)
+            vPortFree(fc);
+            vPortFree(ar);
+#else
+            free(fc);
+            free(ar);
+#endif
+        }
+        SPAN_END("check_tokens");
+
+        /* then compute the signatures together */
+        SPAN_BEGIN("hmac_chains");
+        if (usable)
+        {
+            network_caps_hmac_chains(batch->chains, nb_chains);
+        }
+        else
+        {
+            for (int c = 0; c < nb_chains; ++c)
             {
-                /**
-                 * process_network_caps() needs an address range, which is tricky
-                 * for write_and_read_registers, since it has two ranges
-                 *
-                 * we need to find the entire range that the function is trying to access
-                 * since there's no way to handle disjoint caveats
-                 *
-                 * based on modbus.c, addr = write_addr, nb = write_nb, addr_wr = read_addr, nb_wr = read_nb
-                 * */
-                if (function == MODBUS_FC_WRITE_AND_READ_REGISTERS)
+                if (hmac_chain(&batch->chains[c]) != 0)
                 {
-                    uint16_t write_addr = addr;
-                    uint16_t read_addr = addr_wr;
-                    int write_nb = nb;
-                    int read_nb = nb_wr;
-                    uint16_t write_addr_max = find_max_address(MODBUS_FC_WRITE_AND_READ_REGISTERS, write_addr, write_nb);
-                    uint16_t read_addr_max = find_max_address(MODBUS_FC_WRITE_AND_READ_REGISTERS, read_addr, read_nb);
-                    addr = (write_addr < read_addr) ? write_addr : read_addr;
-                    nb = ((write_addr < read_addr) ? (read_addr_max - write_addr) : (write_addr_max - read_addr)) / 2;
+                    /* matches no signature */
+                    memset(batch->chains[c].result, 0, NETWORK_CAPS_HMAC_LENGTH);
                 }
+            }
+        }
+        SPAN_END("hmac_chains");
 
-                /**
-                 * Extract the previously-received Macaroon
-                 * If verification fails, return -1
-                 * */
-                if (process_network_caps(ctx, mb_mapping->tab_string, function, addr, nb) != 0)
+        for (int c = 0; c < nb_chains; ++c)
+        {
+            network_caps_token_t *checked = &batch->tokens[c];
+            int i = batch->requests[c];
+            const unsigned char *signature;
+            size_t signature_sz;
+
+            macaroon_signature(checked->M, &signature, &signature_sz);
+            if (signature_sz == NETWORK_CAPS_HMAC_LENGTH &&
+                    signatures_equal(signature, batch->chains[c].result))
+            {
+                const uint8_t *token = requests[i].tab_string;
+                int token_length = strnlen((const char *)token, MODBUS_MAX_STRING_LENGTH);
+                uint32_t token_hash = hash_bytes(token, token_length);
+
+                verdicts[i] = 0;
+                ++nb_authorised;
+
+                /* clients may share a token */
+                if (find_policy(token, token_length, token_hash) == NULL)
                 {
-                    return -1;
+                    add_policy(token, token_length, token_hash, checked->key_epoch,
+                            checked->fpcs, checked->num_fpcs, checked->allowed_functions);
                 }
             }
+
+            release_token(checked);
+        }
+
+        if (modbus_get_debug(ctx))
+        {
+            for (int i = first; i < last; ++i)
+            {
+                printf("> Macaroon verification (batch, %s): %s\n", network_caps_hmac_backend(),
+                        verdicts[i] == 0 ? "PASS" : "FAIL");
+            }
+            printf("%s\n", DISPLAY_MARKER);
+        }
     }
 
-    return 0;
+#if defined(__freertos__)
+    vPortFree(batch);
+#else
+    free(batch);
+#endif
+
+    return nb_authorised;
 }
@@ -0,0 +1,617 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/**
+ * Multi-lane HMAC-SHA256 chains
+ *
+ * Each link of a Macaroon's signature chain is keyed with the last, so
+ * one chain can't be split up, but the chains of different tokens are
+ * independent.  A batch of chains is spread over LANES lanes: each step
+ * computes the next link of every lane's chain, with the SHA-256 blocks
+ * of all the lanes compressed together, and a lane whose chain is done
+ * takes the next one.
+ *
+ * The blocks are compressed with:
+ * - SHA-NI (x86): the SHA-256 instructions, one lane at a time
+ * - AVX2 (x86): the eight lanes in the 32-bit elements of 256-bit registers
+ * - otherwise: the lanes in plain C, laid out (an array element per lane)
+ *   so that the compiler can vectorise it for the target
+ *
+ * The x86 code is compiled for its extension with target attributes, and
+ * chosen at run time, so the library still runs on any x86 CPU.
+ * */
+
+#include "network_caps_hmac.h"
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define NETWORK_CAPS_HMAC_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/* SHA-256 blocks compressed at a time */
+#define LANES 8
+
+#define BLOCK_LENGTH 64
+
+/*
+ * Compresses blocks[l] into the state of lane l (state[i][l] is word i),
+ * for each lane with a block: lanes with NULL blocks may be changed
+ */
+typedef void (*compress_lanes_t)(uint32_t state[8][LANES], const uint8_t *const blocks[LANES]);
+
+typedef struct {
+    const char *name;
+    compress_lanes_t compress;
+    /* set if compress leaves lanes without a block alone */
+    int skips_idle_lanes;
+} backend_t;
+
+static const uint32_t iv_[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t k_[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* compressed in lanes without a block, by the vector code */
+static const uint8_t zero_block_[BLOCK_LENGTH];
+
+static uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+    store_be32(p, (uint32_t)(v >> 32));
+    store_be32(p + 4, (uint32_t)v);
+}
+
+/*********************
+ * PORTABLE BACKEND
+ ********************/
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define EP0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define EP1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SIG0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SIG1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static void compress_lanes_portable(uint32_t state[8][LANES], const uint8_t *const blocks[LANES])
+{
+    uint32_t w[64][LANES];
+    uint32_t v[8][LANES];
+
+    for (int t = 0; t < 16; ++t)
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            w[t][l] = blocks[l] != NULL ? load_be32(blocks[l] + 4 * t) : 0;
+        }
+    }
+
+    for (int t = 16; t < 64; ++t)
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            w[t][l] = SIG1(w[t - 2][l]) + w[t - 7][l] + SIG0(w[t - 15][l]) + w[t - 16][l];
+        }
+    }
+
+    memcpy(v, state, sizeof(v));
+
+    for (int t = 0; t < 64; ++t)
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            uint32_t t1 = v[7][l] + EP1(v[4][l]) + CH(v[4][l], v[5][l], v[6][l]) + k_[t] + w[t][l];
+            uint32_t t2 = EP0(v[0][l]) + MAJ(v[0][l], v[1][l], v[2][l]);
+
+            v[7][l] = v[6][l];
+            v[6][l] = v[5][l];
+            v[5][l] = v[4][l];
+            v[4][l] = v[3][l] + t1;
+            v[3][l] = v[2][l];
+            v[2][l] = v[1][l];
+            v[1][l] = v[0][l];
+            v[0][l] = t1 + t2;
+        }
+    }
+
+    for (int i = 0; i < 8; ++i)
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            state[i][l] += v[i][l];
+        }
+    }
+}
+
+#if defined(NETWORK_CAPS_HMAC_X86)
+
+/*********************
+ * AVX2 BACKEND
+ ********************/
+
+#define ROTR_256(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define XOR3_256(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define ADD_256(x, y) _mm256_add_epi32((x), (y))
+
+__attribute__((target("avx2")))
+static void compress_lanes_avx2(uint32_t state[8][LANES], const uint8_t *const blocks[LANES])
+{
+    const uint8_t *b[LANES];
+    __m256i w[16];
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        b[l] = blocks[l] != NULL ? blocks[l] : zero_block_;
+    }
+
+    for (int t = 0; t < 16; ++t)
+    {
+        w[t] = _mm256_setr_epi32(
+                (int)load_be32(b[0] + 4 * t), (int)load_be32(b[1] + 4 * t),
+                (int)load_be32(b[2] + 4 * t), (int)load_be32(b[3] + 4 * t),
+                (int)load_be32(b[4] + 4 * t), (int)load_be32(b[5] + 4 * t),
+                (int)load_be32(b[6] + 4 * t), (int)load_be32(b[7] + 4 * t));
+    }
+
+    __m256i a = _mm256_loadu_si256((const __m256i *)state[0]);
+    __m256i bb = _mm256_loadu_si256((const __m256i *)state[1]);
+    __m256i c = _mm256_loadu_si256((const __m256i *)state[2]);
+    __m256i d = _mm256_loadu_si256((const __m256i *)state[3]);
+    __m256i e = _mm256_loadu_si256((const __m256i *)state[4]);
+    __m256i f = _mm256_loadu_si256((const __m256i *)state[5]);
+    __m256i g = _mm256_loadu_si256((const __m256i *)state[6]);
+    __m256i h = _mm256_loadu_si256((const __m256i *)state[7]);
+
+    for (int t = 0; t < 64; ++t)
+    {
+        if (t >= 16)
+        {
+            __m256i w2 = w[(t - 2) & 15];
+            __m256i w15 = w[(t - 15) & 15];
+            __m256i s1 = XOR3_256(ROTR_256(w2, 17), ROTR_256(w2, 19), _mm256_srli_epi32(w2, 10));
+            __m256i s0 = XOR3_256(ROTR_256(w15, 7), ROTR_256(w15, 18), _mm256_srli_epi32(w15, 3));
+            w[t & 15] = ADD_256(ADD_256(s1, w[(t - 7) & 15]), ADD_256(s0, w[t & 15]));
+        }
+
+        __m256i ep1 = XOR3_256(ROTR_256(e, 6), ROTR_256(e, 11), ROTR_256(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = ADD_256(ADD_256(h, ep1), ADD_256(ch, ADD_256(_mm256_set1_epi32((int)k_[t]), w[t & 15])));
+        __m256i ep0 = XOR3_256(ROTR_256(a, 2), ROTR_256(a, 13), ROTR_256(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, bb), _mm256_and_si256(c, _mm256_or_si256(a, bb)));
+        __m256i t2 = ADD_256(ep0, maj);
+
+        h = g;
+        g = f;
+        f = e;
+        e = ADD_256(d, t1);
+        d = c;
+        c = bb;
+        bb = a;
+        a = ADD_256(t1, t2);
+    }
+
+    __m256i v[8] = { a, bb, c, d, e, f, g, h };
+    for (int i = 0; i < 8; ++i)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i *)state[i]);
+        _mm256_storeu_si256((__m256i *)state[i], ADD_256(s, v[i]));
+    }
+}
+
+/*********************
+ * SHA-NI BACKEND
+ ********************/
+
+__attribute__((target("sha,sse4.1")))
+static void compress_sha_ni(uint32_t digest[8], const uint8_t *block)
+{
+    const __m128i shuffle = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i msg[4];
+
+    /* the instructions take the state as ABEF and CDGH */
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&digest[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&digest[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+
+    for (int i = 0; i < 16; ++i)
+    {
+        if (i < 4)
+        {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block + 16 * i)), shuffle);
+        }
+        else
+        {
+            /* w[t] = sig1(w[t-2]) + w[t-7] + sig0(w[t-15]) + w[t-16] */
+            __m128i m = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+            m = _mm_add_epi32(m, _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+            msg[i & 3] = _mm_sha256msg2_epu32(m, msg[(i + 3) & 3]);
+        }
+
+        __m128i wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *)&k_[4 * i]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *)&digest[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *)&digest[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+/* the SHA instructions are fast enough to take the lanes in turn */
+static void compress_lanes_sha_ni(uint32_t state[8][LANES], const uint8_t *const blocks[LANES])
+{
+    for (int l = 0; l < LANES; ++l)
+    {
+        if (blocks[l] == NULL)
+        {
+            continue;
+        }
+
+        uint32_t digest[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            digest[i] = state[i][l];
+        }
+        compress_sha_ni(digest, blocks[l]);
+        for (int i = 0; i < 8; ++i)
+        {
+            state[i][l] = digest[i];
+        }
+    }
+}
+
+static int cpu_has_sha_ni(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3))
+    {
+        return 0;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        return 0;
+    }
+
+    /* CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29] */
+    return (ebx >> 29) & 1;
+}
+
+#endif /* NETWORK_CAPS_HMAC_X86 */
+
+static const backend_t backend_portable_ = { "portable", compress_lanes_portable, 0 };
+#if defined(NETWORK_CAPS_HMAC_X86)
+static const backend_t backend_avx2_ = { "avx2", compress_lanes_avx2, 0 };
+static const backend_t backend_sha_ni_ = { "sha-ni", compress_lanes_sha_ni, 1 };
+#endif
+
+/* chosen on first use */
+static const backend_t *backend_;
+
+static const backend_t *select_backend(void)
+{
+    const backend_t *backend = __atomic_load_n(&backend_, __ATOMIC_ACQUIRE);
+
+    if (backend == NULL)
+    {
+        backend = &backend_portable_;
+#if defined(NETWORK_CAPS_HMAC_X86)
+        if (cpu_has_sha_ni())
+        {
+            backend = &backend_sha_ni_;
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            backend = &backend_avx2_;
+        }
+#endif
+        __atomic_store_n(&backend_, backend, __ATOMIC_RELEASE);
+    }
+
+    return backend;
+}
+
+const char *network_caps_hmac_backend(void)
+{
+    return select_backend()->name;
+}
+
+/*********************
+ * HMAC
+ ********************/
+
+/*
+ * Compresses blocks[l] into lane l of state, leaving lanes without a
+ * block as they were
+ */
+static void compress_some(const backend_t *backend, uint32_t state[8][LANES], const uint8_t *const blocks[LANES])
+{
+    uint32_t saved[8][LANES];
+
+    if (backend->skips_idle_lanes)
+    {
+        backend->compress(state, blocks);
+        return;
+    }
+
+    memcpy(saved, state, sizeof(saved));
+    backend->compress(state, blocks);
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        if (blocks[l] == NULL)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                state[i][l] = saved[i][l];
+            }
+        }
+    }
+}
+
+/*
+ * Sets out[l] to HMAC-SHA256(keys[l], messages[l]) for every lane with
+ * a key
+ */
+static void hmac_lanes(const backend_t *backend, const uint8_t *const keys[LANES],
+        const uint8_t *const messages[LANES], const size_t message_sz[LANES],
+        uint8_t out[LANES][NETWORK_CAPS_HMAC_LENGTH])
+{
+    uint32_t inner[8][LANES];
+    uint32_t outer[8][LANES];
+    uint8_t ipad[LANES][BLOCK_LENGTH];
+    uint8_t opad[LANES][BLOCK_LENGTH];
+    /* the end of each message, with its padding (one or two blocks) */
+    uint8_t tail[LANES][2 * BLOCK_LENGTH];
+    size_t full_blocks[LANES];
+    size_t nb_blocks[LANES];
+    size_t max_blocks = 0;
+    const uint8_t *blocks[LANES];
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            inner[i][l] = iv_[i];
+            outer[i][l] = iv_[i];
+        }
+
+        nb_blocks[l] = 0;
+        if (keys[l] == NULL)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < BLOCK_LENGTH; ++i)
+        {
+            uint8_t k = i < NETWORK_CAPS_HMAC_LENGTH ? keys[l][i] : 0;
+            ipad[l][i] = k ^ 0x36;
+            opad[l][i] = k ^ 0x5c;
+        }
+
+        /* the inner hash is over ipad then the message */
+        size_t rest = message_sz[l] % BLOCK_LENGTH;
+        full_blocks[l] = message_sz[l] / BLOCK_LENGTH;
+        nb_blocks[l] = full_blocks[l] + (rest + 9 > BLOCK_LENGTH ? 2 : 1);
+
+        memset(tail[l], 0, sizeof(tail[l]));
+        if (rest > 0)
+        {
+            memcpy(tail[l], messages[l] + full_blocks[l] * BLOCK_LENGTH, rest);
+        }
+        tail[l][rest] = 0x80;
+        store_be64(tail[l] + (nb_blocks[l] - full_blocks[l]) * BLOCK_LENGTH - 8,
+                (uint64_t)(BLOCK_LENGTH + message_sz[l]) * 8);
+
+        if (nb_blocks[l] > max_blocks)
+        {
+            max_blocks = nb_blocks[l];
+        }
+    }
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        blocks[l] = keys[l] != NULL ? ipad[l] : NULL;
+    }
+    compress_some(backend, inner, blocks);
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        blocks[l] = keys[l] != NULL ? opad[l] : NULL;
+    }
+    compress_some(backend, outer, blocks);
+
+    for (size_t b = 0; b < max_blocks; ++b)
+    {
+        for (int l = 0; l < LANES; ++l)
+        {
+            if (b >= nb_blocks[l])
+            {
+                blocks[l] = NULL;
+            }
+            else if (b < full_blocks[l])
+            {
+                blocks[l] = messages[l] + b * BLOCK_LENGTH;
+            }
+            else
+            {
+                blocks[l] = tail[l] + (b - full_blocks[l]) * BLOCK_LENGTH;
+            }
+        }
+        compress_some(backend, inner, blocks);
+    }
+
+    /* the outer hash is over opad then the inner hash: one more block */
+    for (int l = 0; l < LANES; ++l)
+    {
+        if (keys[l] == NULL)
+        {
+            blocks[l] = NULL;
+            continue;
+        }
+
+        memset(tail[l], 0, BLOCK_LENGTH);
+        for (int i = 0; i < 8; ++i)
+        {
+            store_be32(tail[l] + 4 * i, inner[i][l]);
+        }
+        tail[l][NETWORK_CAPS_HMAC_LENGTH] = 0x80;
+        store_be64(tail[l] + BLOCK_LENGTH - 8, (uint64_t)(BLOCK_LENGTH + NETWORK_CAPS_HMAC_LENGTH) * 8);
+        blocks[l] = tail[l];
+    }
+    compress_some(backend, outer, blocks);
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        if (keys[l] != NULL)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                store_be32(out[l] + 4 * i, outer[i][l]);
+            }
+        }
+    }
+}
+
+void network_caps_hmac_chains(network_caps_hmac_chain_t *chains, int nb_chains)
+{
+    const backend_t *backend = select_backend();
+
+    /* the chain in each lane (-1 if none), and its next link */
+    int chain[LANES];
+    size_t link[LANES];
+    uint8_t key[LANES][NETWORK_CAPS_HMAC_LENGTH];
+    int next = 0;
+    int active = 0;
+
+    for (int l = 0; l < LANES; ++l)
+    {
+        chain[l] = -1;
+    }
+
+    for (;;)
+    {
+        /* give idle lanes the next chains */
+        for (int l = 0; l < LANES; ++l)
+        {
+            while (chain[l] < 0 && next < nb_chains)
+            {
+                network_caps_hmac_chain_t *c = &chains[next++];
+
+                if (c->nb_messages == 0)
+                {
+                    memcpy(c->result, c->key, NETWORK_CAPS_HMAC_LENGTH);
+                    continue;
+                }
+
+                chain[l] = next - 1;
+                link[l] = 0;
+                memcpy(key[l], c->key, NETWORK_CAPS_HMAC_LENGTH);
+                ++active;
+            }
+        }
+
+        if (active == 0)
+        {
+            break;
+        }
+
+        const uint8_t *keys[LANES];
+        const uint8_t *messages[LANES];
+        size_t message_sz[LANES];
+        uint8_t out[LANES][NETWORK_CAPS_HMAC_LENGTH];
+
+        for (int l = 0; l < LANES; ++l)
+        {
+            keys[l] = NULL;
+            messages[l] = NULL;
+            message_sz[l] = 0;
+
+            if (chain[l] >= 0)
+            {
+                keys[l] = key[l];
+                messages[l] = chains[chain[l]].messages[link[l]];
+                message_sz[l] = chains[chain[l]].message_sz[link[l]];
+            }
+        }
+
+        hmac_lanes(backend, keys, messages, message_sz, out);
+
+        /* each link is keyed with the last */
+        for (int l = 0; l < LANES; ++l)
+        {
+            if (chain[l] < 0)
+            {
+                continue;
+            }
+
+            memcpy(key[l], out[l], NETWORK_CAPS_HMAC_LENGTH);
+
+            if (++link[l] == chains[chain[l]].nb_messages)
+            {
+                memcpy(chains[chain[l]].result, key[l], NETWORK_CAPS_HMAC_LENGTH);
+                chain[l] = -1;
+                --active;
+            }
+        }
+    }
+}
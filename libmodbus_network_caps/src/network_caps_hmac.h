@@ -0,0 +1,65 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2020 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _NETWORK_CAPS_HMAC_H_
+#define _NETWORK_CAPS_HMAC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * HMAC-SHA256 chains (i.e., Macaroon signatures), computed several at a
+ * time for batch verification
+ *
+ * Private to libmodbus_network_caps.
+ * */
+
+/* HMAC-SHA256 keys (always this long here) and outputs */
+#define NETWORK_CAPS_HMAC_LENGTH 32
+
+/**
+ * A chain of HMACs: the first keyed with key over messages[0], each of
+ * the rest keyed with the last's output over the next message
+ *
+ * For a Macaroon, key is the root key and the messages are its
+ * identifier then its caveats, so result is its signature.
+ * */
+typedef struct {
+    unsigned char key[NETWORK_CAPS_HMAC_LENGTH];
+    const unsigned char *const *messages;
+    const size_t *message_sz;
+    size_t nb_messages;
+    unsigned char result[NETWORK_CAPS_HMAC_LENGTH];
+} network_caps_hmac_chain_t;
+
+/* computes the result of every chain */
+void network_caps_hmac_chains(network_caps_hmac_chain_t *chains, int nb_chains);
+
+/* the SHA-256 code network_caps_hmac_chains() uses on this machine */
+const char *network_caps_hmac_backend(void);
+
+#endif /* _NETWORK_CAPS_HMAC_H_ */
@@ -41,6 +41,9 @@
 #include <modbus/modbus.h>
 #include <modbus/modbus-helpers.h>
 
+/* Metrics updates (empty unless MODBUS_METRICS) */
+#include "modbus_metrics.h"
+
 /**
  *  Allocates 5 arrays to store bits, input bits, registers, inputs
  * registers, and a string. The pointers are stored in modbus_mapping structure.
@@ -57,6 +60,13 @@ modbus_mapping_t* modbus_mapping_new_start_address_object_caps(
     unsigned int start_input_registers, unsigned int nb_input_registers);
 
 int modbus_preprocess_request_object_caps(modbus_t *ctx, uint8_t *req, modbus_mapping_t *mb_mapping);
-int modbus_preprocess_request_object_caps(modbus_t *ctx, uint8_t *req, modbus_mapping_t *mb_mapping);
+int modbus_preprocess_request_object_caps_stub(modbus_t *ctx, uint8_t *req, modbus_mapping_t *mb_mapping);
+
+/**
+ * Gives mb_mapping back the table pointers set up by
+ * modbus_mapping_new_start_address_object_caps(), e.g., before processing
+ * requests without this shim after using it (see ModbusCapsModes.h)
+ * */
+void modbus_mapping_restore_object_caps(modbus_t *ctx, modbus_mapping_t *mb_mapping);
 
 #endif /* _MODBUS_OBJECT_CAPABILITIES_H_ */
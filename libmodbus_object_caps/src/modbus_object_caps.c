@@ -38,7 +38,7 @@
  * This allows reducing permissions to the structure and members before sending
  * them to libmodbus:modbus_process_request.
  * */
-#if defined(MODBUS_OBJECT_CAPS)
+#if defined(MODBUS_OBJECT_CAPS) && defined(__CHERI_PURE_CAPABILITY__)
 static uint8_t *tab_bits_;
 static uint8_t *tab_input_bits_;
 static uint16_t *tab_input_registers_;
@@ -79,7 +79,7 @@ modbus_mapping_t* modbus_mapping_new_start_address_object_caps(
         start_registers, nb_registers,
         start_input_registers, nb_input_registers);
 
-#if defined(MODBUS_OBJECT_CAPS)
+#if defined(MODBUS_OBJECT_CAPS) && defined(__CHERI_PURE_CAPABILITY__)
     // may need to be able to read and write to coils
     mb_mapping->tab_bits = (uint8_t *)cheri_perms_and(mb_mapping->tab_bits, CHERI_PERM_LOAD | CHERI_PERM_STORE);
     tab_bits_ = mb_mapping->tab_bits;
@@ -121,7 +121,7 @@ int modbus_preprocess_request_object_caps(modbus_t *ctx, uint8_t *req, modbus_ma
         printf("\n");
     }
 
-#if defined(MODBUS_OBJECT_CAPS)
+#if defined(MODBUS_OBJECT_CAPS) && defined(__CHERI_PURE_CAPABILITY__)
     /* need to be able to STORE to modify mb_mapping permissions */
     mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping_,
         CHERI_PERM_STORE | CHERI_PERM_STORE_CAP | CHERI_PERM_STORE_LOCAL_CAP);
@@ -140,7 +140,8 @@ int modbus_preprocess_request_object_caps(modbus_t *ctx, uint8_t *req, modbus_ma
 #endif
 
     /* reduce mb_mapping capabilities based on the function in the request */
-    switch (modbus_get_function_code(ctx, req))
+    int function = modbus_get_function_code(ctx, req);
+    switch (function)
     {
     case MODBUS_FC_READ_COILS:
     {
@@ -256,6 +257,12 @@ int modbus_preprocess_request_object_caps(modbus_t *ctx, uint8_t *req, modbus_ma
         /* set mb_mapping to NULL */
         mb_mapping = NULL;
     }
+
+    if (mb_mapping == NULL) {
+        METRICS_OBJECT_CAPS_NO_ACCESS();
+    } else {
+        METRICS_OBJECT_CAPS_RESTRICTION(function);
+    }
 #endif
 
     if(debug) {
@@ -288,3 +295,26 @@ int modbus_preprocess_request_object_caps_stub(modbus_t *ctx, uint8_t *req, modb
 
     return 0;
 }
+
+/**
+ * Undoes the restrictions modbus_preprocess_request_object_caps made to
+ * mb_mapping, so requests can be processed without the shim again
+ * */
+void modbus_mapping_restore_object_caps(modbus_t *ctx, modbus_mapping_t *mb_mapping)
+{
+    if(modbus_get_debug(ctx)) {
+        print_shim_info("object capabilities shim", __FUNCTION__);
+    }
+
+#if defined(MODBUS_OBJECT_CAPS) && defined(__CHERI_PURE_CAPABILITY__)
+    /* need to be able to STORE to modify mb_mapping permissions */
+    mb_mapping = (modbus_mapping_t *)cheri_perms_and(mb_mapping_,
+        CHERI_PERM_STORE | CHERI_PERM_STORE_CAP | CHERI_PERM_STORE_LOCAL_CAP);
+
+    mb_mapping->tab_bits = tab_bits_;
+    mb_mapping->tab_input_bits = tab_input_bits_;
+    mb_mapping->tab_input_registers = tab_input_registers_;
+    mb_mapping->tab_registers = tab_registers_;
+    mb_mapping->tab_string = tab_string_;
+#endif
+}
@@ -0,0 +1,101 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_HEAP_PROFILE_H_
+#define _MODBUS_HEAP_PROFILE_H_
+
+#include <stdint.h>
+
+/*-----------------------------------------------------------*/
+
+/* Number of distinct (Modbus function, call site) pairs that are tracked.
+ * Allocations from further call sites are only counted per function. */
+#ifndef heapMAX_CALL_SITES
+#define heapMAX_CALL_SITES 64
+#endif
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Heap profiling for the capability configurations.
+ *
+ * The allocator entry points are wrapped at link time (-Wl,--wrap=...), so
+ * every allocation made by the shims, libmacaroons, libmodbus and
+ * microbenchmark.c is recorded without changing the call sites:
+ * pvPortMalloc()/vPortFree() on FreeRTOS and malloc()/calloc()/realloc()/
+ * free() on Linux hosts.
+ *
+ * Allocations between HEAP_PROFILE_BEGIN() and HEAP_PROFILE_END() are
+ * attributed to pcFunctionName; everything else is attributed to "NONE".
+ * For each function we record the allocation and free counts, the bytes
+ * allocated, and the peak live bytes above the level at
+ * HEAP_PROFILE_BEGIN() (i.e., the extra heap a single request needs).
+ *
+ * Unless MODBUS_HEAP_PROFILE is defined the markers expand to nothing and
+ * no wrapping takes place.
+ */
+#if defined( MODBUS_HEAP_PROFILE )
+#define HEAP_PROFILE_BEGIN( pcFunctionName ) vHeapProfileBegin( ( pcFunctionName ) )
+#define HEAP_PROFILE_END() vHeapProfileEnd()
+#else
+#define HEAP_PROFILE_BEGIN( pcFunctionName )
+#define HEAP_PROFILE_END()
+#endif
+
+/*-----------------------------------------------------------*/
+
+typedef struct _HeapProfileValues_t {
+    uint64_t ullRequests;
+    uint64_t ullAllocations;
+    uint64_t ullFrees;
+    uint64_t ullBytes;
+    uint64_t ullPeakLiveBytes;
+} HeapProfileValues_t;
+
+/*-----------------------------------------------------------*/
+
+void vHeapProfileBegin( const char *pcFunctionName );
+void vHeapProfileEnd( void );
+
+/*
+ * Print the profile in the same CSV format as vPrintMicrobenchmarkSamples(),
+ * (benchmark_type, modbus_function_name, value) using the HEAP_*_PROFILE
+ * benchmark types, then reset it.  Call site rows are named
+ * <function>@<return address>.
+ */
+void vPrintHeapProfile( void );
+
+/*
+ * Copy the profile of pcFunctionName into pxValues and reset it, for
+ * benchmarks that attribute each configuration to the same name in turn.
+ * Returns 0 on success, -1 if pcFunctionName has not been profiled.
+ */
+int xHeapProfileTake( const char *pcFunctionName, HeapProfileValues_t *pxValues );
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_HEAP_PROFILE_H_ */
@@ -39,21 +39,35 @@
  * SPARE_PREOCESSING: @ server. Measures spare time after processing a request.
  * REQUEST_PROCESSING: @ server. Measures time to process a request.
  * MAX_PROCESSING: @ client. Measures time for request/reply roundtrips.
+ * TOKEN_ROUND_TRIP: @ client. With network caps, the part of MAX_PROCESSING
+ *   spent building the Macaroon and writing it to the server.
+ * DATA_ROUND_TRIP: @ client. With network caps, the rest of MAX_PROCESSING,
+ *   i.e., the request itself.
+ * *_COUNTER: @ linux host. Hardware counter deltas from perfcounters.c.
+ * CAPS_DISPATCH: @ server. With runtime capability modes, the time for a
+ *   batch of direct or indirect calls to an empty shim.
  */
 typedef enum _BenchmarkType_t {
     SPARE_PROCESSING,
     REQUEST_PROCESSING,
-    MAX_PROCESSING
+    MAX_PROCESSING,
+    INSTRUCTIONS_COUNTER,
+    CYCLES_COUNTER,
+    CACHE_MISSES_COUNTER,
+    BRANCH_MISSES_COUNTER,
+    TOKEN_ROUND_TRIP,
+    DATA_ROUND_TRIP,
+    CAPS_DISPATCH
 } BenchmarkType_t;
 
 /*-----------------------------------------------------------*/
 
 #if defined(__freertos__)
 void xMicrobenchmarkSample( BenchmarkType_t xBenchmark, char *pcFunctionName,
-        uint64_t ulTimeDiff, BaseType_t xToPrint );
+        uint64_t ullTimeDiff, BaseType_t xToPrint );
 #else
 void xMicrobenchmarkSample( BenchmarkType_t xBenchmark, char *pcFunctionName,
-        uint64_t ulTimeDiff, uint8_t xToPrint );
+        uint64_t ullTimeDiff, uint8_t xToPrint );
 #endif
 
 void vPrintMicrobenchmarkSamples(void);
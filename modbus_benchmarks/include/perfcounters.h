@@ -0,0 +1,74 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_PERF_COUNTERS_H_
+#define _MODBUS_PERF_COUNTERS_H_
+
+#include <stdint.h>
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Hardware counters sampled as a single perf_event_open() group, so all
+ * four values cover exactly the same interval.  Only available on Linux
+ * hosts; the FreeRTOS server keeps using get_cycle_count().
+ */
+typedef struct _PerfCounterValues_t {
+    uint64_t ullInstructions;
+    uint64_t ullCycles;
+    uint64_t ullCacheMisses;
+    uint64_t ullBranchMisses;
+} PerfCounterValues_t;
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Open the counter group for the calling thread.
+ * Returns 0 on success, -1 if the counters are unavailable (e.g., no PMU
+ * access in a VM, or perf_event_paranoid is too restrictive).
+ */
+int xPerfCountersOpen( void );
+
+void vPerfCountersClose( void );
+
+/*
+ * Read the current (scaled) value of every counter in the group.
+ * Returns 0 on success, -1 if the group is not open or the read failed.
+ */
+int xPerfCountersRead( PerfCounterValues_t *pxValues );
+
+/*
+ * Bracket a region of code.  vPerfCountersStop() records the deltas since
+ * the matching vPerfCountersStart() as benchmark samples attributed to
+ * pcFunctionName.  Both are no-ops if the group is not open.
+ */
+void vPerfCountersStart( void );
+void vPerfCountersStop( char *pcFunctionName );
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_PERF_COUNTERS_H_ */
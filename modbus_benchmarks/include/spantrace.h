@@ -0,0 +1,72 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_SPAN_TRACE_H_
+#define _MODBUS_SPAN_TRACE_H_
+
+/*-----------------------------------------------------------*/
+
+/* Number of span events (begin or end) held in the ring buffer.  Once the
+ * buffer is full, the oldest events are overwritten. */
+#ifndef modbusSPAN_TRACE_LENGTH
+#define modbusSPAN_TRACE_LENGTH 1024
+#endif
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Nested span markers for the request processing pipeline.
+ *
+ * pcName must be a string literal (only the pointer is stored).  Every
+ * SPAN_BEGIN() must be matched by a SPAN_END() with the same name on all
+ * paths, including error returns.
+ *
+ * Unless MODBUS_SPAN_TRACE is defined the markers expand to nothing.
+ */
+#if defined( MODBUS_SPAN_TRACE )
+#define SPAN_BEGIN( pcName ) vSpanTraceEvent( ( pcName ), 'B' )
+#define SPAN_END( pcName ) vSpanTraceEvent( ( pcName ), 'E' )
+#else
+#define SPAN_BEGIN( pcName )
+#define SPAN_END( pcName )
+#endif
+
+/*-----------------------------------------------------------*/
+
+void vSpanTraceEvent( const char *pcName, char cPhase );
+
+/*
+ * Print the buffered spans as Chrome trace-event JSON between
+ * SPAN_TRACE_BEGIN and SPAN_TRACE_END marker lines, then reset the buffer.
+ * benchmark_scripts/extract_span_trace.py turns the output into a file
+ * that can be opened in Perfetto or chrome://tracing.
+ */
+void vPrintSpanTrace( void );
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_SPAN_TRACE_H_ */
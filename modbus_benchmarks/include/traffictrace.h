@@ -0,0 +1,92 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_TRAFFIC_TRACE_H_
+#define _MODBUS_TRAFFIC_TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*-----------------------------------------------------------*/
+
+/* First bytes of every trace file, including the format version */
+#define trafficTRACE_MAGIC "MBTRACE1"
+#define trafficTRACE_MAGIC_LENGTH 8
+
+/* Largest ADU that can be recorded, with room for the
+ * MODBUS_FC_WRITE_STRING requests that carry tokens */
+#define trafficMAX_ADU_LENGTH 1024
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Binary traces of the requests a Modbus server receives, so captured
+ * traffic can be replayed as a benchmark (modbus_trace_replay).
+ *
+ * A trace is the magic string followed by one record per request:
+ *   uint64_t timestamp (ns since the first request)
+ *   uint16_t connection (numbered in the order connections were accepted)
+ *   uint16_t length
+ *   uint8_t  adu[length] (the raw request ADU, including the MBAP header)
+ * with the integers little-endian.  Network capability tokens are written
+ * with MODBUS_FC_WRITE_STRING, so they are recorded like any other request.
+ */
+typedef struct _TrafficTraceRecord_t {
+    uint64_t ullTimestamp;
+    uint16_t usConnection;
+    uint16_t usLength;
+    uint8_t pucAdu[ trafficMAX_ADU_LENGTH ];
+} TrafficTraceRecord_t;
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Create a trace file and write its header.
+ * Returns NULL on failure.
+ */
+FILE *pxTrafficTraceCreate( const char *pcPath );
+
+/*
+ * Open a trace file for reading and check its header.
+ * Returns NULL on failure, or if the file is not a trace.
+ */
+FILE *pxTrafficTraceOpen( const char *pcPath );
+
+/*
+ * Returns 0 on success, -1 on failure.
+ */
+int xTrafficTraceWrite( FILE *pxTrace, const TrafficTraceRecord_t *pxRecord );
+
+/*
+ * Returns 1 if a record was read, 0 at the end of the trace, and -1 if the
+ * trace is truncated or corrupt.
+ */
+int xTrafficTraceRead( FILE *pxTrace, TrafficTraceRecord_t *pxRecord );
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_TRAFFIC_TRACE_H_ */
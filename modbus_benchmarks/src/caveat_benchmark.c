@@ -0,0 +1,483 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/*
+ * Verification cost of network capabilities as tokens are attenuated.
+ *
+ * Each delegation step adds first-party caveats to a Macaroon, so we
+ * synthesise tokens with a growing number of caveats of a given length in
+ * each text serialisation format, and run them through the server
+ * preprocessing path (modbus_preprocess_request_network_caps()) in-process,
+ * without a socket.  For each token we record the time, hardware counters
+ * (if perf_event_open() is available) and heap use per verification.
+ *
+ * The first two caveats are the ones the client shim adds (the requested
+ * function and address range).  Each further caveat alternates between
+ * a function and an address caveat that the request still satisfies,
+ * zero-padded to the requested length.
+ *
+ * MACAROON_V2 is binary, so it can't be carried in the NUL-terminated
+ * tab_string, and only MACAROON_V1 and MACAROON_V2J are benchmarked.
+ *
+ * Output rows are
+ * CAVEAT_SCALING, format, caveats, caveat_length, token_bytes, result,
+ *     iterations, mean_ns, p50_ns, p99_ns, cycles, instructions,
+ *     allocations, bytes, peak_live_bytes
+ * where the counters and heap columns are per verification and result is
+ * PASS, FAIL (rejected by the shim) or TOO_LONG (larger than tab_string).
+ * benchmark_scripts/process_caveat_scaling.py plots them.
+ */
+
+/* Standard includes. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+#include <modbus/modbus-helpers.h>
+
+/* Modbus network capability includes */
+#include "modbus_network_caps.h"
+
+/* Microbenchmark includes */
+#include "perfcounters.h"
+#include "heapprofile.h"
+
+/*-----------------------------------------------------------*/
+
+#define caveatDEFAULT_MAX_CAVEATS 16
+#define caveatDEFAULT_ITERATIONS 1000
+#define caveatDEFAULT_WARMUP 10
+#define caveatDEFAULT_LENGTHS "24,32,39"
+
+#define caveatMAX_LENGTHS 16
+#define caveatMAX_CAVEAT_LENGTH 256
+
+/* Heap use is attributed to this name while verifying */
+#define caveatPROFILE_NAME "process_network_caps"
+
+/* The request being authorised: read caveatREQUEST_NB holding registers */
+#define caveatREQUEST_ADDRESS 0x10
+#define caveatREQUEST_NB 4
+
+/* As in the shim (see create_function_caveat_from_bitfield() and
+ * create_address_caveat()) */
+#define caveatFUNCTION_TOKEN "function = "
+#define caveatADDRESS_TOKEN "address = "
+
+/* Server Macaroon, as in modbus_host_server.c */
+#define caveatKEY "a bad secret"
+#define caveatID "id for a bad secret"
+#define caveatLOCATION "https://www.modbus.com/macaroons/"
+
+/*-----------------------------------------------------------*/
+
+typedef struct _CaveatFormat_t {
+    const char *pcName;
+    enum macaroon_format xFormat;
+} CaveatFormat_t;
+
+static const CaveatFormat_t pxCaveatFormats[] = {
+    { "V1", MACAROON_V1 },
+    { "V2J", MACAROON_V2J },
+};
+
+#define caveatNUM_FORMATS ( sizeof( pxCaveatFormats ) / sizeof( pxCaveatFormats[ 0 ] ) )
+
+/*-----------------------------------------------------------*/
+
+static void prvUsage( const char *pcName )
+{
+    printf( "Usage: %s [-n <max caveats>] [-l <caveat lengths>] [-f <formats>]"
+            " [-i <iterations>] [-w <warm-up iterations>]\n", pcName );
+    printf( "-n tokens have 2..n caveats (default: %d)\n", caveatDEFAULT_MAX_CAVEATS );
+    printf( "-l comma-separated lengths of the added caveats (default: %s)\n", caveatDEFAULT_LENGTHS );
+    printf( "-f comma-separated formats, v1 and/or v2j (default: v1,v2j)\n" );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint64_t prvNowNs( void )
+{
+    struct timespec xNow;
+    clock_gettime( CLOCK_MONOTONIC, &xNow );
+    return ( uint64_t )xNow.tv_sec * 1000000000ULL + ( uint64_t )xNow.tv_nsec;
+}
+
+/*-----------------------------------------------------------*/
+
+static int prvCompareSamples( const void *pvA, const void *pvB )
+{
+    uint64_t ullA = *( const uint64_t * )pvA;
+    uint64_t ullB = *( const uint64_t * )pvB;
+
+    return ( ullA > ullB ) - ( ullA < ullB );
+}
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Write "<pcToken><ulValue>" to pcCaveat, zero-padding the value so the
+ * caveat is xLength characters long (or longer, if the value needs it).
+ */
+static void prvFormatCaveat( char *pcCaveat, const char *pcToken, uint32_t ulValue, size_t xLength )
+{
+    int xWidth = ( int )xLength - ( int )strlen( pcToken );
+
+    snprintf( pcCaveat, caveatMAX_CAVEAT_LENGTH, "%s%0*u", pcToken,
+            ( xWidth > 0 ) ? xWidth : 1, ulValue );
+}
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Serialise a Macaroon with xNumCaveats caveats into pucToken.
+ * Returns the token length, or 0 on failure.
+ */
+static size_t prvCreateToken( size_t xNumCaveats, size_t xCaveatLength,
+        enum macaroon_format xFormat, unsigned char *pucToken, size_t xTokenSize )
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+    char pcCaveat[ caveatMAX_CAVEAT_LENGTH ];
+    struct macaroon *M;
+    struct macaroon *N;
+    size_t xLength;
+
+    uint32_t ulFunction = 1 << MODBUS_FC_READ_HOLDING_REGISTERS;
+    uint32_t ulAddress = ( caveatREQUEST_ADDRESS << 16 ) +
+        ( caveatREQUEST_ADDRESS + caveatREQUEST_NB * 2 );
+
+    M = macaroon_create( ( const unsigned char * )caveatLOCATION, strlen( caveatLOCATION ),
+            ( const unsigned char * )caveatKEY, strlen( caveatKEY ),
+            ( const unsigned char * )caveatID, strlen( caveatID ), &err );
+    if( err != MACAROON_SUCCESS )
+    {
+        return 0;
+    }
+
+    for( size_t i = 0; i < xNumCaveats; ++i )
+    {
+        if( i == 0 )
+        {
+            /* the function caveat added by the client shim */
+            prvFormatCaveat( pcCaveat, caveatFUNCTION_TOKEN, ulFunction, 0 );
+        }
+        else if( i == 1 )
+        {
+            /* the address caveat added by the client shim */
+            prvFormatCaveat( pcCaveat, caveatADDRESS_TOKEN, ulAddress, 0 );
+        }
+        else if( i % 2 == 0 )
+        {
+            prvFormatCaveat( pcCaveat, caveatFUNCTION_TOKEN, ulFunction, xCaveatLength );
+        }
+        else
+        {
+            /* the whole address space, which contains the request */
+            prvFormatCaveat( pcCaveat, caveatADDRESS_TOKEN, 0x0000FFFF, xCaveatLength );
+        }
+
+        N = macaroon_add_first_party_caveat( M, ( const unsigned char * )pcCaveat,
+                strlen( pcCaveat ), &err );
+        macaroon_destroy( M );
+        if( err != MACAROON_SUCCESS )
+        {
+            return 0;
+        }
+        M = N;
+    }
+
+    if( macaroon_serialize_size_hint( M, xFormat ) > xTokenSize )
+    {
+        macaroon_destroy( M );
+        return xTokenSize;
+    }
+
+    memset( pucToken, 0, xTokenSize );
+    macaroon_serialize( M, xFormat, pucToken, xTokenSize, &err );
+    macaroon_destroy( M );
+    if( err != MACAROON_SUCCESS )
+    {
+        return 0;
+    }
+
+    xLength = strnlen( ( char * )pucToken, xTokenSize );
+    return xLength;
+}
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Parse a comma-separated list of lengths into pxLengths.
+ * Returns the number of lengths, or -1 on error.
+ */
+static int prvParseLengths( char *pcList, size_t *pxLengths )
+{
+    int xCount = 0;
+    char *pcSave = NULL;
+
+    for( char *pcLength = strtok_r( pcList, ",", &pcSave ); pcLength != NULL;
+         pcLength = strtok_r( NULL, ",", &pcSave ) )
+    {
+        int xLength = atoi( pcLength );
+
+        if( xLength <= 0 || xLength >= caveatMAX_CAVEAT_LENGTH || xCount == caveatMAX_LENGTHS )
+        {
+            return -1;
+        }
+        pxLengths[ xCount++ ] = ( size_t )xLength;
+    }
+
+    return xCount;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char *argv[] )
+{
+    int xMaxCaveats = caveatDEFAULT_MAX_CAVEATS;
+    int xIterations = caveatDEFAULT_ITERATIONS;
+    int xWarmup = caveatDEFAULT_WARMUP;
+    char pcLengths[ 128 ] = caveatDEFAULT_LENGTHS;
+    size_t pxLengths[ caveatMAX_LENGTHS ];
+    int xNumLengths;
+    int xFormats[ caveatNUM_FORMATS ] = { 1, 1 };
+    int xPerfCounters;
+    int xOpt;
+
+    modbus_t *ctx;
+    modbus_mapping_t *mb_mapping;
+    uint8_t req[ MODBUS_TCP_MAX_ADU_LENGTH ];
+    unsigned char pucToken[ MODBUS_MAX_STRING_LENGTH ];
+    uint64_t *pullSamples;
+
+    while( ( xOpt = getopt( argc, argv, "hn:l:f:i:w:" ) ) != -1 )
+    {
+        switch( xOpt )
+        {
+            case 'n':
+                xMaxCaveats = atoi( optarg );
+                break;
+            case 'l':
+                strncpy( pcLengths, optarg, sizeof( pcLengths ) - 1 );
+                break;
+            case 'f':
+                xFormats[ 0 ] = ( strstr( optarg, "v1" ) != NULL );
+                xFormats[ 1 ] = ( strstr( optarg, "v2j" ) != NULL );
+                break;
+            case 'i':
+                xIterations = atoi( optarg );
+                break;
+            case 'w':
+                xWarmup = atoi( optarg );
+                break;
+            default:
+                prvUsage( argv[ 0 ] );
+                return ( xOpt == 'h' ) ? 0 : 1;
+        }
+    }
+
+    xNumLengths = prvParseLengths( pcLengths, pxLengths );
+    if( xMaxCaveats < 2 || xIterations <= 0 || xWarmup < 0 || xNumLengths <= 0 )
+    {
+        prvUsage( argv[ 0 ] );
+        return 1;
+    }
+
+    /* The context is only used to decompose requests, so it is never
+     * connected */
+    ctx = modbus_new_tcp( "127.0.0.1", 1502 );
+    if( ctx == NULL )
+    {
+        fprintf( stderr, "Failed to allocate ctx\n" );
+        return 1;
+    }
+
+    mb_mapping = modbus_mapping_new_start_address( 0, 0, 0, 0,
+            0, caveatREQUEST_ADDRESS + caveatREQUEST_NB, 0, 0 );
+    if( mb_mapping == NULL )
+    {
+        fprintf( stderr, "Failed to allocate the mapping\n" );
+        modbus_free( ctx );
+        return 1;
+    }
+
+    if( initialise_server_network_caps( ctx, caveatLOCATION, caveatKEY, caveatID ) == -1 )
+    {
+        fprintf( stderr, "Failed to initialise server macaroon\n" );
+        modbus_mapping_free( mb_mapping );
+        modbus_free( ctx );
+        return 1;
+    }
+
+    /* MBAP header (transaction 1, protocol 0, length 6, unit 0xFF),
+     * then read holding registers */
+    memset( req, 0, sizeof( req ) );
+    req[ 1 ] = 1;
+    req[ 5 ] = 6;
+    req[ 6 ] = 0xFF;
+    req[ 7 ] = MODBUS_FC_READ_HOLDING_REGISTERS;
+    req[ 8 ] = caveatREQUEST_ADDRESS >> 8;
+    req[ 9 ] = caveatREQUEST_ADDRESS & 0xFF;
+    req[ 10 ] = caveatREQUEST_NB >> 8;
+    req[ 11 ] = caveatREQUEST_NB & 0xFF;
+
+    pullSamples = ( uint64_t * )malloc( xIterations * sizeof( uint64_t ) );
+    if( pullSamples == NULL )
+    {
+        fprintf( stderr, "Failed to allocate samples\n" );
+        return 1;
+    }
+
+    xPerfCounters = ( xPerfCountersOpen() == 0 );
+    if( !xPerfCounters )
+    {
+        fprintf( stderr, "Hardware counters unavailable, reporting NA\n" );
+    }
+
+    printf( "benchmark_type, format, caveats, caveat_length, token_bytes, result, iterations, "
+            "mean_ns, p50_ns, p99_ns, cycles, instructions, allocations, bytes, peak_live_bytes\n" );
+
+    for( size_t f = 0; f < caveatNUM_FORMATS; ++f )
+    {
+        if( !xFormats[ f ] )
+        {
+            continue;
+        }
+
+        for( int l = 0; l < xNumLengths; ++l )
+        {
+            for( int n = 2; n <= xMaxCaveats; ++n )
+            {
+                PerfCounterValues_t xPerfStart;
+                PerfCounterValues_t xPerfEnd;
+                HeapProfileValues_t xHeap;
+                uint64_t ullCycles = 0;
+                uint64_t ullInstructions = 0;
+                uint64_t ullTotal = 0;
+                uint64_t ullStart;
+                int xPassed = 1;
+                size_t xTokenLength;
+
+                xTokenLength = prvCreateToken( n, pxLengths[ l ], pxCaveatFormats[ f ].xFormat,
+                        pucToken, sizeof( pucToken ) );
+                if( xTokenLength == 0 )
+                {
+                    fprintf( stderr, "Failed to create a token with %d caveats\n", n );
+                    return 1;
+                }
+
+                if( xTokenLength >= sizeof( pucToken ) )
+                {
+                    printf( "CAVEAT_SCALING, %s, %d, %zu, %zu, TOO_LONG, 0, NA, NA, NA, NA, NA, NA, NA, NA\n",
+                            pxCaveatFormats[ f ].pcName, n, pxLengths[ l ], xTokenLength );
+                    continue;
+                }
+
+                for( int i = 0; i < xWarmup; ++i )
+                {
+                    memcpy( mb_mapping->tab_string, pucToken, xTokenLength + 1 );
+                    network_caps_clear_policy_cache();
+                    modbus_preprocess_request_network_caps( ctx, req, mb_mapping );
+                }
+
+                /* discard anything recorded before this token */
+                xHeapProfileTake( caveatPROFILE_NAME, &xHeap );
+
+                for( int i = 0; i < xIterations; ++i )
+                {
+                    memcpy( mb_mapping->tab_string, pucToken, xTokenLength + 1 );
+
+                    /* measure full verification, not the verified token's policy */
+                    network_caps_clear_policy_cache();
+
+                    if( xPerfCounters )
+                    {
+                        xPerfCountersRead( &xPerfStart );
+                    }
+                    vHeapProfileBegin( caveatPROFILE_NAME );
+                    ullStart = prvNowNs();
+
+                    if( modbus_preprocess_request_network_caps( ctx, req, mb_mapping ) != 0 )
+                    {
+                        xPassed = 0;
+                    }
+
+                    pullSamples[ i ] = prvNowNs() - ullStart;
+                    vHeapProfileEnd();
+                    if( xPerfCounters && xPerfCountersRead( &xPerfEnd ) == 0 )
+                    {
+                        ullCycles += xPerfEnd.ullCycles - xPerfStart.ullCycles;
+                        ullInstructions += xPerfEnd.ullInstructions - xPerfStart.ullInstructions;
+                    }
+
+                    ullTotal += pullSamples[ i ];
+                }
+
+                /* all zeros unless the allocator is wrapped */
+                if( xHeapProfileTake( caveatPROFILE_NAME, &xHeap ) != 0 )
+                {
+                    memset( &xHeap, 0, sizeof( xHeap ) );
+                }
+
+                qsort( pullSamples, xIterations, sizeof( uint64_t ), prvCompareSamples );
+
+                printf( "CAVEAT_SCALING, %s, %d, %zu, %zu, %s, %d, %.1f, %llu, %llu, ",
+                        pxCaveatFormats[ f ].pcName, n, pxLengths[ l ], xTokenLength,
+                        xPassed ? "PASS" : "FAIL", xIterations,
+                        ( double )ullTotal / xIterations,
+                        ( unsigned long long )pullSamples[ xIterations / 2 ],
+                        ( unsigned long long )pullSamples[ ( size_t )( xIterations * 0.99 ) ] );
+                if( xPerfCounters )
+                {
+                    printf( "%.1f, %.1f, ", ( double )ullCycles / xIterations,
+                            ( double )ullInstructions / xIterations );
+                }
+                else
+                {
+                    printf( "NA, NA, " );
+                }
+                printf( "%.1f, %.1f, %llu\n",
+                        ( double )xHeap.ullAllocations / xIterations,
+                        ( double )xHeap.ullBytes / xIterations,
+                        ( unsigned long long )xHeap.ullPeakLiveBytes );
+                fflush( stdout );
+            }
+        }
+    }
+
+    vPerfCountersClose();
+    free( pullSamples );
+    modbus_mapping_free( mb_mapping );
+    modbus_free( ctx );
+
+    return 0;
+}
@@ -0,0 +1,436 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__freertos__)
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+#else
+#include <malloc.h>
+#endif
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+#include <modbus/modbus-helpers.h>
+
+/* Microbenchmark includes */
+#include "microbenchmark.h"
+#include "heapprofile.h"
+
+/*-----------------------------------------------------------*/
+
+/* Slot 0 collects allocations made outside HEAP_PROFILE_BEGIN/END */
+#define heapMAX_FUNCTIONS ( MAX_FUNCTIONS + 1 )
+#define heapNO_FUNCTION 0
+
+#if defined(__freertos__)
+/* heap_4 has no way to query the size of a block, so on FreeRTOS each block
+ * is prefixed with its requested size.  The header is 16 bytes so the
+ * returned pointer keeps the allocator's alignment, which CHERI needs for
+ * capabilities stored in the block. */
+#define heapHEADER_SIZE 16
+
+typedef union _HeapBlockHeader_t {
+    size_t xSize;
+    uint8_t ucPad[ heapHEADER_SIZE ];
+} HeapBlockHeader_t;
+
+#define heapLOCK() taskENTER_CRITICAL()
+#define heapUNLOCK() taskEXIT_CRITICAL()
+#else
+/* glibc can report block sizes (malloc_usable_size()), so no header is
+ * needed on Linux hosts.  That also keeps blocks allocated inside libc but
+ * released with free() (e.g., by strdup()) valid. */
+static char cHeapLock = 0;
+
+#define heapLOCK() while( __atomic_test_and_set( &cHeapLock, __ATOMIC_ACQUIRE ) ) {}
+#define heapUNLOCK() __atomic_clear( &cHeapLock, __ATOMIC_RELEASE )
+#endif
+
+/* type definitions */
+
+typedef struct _HeapFunctionProfile_t {
+    char pcFunctionName[ MODBUS_MAX_FUNCTION_NAME_LEN ];
+    uint64_t ullRequests;
+    uint64_t ullAllocations;
+    uint64_t ullFrees;
+    uint64_t ullBytes;
+    uint64_t ullPeakLiveBytes;
+} HeapFunctionProfile_t;
+
+typedef struct _HeapCallSite_t {
+    void *pvSite;
+    size_t xFunction;
+    uint64_t ullAllocations;
+    uint64_t ullBytes;
+} HeapCallSite_t;
+
+/* static variable declarations */
+
+static HeapFunctionProfile_t pxHeapFunctions[ heapMAX_FUNCTIONS ] = {
+    { .pcFunctionName = "NONE" }
+};
+static size_t xHeapFunctionCount = 1;
+static size_t xHeapCurrentFunction = heapNO_FUNCTION;
+
+static HeapCallSite_t pxHeapCallSites[ heapMAX_CALL_SITES ];
+
+static uint64_t ullHeapLiveBytes = 0;
+static uint64_t ullHeapLiveBytesAtBegin = 0;
+
+/* Set while printing, since printf() may itself allocate */
+static int xHeapProfilePaused = 0;
+
+/*-----------------------------------------------------------*/
+
+static void prvRecordCallSite( void *pvSite, size_t xSize )
+{
+    size_t xHash = ( ( size_t )( uintptr_t )pvSite >> 2 ) ^ xHeapCurrentFunction;
+
+    /* Open addressing with linear probing.  Once the table is full, further
+     * call sites are only counted in the per-function totals. */
+    for( size_t i = 0; i < heapMAX_CALL_SITES; ++i )
+    {
+        HeapCallSite_t *pxCallSite = &pxHeapCallSites[ ( xHash + i ) % heapMAX_CALL_SITES ];
+
+        if( pxCallSite->pvSite == NULL )
+        {
+            pxCallSite->pvSite = pvSite;
+            pxCallSite->xFunction = xHeapCurrentFunction;
+        }
+
+        if( pxCallSite->pvSite == pvSite && pxCallSite->xFunction == xHeapCurrentFunction )
+        {
+            pxCallSite->ullAllocations += 1;
+            pxCallSite->ullBytes += xSize;
+            return;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRecordAllocation( void *pvSite, size_t xSize )
+{
+    HeapFunctionProfile_t *pxFunction;
+
+    heapLOCK();
+    if( !xHeapProfilePaused )
+    {
+        pxFunction = &pxHeapFunctions[ xHeapCurrentFunction ];
+        pxFunction->ullAllocations += 1;
+        pxFunction->ullBytes += xSize;
+
+        ullHeapLiveBytes += xSize;
+        if( xHeapCurrentFunction != heapNO_FUNCTION &&
+            ullHeapLiveBytes > ullHeapLiveBytesAtBegin &&
+            ullHeapLiveBytes - ullHeapLiveBytesAtBegin > pxFunction->ullPeakLiveBytes )
+        {
+            pxFunction->ullPeakLiveBytes = ullHeapLiveBytes - ullHeapLiveBytesAtBegin;
+        }
+
+        prvRecordCallSite( pvSite, xSize );
+    }
+    heapUNLOCK();
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRecordFree( size_t xSize )
+{
+    heapLOCK();
+    if( !xHeapProfilePaused )
+    {
+        pxHeapFunctions[ xHeapCurrentFunction ].ullFrees += 1;
+        ullHeapLiveBytes = ( xSize > ullHeapLiveBytes ) ? 0 : ullHeapLiveBytes - xSize;
+    }
+    heapUNLOCK();
+}
+
+/*-----------------------------------------------------------*/
+
+void vHeapProfileBegin( const char *pcFunctionName )
+{
+    size_t xFunction;
+
+    heapLOCK();
+    for( xFunction = heapNO_FUNCTION + 1; xFunction < xHeapFunctionCount; ++xFunction )
+    {
+        if( strncmp( pxHeapFunctions[ xFunction ].pcFunctionName, pcFunctionName,
+                    MODBUS_MAX_FUNCTION_NAME_LEN ) == 0 )
+        {
+            break;
+        }
+    }
+
+    if( xFunction == xHeapFunctionCount )
+    {
+        if( xHeapFunctionCount < heapMAX_FUNCTIONS )
+        {
+            strncpy( pxHeapFunctions[ xFunction ].pcFunctionName, pcFunctionName,
+                    MODBUS_MAX_FUNCTION_NAME_LEN - 1 );
+            xHeapFunctionCount += 1;
+        }
+        else
+        {
+            xFunction = heapNO_FUNCTION;
+        }
+    }
+
+    xHeapCurrentFunction = xFunction;
+    pxHeapFunctions[ xFunction ].ullRequests += 1;
+    ullHeapLiveBytesAtBegin = ullHeapLiveBytes;
+    heapUNLOCK();
+}
+
+/*-----------------------------------------------------------*/
+
+void vHeapProfileEnd( void )
+{
+    heapLOCK();
+    xHeapCurrentFunction = heapNO_FUNCTION;
+    heapUNLOCK();
+}
+
+/*-----------------------------------------------------------*/
+
+void vPrintHeapProfile( void )
+{
+    heapLOCK();
+    xHeapProfilePaused = 1;
+    heapUNLOCK();
+
+    printf( "benchmark_type, modbus_function_name, value\n" );
+    for( size_t i = 0; i < xHeapFunctionCount; ++i )
+    {
+        HeapFunctionProfile_t *pxFunction = &pxHeapFunctions[ i ];
+
+        printf( "HEAP_REQUESTS_PROFILE, %s, %llu\n", pxFunction->pcFunctionName,
+                ( unsigned long long )pxFunction->ullRequests );
+        printf( "HEAP_ALLOCATIONS_PROFILE, %s, %llu\n", pxFunction->pcFunctionName,
+                ( unsigned long long )pxFunction->ullAllocations );
+        printf( "HEAP_FREES_PROFILE, %s, %llu\n", pxFunction->pcFunctionName,
+                ( unsigned long long )pxFunction->ullFrees );
+        printf( "HEAP_BYTES_PROFILE, %s, %llu\n", pxFunction->pcFunctionName,
+                ( unsigned long long )pxFunction->ullBytes );
+        printf( "HEAP_PEAK_LIVE_BYTES_PROFILE, %s, %llu\n", pxFunction->pcFunctionName,
+                ( unsigned long long )pxFunction->ullPeakLiveBytes );
+    }
+
+    for( size_t i = 0; i < heapMAX_CALL_SITES; ++i )
+    {
+        HeapCallSite_t *pxCallSite = &pxHeapCallSites[ i ];
+
+        if( pxCallSite->pvSite == NULL )
+        {
+            continue;
+        }
+
+        printf( "HEAP_CALL_SITE_ALLOCATIONS_PROFILE, %s@%p, %llu\n",
+                pxHeapFunctions[ pxCallSite->xFunction ].pcFunctionName,
+                pxCallSite->pvSite,
+                ( unsigned long long )pxCallSite->ullAllocations );
+        printf( "HEAP_CALL_SITE_BYTES_PROFILE, %s@%p, %llu\n",
+                pxHeapFunctions[ pxCallSite->xFunction ].pcFunctionName,
+                pxCallSite->pvSite,
+                ( unsigned long long )pxCallSite->ullBytes );
+    }
+
+    /* Reset the profile, but keep tracking the live bytes. */
+    heapLOCK();
+    for( size_t i = 0; i < xHeapFunctionCount; ++i )
+    {
+        pxHeapFunctions[ i ].ullRequests = 0;
+        pxHeapFunctions[ i ].ullAllocations = 0;
+        pxHeapFunctions[ i ].ullFrees = 0;
+        pxHeapFunctions[ i ].ullBytes = 0;
+        pxHeapFunctions[ i ].ullPeakLiveBytes = 0;
+    }
+    memset( pxHeapCallSites, 0, sizeof( pxHeapCallSites ) );
+    xHeapProfilePaused = 0;
+    heapUNLOCK();
+}
+
+/*-----------------------------------------------------------*/
+
+int xHeapProfileTake( const char *pcFunctionName, HeapProfileValues_t *pxValues )
+{
+    int xReturn = -1;
+
+    heapLOCK();
+    for( size_t i = heapNO_FUNCTION + 1; i < xHeapFunctionCount; ++i )
+    {
+        HeapFunctionProfile_t *pxFunction = &pxHeapFunctions[ i ];
+
+        if( strncmp( pxFunction->pcFunctionName, pcFunctionName,
+                    MODBUS_MAX_FUNCTION_NAME_LEN ) == 0 )
+        {
+            pxValues->ullRequests = pxFunction->ullRequests;
+            pxValues->ullAllocations = pxFunction->ullAllocations;
+            pxValues->ullFrees = pxFunction->ullFrees;
+            pxValues->ullBytes = pxFunction->ullBytes;
+            pxValues->ullPeakLiveBytes = pxFunction->ullPeakLiveBytes;
+
+            pxFunction->ullRequests = 0;
+            pxFunction->ullAllocations = 0;
+            pxFunction->ullFrees = 0;
+            pxFunction->ullBytes = 0;
+            pxFunction->ullPeakLiveBytes = 0;
+
+            xReturn = 0;
+            break;
+        }
+    }
+    heapUNLOCK();
+
+    return xReturn;
+}
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Link-time wrappers (-Wl,--wrap=<symbol>).  References to <symbol> resolve
+ * to __wrap_<symbol>, and __real_<symbol> resolves to the allocator.
+ */
+#if defined(__freertos__)
+
+void *__real_pvPortMalloc( size_t xWantedSize );
+void __real_vPortFree( void *pv );
+
+void *__wrap_pvPortMalloc( size_t xWantedSize )
+{
+    HeapBlockHeader_t *pxHeader;
+
+    pxHeader = ( HeapBlockHeader_t * )__real_pvPortMalloc( xWantedSize + heapHEADER_SIZE );
+    if( pxHeader == NULL )
+    {
+        return NULL;
+    }
+
+    pxHeader->xSize = xWantedSize;
+    prvRecordAllocation( __builtin_return_address( 0 ), xWantedSize );
+
+    return ( uint8_t * )pxHeader + heapHEADER_SIZE;
+}
+
+/*-----------------------------------------------------------*/
+
+void __wrap_vPortFree( void *pv )
+{
+    HeapBlockHeader_t *pxHeader;
+
+    if( pv == NULL )
+    {
+        return;
+    }
+
+    pxHeader = ( HeapBlockHeader_t * )( ( uint8_t * )pv - heapHEADER_SIZE );
+    prvRecordFree( pxHeader->xSize );
+
+    __real_vPortFree( pxHeader );
+}
+
+#else
+
+void *__real_malloc( size_t xSize );
+void *__real_calloc( size_t xCount, size_t xSize );
+void *__real_realloc( void *pv, size_t xSize );
+void __real_free( void *pv );
+
+void *__wrap_malloc( size_t xSize )
+{
+    void *pv = __real_malloc( xSize );
+
+    if( pv != NULL )
+    {
+        prvRecordAllocation( __builtin_return_address( 0 ), malloc_usable_size( pv ) );
+    }
+
+    return pv;
+}
+
+/*-----------------------------------------------------------*/
+
+void *__wrap_calloc( size_t xCount, size_t xSize )
+{
+    void *pv = __real_calloc( xCount, xSize );
+
+    if( pv != NULL )
+    {
+        prvRecordAllocation( __builtin_return_address( 0 ), malloc_usable_size( pv ) );
+    }
+
+    return pv;
+}
+
+/*-----------------------------------------------------------*/
+
+void *__wrap_realloc( void *pv, size_t xSize )
+{
+    size_t xOldSize = ( pv != NULL ) ? malloc_usable_size( pv ) : 0;
+    void *pvNew = __real_realloc( pv, xSize );
+
+    /* On failure the original block is untouched */
+    if( pvNew == NULL && xSize != 0 )
+    {
+        return NULL;
+    }
+
+    if( pv != NULL )
+    {
+        prvRecordFree( xOldSize );
+    }
+
+    if( pvNew != NULL )
+    {
+        prvRecordAllocation( __builtin_return_address( 0 ), malloc_usable_size( pvNew ) );
+    }
+
+    return pvNew;
+}
+
+/*-----------------------------------------------------------*/
+
+void __wrap_free( void *pv )
+{
+    if( pv == NULL )
+    {
+        return;
+    }
+
+    prvRecordFree( malloc_usable_size( pv ) );
+    __real_free( pv );
+}
+
+#endif /* defined(__freertos__) */
+
+/*-----------------------------------------------------------*/
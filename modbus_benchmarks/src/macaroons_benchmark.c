@@ -0,0 +1,567 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/*
+ * Micro-benchmarks of the libmacaroons primitives the network capabilities
+ * shim uses, to separate the cost of libmacaroons from the cost of the shim.
+ *
+ * Each operation is run in batches of -i iterations (after a warm-up batch)
+ * and timed per batch, -k times.  ns_per_op is the median over the batches
+ * and min_ns_per_op the fastest; allocations and bytes are per operation.
+ *
+ * The SHA-256 implementation in libmacaroons is internal to the library,
+ * so it is measured through macaroon_hmac() at several message sizes: the
+ * increase in cost per byte is the cost of the compression function, and
+ * the cost at 32 bytes is close to the fixed HMAC cost paid per caveat.
+ *
+ * network_caps_verify verifies a token through the server shim, with its
+ * policy cache cleared, and network_caps_verify_requests_16 verifies 16
+ * at once (per operation), with the shim's multi-lane HMAC-SHA256 (see
+ * network_caps_hmac.c) rather than macaroon_verify_raw().
+ *
+ * Output rows are
+ * MACAROONS_PRIMITIVE, revision, operation, iterations, ns_per_op,
+ *     min_ns_per_op, allocations_per_op, bytes_per_op
+ * benchmark_scripts/run_macaroons_bench.sh appends them to a history file
+ * and benchmark_scripts/process_macaroons_primitives.py compares revisions.
+ */
+
+/* Standard includes. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Macaroons */
+#include "macaroons/macaroons.h"
+
+/* libmacaroons internals (macaroon_hmac()) */
+#include "port.h"
+
+/* the root key derivation the server shim verifies with */
+#include "modbus_network_caps.h"
+
+/* Microbenchmark includes */
+#include "heapprofile.h"
+
+/*-----------------------------------------------------------*/
+
+#define primDEFAULT_ITERATIONS 10000
+#define primDEFAULT_REPEATS 5
+#define primMAX_REPEATS 64
+#define primMAX_TOKEN_LENGTH 1024
+#define primMAX_MESSAGE_LENGTH 1024
+
+/* requests verified together by network_caps_verify_requests_16 */
+#define primREQUESTS 16
+
+/* HMAC-SHA256 output */
+#define primHASH_BYTES 32
+
+/* As in modbus_host_server.c and the client shim */
+#define primKEY "a bad secret"
+#define primID "id for a bad secret"
+#define primLOCATION "https://www.modbus.com/macaroons/"
+#define primFUNCTION_CAVEAT "function = 8"
+#define primADDRESS_CAVEAT "address = 1048600"
+
+/*-----------------------------------------------------------*/
+
+/* Shared state for the operations.  Operations that create Macaroons store
+ * them in pxMacaroons, and they are destroyed after the batch is timed. */
+typedef struct _PrimitiveState_t {
+    struct macaroon *pxRoot;
+    struct macaroon *pxToken;
+    struct macaroon_verifier *pxVerifier;
+    struct macaroon **pxMacaroons;
+    unsigned char pucTokens[ 2 ][ primMAX_TOKEN_LENGTH ];
+    size_t pxTokenLengths[ 2 ];
+    unsigned char pucMessage[ primMAX_MESSAGE_LENGTH ];
+    unsigned char pucSerialised[ primMAX_TOKEN_LENGTH ];
+    unsigned char pucDerivedKey[ NETWORK_CAPS_DERIVED_KEY_LENGTH ];
+    /* a token as the client shim sends it, and the request it's for */
+    modbus_t *pxCtx;
+    uint8_t pucShimToken[ MODBUS_MAX_STRING_LENGTH ];
+    network_caps_request_t pxRequests[ primREQUESTS ];
+    int pxVerdicts[ primREQUESTS ];
+} PrimitiveState_t;
+
+typedef int ( *PrimitiveOperation_t )( PrimitiveState_t *pxState, size_t xIndex );
+
+typedef struct _Primitive_t {
+    const char *pcName;
+    PrimitiveOperation_t xOperation;
+    int xCreatesMacaroons;
+} Primitive_t;
+
+/*-----------------------------------------------------------*/
+
+static int prvCreate( PrimitiveState_t *pxState, size_t xIndex )
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+
+    pxState->pxMacaroons[ xIndex ] = macaroon_create(
+            ( const unsigned char * )primLOCATION, strlen( primLOCATION ),
+            ( const unsigned char * )primKEY, strlen( primKEY ),
+            ( const unsigned char * )primID, strlen( primID ), &err );
+
+    return ( err == MACAROON_SUCCESS ) ? 0 : -1;
+}
+
+static int prvAddFirstPartyCaveat( PrimitiveState_t *pxState, size_t xIndex )
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+
+    pxState->pxMacaroons[ xIndex ] = macaroon_add_first_party_caveat( pxState->pxRoot,
+            ( const unsigned char * )primFUNCTION_CAVEAT, strlen( primFUNCTION_CAVEAT ), &err );
+
+    return ( err == MACAROON_SUCCESS ) ? 0 : -1;
+}
+
+static int prvSerialise( PrimitiveState_t *pxState, enum macaroon_format xFormat )
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+
+    macaroon_serialize( pxState->pxToken, xFormat, pxState->pucSerialised,
+            sizeof( pxState->pucSerialised ), &err );
+
+    return ( err == MACAROON_SUCCESS ) ? 0 : -1;
+}
+
+static int prvSerialiseV1( PrimitiveState_t *pxState, size_t xIndex )
+{
+    ( void )xIndex;
+    return prvSerialise( pxState, MACAROON_V1 );
+}
+
+static int prvSerialiseV2( PrimitiveState_t *pxState, size_t xIndex )
+{
+    ( void )xIndex;
+    return prvSerialise( pxState, MACAROON_V2 );
+}
+
+static int prvDeserialise( PrimitiveState_t *pxState, size_t xIndex, int xToken )
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+
+    pxState->pxMacaroons[ xIndex ] = macaroon_deserialize( pxState->pucTokens[ xToken ],
+            pxState->pxTokenLengths[ xToken ], &err );
+
+    return ( err == MACAROON_SUCCESS ) ? 0 : -1;
+}
+
+static int prvDeserialiseV1( PrimitiveState_t *pxState, size_t xIndex )
+{
+    return prvDeserialise( pxState, xIndex, 0 );
+}
+
+static int prvDeserialiseV2( PrimitiveState_t *pxState, size_t xIndex )
+{
+    return prvDeserialise( pxState, xIndex, 1 );
+}
+
+static int prvVerify( PrimitiveState_t *pxState, size_t xIndex )
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+
+    ( void )xIndex;
+    macaroon_verify( pxState->pxVerifier, pxState->pxToken,
+            ( const unsigned char * )primKEY, strlen( primKEY ), NULL, 0, &err );
+
+    return ( err == MACAROON_SUCCESS ) ? 0 : -1;
+}
+
+/* as the server shim verifies, with the root key derived once */
+static int prvVerifyRaw( PrimitiveState_t *pxState, size_t xIndex )
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+
+    ( void )xIndex;
+    macaroon_verify_raw( pxState->pxVerifier, pxState->pxToken,
+            pxState->pucDerivedKey, sizeof( pxState->pucDerivedKey ), NULL, 0, &err );
+
+    return ( err == MACAROON_SUCCESS ) ? 0 : -1;
+}
+
+/* as the server shim verifies a token it hasn't cached */
+static int prvShimVerify( PrimitiveState_t *pxState, size_t xIndex )
+{
+    network_caps_range_t *pxRange = &pxState->pxRequests[ 0 ].range;
+
+    ( void )xIndex;
+    network_caps_clear_policy_cache();
+
+    return modbus_verify_network_caps( pxState->pxCtx, pxState->pucShimToken,
+            pxRange->function, pxRange->addr, pxRange->nb );
+}
+
+static int prvShimVerifyRequests( PrimitiveState_t *pxState, size_t xIndex )
+{
+    ( void )xIndex;
+    network_caps_clear_policy_cache();
+
+    return modbus_verify_requests_network_caps( pxState->pxCtx, pxState->pxRequests,
+            primREQUESTS, pxState->pxVerdicts ) == primREQUESTS ? 0 : -1;
+}
+
+static int prvHmac( PrimitiveState_t *pxState, size_t xLength )
+{
+    unsigned char pucHash[ primHASH_BYTES ];
+
+    return macaroon_hmac( ( const unsigned char * )primKEY, strlen( primKEY ),
+            pxState->pucMessage, xLength, pucHash );
+}
+
+static int prvHmac32( PrimitiveState_t *pxState, size_t xIndex )
+{
+    ( void )xIndex;
+    return prvHmac( pxState, 32 );
+}
+
+static int prvHmac64( PrimitiveState_t *pxState, size_t xIndex )
+{
+    ( void )xIndex;
+    return prvHmac( pxState, 64 );
+}
+
+static int prvHmac256( PrimitiveState_t *pxState, size_t xIndex )
+{
+    ( void )xIndex;
+    return prvHmac( pxState, 256 );
+}
+
+static int prvHmac1024( PrimitiveState_t *pxState, size_t xIndex )
+{
+    ( void )xIndex;
+    return prvHmac( pxState, 1024 );
+}
+
+/*-----------------------------------------------------------*/
+
+/* The operation names are stable, since they key the history file */
+static const Primitive_t pxPrimitives[] = {
+    { "macaroon_create", prvCreate, 1 },
+    { "macaroon_add_first_party_caveat", prvAddFirstPartyCaveat, 1 },
+    { "macaroon_serialize_v1", prvSerialiseV1, 0 },
+    { "macaroon_serialize_v2", prvSerialiseV2, 0 },
+    { "macaroon_deserialize_v1", prvDeserialiseV1, 1 },
+    { "macaroon_deserialize_v2", prvDeserialiseV2, 1 },
+    { "macaroon_verify", prvVerify, 0 },
+    { "macaroon_verify_raw", prvVerifyRaw, 0 },
+    { "network_caps_verify", prvShimVerify, 0 },
+    { "network_caps_verify_requests_16", prvShimVerifyRequests, 0 },
+    { "macaroon_hmac_32", prvHmac32, 0 },
+    { "macaroon_hmac_64", prvHmac64, 0 },
+    { "macaroon_hmac_256", prvHmac256, 0 },
+    { "macaroon_hmac_1024", prvHmac1024, 0 },
+};
+
+#define primNUM_PRIMITIVES ( sizeof( pxPrimitives ) / sizeof( pxPrimitives[ 0 ] ) )
+
+/*-----------------------------------------------------------*/
+
+static void prvUsage( const char *pcName )
+{
+    printf( "Usage: %s [-i <iterations>] [-k <repeats>] [-r <revision>] [-o <operation>]\n", pcName );
+    printf( "-o runs only the operations whose names contain the argument\n" );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint64_t prvNowNs( void )
+{
+    struct timespec xNow;
+    clock_gettime( CLOCK_MONOTONIC, &xNow );
+    return ( uint64_t )xNow.tv_sec * 1000000000ULL + ( uint64_t )xNow.tv_nsec;
+}
+
+/*-----------------------------------------------------------*/
+
+static int prvCompareDoubles( const void *pvA, const void *pvB )
+{
+    double dA = *( const double * )pvA;
+    double dB = *( const double * )pvB;
+
+    return ( dA > dB ) - ( dA < dB );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvDestroyMacaroons( PrimitiveState_t *pxState, size_t xCount )
+{
+    for( size_t i = 0; i < xCount; ++i )
+    {
+        if( pxState->pxMacaroons[ i ] != NULL )
+        {
+            macaroon_destroy( pxState->pxMacaroons[ i ] );
+            pxState->pxMacaroons[ i ] = NULL;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Time one batch of xIterations operations.
+ * Returns the nanoseconds per operation, or a negative value on failure.
+ */
+static double prvRunBatch( const Primitive_t *pxPrimitive, PrimitiveState_t *pxState,
+        size_t xIterations, int xProfile )
+{
+    uint64_t ullStart;
+    uint64_t ullEnd;
+    int xFailed = 0;
+
+    if( xProfile )
+    {
+        vHeapProfileBegin( pxPrimitive->pcName );
+    }
+
+    ullStart = prvNowNs();
+    for( size_t i = 0; i < xIterations; ++i )
+    {
+        xFailed |= pxPrimitive->xOperation( pxState, i );
+    }
+    ullEnd = prvNowNs();
+
+    if( xProfile )
+    {
+        vHeapProfileEnd();
+    }
+
+    if( pxPrimitive->xCreatesMacaroons )
+    {
+        prvDestroyMacaroons( pxState, xIterations );
+    }
+
+    return xFailed ? -1.0 : ( double )( ullEnd - ullStart ) / xIterations;
+}
+
+/*-----------------------------------------------------------*/
+
+static int prvInitialiseState( PrimitiveState_t *pxState, size_t xIterations )
+{
+    enum macaroon_returncode err = MACAROON_SUCCESS;
+    struct macaroon *M;
+    const enum macaroon_format pxFormats[ 2 ] = { MACAROON_V1, MACAROON_V2 };
+    unsigned char pucRoot[ primMAX_TOKEN_LENGTH ];
+    size_t xRootLength;
+
+    memset( pxState, 0, sizeof( *pxState ) );
+
+    pxState->pxMacaroons = ( struct macaroon ** )calloc( xIterations, sizeof( struct macaroon * ) );
+    if( pxState->pxMacaroons == NULL )
+    {
+        return -1;
+    }
+
+    for( size_t i = 0; i < sizeof( pxState->pucMessage ); ++i )
+    {
+        pxState->pucMessage[ i ] = ( unsigned char )i;
+    }
+
+    pxState->pxRoot = macaroon_create(
+            ( const unsigned char * )primLOCATION, strlen( primLOCATION ),
+            ( const unsigned char * )primKEY, strlen( primKEY ),
+            ( const unsigned char * )primID, strlen( primID ), &err );
+    if( err != MACAROON_SUCCESS )
+    {
+        return -1;
+    }
+
+    /* a token like the ones the client shim sends */
+    M = macaroon_add_first_party_caveat( pxState->pxRoot,
+            ( const unsigned char * )primFUNCTION_CAVEAT, strlen( primFUNCTION_CAVEAT ), &err );
+    if( err != MACAROON_SUCCESS )
+    {
+        return -1;
+    }
+    pxState->pxToken = macaroon_add_first_party_caveat( M,
+            ( const unsigned char * )primADDRESS_CAVEAT, strlen( primADDRESS_CAVEAT ), &err );
+    macaroon_destroy( M );
+    if( err != MACAROON_SUCCESS )
+    {
+        return -1;
+    }
+
+    for( int i = 0; i < 2; ++i )
+    {
+        pxState->pxTokenLengths[ i ] = macaroon_serialize( pxState->pxToken, pxFormats[ i ],
+                pxState->pucTokens[ i ], sizeof( pxState->pucTokens[ i ] ), &err );
+        if( err != MACAROON_SUCCESS )
+        {
+            return -1;
+        }
+    }
+
+    pxState->pxVerifier = macaroon_verifier_create();
+    macaroon_verifier_satisfy_exact( pxState->pxVerifier,
+            ( const unsigned char * )primFUNCTION_CAVEAT, strlen( primFUNCTION_CAVEAT ), &err );
+    macaroon_verifier_satisfy_exact( pxState->pxVerifier,
+            ( const unsigned char * )primADDRESS_CAVEAT, strlen( primADDRESS_CAVEAT ), &err );
+
+    /* the root key, derived as the server shim does */
+    if( network_caps_derive_root_key( ( const unsigned char * )primKEY, strlen( primKEY ),
+            pxState->pucDerivedKey ) != 0 )
+    {
+        return -1;
+    }
+
+    /* the shims, as client and server of one (unconnected) context */
+    xRootLength = macaroon_serialize( pxState->pxRoot, MACAROON_V1,
+            pucRoot, sizeof( pucRoot ), &err );
+    if( err != MACAROON_SUCCESS )
+    {
+        return -1;
+    }
+
+    pxState->pxCtx = modbus_new_tcp( "127.0.0.1", 502 );
+    if( pxState->pxCtx == NULL ||
+            initialise_server_network_caps( pxState->pxCtx, primLOCATION, primKEY, primID ) != 0 ||
+            initialise_client_network_caps( pxState->pxCtx, ( char * )pucRoot, ( int )xRootLength ) != 0 ||
+            network_caps_build_token( pxState->pxCtx, MODBUS_FC_READ_HOLDING_REGISTERS, 24, 1,
+                    pxState->pucShimToken, sizeof( pxState->pucShimToken ) ) < 0 )
+    {
+        return -1;
+    }
+
+    for( int i = 0; i < primREQUESTS; ++i )
+    {
+        pxState->pxRequests[ i ].tab_string = pxState->pucShimToken;
+        pxState->pxRequests[ i ].range.function = MODBUS_FC_READ_HOLDING_REGISTERS;
+        pxState->pxRequests[ i ].range.addr = 24;
+        pxState->pxRequests[ i ].range.nb = 1;
+    }
+
+    return ( err == MACAROON_SUCCESS ) ? 0 : -1;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char *argv[] )
+{
+    int xIterations = primDEFAULT_ITERATIONS;
+    int xRepeats = primDEFAULT_REPEATS;
+    const char *pcRevision = "unknown";
+    const char *pcFilter = NULL;
+    PrimitiveState_t xState;
+    int xOpt;
+
+    while( ( xOpt = getopt( argc, argv, "hi:k:r:o:" ) ) != -1 )
+    {
+        switch( xOpt )
+        {
+            case 'i':
+                xIterations = atoi( optarg );
+                break;
+            case 'k':
+                xRepeats = atoi( optarg );
+                break;
+            case 'r':
+                pcRevision = optarg;
+                break;
+            case 'o':
+                pcFilter = optarg;
+                break;
+            default:
+                prvUsage( argv[ 0 ] );
+                return ( xOpt == 'h' ) ? 0 : 1;
+        }
+    }
+
+    if( xIterations <= 0 || xRepeats <= 0 || xRepeats > primMAX_REPEATS )
+    {
+        prvUsage( argv[ 0 ] );
+        return 1;
+    }
+
+    if( prvInitialiseState( &xState, xIterations ) != 0 )
+    {
+        fprintf( stderr, "Failed to initialise the Macaroons\n" );
+        return 1;
+    }
+
+    printf( "benchmark_type, revision, operation, iterations, ns_per_op, min_ns_per_op, "
+            "allocations_per_op, bytes_per_op\n" );
+
+    for( size_t p = 0; p < primNUM_PRIMITIVES; ++p )
+    {
+        const Primitive_t *pxPrimitive = &pxPrimitives[ p ];
+        double pdNsPerOp[ primMAX_REPEATS ];
+        HeapProfileValues_t xHeap;
+        int xFailed = 0;
+
+        if( pcFilter != NULL && strstr( pxPrimitive->pcName, pcFilter ) == NULL )
+        {
+            continue;
+        }
+
+        /* warm-up */
+        if( prvRunBatch( pxPrimitive, &xState, xIterations, 0 ) < 0 )
+        {
+            xFailed = 1;
+        }
+
+        for( int k = 0; k < xRepeats && !xFailed; ++k )
+        {
+            pdNsPerOp[ k ] = prvRunBatch( pxPrimitive, &xState, xIterations, 1 );
+            xFailed = ( pdNsPerOp[ k ] < 0 );
+        }
+
+        /* all zeros unless the allocator is wrapped */
+        if( xHeapProfileTake( pxPrimitive->pcName, &xHeap ) != 0 )
+        {
+            memset( &xHeap, 0, sizeof( xHeap ) );
+        }
+
+        if( xFailed )
+        {
+            fprintf( stderr, "%s failed\n", pxPrimitive->pcName );
+            continue;
+        }
+
+        qsort( pdNsPerOp, xRepeats, sizeof( double ), prvCompareDoubles );
+
+        printf( "MACAROONS_PRIMITIVE, %s, %s, %d, %.1f, %.1f, %.2f, %.1f\n",
+                pcRevision, pxPrimitive->pcName, xIterations,
+                pdNsPerOp[ xRepeats / 2 ], pdNsPerOp[ 0 ],
+                ( double )xHeap.ullAllocations / ( ( double )xIterations * xRepeats ),
+                ( double )xHeap.ullBytes / ( ( double )xIterations * xRepeats ) );
+        fflush( stdout );
+    }
+
+    free_client_network_caps( xState.pxCtx );
+    modbus_free( xState.pxCtx );
+    macaroon_verifier_destroy( xState.pxVerifier );
+    macaroon_destroy( xState.pxToken );
+    macaroon_destroy( xState.pxRoot );
+    free( xState.pxMacaroons );
+
+    return 0;
+}
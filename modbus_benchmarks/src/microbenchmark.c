@@ -60,7 +60,7 @@
 typedef struct _BenchmarkSample_t {
     BenchmarkType_t xBenchmark;
     char pcFunctionName[ MODBUS_MAX_FUNCTION_NAME_LEN ];
-    uint32_t ulTimeDiff;
+    uint64_t ullTimeDiff;
 } BenchmarkSample_t;
 
 /* static variable declarations */
@@ -73,10 +73,10 @@ static size_t xPrintBufferCount = 0;
 /*-----------------------------------------------------------*/
 #if defined(__freertos__)
 void xMicrobenchmarkSample( BenchmarkType_t xBenchmark, char *pcFunctionName,
-        uint64_t ulTimeDiff, BaseType_t xToPrint )
+        uint64_t ullTimeDiff, BaseType_t xToPrint )
 #else
 void xMicrobenchmarkSample( BenchmarkType_t xBenchmark, char *pcFunctionName,
-        uint64_t ulTimeDiff, uint8_t xToPrint )
+        uint64_t ullTimeDiff, uint8_t xToPrint )
 #endif
 {
     size_t xFunctionNameLen = strnlen(pcFunctionName, MODBUS_MAX_FUNCTION_NAME_LEN);
@@ -141,7 +141,7 @@ void xMicrobenchmarkSample( BenchmarkType_t xBenchmark, char *pcFunctionName,
 
         /* populate BenchmarkSample_t struct and add to the print buffer */
         pxPrintBuffer[ xPrintBufferCount ].xBenchmark = xBenchmark;
-        pxPrintBuffer[ xPrintBufferCount ].ulTimeDiff = ulTimeDiff;
+        pxPrintBuffer[ xPrintBufferCount ].ullTimeDiff = ullTimeDiff;
         strncpy ( pxPrintBuffer[ xPrintBufferCount ].pcFunctionName, pcFunctionName, xFunctionNameLen + 1 );
         xPrintBufferCount += 1;
     }
@@ -153,29 +153,56 @@ void vPrintMicrobenchmarkSamples( void )
     char *spare_string = "SPARE_PROCESSING_MICROBENCHMARK";
     char *request_string = "REQUEST_PROCESSING_MICROBENCHMARK";
     char *max_string = "MAX_PROCESSING_MACROBENCHMARK";
+    char *instructions_string = "INSTRUCTIONS_PERF_COUNTER";
+    char *cycles_string = "CYCLES_PERF_COUNTER";
+    char *cache_misses_string = "CACHE_MISSES_PERF_COUNTER";
+    char *branch_misses_string = "BRANCH_MISSES_PERF_COUNTER";
+    char *token_string = "TOKEN_ROUND_TRIP_MACROBENCHMARK";
+    char *data_string = "DATA_ROUND_TRIP_MACROBENCHMARK";
+    char *dispatch_string = "CAPS_DISPATCH_MICROBENCHMARK";
     char *print_string;
 
     /* Print out column headings for the run-time stats table. */
     printf( "benchmark_type, modbus_function_name, time_diff\n" );
     for( int i = 0; i < xPrintBufferCount; ++i)
     {
-        if( pxPrintBuffer[ i ].xBenchmark == SPARE_PROCESSING )
+        switch( pxPrintBuffer[ i ].xBenchmark )
         {
-            print_string = spare_string;
-        }
-        else if( pxPrintBuffer[ i ].xBenchmark == REQUEST_PROCESSING )
-        {
-            print_string = request_string;
-        }
-        else
-        {
-            print_string = max_string;
+            case SPARE_PROCESSING:
+                print_string = spare_string;
+                break;
+            case REQUEST_PROCESSING:
+                print_string = request_string;
+                break;
+            case INSTRUCTIONS_COUNTER:
+                print_string = instructions_string;
+                break;
+            case CYCLES_COUNTER:
+                print_string = cycles_string;
+                break;
+            case CACHE_MISSES_COUNTER:
+                print_string = cache_misses_string;
+                break;
+            case BRANCH_MISSES_COUNTER:
+                print_string = branch_misses_string;
+                break;
+            case TOKEN_ROUND_TRIP:
+                print_string = token_string;
+                break;
+            case DATA_ROUND_TRIP:
+                print_string = data_string;
+                break;
+            case CAPS_DISPATCH:
+                print_string = dispatch_string;
+                break;
+            default:
+                print_string = max_string;
         }
 
-        printf( "%s, %s, %u\n",
+        printf( "%s, %s, %llu\n",
                 print_string,
                 pxPrintBuffer[ i ].pcFunctionName,
-                pxPrintBuffer[ i ].ulTimeDiff );
+                ( unsigned long long )pxPrintBuffer[ i ].ullTimeDiff );
     }
 
     /* Reset the buffer. */
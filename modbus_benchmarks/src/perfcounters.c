@@ -0,0 +1,207 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/* Linux perf includes. */
+#include <linux/perf_event.h>
+
+/* Microbenchmark includes */
+#include "microbenchmark.h"
+#include "perfcounters.h"
+
+/* The events in the group, in the order they are opened.  The first
+ * event is the group leader. */
+static const uint64_t pulPerfEventConfigs[] = {
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+#define perfNUM_EVENTS ( sizeof( pulPerfEventConfigs ) / sizeof( pulPerfEventConfigs[ 0 ] ) )
+
+/* Layout of a read() from the group leader with
+ * PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING */
+typedef struct _PerfGroupRead_t {
+    uint64_t ullNr;
+    uint64_t ullTimeEnabled;
+    uint64_t ullTimeRunning;
+    uint64_t pullValues[ perfNUM_EVENTS ];
+} PerfGroupRead_t;
+
+/* static variable declarations */
+
+static int pxPerfFds[ perfNUM_EVENTS ] = { -1, -1, -1, -1 };
+static PerfCounterValues_t xPerfStart;
+
+/*-----------------------------------------------------------*/
+
+static int prvPerfEventOpen( struct perf_event_attr *pxAttr, int xGroupFd )
+{
+    /* Count the calling thread on whichever CPU it runs. */
+    return ( int )syscall( __NR_perf_event_open, pxAttr, 0, -1, xGroupFd, 0 );
+}
+
+/*-----------------------------------------------------------*/
+
+int xPerfCountersOpen( void )
+{
+    struct perf_event_attr xAttr;
+
+    if( pxPerfFds[ 0 ] != -1 )
+    {
+        return 0;
+    }
+
+    for( size_t i = 0; i < perfNUM_EVENTS; ++i )
+    {
+        memset( &xAttr, 0, sizeof( xAttr ) );
+        xAttr.type = PERF_TYPE_HARDWARE;
+        xAttr.size = sizeof( xAttr );
+        xAttr.config = pulPerfEventConfigs[ i ];
+        xAttr.read_format = PERF_FORMAT_GROUP |
+            PERF_FORMAT_TOTAL_TIME_ENABLED |
+            PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        /* Only the leader starts disabled; members follow the leader. */
+        xAttr.disabled = ( i == 0 ) ? 1 : 0;
+
+        /* User space only, which works with the default perf_event_paranoid
+         * and is where the shims and libmacaroons run anyway. */
+        xAttr.exclude_kernel = 1;
+        xAttr.exclude_hv = 1;
+
+        pxPerfFds[ i ] = prvPerfEventOpen( &xAttr, ( i == 0 ) ? -1 : pxPerfFds[ 0 ] );
+        if( pxPerfFds[ i ] == -1 )
+        {
+            perror( "perf_event_open" );
+            vPerfCountersClose();
+            return -1;
+        }
+    }
+
+    ioctl( pxPerfFds[ 0 ], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+    ioctl( pxPerfFds[ 0 ], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+void vPerfCountersClose( void )
+{
+    for( size_t i = 0; i < perfNUM_EVENTS; ++i )
+    {
+        if( pxPerfFds[ i ] != -1 )
+        {
+            close( pxPerfFds[ i ] );
+            pxPerfFds[ i ] = -1;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+int xPerfCountersRead( PerfCounterValues_t *pxValues )
+{
+    PerfGroupRead_t xRead;
+    uint64_t pullScaled[ perfNUM_EVENTS ];
+
+    if( pxPerfFds[ 0 ] == -1 )
+    {
+        return -1;
+    }
+
+    if( read( pxPerfFds[ 0 ], &xRead, sizeof( xRead ) ) != sizeof( xRead ) ||
+        xRead.ullNr != perfNUM_EVENTS )
+    {
+        return -1;
+    }
+
+    /* If the PMU was multiplexed, scale up to an estimate of the full
+     * count.  All members of a group are scheduled together, so the same
+     * ratio applies to every counter. */
+    for( size_t i = 0; i < perfNUM_EVENTS; ++i )
+    {
+        if( xRead.ullTimeRunning != 0 && xRead.ullTimeRunning < xRead.ullTimeEnabled )
+        {
+            pullScaled[ i ] = ( uint64_t )( ( double )xRead.pullValues[ i ] *
+                    ( double )xRead.ullTimeEnabled / ( double )xRead.ullTimeRunning );
+        }
+        else
+        {
+            pullScaled[ i ] = xRead.pullValues[ i ];
+        }
+    }
+
+    pxValues->ullInstructions = pullScaled[ 0 ];
+    pxValues->ullCycles = pullScaled[ 1 ];
+    pxValues->ullCacheMisses = pullScaled[ 2 ];
+    pxValues->ullBranchMisses = pullScaled[ 3 ];
+
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+void vPerfCountersStart( void )
+{
+    if( xPerfCountersRead( &xPerfStart ) != 0 )
+    {
+        memset( &xPerfStart, 0, sizeof( xPerfStart ) );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void vPerfCountersStop( char *pcFunctionName )
+{
+    PerfCounterValues_t xPerfEnd;
+
+    if( xPerfCountersRead( &xPerfEnd ) != 0 )
+    {
+        return;
+    }
+
+    xMicrobenchmarkSample( INSTRUCTIONS_COUNTER, pcFunctionName,
+            xPerfEnd.ullInstructions - xPerfStart.ullInstructions, 1 );
+    xMicrobenchmarkSample( CYCLES_COUNTER, pcFunctionName,
+            xPerfEnd.ullCycles - xPerfStart.ullCycles, 1 );
+    xMicrobenchmarkSample( CACHE_MISSES_COUNTER, pcFunctionName,
+            xPerfEnd.ullCacheMisses - xPerfStart.ullCacheMisses, 1 );
+    xMicrobenchmarkSample( BRANCH_MISSES_COUNTER, pcFunctionName,
+            xPerfEnd.ullBranchMisses - xPerfStart.ullBranchMisses, 1 );
+}
+
+/*-----------------------------------------------------------*/
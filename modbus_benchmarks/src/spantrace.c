@@ -0,0 +1,157 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(__freertos__)
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Modbus includes (for get_cycle_count()). */
+#include <modbus/modbus.h>
+#include <modbus/modbus-helpers.h>
+#else
+#include <time.h>
+#endif
+
+/* Span trace includes */
+#include "spantrace.h"
+
+/* type definitions */
+
+typedef struct _SpanTraceEvent_t {
+    const char *pcName;
+    char cPhase;
+    uint64_t ullTimestamp;
+} SpanTraceEvent_t;
+
+/* static variable declarations */
+
+/* The ring buffer is statically allocated so recording an event never
+ * allocates on the request path. */
+static SpanTraceEvent_t pxSpanTraceBuffer[ modbusSPAN_TRACE_LENGTH ];
+static size_t xSpanTraceHead = 0;
+static size_t xSpanTraceCount = 0;
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Timestamps are cycles on FreeRTOS and nanoseconds on Linux hosts.
+ */
+static uint64_t prvSpanTraceTimestamp( void )
+{
+#if defined(__freertos__)
+    return get_cycle_count();
+#else
+    struct timespec xNow;
+    clock_gettime( CLOCK_MONOTONIC, &xNow );
+    return ( uint64_t )xNow.tv_sec * 1000000000ULL + ( uint64_t )xNow.tv_nsec;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Chrome trace-event timestamps are in microseconds.
+ */
+static double prvSpanTraceToMicroseconds( uint64_t ullTimestamp )
+{
+#if defined(__freertos__)
+    return ( double )ullTimestamp / ( ( double )configCPU_CLOCK_HZ / 1e6 );
+#else
+    return ( double )ullTimestamp / 1e3;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+void vSpanTraceEvent( const char *pcName, char cPhase )
+{
+    SpanTraceEvent_t *pxEvent = &pxSpanTraceBuffer[ xSpanTraceHead ];
+
+    pxEvent->pcName = pcName;
+    pxEvent->cPhase = cPhase;
+    pxEvent->ullTimestamp = prvSpanTraceTimestamp();
+
+    xSpanTraceHead = ( xSpanTraceHead + 1 ) % modbusSPAN_TRACE_LENGTH;
+    if( xSpanTraceCount < modbusSPAN_TRACE_LENGTH )
+    {
+        xSpanTraceCount += 1;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void vPrintSpanTrace( void )
+{
+    size_t xStart = ( xSpanTraceHead + modbusSPAN_TRACE_LENGTH - xSpanTraceCount ) %
+        modbusSPAN_TRACE_LENGTH;
+    int xDepth = 0;
+    int xFirst = 1;
+
+    printf( "SPAN_TRACE_BEGIN\n" );
+    printf( "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n" );
+
+    for( size_t i = 0; i < xSpanTraceCount; ++i )
+    {
+        SpanTraceEvent_t *pxEvent = &pxSpanTraceBuffer[ ( xStart + i ) % modbusSPAN_TRACE_LENGTH ];
+
+        /* If the buffer wrapped, the oldest spans may have lost their begin
+         * event.  Drop the orphaned ends so the viewer doesn't misnest. */
+        if( pxEvent->cPhase == 'E' )
+        {
+            if( xDepth == 0 )
+            {
+                continue;
+            }
+            xDepth -= 1;
+        }
+        else
+        {
+            xDepth += 1;
+        }
+
+        printf( "%s{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": 1}",
+                xFirst ? "" : ",\n",
+                pxEvent->pcName,
+                pxEvent->cPhase,
+                prvSpanTraceToMicroseconds( pxEvent->ullTimestamp ) );
+        xFirst = 0;
+    }
+
+    printf( "\n]}\n" );
+    printf( "SPAN_TRACE_END\n" );
+
+    /* Reset the buffer. */
+    xSpanTraceHead = 0;
+    xSpanTraceCount = 0;
+}
+
+/*-----------------------------------------------------------*/
@@ -0,0 +1,159 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Traffic trace includes */
+#include "traffictrace.h"
+
+/* Size of a record before its ADU */
+#define trafficRECORD_HEADER_LENGTH 12
+
+/*-----------------------------------------------------------*/
+
+static void prvPutLittleEndian( uint8_t *pucBuffer, uint64_t ullValue, size_t xBytes )
+{
+    for( size_t i = 0; i < xBytes; ++i )
+    {
+        pucBuffer[ i ] = ( uint8_t )( ullValue >> ( 8 * i ) );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static uint64_t prvGetLittleEndian( const uint8_t *pucBuffer, size_t xBytes )
+{
+    uint64_t ullValue = 0;
+
+    for( size_t i = 0; i < xBytes; ++i )
+    {
+        ullValue |= ( uint64_t )pucBuffer[ i ] << ( 8 * i );
+    }
+
+    return ullValue;
+}
+
+/*-----------------------------------------------------------*/
+
+FILE *pxTrafficTraceCreate( const char *pcPath )
+{
+    FILE *pxTrace = fopen( pcPath, "wb" );
+
+    if( pxTrace == NULL )
+    {
+        return NULL;
+    }
+
+    if( fwrite( trafficTRACE_MAGIC, 1, trafficTRACE_MAGIC_LENGTH, pxTrace ) != trafficTRACE_MAGIC_LENGTH )
+    {
+        fclose( pxTrace );
+        return NULL;
+    }
+
+    return pxTrace;
+}
+
+/*-----------------------------------------------------------*/
+
+FILE *pxTrafficTraceOpen( const char *pcPath )
+{
+    char pcMagic[ trafficTRACE_MAGIC_LENGTH ];
+    FILE *pxTrace = fopen( pcPath, "rb" );
+
+    if( pxTrace == NULL )
+    {
+        return NULL;
+    }
+
+    if( fread( pcMagic, 1, trafficTRACE_MAGIC_LENGTH, pxTrace ) != trafficTRACE_MAGIC_LENGTH ||
+        memcmp( pcMagic, trafficTRACE_MAGIC, trafficTRACE_MAGIC_LENGTH ) != 0 )
+    {
+        fclose( pxTrace );
+        return NULL;
+    }
+
+    return pxTrace;
+}
+
+/*-----------------------------------------------------------*/
+
+int xTrafficTraceWrite( FILE *pxTrace, const TrafficTraceRecord_t *pxRecord )
+{
+    uint8_t pucHeader[ trafficRECORD_HEADER_LENGTH ];
+
+    if( pxRecord->usLength > trafficMAX_ADU_LENGTH )
+    {
+        return -1;
+    }
+
+    prvPutLittleEndian( &pucHeader[ 0 ], pxRecord->ullTimestamp, 8 );
+    prvPutLittleEndian( &pucHeader[ 8 ], pxRecord->usConnection, 2 );
+    prvPutLittleEndian( &pucHeader[ 10 ], pxRecord->usLength, 2 );
+
+    if( fwrite( pucHeader, 1, sizeof( pucHeader ), pxTrace ) != sizeof( pucHeader ) ||
+        fwrite( pxRecord->pucAdu, 1, pxRecord->usLength, pxTrace ) != pxRecord->usLength )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+int xTrafficTraceRead( FILE *pxTrace, TrafficTraceRecord_t *pxRecord )
+{
+    uint8_t pucHeader[ trafficRECORD_HEADER_LENGTH ];
+    size_t xRead = fread( pucHeader, 1, sizeof( pucHeader ), pxTrace );
+
+    if( xRead == 0 && feof( pxTrace ) )
+    {
+        return 0;
+    }
+
+    if( xRead != sizeof( pucHeader ) )
+    {
+        return -1;
+    }
+
+    pxRecord->ullTimestamp = prvGetLittleEndian( &pucHeader[ 0 ], 8 );
+    pxRecord->usConnection = ( uint16_t )prvGetLittleEndian( &pucHeader[ 8 ], 2 );
+    pxRecord->usLength = ( uint16_t )prvGetLittleEndian( &pucHeader[ 10 ], 2 );
+
+    if( pxRecord->usLength > trafficMAX_ADU_LENGTH ||
+        fread( pxRecord->pucAdu, 1, pxRecord->usLength, pxTrace ) != pxRecord->usLength )
+    {
+        return -1;
+    }
+
+    return 1;
+}
+
+/*-----------------------------------------------------------*/
@@ -0,0 +1,562 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "modbus_load_generator.h"
+
+#if defined(MODBUS_NETWORK_CAPS)
+#include "modbus_network_caps.h"
+#endif
+
+/*************
+ * DEFINITIONS
+ ************/
+
+/**
+ * Log-linear latency histogram over nanoseconds: values below 16 get a
+ * bucket each, and every power of two above that is split into 16 linear
+ * sub-buckets, so a bucket is never more than 1/16th wider than its lower
+ * bound (~6% relative error in the reported percentiles).
+ * */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/* the last slot holds the totals over all functions */
+#define LOAD_ALL_FUNCTIONS WORKLOAD_NUM_FUNCTIONS
+#define LOAD_NUM_SLOTS (WORKLOAD_NUM_FUNCTIONS + 1)
+
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} load_histogram_t;
+
+typedef struct {
+    int id;
+    const modbus_load_config_t *config;
+    pthread_barrier_t *start_barrier;
+    modbus_workload_t workload;
+    modbus_t **ctxs;
+    int num_ctxs;
+    int num_connected;
+    /* open loop: this thread's share of the rate and its arrival process */
+    double rate;
+    unsigned short arrival_state[3];
+    uint64_t elapsed_ns;
+    load_histogram_t histograms[LOAD_NUM_SLOTS];
+} load_thread_t;
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+    int sub_bucket = (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/* the largest value that falls in bucket */
+static uint64_t histogram_bucket_upper(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = (uint64_t)(bucket % HISTOGRAM_SUB_BUCKETS);
+    uint64_t lower = (HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+
+    return lower + ((1ULL << shift) - 1);
+}
+
+static void histogram_record(load_histogram_t *histogram, uint64_t value, int rc)
+{
+    if (rc == -1) {
+        histogram->errors += 1;
+        return;
+    }
+
+    histogram->count += 1;
+    histogram->sum_ns += value;
+    if (value > histogram->max_ns) {
+        histogram->max_ns = value;
+    }
+    histogram->buckets[histogram_bucket(value)] += 1;
+}
+
+static void histogram_merge(load_histogram_t *dst, const load_histogram_t *src)
+{
+    dst->count += src->count;
+    dst->errors += src->errors;
+    dst->sum_ns += src->sum_ns;
+    if (src->max_ns > dst->max_ns) {
+        dst->max_ns = src->max_ns;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+/* returns the latency in ns at quantile q (0 < q <= 1) */
+static uint64_t histogram_quantile(const load_histogram_t *histogram, double q)
+{
+    uint64_t rank = (uint64_t)(q * (double)histogram->count + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            /* the bucket bound may overshoot the largest sample */
+            uint64_t upper = histogram_bucket_upper(i);
+            return (upper < histogram->max_ns) ? upper : histogram->max_ns;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+/* prefix holds the leading columns, e.g., "LOADGEN_CLOSED_LOOP, 0" */
+static void print_histogram(FILE *stream, const char *prefix, const char *function,
+        const load_histogram_t *histogram, uint64_t elapsed_ns)
+{
+    if (histogram->count == 0 && histogram->errors == 0) {
+        return;
+    }
+
+    double throughput = (elapsed_ns == 0) ? 0.0 :
+        (double)histogram->count * 1e9 / (double)elapsed_ns;
+    double mean_us = (histogram->count == 0) ? 0.0 :
+        (double)histogram->sum_ns / (double)histogram->count / 1e3;
+
+    fprintf(stream, "%s, %s, %llu, %llu, %.1f, %.3f, %.3f, %.3f, %.3f, %.3f\n",
+            prefix, function,
+            (unsigned long long)histogram->count,
+            (unsigned long long)histogram->errors,
+            throughput, mean_us,
+            histogram_quantile(histogram, 0.50) / 1e3,
+            histogram_quantile(histogram, 0.99) / 1e3,
+            histogram_quantile(histogram, 0.999) / 1e3,
+            histogram->max_ns / 1e3);
+}
+
+static void print_histograms(FILE *stream, const char *prefix,
+        const load_histogram_t *histograms, uint64_t elapsed_ns)
+{
+    for (int i = 0; i < WORKLOAD_NUM_FUNCTIONS; ++i) {
+        print_histogram(stream, prefix, workload_function_names[i],
+                &histograms[i], elapsed_ns);
+    }
+    print_histogram(stream, prefix, "ALL",
+            &histograms[LOAD_ALL_FUNCTIONS], elapsed_ns);
+}
+
+static void think(int think_time_us)
+{
+    struct timespec delay;
+
+    if (think_time_us <= 0) {
+        return;
+    }
+
+    delay.tv_sec = think_time_us / 1000000;
+    delay.tv_nsec = (long)(think_time_us % 1000000) * 1000;
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR) {
+    }
+}
+
+static void disconnect(modbus_t *ctx)
+{
+#if defined(MODBUS_NETWORK_CAPS)
+    free_client_network_caps(ctx);
+#endif
+    modbus_close(ctx);
+    modbus_free(ctx);
+}
+
+/**
+ * Open a connection and, with network capabilities, read the server's
+ * Macaroon and hold it for this connection.
+ *
+ * Returns the context, or NULL on failure.
+ * */
+static modbus_t *connect_client(const modbus_load_config_t *config)
+{
+    modbus_t *ctx = modbus_new_tcp(config->ip, config->port);
+    if (ctx == NULL) {
+        fprintf(stderr, "Unable to allocate libmodbus context\r\n");
+        return NULL;
+    }
+
+    modbus_set_debug(ctx, FALSE);
+    modbus_set_error_recovery(ctx,
+                              MODBUS_ERROR_RECOVERY_LINK |
+                              MODBUS_ERROR_RECOVERY_PROTOCOL);
+
+    if (modbus_connect(ctx) == -1) {
+        fprintf(stderr, "Connection failed: %s\r\n", modbus_strerror(errno));
+        modbus_free(ctx);
+        return NULL;
+    }
+
+#if defined(MODBUS_NETWORK_CAPS)
+    uint8_t serialised_macaroon[MODBUS_MAX_STRING_LENGTH];
+    int rc;
+
+    memset(serialised_macaroon, 0, sizeof(serialised_macaroon));
+    rc = modbus_read_string(ctx, serialised_macaroon);
+    if (rc == -1 ||
+            initialise_client_network_caps(ctx, (char *)serialised_macaroon, rc) == -1) {
+        fprintf(stderr, "Failed to initialise the client Macaroon\r\n");
+        disconnect(ctx);
+        return NULL;
+    }
+#endif
+
+    return ctx;
+}
+
+/* sleep until the CLOCK_MONOTONIC time t_ns, returning at once if it has passed */
+static void sleep_until(uint64_t t_ns)
+{
+    struct timespec t;
+
+    t.tv_sec = (time_t)(t_ns / 1000000000ULL);
+    t.tv_nsec = (long)(t_ns % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) {
+    }
+}
+
+/* the time in ns until the next open-loop request */
+static uint64_t next_interval(load_thread_t *thread)
+{
+    double mean_ns = 1e9 / thread->rate;
+
+    if (thread->config->arrival == LOAD_ARRIVAL_POISSON) {
+        /* exponential inter-arrival times; erand48() is in [0, 1) */
+        return (uint64_t)(-log(1.0 - erand48(thread->arrival_state)) * mean_ns);
+    }
+
+    return (uint64_t)mean_ns;
+}
+
+static void connect_thread(load_thread_t *thread)
+{
+    for (int i = 0; i < thread->num_ctxs; ++i) {
+        thread->ctxs[i] = connect_client(thread->config);
+        if (thread->ctxs[i] == NULL) {
+            break;
+        }
+        thread->num_connected += 1;
+    }
+
+    /* all threads start sending together, once every connection is open */
+    pthread_barrier_wait(thread->start_barrier);
+}
+
+static void disconnect_thread(load_thread_t *thread)
+{
+    for (int i = 0; i < thread->num_connected; ++i) {
+        disconnect(thread->ctxs[i]);
+    }
+}
+
+static void *closed_loop_thread(void *arg)
+{
+    load_thread_t *thread = (load_thread_t *)arg;
+    int num_requests = thread->workload.num_iters * thread->workload.num_ops;
+    uint8_t bits[MODBUS_MAX_READ_BITS];
+    uint16_t registers[MODBUS_MAX_READ_REGISTERS];
+    workload_op_t op;
+    uint64_t start, end, thread_start;
+    int rc;
+
+    connect_thread(thread);
+
+    if (thread->num_connected == thread->num_ctxs) {
+        thread_start = now_ns();
+
+        for (int i = 0; i < num_requests; ++i) {
+            modbus_t *ctx = thread->ctxs[i % thread->num_connected];
+
+            modbus_workload_next_op(&thread->workload, &op);
+
+            start = now_ns();
+            rc = modbus_workload_execute(ctx, &op, bits, registers);
+            end = now_ns();
+
+            histogram_record(&thread->histograms[op.function], end - start, rc);
+            histogram_record(&thread->histograms[LOAD_ALL_FUNCTIONS], end - start, rc);
+
+            think(thread->config->think_time_us);
+        }
+
+        thread->elapsed_ns = now_ns() - thread_start;
+    }
+
+    disconnect_thread(thread);
+
+    return NULL;
+}
+
+static void *open_loop_thread(void *arg)
+{
+    load_thread_t *thread = (load_thread_t *)arg;
+    uint8_t bits[MODBUS_MAX_READ_BITS];
+    uint16_t registers[MODBUS_MAX_READ_REGISTERS];
+    workload_op_t op;
+    uint64_t thread_start, thread_end, intended, end;
+    int rc;
+
+    connect_thread(thread);
+
+    if (thread->num_connected == thread->num_ctxs) {
+        thread_start = now_ns();
+        thread_end = thread_start + (uint64_t)thread->config->duration_s * 1000000000ULL;
+
+        /* stagger the first request of each connection over one interval */
+        intended = thread_start + (uint64_t)(1e9 / thread->rate * thread->id /
+            (thread->config->num_threads * thread->config->num_connections));
+
+        while (intended < thread_end) {
+            modbus_workload_next_op(&thread->workload, &op);
+
+            /* if the previous request overran, this one is already late
+             * and goes out at once */
+            sleep_until(intended);
+            rc = modbus_workload_execute(thread->ctxs[0], &op, bits, registers);
+            end = now_ns();
+
+            histogram_record(&thread->histograms[op.function], end - intended, rc);
+            histogram_record(&thread->histograms[LOAD_ALL_FUNCTIONS], end - intended, rc);
+
+            intended += next_interval(thread);
+        }
+
+        thread->elapsed_ns = now_ns() - thread_start;
+    }
+
+    disconnect_thread(thread);
+
+    return NULL;
+}
+
+/**
+ * Start one load thread per entry in threads and wait for them all
+ */
+static void run_threads(load_thread_t *threads, int num_threads,
+        void *(*thread_function)(void *))
+{
+    pthread_barrier_t start_barrier;
+    pthread_t *thread_ids = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+
+    pthread_barrier_init(&start_barrier, NULL, num_threads);
+
+    for (int i = 0; i < num_threads; ++i) {
+        threads[i].start_barrier = &start_barrier;
+        pthread_create(&thread_ids[i], NULL, thread_function, &threads[i]);
+    }
+
+    for (int i = 0; i < num_threads; ++i) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    pthread_barrier_destroy(&start_barrier);
+    free(thread_ids);
+}
+
+/**
+ * Run the load once and print its rows, each starting with prefix.
+ *
+ * Returns 0 on success, -1 if any connection could not be established.
+ * */
+static int run_once(const modbus_load_config_t *config, double rate,
+        const char *prefix, FILE *stream)
+{
+    /* open loop runs a thread for each connection */
+    int open_loop = (config->mode == LOAD_OPEN_LOOP);
+    int num_load_threads = open_loop ?
+        config->num_threads * config->num_connections : config->num_threads;
+    int num_ctxs = open_loop ? 1 : config->num_connections;
+    int threads_per_group = open_loop ? config->num_connections : 1;
+    load_thread_t *threads;
+    load_histogram_t *group, *merged;
+    uint64_t elapsed_ns = 0, group_elapsed_ns = 0;
+    char row_prefix[64];
+    int rc = 0;
+
+    threads = (load_thread_t *)calloc(num_load_threads, sizeof(load_thread_t));
+    group = (load_histogram_t *)calloc(LOAD_NUM_SLOTS, sizeof(load_histogram_t));
+    merged = (load_histogram_t *)calloc(LOAD_NUM_SLOTS, sizeof(load_histogram_t));
+    if (threads == NULL || group == NULL || merged == NULL) {
+        fprintf(stderr, "Unable to allocate the load generator\r\n");
+        free(threads);
+        free(group);
+        free(merged);
+        return -1;
+    }
+
+    for (int i = 0; i < num_load_threads; ++i) {
+        uint32_t seed = config->workload->seed + i;
+
+        threads[i].id = i;
+        threads[i].config = config;
+        threads[i].workload = *config->workload;
+        modbus_workload_seed(&threads[i].workload, seed);
+        threads[i].num_ctxs = num_ctxs;
+        threads[i].ctxs = (modbus_t **)calloc(num_ctxs, sizeof(modbus_t *));
+        threads[i].rate = rate / num_load_threads;
+        threads[i].arrival_state[0] = 0x330E;
+        threads[i].arrival_state[1] = (unsigned short)seed;
+        threads[i].arrival_state[2] = (unsigned short)(seed >> 16);
+    }
+
+    run_threads(threads, num_load_threads, open_loop ? open_loop_thread : closed_loop_thread);
+
+    for (int i = 0; i < num_load_threads; ++i) {
+        if (threads[i].num_connected != threads[i].num_ctxs) {
+            fprintf(stderr, "Thread %d connected %d of %d\r\n", i / threads_per_group,
+                    threads[i].num_connected, threads[i].num_ctxs);
+            rc = -1;
+        }
+
+        for (int j = 0; j < LOAD_NUM_SLOTS; ++j) {
+            histogram_merge(&group[j], &threads[i].histograms[j]);
+        }
+
+        /* threads start together, so the slowest thread spans the run */
+        if (threads[i].elapsed_ns > group_elapsed_ns) {
+            group_elapsed_ns = threads[i].elapsed_ns;
+        }
+
+        if ((i + 1) % threads_per_group == 0) {
+            snprintf(row_prefix, sizeof(row_prefix), "%s, %d", prefix, i / threads_per_group);
+            print_histograms(stream, row_prefix, group, group_elapsed_ns);
+
+            for (int j = 0; j < LOAD_NUM_SLOTS; ++j) {
+                histogram_merge(&merged[j], &group[j]);
+            }
+            if (group_elapsed_ns > elapsed_ns) {
+                elapsed_ns = group_elapsed_ns;
+            }
+
+            memset(group, 0, LOAD_NUM_SLOTS * sizeof(load_histogram_t));
+            group_elapsed_ns = 0;
+        }
+    }
+
+    snprintf(row_prefix, sizeof(row_prefix), "%s, ALL", prefix);
+    print_histograms(stream, row_prefix, merged, elapsed_ns);
+
+    for (int i = 0; i < num_load_threads; ++i) {
+        free(threads[i].ctxs);
+    }
+    free(threads);
+    free(group);
+    free(merged);
+
+    return rc;
+}
+
+/***********
+ * FUNCTIONS
+ **********/
+
+/**
+ * Run the load described by config and print the per-thread and merged
+ * results to stream.
+ *
+ * Returns 0 on success, -1 if the config is invalid or any connection
+ * could not be established.
+ * */
+int modbus_load_generator_run(const modbus_load_config_t *config, FILE *stream)
+{
+    char prefix[64];
+    int rc = 0;
+
+    if (config->num_threads <= 0 || config->num_connections <= 0) {
+        fprintf(stderr, "Threads and connections must be positive\r\n");
+        return -1;
+    }
+
+    if (config->mode == LOAD_CLOSED_LOOP) {
+        fprintf(stream, "benchmark_type, thread, modbus_function_name, requests, errors, "
+                "throughput, mean_us, p50_us, p99_us, p999_us, max_us\n");
+        return run_once(config, 0.0, "LOADGEN_CLOSED_LOOP", stream);
+    }
+
+    if (config->rate <= 0.0 || config->duration_s <= 0) {
+        fprintf(stderr, "Open loop needs a positive rate and duration\r\n");
+        return -1;
+    }
+
+    fprintf(stream, "benchmark_type, rate, thread, modbus_function_name, requests, errors, "
+            "throughput, mean_us, p50_us, p99_us, p999_us, max_us\n");
+
+    /* a single rate unless a sweep was given */
+    double rate_stop = (config->rate_step > 0.0 && config->rate_stop > config->rate) ?
+        config->rate_stop : config->rate;
+    double rate_step = (config->rate_step > 0.0) ? config->rate_step : 1.0;
+
+    for (double rate = config->rate; rate <= rate_stop; rate += rate_step) {
+        snprintf(prefix, sizeof(prefix), "LOADGEN_OPEN_LOOP, %.0f", rate);
+        if (run_once(config, rate, prefix, stream) == -1) {
+            rc = -1;
+        }
+        fflush(stream);
+    }
+
+    return rc;
+}
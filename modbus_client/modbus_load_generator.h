@@ -0,0 +1,113 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_LOAD_GENERATOR_H_
+#define _MODBUS_LOAD_GENERATOR_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "modbus_workload.h"
+
+/**
+ * A closed-loop load generator: num_threads threads, each holding
+ * num_connections connections to the server.  Each thread sends one request
+ * at a time, round-robin over its connections, waits for the reply and then
+ * for think_time_us before sending the next, so the offered load follows
+ * the server's response time.
+ *
+ * Every thread runs its own copy of the workload (seeded with the workload's
+ * seed plus the thread number) for the workload's iters * ops requests.
+ * With network capabilities, every connection reads and holds its own
+ * client Macaroon.
+ *
+ * Latencies are recorded per thread and per function in log-linear
+ * histograms, which are merged once all threads have finished.  Results
+ * are printed as CSV:
+ *
+ *   LOADGEN_CLOSED_LOOP, <thread|ALL>, <function|ALL>, requests, errors,
+ *       throughput (req/s), mean_us, p50_us, p99_us, p999_us, max_us
+ *
+ * In open-loop mode, requests are instead sent on a fixed schedule at
+ * rate requests per second in total, with constant or Poisson
+ * inter-arrival times, for duration_s seconds.  A stalled server therefore
+ * builds up a queue rather than slowing the client down.  Latency is
+ * measured from the intended send time, not the actual one, so time spent
+ * queued behind a slow request is counted (i.e., corrected for coordinated
+ * omission).  Think time does not apply.
+ *
+ * libmodbus connections are synchronous, so every connection runs its own
+ * schedule in its own thread, at an equal share of the rate.  Results are
+ * still grouped by thread, i.e., by num_connections connections.
+ *
+ * If rate_stop and rate_step are set, the run is repeated for each rate
+ * from rate to rate_stop, giving a throughput-versus-latency curve:
+ *
+ *   LOADGEN_OPEN_LOOP, <target rate>, <thread|ALL>, <function|ALL>, ...
+ *
+ * with the same columns as above.  benchmark_scripts/process_load_curve.py
+ * tabulates and plots the curve.
+ * */
+
+/*************
+ * DEFINITIONS
+ ************/
+
+typedef enum {
+    LOAD_CLOSED_LOOP,
+    LOAD_OPEN_LOOP
+} load_mode_t;
+
+typedef enum {
+    LOAD_ARRIVAL_CONSTANT,
+    LOAD_ARRIVAL_POISSON
+} load_arrival_t;
+
+typedef struct {
+    const char *ip;
+    int port;
+    int num_threads;
+    int num_connections;
+    const modbus_workload_t *workload;
+    load_mode_t mode;
+    /* closed loop */
+    int think_time_us;
+    /* open loop */
+    load_arrival_t arrival;
+    double rate;
+    double rate_stop;
+    double rate_step;
+    int duration_s;
+} modbus_load_config_t;
+
+/***********
+ * FUNCTIONS
+ **********/
+
+int modbus_load_generator_run(const modbus_load_config_t *config, FILE *stream);
+
+#endif /* _MODBUS_LOAD_GENERATOR_H_ */
@@ -0,0 +1,314 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/**
+ * Compares synchronous requests with pipelined ones from the asynchronous
+ * client (libmodbus_client), against a running server.
+ *
+ * For each window size (-w, a comma separated list), -n reads of -r holding
+ * registers are sent: first one at a time with the synchronous libmodbus
+ * calls (window 1, mode sync), then with up to window requests in flight.
+ * With -c every request carries a network caps Macaroon, as the
+ * modbus_*_network_caps() calls.
+ *
+ * Pipelining only pays off when there is latency on the path to hide, so
+ * run the server behind a real link or a netem delay; the host server's -d
+ * delays requests one after another and serialises them again.
+ *
+ * Output, one row per run:
+ * PIPELINE, mode, network_caps, window, requests, errors, elapsed_us,
+ * us_per_request, p50_us, p99_us
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "modbus/modbus.h"
+#include "modbus/modbus-helpers.h"
+
+#include "modbus_network_caps.h"
+#include "modbus_client_async.h"
+#include "modbus_test_constants.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+#define DEFAULT_IP "127.0.0.1"
+#define DEFAULT_PORT 1502
+#define DEFAULT_REQUESTS 1000
+#define DEFAULT_WINDOWS "1,4,16"
+
+#define MAX_WINDOWS 16
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-i <ip>] [-p <port>] [-n <requests>] [-r <registers>] [-w <window>[,<window>...]] [-c]\r\n",
+            name);
+    printf("-c sends a network caps Macaroon with every request\r\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_row(const char *mode, int network_caps, int window, int num_requests,
+        int errors, uint64_t elapsed_ns, uint64_t *latencies)
+{
+    int count = num_requests - errors;
+
+    if (count == 0) {
+        printf("PIPELINE, %s, %d, %d, %d, %d, %.1f, 0, 0, 0\n",
+                mode, network_caps, window, num_requests, errors, (double)elapsed_ns / 1e3);
+        return;
+    }
+
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    printf("PIPELINE, %s, %d, %d, %d, %d, %.1f, %.2f, %.1f, %.1f\n",
+            mode, network_caps, window, num_requests, errors,
+            (double)elapsed_ns / 1e3,
+            (double)elapsed_ns / num_requests / 1e3,
+            (double)latencies[count / 2] / 1e3,
+            (double)latencies[(size_t)(count * 0.99)] / 1e3);
+}
+
+/**
+ * Reads the same registers num_requests times, each waiting for its reply
+ * */
+static void run_sync(modbus_t *ctx, int network_caps, int num_requests, int nb,
+        uint16_t *dest, uint64_t *latencies)
+{
+    int errors = 0;
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < num_requests; ++i) {
+        uint64_t sent = now_ns();
+        int rc;
+
+        if (network_caps) {
+            rc = modbus_read_registers_network_caps(ctx, UT_REGISTERS_ADDRESS, nb, dest);
+        } else {
+            rc = modbus_read_registers(ctx, UT_REGISTERS_ADDRESS, nb, dest);
+        }
+
+        if (rc != nb) {
+            errors += 1;
+            continue;
+        }
+        latencies[i - errors] = now_ns() - sent;
+    }
+
+    print_row("sync", network_caps, 1, num_requests, errors, now_ns() - start, latencies);
+}
+
+/**
+ * As run_sync, keeping up to window requests in flight
+ * */
+static int run_async(modbus_t *ctx, int network_caps, int window, int num_requests, int nb,
+        uint16_t *dest, uint64_t *latencies)
+{
+    modbus_async_t *async = modbus_async_new(ctx, network_caps ? 2 * window : window);
+    modbus_async_request_t **requests;
+    int errors = 0;
+    uint64_t start;
+
+    if (async == NULL) {
+        fprintf(stderr, "Unable to create the asynchronous client: %s\r\n", modbus_strerror(errno));
+        return -1;
+    }
+
+    requests = (modbus_async_request_t **)calloc(num_requests, sizeof(modbus_async_request_t *));
+    if (requests == NULL) {
+        modbus_async_free(async);
+        return -1;
+    }
+
+    /* the replies all land in dest: only the timing matters here */
+    start = now_ns();
+    for (int i = 0; i < num_requests; ++i) {
+        if (network_caps) {
+            requests[i] = modbus_async_read_registers_network_caps(async, UT_REGISTERS_ADDRESS,
+                    nb, dest, NULL, NULL);
+        } else {
+            requests[i] = modbus_async_read_registers(async, UT_REGISTERS_ADDRESS,
+                    nb, dest, NULL, NULL);
+        }
+
+        /* keep the queue no deeper than the window */
+        while (modbus_async_pending(async) >= window) {
+            if (modbus_async_poll(async, -1) == -1) {
+                break;
+            }
+        }
+    }
+    modbus_async_wait_all(async, -1);
+
+    uint64_t elapsed = now_ns() - start;
+
+    for (int i = 0; i < num_requests; ++i) {
+        if (requests[i] == NULL || modbus_async_result(requests[i]) != nb) {
+            errors += 1;
+        } else {
+            latencies[i - errors] = modbus_async_latency(requests[i]);
+        }
+        modbus_async_release(requests[i]);
+    }
+
+    print_row("async", network_caps, window, num_requests, errors, elapsed, latencies);
+
+    free(requests);
+    modbus_async_free(async);
+    return 0;
+}
+
+/***********
+ * FUNCTIONS
+ **********/
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    const char *ip = DEFAULT_IP;
+    int port = DEFAULT_PORT;
+    int num_requests = DEFAULT_REQUESTS;
+    int nb = UT_REGISTERS_NB_MAX;
+    int network_caps = 0;
+    char windows_arg[64] = DEFAULT_WINDOWS;
+    int windows[MAX_WINDOWS];
+    int num_windows = 0;
+    uint16_t *dest;
+    uint64_t *latencies;
+    modbus_t *ctx;
+
+    while ((opt = getopt(argc, argv, "i:p:n:r:w:ch")) != -1) {
+        switch (opt) {
+            case 'i':
+                ip = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'n':
+                num_requests = atoi(optarg);
+                break;
+            case 'r':
+                nb = atoi(optarg);
+                break;
+            case 'w':
+                strncpy(windows_arg, optarg, sizeof(windows_arg) - 1);
+                break;
+            case 'c':
+                network_caps = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    for (char *token = strtok(windows_arg, ","); token != NULL && num_windows < MAX_WINDOWS;
+            token = strtok(NULL, ",")) {
+        windows[num_windows++] = atoi(token);
+    }
+
+    if (optind != argc || num_requests <= 0 || nb < 1 || nb > UT_REGISTERS_NB_MAX ||
+            num_windows == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    dest = (uint16_t *)malloc(nb * sizeof(uint16_t));
+    latencies = (uint64_t *)malloc(num_requests * sizeof(uint64_t));
+    if (dest == NULL || latencies == NULL) {
+        exit(1);
+    }
+
+    ctx = modbus_new_tcp(ip, port);
+    if (ctx == NULL) {
+        fprintf(stderr, "Unable to allocate libmodbus context\r\n");
+        exit(1);
+    }
+
+    if (modbus_connect(ctx) == -1) {
+        fprintf(stderr, "Connection failed: %s\r\n", modbus_strerror(errno));
+        modbus_free(ctx);
+        exit(1);
+    }
+
+    if (network_caps) {
+        /* as modbus_test_client: trust the server's Macaroon on first use */
+        uint8_t macaroon[MODBUS_MAX_STRING_LENGTH] = { 0 };
+        int rc = modbus_read_string(ctx, macaroon);
+
+        if (rc == -1 || initialise_client_network_caps(ctx, (char *)macaroon, rc) == -1) {
+            fprintf(stderr, "Unable to initialise network caps: %s\r\n", modbus_strerror(errno));
+            modbus_close(ctx);
+            modbus_free(ctx);
+            exit(1);
+        }
+    }
+
+    printf("benchmark_type, mode, network_caps, window, requests, errors, elapsed_us, "
+            "us_per_request, p50_us, p99_us\n");
+
+    run_sync(ctx, network_caps, num_requests, nb, dest, latencies);
+    for (int i = 0; i < num_windows; ++i) {
+        if (windows[i] <= 0 || run_async(ctx, network_caps, windows[i], num_requests, nb,
+                    dest, latencies) == -1) {
+            break;
+        }
+    }
+
+    if (network_caps) {
+        free_client_network_caps(ctx);
+    }
+    modbus_close(ctx);
+    modbus_free(ctx);
+    free(latencies);
+    free(dest);
+
+    return 0;
+}
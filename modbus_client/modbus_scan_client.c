@@ -0,0 +1,203 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/**
+ * Polls one or more servers with the scan engine (libmodbus_client).
+ *
+ * Every server gets a group of the test tags for each period (-P, a comma
+ * separated list in ms), and the engine runs for -d ms.  Tags are merged
+ * into requests with a gap of -g addresses (0 = only adjacent or
+ * overlapping tags).  With -c every request carries a network caps Macaroon.
+ *
+ * Output, one row per group (see modbus_scan_print_stats()):
+ * SCAN, server, group, period_ms, blocks, scans, failed, missed,
+ * mean_lateness_us, max_lateness_us, mean_duration_us, max_duration_us
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "modbus/modbus.h"
+
+#include "modbus_client_scan.h"
+#include "modbus_test_constants.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+#define DEFAULT_PORT 1502
+#define DEFAULT_PERIODS "100,1000"
+#define DEFAULT_DURATION_MS 10000
+#define DEFAULT_GAP 8
+
+#define MAX_PERIODS 16
+
+/* the test tags: spread over the server's tables, with gaps between them
+ * (the registers stop short of the libmodbus unit test special addresses) */
+#define NB_TAGS 7
+
+typedef struct {
+    uint8_t bits[2][8];
+    uint8_t input_bits[0x16];
+    uint16_t registers[3][4];
+    uint16_t input_registers[1];
+} tag_values_t;
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-P <period_ms>[,<period_ms>...]] [-d <duration_ms>] [-g <gap>] [-w <window>] [-c]"
+            " <ip>[:<port>] [<ip>[:<port>]...]\r\n", name);
+    printf("-c sends a network caps Macaroon with every request\r\n");
+}
+
+static void test_tags(modbus_tag_t *tags, tag_values_t *values)
+{
+    modbus_tag_t test_tags[NB_TAGS] = {
+        { MODBUS_TABLE_COILS, UT_BITS_ADDRESS, 8, values->bits[0] },
+        { MODBUS_TABLE_COILS, UT_BITS_ADDRESS + 16, 8, values->bits[1] },
+        { MODBUS_TABLE_DISCRETE_INPUTS, UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB, values->input_bits },
+        { MODBUS_TABLE_HOLDING_REGISTERS, UT_REGISTERS_ADDRESS, 4, values->registers[0] },
+        { MODBUS_TABLE_HOLDING_REGISTERS, UT_REGISTERS_ADDRESS + 6, 4, values->registers[1] },
+        { MODBUS_TABLE_HOLDING_REGISTERS, UT_REGISTERS_ADDRESS + 12, 4, values->registers[2] },
+        { MODBUS_TABLE_INPUT_REGISTERS, UT_INPUT_REGISTERS_ADDRESS, UT_INPUT_REGISTERS_NB,
+            values->input_registers },
+    };
+
+    memcpy(tags, test_tags, sizeof(test_tags));
+}
+
+/***********
+ * FUNCTIONS
+ **********/
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    char periods_arg[128] = DEFAULT_PERIODS;
+    uint32_t periods[MAX_PERIODS];
+    int num_periods = 0;
+    int duration_ms = DEFAULT_DURATION_MS;
+    int gap = DEFAULT_GAP;
+    int window = 0;
+    int network_caps = 0;
+    modbus_scan_t *scan;
+
+    while ((opt = getopt(argc, argv, "P:d:g:w:ch")) != -1) {
+        switch (opt) {
+            case 'P':
+                strncpy(periods_arg, optarg, sizeof(periods_arg) - 1);
+                break;
+            case 'd':
+                duration_ms = atoi(optarg);
+                break;
+            case 'g':
+                gap = atoi(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            case 'c':
+                network_caps = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    for (char *token = strtok(periods_arg, ","); token != NULL && num_periods < MAX_PERIODS;
+            token = strtok(NULL, ",")) {
+        periods[num_periods++] = (uint32_t)atoi(token);
+    }
+
+    if (optind == argc || num_periods == 0 || duration_ms <= 0 || gap < 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    scan = modbus_scan_new();
+    if (scan == NULL) {
+        exit(1);
+    }
+
+    int num_servers = argc - optind;
+    tag_values_t *values = (tag_values_t *)calloc(num_servers * num_periods, sizeof(tag_values_t));
+    if (values == NULL) {
+        exit(1);
+    }
+
+    for (int i = 0; i < num_servers; ++i) {
+        char ip[64];
+        int port = DEFAULT_PORT;
+        char *colon;
+
+        strncpy(ip, argv[optind + i], sizeof(ip) - 1);
+        ip[sizeof(ip) - 1] = '\0';
+        colon = strchr(ip, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            port = atoi(colon + 1);
+        }
+
+        int server = modbus_scan_add_server(scan, ip, port, network_caps, window);
+        if (server == -1) {
+            fprintf(stderr, "Unable to connect to %s:%d: %s\r\n", ip, port, modbus_strerror(errno));
+            exit(1);
+        }
+
+        for (int j = 0; j < num_periods; ++j) {
+            modbus_tag_t tags[NB_TAGS];
+
+            test_tags(tags, &values[i * num_periods + j]);
+            if (modbus_scan_add_group(scan, server, tags, NB_TAGS, gap, periods[j], NULL, NULL) == -1) {
+                fprintf(stderr, "Unable to add a %u ms group: %s\r\n", periods[j], modbus_strerror(errno));
+                exit(1);
+            }
+        }
+    }
+
+    if (modbus_scan_run(scan, duration_ms) == -1) {
+        fprintf(stderr, "Scan failed: %s\r\n", strerror(errno));
+    }
+
+    printf("benchmark_type, server, group, period_ms, blocks, scans, failed, missed, "
+            "mean_lateness_us, max_lateness_us, mean_duration_us, max_duration_us\n");
+    modbus_scan_print_stats(scan, stdout);
+
+    modbus_scan_free(scan);
+    free(values);
+
+    return 0;
+}
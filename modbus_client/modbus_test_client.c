@@ -9,16 +9,27 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <time.h>
 
 #include "modbus/modbus.h"
 
 #include "modbus_test_constants.h"
+#include "modbus_workload.h"
+#include "modbus_load_generator.h"
 
 #if defined(MODBUS_BENCHMARK)
 #include "microbenchmark.h"
 #endif
 
+#if defined(MODBUS_BENCHMARK) && defined(MODBUS_PERF_COUNTERS)
+#include "perfcounters.h"
+#endif
+
+#if defined(MODBUS_BENCHMARK)
+/* markers are empty unless MODBUS_HEAP_PROFILE */
+#include "heapprofile.h"
+#endif
+
 #if defined(MODBUS_NETWORK_CAPS)
 #include "modbus_network_caps.h"
 #endif
@@ -65,34 +76,117 @@ static uint32_t response_to_sec;
 static uint32_t response_to_usec;
 static int success = FALSE;
 
+static void usage(const char *name)
+{
+    printf("Usage: %s [-w <workload spec> | -f <workload file>]"
+            " [-t <threads> [-c <connections per thread>] [-z <think time us>]]"
+            " [-r <rate>[:<stop>:<step>] [-a constant|poisson] [-d <seconds>]]"
+            " [qemu|fett] [iterations]"
+            " - Modbus client for unit testing\r\n", name);
+    printf("See modbus_workload.h for the workload spec\r\n");
+    printf("-t runs the closed-loop load generator, -r the open-loop one"
+            " (see modbus_load_generator.h)\r\n");
+}
+
 int main(int argc, char *argv[])
 {
     int rc;
-    int num_iters;
-    int num_iters_inner = 10;
-    struct timeval tv_start, tv_end;
+    int opt;
+#if defined(MODBUS_BENCHMARK)
+    struct timespec ts_op_start, ts_op_end;
     uint64_t time_diff;
+#endif
+    modbus_workload_t workload;
+    workload_op_t op;
+    modbus_load_config_t load_config = {
+        .ip = "127.0.0.1",
+        .port = 1502,
+        .num_connections = 1,
+        .workload = &workload,
+        .mode = LOAD_CLOSED_LOOP,
+        .arrival = LOAD_ARRIVAL_CONSTANT,
+        .duration_s = 10
+    };
+    workload_table_t bits_table = { UT_BITS_ADDRESS, UT_BITS_NB };
+    workload_table_t input_bits_table = { UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB };
+    workload_table_t registers_table = { UT_REGISTERS_ADDRESS, UT_REGISTERS_NB_MAX };
+    workload_table_t input_registers_table = { UT_INPUT_REGISTERS_ADDRESS, UT_INPUT_REGISTERS_NB };
+
+    modbus_workload_init(&workload, bits_table, input_bits_table,
+            registers_table, input_registers_table);
+
+    while ((opt = getopt(argc, argv, "w:f:t:c:z:r:a:d:h")) != -1) {
+        switch (opt) {
+            case 'w':
+                if (modbus_workload_parse(&workload, optarg) == -1) {
+                    exit(1);
+                }
+                break;
+            case 'f':
+                if (modbus_workload_parse_file(&workload, optarg) == -1) {
+                    exit(1);
+                }
+                break;
+            case 't':
+                load_config.num_threads = atoi(optarg);
+                break;
+            case 'c':
+                load_config.num_connections = atoi(optarg);
+                break;
+            case 'z':
+                load_config.think_time_us = atoi(optarg);
+                break;
+            case 'r':
+                load_config.mode = LOAD_OPEN_LOOP;
+                if (sscanf(optarg, "%lf:%lf:%lf", &load_config.rate,
+                            &load_config.rate_stop, &load_config.rate_step) < 1) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'a':
+                if (strcmp(optarg, "poisson") == 0) {
+                    load_config.arrival = LOAD_ARRIVAL_POISSON;
+                } else if (strcmp(optarg, "constant") != 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                load_config.duration_s = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
 
-    if (argc > 1) {
-        if (strcmp(argv[1], "qemu") == 0) {
-            ctx = modbus_new_tcp("127.0.0.1", 1502);
-        } else if (strcmp(argv[1], "fett") == 0) {
-            ctx = modbus_new_tcp("10.0.2.15", 502);
-        } else {
-            printf("Usage: %s [qemu|fett] - Modbus client for unit testing\r\n", argv[0]);
+    /* By default, qemu */
+    if (optind < argc) {
+        if (strcmp(argv[optind], "fett") == 0) {
+            load_config.ip = "10.0.2.15";
+            load_config.port = 502;
+        } else if (strcmp(argv[optind], "qemu") != 0) {
+            usage(argv[0]);
             exit(1);
         }
-    } else {
-        /* By default */
-        ctx = modbus_new_tcp("127.0.0.1", 1502);
     }
 
-    if (argc == 3) {
-        num_iters = atoi(argv[2]);
-    } else {
-        num_iters = 1;
+    /* the iteration count on the command line overrides the workload's */
+    if (optind + 1 < argc) {
+        workload.num_iters = atoi(argv[optind + 1]);
+    }
+
+    if (load_config.mode == LOAD_OPEN_LOOP && load_config.num_threads == 0) {
+        load_config.num_threads = 1;
+    }
+
+    if (load_config.num_threads > 0) {
+        return modbus_load_generator_run(&load_config, stdout);
     }
 
+    ctx = modbus_new_tcp(load_config.ip, load_config.port);
+
     if (ctx == NULL) {
         fprintf(stderr, "Unable to allocate libmodbus context\r\n");
         return -1;
@@ -114,9 +208,10 @@ int main(int argc, char *argv[])
     tab_rp_bits = (uint8_t *) malloc(nb_points * sizeof(uint8_t));
     memset(tab_rp_bits, 0, nb_points * sizeof(uint8_t));
 
-    /* Allocate and initialize the memory to store the registers */
-    nb_points = (UT_REGISTERS_NB > UT_INPUT_REGISTERS_NB) ?
-        UT_REGISTERS_NB : UT_INPUT_REGISTERS_NB;
+    /* Allocate and initialize the memory to store the registers
+     * (workloads may access the whole holding register table) */
+    nb_points = (UT_REGISTERS_NB_MAX > UT_INPUT_REGISTERS_NB) ?
+        UT_REGISTERS_NB_MAX : UT_INPUT_REGISTERS_NB;
     tab_rp_registers = (uint16_t *) malloc(nb_points * sizeof(uint16_t));
     memset(tab_rp_registers, 0, nb_points * sizeof(uint16_t));
 
@@ -145,38 +240,56 @@ int main(int argc, char *argv[])
     printf("----------\r\n");
     printf("BEGIN_TEST\r\n");
     printf("----------\r\n");
+    modbus_workload_print(&workload, stdout);
+#endif
+
+#if defined(MODBUS_BENCHMARK) && defined(MODBUS_PERF_COUNTERS)
+    /* Hardware counters are optional: if the host doesn't expose a PMU
+     * we still collect the timing samples. */
+    if (xPerfCountersOpen() != 0) {
+        fprintf(stderr, "Hardware performance counters unavailable\r\n");
+    }
 #endif
 
     /* Execute a series of requests to the Modbus server
      * and validate the replies. */
-    for(int i = 0; i < num_iters; ++i) {
-
-        /* Get timestamp before executing test_body(). */
-        gettimeofday(&tv_start, NULL);
+    for(int i = 0; i < workload.num_iters; ++i) {
+        for(int j = 0; j < workload.num_ops; ++j) {
+            modbus_workload_next_op(&workload, &op);
 
-        for(int j = 0; j < num_iters_inner; ++j) {
-#if defined(MODBUS_NETWORK_CAPS)
-            rc = modbus_write_bit_network_caps(ctx, UT_BITS_ADDRESS, ON);
-#else
-            rc = modbus_write_bit(ctx, UT_BITS_ADDRESS, ON);
+#if defined(MODBUS_BENCHMARK) && defined(MODBUS_PERF_COUNTERS)
+            vPerfCountersStart();
+#endif
+#if defined(MODBUS_BENCHMARK)
+            HEAP_PROFILE_BEGIN(op.name);
+            clock_gettime(CLOCK_MONOTONIC, &ts_op_start);
+#endif
+            rc = modbus_workload_execute(ctx, &op, tab_rp_bits, tab_rp_registers);
+#if defined(MODBUS_BENCHMARK)
+            clock_gettime(CLOCK_MONOTONIC, &ts_op_end);
+            HEAP_PROFILE_END();
+#endif
+#if defined(MODBUS_BENCHMARK) && defined(MODBUS_PERF_COUNTERS)
+            vPerfCountersStop((char *)op.name);
 #endif
             /* Swap this for the call above to test all modbus functions */
             /* rc = test_body(); */
             ASSERT_TRUE(rc != -1, "");
-        }
-
-        /* Get timestamp after executing test_body(). */
-        gettimeofday(&tv_end, NULL);
 
 #if defined(MODBUS_BENCHMARK)
-        /* Get the timestamp difference in usec and store as
-         * a benchmark sample.
-         * We divide by num_iters_inner to get an average per-call
-         * time from the aggregate. */
-        time_diff = 1e6 * (tv_end.tv_sec - tv_start.tv_sec) +
-            (tv_end.tv_usec - tv_start.tv_usec);
-        xMicrobenchmarkSample(MAX_PROCESSING, "MODBUS_FC_ALL", time_diff/num_iters_inner, 1);
+            /* Record the round trip (ns) of each request against its function. */
+            time_diff = 1000000000ULL * (ts_op_end.tv_sec - ts_op_start.tv_sec) +
+                (ts_op_end.tv_nsec - ts_op_start.tv_nsec);
+            xMicrobenchmarkSample(MAX_PROCESSING, (char *)op.name, time_diff, 1);
+#endif
+#if defined(MODBUS_BENCHMARK) && defined(MODBUS_NETWORK_CAPS)
+            /* Break the round trip into the token write and the request */
+            uint64_t token_time = network_caps_last_token_time(ctx);
+            xMicrobenchmarkSample(TOKEN_ROUND_TRIP, (char *)op.name, token_time, 1);
+            xMicrobenchmarkSample(DATA_ROUND_TRIP, (char *)op.name,
+                    (time_diff > token_time) ? time_diff - token_time : 0, 1);
 #endif
+        }
     }
 
 #if !defined(MODBUS_BENCHMARK)
@@ -185,10 +298,18 @@ int main(int argc, char *argv[])
     printf("--------\r\n");
 #endif
 
+#if defined(MODBUS_BENCHMARK) && defined(MODBUS_PERF_COUNTERS)
+    vPerfCountersClose();
+#endif
+
 #if defined(MODBUS_BENCHMARK)
     vPrintMicrobenchmarkSamples();
 #endif
 
+#if defined(MODBUS_BENCHMARK) && defined(MODBUS_HEAP_PROFILE)
+    vPrintHeapProfile();
+#endif
+
     success = TRUE;
 
 close:
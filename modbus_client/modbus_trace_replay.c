@@ -0,0 +1,388 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/*
+ * Replays a traffic trace recorded by modbus_host_server -w to a Modbus
+ * server, so captured traffic can be used as a reproducible benchmark.
+ *
+ * Each connection in the trace gets its own connection to the server, and
+ * requests are sent in trace order, each waiting for its reply.  The raw
+ * request ADUs are sent with modbus_send_raw_request(), so the server sees
+ * exactly the recorded requests, including the tokens written with
+ * MODBUS_FC_WRITE_STRING (which only verify against a server with the same
+ * Macaroon key as the one recorded).
+ *
+ * -s sets the pacing: 1 replays at the recorded times, N replays N times
+ * faster, and 0 sends each request as soon as the previous reply arrives.
+ * Latencies are from the send of each request to its reply; lateness is
+ * how far behind the paced send time a request was sent.
+ *
+ * For each repeat (-n), the output has a row per function code and one for
+ * ALL functions, then a summary:
+ * REPLAY, repeat, function, requests, errors, mean_us, p50_us, p99_us, max_us
+ * REPLAY_SUMMARY, repeat, elapsed_s, throughput, max_lateness_us
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "modbus/modbus.h"
+#include "modbus/modbus-helpers.h"
+
+#include "traffictrace.h"
+
+/*************
+ * DEFINITIONS
+ ************/
+
+#define DEFAULT_IP "127.0.0.1"
+#define DEFAULT_PORT 1502
+
+/* Length of the MBAP header fields that libmodbus rebuilds when sending a
+ * raw request (transaction id, protocol id and length).  The unit id and
+ * the PDU that follow are the raw request. */
+#define MBAP_REBUILT_LENGTH 6
+
+/* the last slot holds the totals over all functions */
+#define REPLAY_ALL_FUNCTIONS 256
+#define REPLAY_NUM_SLOTS 257
+
+typedef struct {
+    uint16_t connection;
+    uint16_t length;
+    uint64_t timestamp_ns;
+    uint8_t *adu;
+    uint64_t latency_ns;
+    int failed;
+} replay_request_t;
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-i <ip>] [-p <port>] [-s <speed-up>] [-n <repeats>] <trace file>\r\n", name);
+    printf("-s 1 replays at the recorded pacing (default), N replays N times faster,"
+            " and 0 replays as fast as possible\r\n");
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline)
+{
+    struct timespec t = {
+        .tv_sec = (time_t)(deadline / 1000000000ULL),
+        .tv_nsec = (long)(deadline % 1000000000ULL)
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) {
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Load every record in the trace into an array
+ * Returns the number of requests, or -1 on error
+ * */
+static int load_trace(const char *path, replay_request_t **requests, int *num_connections)
+{
+    TrafficTraceRecord_t record;
+    FILE *trace = pxTrafficTraceOpen(path);
+    replay_request_t *loaded = NULL;
+    int num_loaded = 0;
+    int capacity = 0;
+    int rc;
+
+    if (trace == NULL) {
+        fprintf(stderr, "%s is not a traffic trace\r\n", path);
+        return -1;
+    }
+
+    *num_connections = 0;
+    while ((rc = xTrafficTraceRead(trace, &record)) == 1) {
+        if (record.usLength <= MBAP_REBUILT_LENGTH + 1) {
+            /* not a request libmodbus can send */
+            continue;
+        }
+
+        if (num_loaded == capacity) {
+            capacity = (capacity == 0) ? 1024 : capacity * 2;
+            loaded = (replay_request_t *)realloc(loaded, capacity * sizeof(replay_request_t));
+            if (loaded == NULL) {
+                fclose(trace);
+                return -1;
+            }
+        }
+
+        replay_request_t *request = &loaded[num_loaded++];
+        request->connection = record.usConnection;
+        request->length = record.usLength;
+        request->timestamp_ns = record.ullTimestamp;
+        request->adu = (uint8_t *)malloc(record.usLength);
+        if (request->adu == NULL) {
+            fclose(trace);
+            return -1;
+        }
+        memcpy(request->adu, record.pucAdu, record.usLength);
+
+        if (record.usConnection >= *num_connections) {
+            *num_connections = record.usConnection + 1;
+        }
+    }
+
+    fclose(trace);
+
+    if (rc == -1) {
+        fprintf(stderr, "%s is truncated or corrupt\r\n", path);
+        return -1;
+    }
+
+    *requests = loaded;
+    return num_loaded;
+}
+
+/**
+ * The context for a connection in the trace, connecting on first use
+ * */
+static modbus_t *get_connection(modbus_t **ctxs, uint16_t connection, const char *ip, int port)
+{
+    if (ctxs[connection] == NULL) {
+        modbus_t *ctx = modbus_new_tcp(ip, port);
+
+        if (ctx == NULL) {
+            return NULL;
+        }
+
+        if (modbus_connect(ctx) == -1) {
+            fprintf(stderr, "Connection failed: %s\r\n", modbus_strerror(errno));
+            modbus_free(ctx);
+            return NULL;
+        }
+
+        ctxs[connection] = ctx;
+    }
+
+    return ctxs[connection];
+}
+
+static void print_row(int repeat, const char *function_name, replay_request_t *requests,
+        int num_requests, int function, uint64_t *latencies)
+{
+    int count = 0;
+    int errors = 0;
+    uint64_t sum_ns = 0;
+
+    for (int i = 0; i < num_requests; ++i) {
+        if (function != REPLAY_ALL_FUNCTIONS &&
+                requests[i].adu[MBAP_REBUILT_LENGTH + 1] != function) {
+            continue;
+        }
+
+        if (requests[i].failed) {
+            errors += 1;
+            continue;
+        }
+
+        latencies[count++] = requests[i].latency_ns;
+        sum_ns += requests[i].latency_ns;
+    }
+
+    if (count + errors == 0) {
+        return;
+    }
+
+    if (count == 0) {
+        printf("REPLAY, %d, %s, 0, %d, 0, 0, 0, 0\n", repeat, function_name, errors);
+        return;
+    }
+
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    printf("REPLAY, %d, %s, %d, %d, %.1f, %.1f, %.1f, %.1f\n",
+            repeat, function_name, count, errors,
+            (double)sum_ns / count / 1e3,
+            (double)latencies[count / 2] / 1e3,
+            (double)latencies[(size_t)(count * 0.99)] / 1e3,
+            (double)latencies[count - 1] / 1e3);
+}
+
+/***********
+ * FUNCTIONS
+ **********/
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    const char *ip = DEFAULT_IP;
+    int port = DEFAULT_PORT;
+    double speed = 1.0;
+    int repeats = 1;
+    replay_request_t *requests = NULL;
+    int num_requests;
+    int num_connections;
+    uint64_t *latencies;
+    uint8_t rsp[MODBUS_MAX_STRING_LENGTH];
+    modbus_t *names_ctx;
+
+    while ((opt = getopt(argc, argv, "i:p:s:n:h")) != -1) {
+        switch (opt) {
+            case 'i':
+                ip = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'n':
+                repeats = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind != argc - 1 || speed < 0 || repeats <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    num_requests = load_trace(argv[optind], &requests, &num_connections);
+    if (num_requests <= 0) {
+        fprintf(stderr, "No requests to replay\r\n");
+        exit(1);
+    }
+
+    latencies = (uint64_t *)malloc(num_requests * sizeof(uint64_t));
+    if (latencies == NULL) {
+        exit(1);
+    }
+
+    /* never connected, only used to decode the recorded ADUs */
+    names_ctx = modbus_new_tcp(ip, port);
+    if (names_ctx == NULL) {
+        exit(1);
+    }
+
+    printf("benchmark_type, repeat, modbus_function_name, requests, errors, "
+            "mean_us, p50_us, p99_us, max_us\n");
+
+    for (int repeat = 0; repeat < repeats; ++repeat) {
+        modbus_t **ctxs = (modbus_t **)calloc(num_connections, sizeof(modbus_t *));
+        uint64_t max_lateness_ns = 0;
+        uint64_t start, elapsed;
+        int seen[REPLAY_NUM_SLOTS] = { 0 };
+
+        if (ctxs == NULL) {
+            exit(1);
+        }
+
+        start = now_ns();
+        for (int i = 0; i < num_requests; ++i) {
+            replay_request_t *request = &requests[i];
+            modbus_t *ctx;
+            uint64_t sent;
+
+            if (speed > 0) {
+                uint64_t due = start + (uint64_t)(request->timestamp_ns / speed);
+
+                sleep_until_ns(due);
+                sent = now_ns();
+                if (sent - due > max_lateness_ns) {
+                    max_lateness_ns = sent - due;
+                }
+            } else {
+                sent = now_ns();
+            }
+
+            request->failed = 1;
+            ctx = get_connection(ctxs, request->connection, ip, port);
+            if (ctx == NULL) {
+                continue;
+            }
+
+            if (modbus_send_raw_request(ctx, request->adu + MBAP_REBUILT_LENGTH,
+                        request->length - MBAP_REBUILT_LENGTH) != -1 &&
+                    modbus_receive_confirmation(ctx, rsp) != -1) {
+                request->failed = 0;
+            }
+            request->latency_ns = now_ns() - sent;
+        }
+        elapsed = now_ns() - start;
+
+        for (int c = 0; c < num_connections; ++c) {
+            if (ctxs[c] != NULL) {
+                modbus_close(ctxs[c]);
+                modbus_free(ctxs[c]);
+            }
+        }
+        free(ctxs);
+
+        /* a row per function code in the trace, then the totals */
+        for (int i = 0; i < num_requests; ++i) {
+            int function = requests[i].adu[MBAP_REBUILT_LENGTH + 1];
+
+            if (!seen[function]) {
+                seen[function] = 1;
+                print_row(repeat, modbus_get_function_name(names_ctx, requests[i].adu),
+                        requests, num_requests, function, latencies);
+            }
+        }
+        print_row(repeat, "ALL", requests, num_requests, REPLAY_ALL_FUNCTIONS, latencies);
+
+        printf("REPLAY_SUMMARY, %d, %.3f, %.1f, %.1f\n", repeat, elapsed / 1e9,
+                num_requests / (elapsed / 1e9), max_lateness_ns / 1e3);
+        fflush(stdout);
+    }
+
+    for (int i = 0; i < num_requests; ++i) {
+        free(requests[i].adu);
+    }
+    free(requests);
+    free(latencies);
+    modbus_free(names_ctx);
+
+    return 0;
+}
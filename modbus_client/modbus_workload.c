@@ -0,0 +1,487 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus_workload.h"
+
+#if defined(MODBUS_NETWORK_CAPS)
+#include "modbus_network_caps.h"
+#endif
+
+/*************
+ * DEFINITIONS
+ ************/
+
+/* maximum size of a workload file */
+#define MAX_WORKLOAD_FILE_LENGTH 4096
+
+/* with network capabilities, every request goes through the shim */
+#if defined(MODBUS_NETWORK_CAPS)
+#define WORKLOAD_CALL(function, ...) function##_network_caps(__VA_ARGS__)
+#else
+#define WORKLOAD_CALL(function, ...) function(__VA_ARGS__)
+#endif
+
+/* names accepted in mix= */
+const char *workload_function_names[WORKLOAD_NUM_FUNCTIONS] = {
+    "read_bits",
+    "read_input_bits",
+    "read_registers",
+    "read_input_registers",
+    "write_bit",
+    "write_register",
+    "write_bits",
+    "write_registers",
+    "mask_write_register",
+    "write_and_read_registers"
+};
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+/**
+ * xorshift32: small, fast and reproducible across hosts, which is all
+ * the address and mix choices need
+ * */
+static uint32_t next_random(modbus_workload_t *wl)
+{
+    uint32_t x = wl->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    wl->rng = x;
+    return x;
+}
+
+/* uniform in [0, n) */
+static int random_below(modbus_workload_t *wl, int n)
+{
+    return (n <= 1) ? 0 : (int)(next_random(wl) % (uint32_t)n);
+}
+
+/* uniform in [0, 1) */
+static double random_unit(modbus_workload_t *wl)
+{
+    return (next_random(wl) >> 8) / (double)(1 << 24);
+}
+
+static int function_from_name(const char *name)
+{
+    for (int i = 0; i < WORKLOAD_NUM_FUNCTIONS; ++i) {
+        if (strcmp(name, workload_function_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Returns the table a function accesses and the largest nb a single
+ * request may carry for it (1 for single-element functions)
+ * */
+static const workload_table_t *function_table(const modbus_workload_t *wl,
+        workload_function_t function, int *nb_max)
+{
+    switch (function) {
+        case WORKLOAD_READ_BITS:
+            *nb_max = MODBUS_MAX_READ_BITS;
+            return &wl->bits;
+        case WORKLOAD_WRITE_BITS:
+            *nb_max = MODBUS_MAX_WRITE_BITS;
+            return &wl->bits;
+        case WORKLOAD_WRITE_BIT:
+            *nb_max = 1;
+            return &wl->bits;
+        case WORKLOAD_READ_INPUT_BITS:
+            *nb_max = MODBUS_MAX_READ_BITS;
+            return &wl->input_bits;
+        case WORKLOAD_READ_REGISTERS:
+            *nb_max = MODBUS_MAX_READ_REGISTERS;
+            return &wl->registers;
+        case WORKLOAD_WRITE_REGISTERS:
+            *nb_max = MODBUS_MAX_WRITE_REGISTERS;
+            return &wl->registers;
+        case WORKLOAD_WRITE_AND_READ_REGISTERS:
+            *nb_max = MODBUS_MAX_WR_WRITE_REGISTERS;
+            return &wl->registers;
+        case WORKLOAD_WRITE_REGISTER:
+        case WORKLOAD_MASK_WRITE_REGISTER:
+            *nb_max = 1;
+            return &wl->registers;
+        case WORKLOAD_READ_INPUT_REGISTERS:
+        default:
+            *nb_max = MODBUS_MAX_READ_REGISTERS;
+            return &wl->input_registers;
+    }
+}
+
+/**
+ * Benchmark sample names, matching modbus_get_function_name() on the
+ * server so client and server samples can be joined
+ * */
+static const char *function_sample_name(workload_function_t function, int nb)
+{
+    switch (function) {
+        case WORKLOAD_READ_BITS:
+            return (nb == 1) ? "MODBUS_FC_READ_SINGLE_COIL" : "MODBUS_FC_READ_MULTIPLE_COILS";
+        case WORKLOAD_READ_INPUT_BITS:
+            return "MODBUS_FC_READ_MULTIPLE_DISCRETE_INPUTS";
+        case WORKLOAD_READ_REGISTERS:
+            return (nb == 1) ? "MODBUS_FC_READ_SINGLE_HOLDING_REGISTER" :
+                "MODBUS_FC_READ_MULTIPLE_HOLDING_REGISTERS";
+        case WORKLOAD_READ_INPUT_REGISTERS:
+            return "MODBUS_FC_READ_INPUT_REGISTERS";
+        case WORKLOAD_WRITE_BIT:
+            return "MODBUS_FC_WRITE_SINGLE_COIL";
+        case WORKLOAD_WRITE_REGISTER:
+            return "MODBUS_FC_WRITE_SINGLE_REGISTER";
+        case WORKLOAD_WRITE_BITS:
+            return "MODBUS_FC_WRITE_MULTIPLE_COILS";
+        case WORKLOAD_WRITE_REGISTERS:
+            return "MODBUS_FC_WRITE_MULTIPLE_REGISTERS";
+        case WORKLOAD_MASK_WRITE_REGISTER:
+            return "MODBUS_FC_MASK_WRITE_REGISTER";
+        case WORKLOAD_WRITE_AND_READ_REGISTERS:
+        default:
+            return "MODBUS_FC_WRITE_AND_READ_REGISTERS";
+    }
+}
+
+static int parse_mix_entry(modbus_workload_t *wl, char *entry)
+{
+    char *colon = strchr(entry, ':');
+    int function;
+    int weight = 1;
+
+    if (colon != NULL) {
+        *colon = '\0';
+        weight = atoi(colon + 1);
+    }
+
+    function = function_from_name(entry);
+    if (function < 0 || weight < 0) {
+        fprintf(stderr, "Unknown workload function or bad weight: %s\n", entry);
+        return -1;
+    }
+
+    wl->total_weight += weight - wl->weights[function];
+    wl->weights[function] = weight;
+    return 0;
+}
+
+static int parse_addr(modbus_workload_t *wl, char *value)
+{
+    if (strcmp(value, "fixed") == 0) {
+        wl->addr_dist = WORKLOAD_ADDR_FIXED;
+    } else if (strcmp(value, "uniform") == 0) {
+        wl->addr_dist = WORKLOAD_ADDR_UNIFORM;
+    } else if (strncmp(value, "hotset", strlen("hotset")) == 0) {
+        wl->addr_dist = WORKLOAD_ADDR_HOTSET;
+        if (sscanf(value, "hotset:%lf:%lf", &wl->hotset_fraction, &wl->hotset_probability) != 2 ||
+                wl->hotset_fraction <= 0 || wl->hotset_fraction > 1 ||
+                wl->hotset_probability < 0 || wl->hotset_probability > 1) {
+            fprintf(stderr, "Expected addr=hotset:<fraction>:<probability>, got %s\n", value);
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "Unknown address distribution: %s\n", value);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*******************
+ * WORKLOAD FUNCTIONS
+ ******************/
+
+void modbus_workload_init(modbus_workload_t *wl,
+        workload_table_t bits, workload_table_t input_bits,
+        workload_table_t registers, workload_table_t input_registers)
+{
+    memset(wl, 0, sizeof(modbus_workload_t));
+
+    /* the original benchmark: 10 x write_bit to the first coil */
+    wl->weights[WORKLOAD_WRITE_BIT] = 1;
+    wl->total_weight = 1;
+    wl->addr_dist = WORKLOAD_ADDR_FIXED;
+    wl->nb = 1;
+    wl->num_iters = 1;
+    wl->num_ops = 10;
+
+    wl->bits = bits;
+    wl->input_bits = input_bits;
+    wl->registers = registers;
+    wl->input_registers = input_registers;
+
+    modbus_workload_seed(wl, 1);
+}
+
+void modbus_workload_seed(modbus_workload_t *wl, uint32_t seed)
+{
+    wl->seed = seed;
+
+    /* xorshift must not start at 0 */
+    wl->rng = (seed != 0) ? seed : 0x9e3779b9;
+}
+
+/**
+ * Parse a workload spec (see modbus_workload.h) into wl.
+ * Keys not given in the spec keep their current values.
+ *
+ * Returns 0 on success, -1 on a malformed spec.
+ * */
+int modbus_workload_parse(modbus_workload_t *wl, const char *spec)
+{
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    char *token;
+    int in_mix = 0;
+    int mix_given = 0;
+    int rc = 0;
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    for (token = strtok_r(copy, ",\n", &saveptr); token != NULL && rc == 0;
+            token = strtok_r(NULL, ",\n", &saveptr)) {
+        /* skip blank lines and comments in workload files */
+        token += strspn(token, " \t\r");
+        if (*token == '\0' || *token == '#') {
+            continue;
+        }
+
+        char *equals = strchr(token, '=');
+
+        /* mix entries after the first are separated by commas too */
+        if (equals == NULL) {
+            if (in_mix) {
+                rc = parse_mix_entry(wl, token);
+            } else {
+                fprintf(stderr, "Expected key=value in workload, got %s\n", token);
+                rc = -1;
+            }
+            continue;
+        }
+
+        *equals = '\0';
+        char *key = token;
+        char *value = equals + 1;
+        in_mix = 0;
+
+        if (strcmp(key, "mix") == 0) {
+            /* a mix replaces the default one */
+            if (!mix_given) {
+                memset(wl->weights, 0, sizeof(wl->weights));
+                wl->total_weight = 0;
+                mix_given = 1;
+            }
+            in_mix = 1;
+            rc = parse_mix_entry(wl, value);
+        } else if (strcmp(key, "addr") == 0) {
+            rc = parse_addr(wl, value);
+        } else if (strcmp(key, "nb") == 0) {
+            wl->nb = atoi(value);
+        } else if (strcmp(key, "iters") == 0) {
+            wl->num_iters = atoi(value);
+        } else if (strcmp(key, "ops") == 0) {
+            wl->num_ops = atoi(value);
+        } else if (strcmp(key, "seed") == 0) {
+            modbus_workload_seed(wl, (uint32_t)strtoul(value, NULL, 0));
+        } else {
+            fprintf(stderr, "Unknown workload key: %s\n", key);
+            rc = -1;
+        }
+    }
+
+    free(copy);
+
+    if (rc == 0 && (wl->total_weight <= 0 || wl->nb < 1 ||
+                wl->num_iters < 1 || wl->num_ops < 1)) {
+        fprintf(stderr, "Workload needs a non-empty mix and positive nb, iters and ops\n");
+        rc = -1;
+    }
+
+    return rc;
+}
+
+/**
+ * Parse a workload file: the same keys as a spec, one or more per line
+ * */
+int modbus_workload_parse_file(modbus_workload_t *wl, const char *path)
+{
+    char spec[MAX_WORKLOAD_FILE_LENGTH];
+    size_t length;
+    FILE *fin = fopen(path, "r");
+
+    if (fin == NULL) {
+        fprintf(stderr, "Unable to open workload %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    length = fread(spec, 1, sizeof(spec) - 1, fin);
+    spec[length] = '\0';
+
+    /* a longer file would be cut off, perhaps mid-key, and parse as another workload */
+    if (ferror(fin)) {
+        fprintf(stderr, "Unable to read workload %s: %s\n", path, strerror(errno));
+        fclose(fin);
+        return -1;
+    }
+    if (fgetc(fin) != EOF) {
+        fprintf(stderr, "Workload %s is longer than %d bytes\n", path, MAX_WORKLOAD_FILE_LENGTH - 1);
+        fclose(fin);
+        return -1;
+    }
+    fclose(fin);
+
+    return modbus_workload_parse(wl, spec);
+}
+
+void modbus_workload_print(const modbus_workload_t *wl, FILE *stream)
+{
+    const char *addr_dist_names[] = { "fixed", "uniform", "hotset" };
+
+    fprintf(stream, "workload: mix=");
+    for (int i = 0, first = 1; i < WORKLOAD_NUM_FUNCTIONS; ++i) {
+        if (wl->weights[i] > 0) {
+            fprintf(stream, "%s%s:%d", first ? "" : ",", workload_function_names[i], wl->weights[i]);
+            first = 0;
+        }
+    }
+
+    fprintf(stream, " addr=%s", addr_dist_names[wl->addr_dist]);
+    if (wl->addr_dist == WORKLOAD_ADDR_HOTSET) {
+        fprintf(stream, ":%g:%g", wl->hotset_fraction, wl->hotset_probability);
+    }
+
+    fprintf(stream, " nb=%d iters=%d ops=%d seed=%u\n",
+            wl->nb, wl->num_iters, wl->num_ops, wl->seed);
+}
+
+/**
+ * Choose the next request: a function from the mix, an nb clamped to the
+ * function and table, and an address from the address distribution
+ * */
+void modbus_workload_next_op(modbus_workload_t *wl, workload_op_t *op)
+{
+    const workload_table_t *table;
+    int nb_max;
+    int choice;
+    int num_offsets;
+
+    /* pick the function */
+    choice = random_below(wl, wl->total_weight);
+    op->function = WORKLOAD_WRITE_BIT;
+    for (int i = 0; i < WORKLOAD_NUM_FUNCTIONS; ++i) {
+        if (choice < wl->weights[i]) {
+            op->function = (workload_function_t)i;
+            break;
+        }
+        choice -= wl->weights[i];
+    }
+
+    /* clamp nb to what the function and the table allow */
+    table = function_table(wl, op->function, &nb_max);
+    op->nb = wl->nb;
+    if (op->nb > nb_max) {
+        op->nb = nb_max;
+    }
+    if (op->nb > table->nb) {
+        op->nb = table->nb;
+    }
+
+    /* pick the address so that [addr, addr + nb) stays in the table */
+    num_offsets = table->nb - op->nb + 1;
+    switch (wl->addr_dist) {
+        case WORKLOAD_ADDR_UNIFORM:
+            op->addr = table->start + random_below(wl, num_offsets);
+            break;
+        case WORKLOAD_ADDR_HOTSET:
+            if (random_unit(wl) < wl->hotset_probability) {
+                int hot_offsets = (int)(wl->hotset_fraction * num_offsets + 0.5);
+                op->addr = table->start + random_below(wl, (hot_offsets > 0) ? hot_offsets : 1);
+            } else {
+                op->addr = table->start + random_below(wl, num_offsets);
+            }
+            break;
+        case WORKLOAD_ADDR_FIXED:
+        default:
+            op->addr = table->start;
+    }
+
+    op->name = function_sample_name(op->function, op->nb);
+}
+
+/**
+ * Send one request.  bits and registers must hold at least nb elements.
+ *
+ * Returns the libmodbus return code (-1 on failure).
+ * */
+int modbus_workload_execute(modbus_t *ctx, const workload_op_t *op,
+        uint8_t *bits, uint16_t *registers)
+{
+    switch (op->function) {
+        case WORKLOAD_READ_BITS:
+            return WORKLOAD_CALL(modbus_read_bits, ctx, op->addr, op->nb, bits);
+        case WORKLOAD_READ_INPUT_BITS:
+            return WORKLOAD_CALL(modbus_read_input_bits, ctx, op->addr, op->nb, bits);
+        case WORKLOAD_READ_REGISTERS:
+            return WORKLOAD_CALL(modbus_read_registers, ctx, op->addr, op->nb, registers);
+        case WORKLOAD_READ_INPUT_REGISTERS:
+            return WORKLOAD_CALL(modbus_read_input_registers, ctx, op->addr, op->nb, registers);
+        case WORKLOAD_WRITE_BIT:
+            return WORKLOAD_CALL(modbus_write_bit, ctx, op->addr, ON);
+        case WORKLOAD_WRITE_REGISTER:
+            return WORKLOAD_CALL(modbus_write_register, ctx, op->addr, (uint16_t)op->addr);
+        case WORKLOAD_WRITE_BITS:
+            memset(bits, ON, op->nb * sizeof(uint8_t));
+            return WORKLOAD_CALL(modbus_write_bits, ctx, op->addr, op->nb, bits);
+        case WORKLOAD_WRITE_REGISTERS:
+            for (int i = 0; i < op->nb; ++i) {
+                registers[i] = (uint16_t)(op->addr + i);
+            }
+            return WORKLOAD_CALL(modbus_write_registers, ctx, op->addr, op->nb, registers);
+        case WORKLOAD_MASK_WRITE_REGISTER:
+            return WORKLOAD_CALL(modbus_mask_write_register, ctx, op->addr, 0xF2, 0x25);
+        case WORKLOAD_WRITE_AND_READ_REGISTERS:
+            for (int i = 0; i < op->nb; ++i) {
+                registers[i] = (uint16_t)(op->addr + i);
+            }
+            return WORKLOAD_CALL(modbus_write_and_read_registers, ctx,
+                    op->addr, op->nb, registers, op->addr, op->nb, registers);
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
@@ -0,0 +1,134 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_WORKLOAD_H_
+#define _MODBUS_WORKLOAD_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* for Modbus */
+#include <modbus/modbus.h>
+
+/**
+ * A workload describes the requests a benchmark client sends: the mix of
+ * Modbus functions, how request addresses are distributed over each table,
+ * the number of coils/registers per request and the number of iterations.
+ *
+ * Specs are comma- (or newline-) separated key=value pairs, e.g.:
+ *
+ *   mix=read_registers:60,read_bits:20,write_register:20,addr=hotset:0.1:0.9,nb=4,iters=100
+ *
+ * mix=<function>:<weight>[,...]  relative frequency of each function
+ *                                (functions listed in workload_function_names)
+ * addr=fixed                     always the start of the table
+ * addr=uniform                   uniformly over the table
+ * addr=hotset:<fraction>:<prob>  with probability <prob>, uniformly over the
+ *                                first <fraction> of the table, otherwise
+ *                                uniformly over the whole table
+ * nb=<n>                         coils/registers per multi-element request
+ * iters=<n>                      number of iterations
+ * ops=<n>                        requests per iteration
+ * seed=<n>                       seed for the address and mix choices
+ *
+ * The default workload is the original benchmark: ten write_bit requests
+ * to the first coil per iteration.
+ * */
+
+/*************
+ * DEFINITIONS
+ ************/
+
+typedef enum {
+    WORKLOAD_READ_BITS,
+    WORKLOAD_READ_INPUT_BITS,
+    WORKLOAD_READ_REGISTERS,
+    WORKLOAD_READ_INPUT_REGISTERS,
+    WORKLOAD_WRITE_BIT,
+    WORKLOAD_WRITE_REGISTER,
+    WORKLOAD_WRITE_BITS,
+    WORKLOAD_WRITE_REGISTERS,
+    WORKLOAD_MASK_WRITE_REGISTER,
+    WORKLOAD_WRITE_AND_READ_REGISTERS,
+    WORKLOAD_NUM_FUNCTIONS
+} workload_function_t;
+
+typedef enum {
+    WORKLOAD_ADDR_FIXED,
+    WORKLOAD_ADDR_UNIFORM,
+    WORKLOAD_ADDR_HOTSET
+} workload_addr_dist_t;
+
+/* the address range of one table in the server's mapping */
+typedef struct {
+    int start;
+    int nb;
+} workload_table_t;
+
+typedef struct {
+    int weights[WORKLOAD_NUM_FUNCTIONS];
+    int total_weight;
+    workload_addr_dist_t addr_dist;
+    double hotset_fraction;
+    double hotset_probability;
+    int nb;
+    int num_iters;
+    int num_ops;
+    uint32_t seed;
+    uint32_t rng;
+    workload_table_t bits;
+    workload_table_t input_bits;
+    workload_table_t registers;
+    workload_table_t input_registers;
+} modbus_workload_t;
+
+/* a single request generated from a workload */
+typedef struct {
+    workload_function_t function;
+    int addr;
+    int nb;
+    const char *name;
+} workload_op_t;
+
+extern const char *workload_function_names[WORKLOAD_NUM_FUNCTIONS];
+
+/***********
+ * FUNCTIONS
+ **********/
+
+void modbus_workload_init(modbus_workload_t *wl,
+        workload_table_t bits, workload_table_t input_bits,
+        workload_table_t registers, workload_table_t input_registers);
+int modbus_workload_parse(modbus_workload_t *wl, const char *spec);
+int modbus_workload_parse_file(modbus_workload_t *wl, const char *path);
+void modbus_workload_seed(modbus_workload_t *wl, uint32_t seed);
+void modbus_workload_print(const modbus_workload_t *wl, FILE *stream);
+void modbus_workload_next_op(modbus_workload_t *wl, workload_op_t *op);
+int modbus_workload_execute(modbus_t *ctx, const workload_op_t *op,
+        uint8_t *bits, uint16_t *registers);
+
+#endif /* _MODBUS_WORKLOAD_H_ */
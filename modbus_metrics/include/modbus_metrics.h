@@ -0,0 +1,130 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_METRICS_H_
+#define _MODBUS_METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*-----------------------------------------------------------*/
+
+/* Requests are counted per function code.  Codes at or above this bound
+ * (e.g., exception responses) share the last slot. */
+#define metricsMAX_FUNCTION_CODE 64
+
+/* Request processing latency is recorded in log2 buckets, so bucket i
+ * holds samples below 2^(metricsFIRST_BUCKET_LOG2 + i).  Units are cycles
+ * on FreeRTOS and nanoseconds on Linux hosts. */
+#define metricsFIRST_BUCKET_LOG2 8
+#define metricsNUM_BUCKETS 24
+
+/* Size of the buffer the text endpoint renders into */
+#ifndef metricsRENDER_BUFFER_SIZE
+#define metricsRENDER_BUFFER_SIZE 8192
+#endif
+
+/*-----------------------------------------------------------*/
+
+/*
+ * The reasons process_network_caps() can reject a request.
+ */
+typedef enum _MetricsVerificationFailure_t {
+    DESERIALISE_FAILURE,
+    TOO_MANY_CAVEATS,
+    EXCLUSIVE_FUNCTION_CAVEATS,
+    ADDRESS_OUT_OF_RANGE,
+    VERIFIER_CAVEAT_FAILURE,
+    FUNCTION_NOT_CAVEAT,
+    ADDRESS_NOT_CAVEAT,
+    SIGNATURE_FAILURE,
+    UNKNOWN_KEY,
+    NUM_VERIFICATION_FAILURES
+} MetricsVerificationFailure_t;
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Update hooks for the request path.
+ *
+ * Each update is a single relaxed atomic add on a statically allocated
+ * counter (no locks, no allocation), so metrics can stay enabled in
+ * production builds.  Unless MODBUS_METRICS is defined the hooks expand
+ * to nothing.
+ */
+#if defined( MODBUS_METRICS )
+#define METRICS_REQUEST( xFunction, ullLatency ) vMetricsRequest( ( xFunction ), ( ullLatency ) )
+#define METRICS_BYTES( xBytesIn, xBytesOut ) vMetricsBytes( ( xBytesIn ), ( xBytesOut ) )
+#define METRICS_CONNECTION() vMetricsConnection()
+#define METRICS_OVERRUN() vMetricsOverrun()
+#define METRICS_VERIFICATION_SUCCESS() vMetricsVerificationSuccess()
+#define METRICS_VERIFICATION_FAILURE( xReason ) vMetricsVerificationFailure( ( xReason ) )
+#define METRICS_OBJECT_CAPS_RESTRICTION( xFunction ) vMetricsObjectCapsRestriction( ( xFunction ) )
+#define METRICS_OBJECT_CAPS_NO_ACCESS() vMetricsObjectCapsNoAccess()
+#else
+#define METRICS_REQUEST( xFunction, ullLatency )
+#define METRICS_BYTES( xBytesIn, xBytesOut )
+#define METRICS_CONNECTION()
+#define METRICS_OVERRUN()
+#define METRICS_VERIFICATION_SUCCESS()
+#define METRICS_VERIFICATION_FAILURE( xReason )
+#define METRICS_OBJECT_CAPS_RESTRICTION( xFunction )
+#define METRICS_OBJECT_CAPS_NO_ACCESS()
+#endif
+
+/*-----------------------------------------------------------*/
+
+void vMetricsRequest( int xFunction, uint64_t ullLatency );
+void vMetricsBytes( int xBytesIn, int xBytesOut );
+void vMetricsConnection( void );
+void vMetricsOverrun( void );
+void vMetricsVerificationSuccess( void );
+void vMetricsVerificationFailure( MetricsVerificationFailure_t xReason );
+void vMetricsObjectCapsRestriction( int xFunction );
+void vMetricsObjectCapsNoAccess( void );
+
+/*
+ * Render every metric in the Prometheus text exposition format.
+ *
+ * Returns the number of characters written (excluding the terminating NUL),
+ * or -1 if pcBuffer is too small.
+ */
+int xMetricsRender( char *pcBuffer, size_t xBufferLength );
+
+#if !defined(__freertos__)
+/*
+ * Serve xMetricsRender() over HTTP on usPort from a detached thread
+ * (Linux hosts only; the FreeRTOS server has its own endpoint task).
+ *
+ * Returns 0 on success, -1 if the socket or thread could not be created.
+ */
+int xMetricsStartEndpoint( uint16_t usPort );
+#endif
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_METRICS_H_ */
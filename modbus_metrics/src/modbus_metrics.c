@@ -0,0 +1,423 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(__freertos__)
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+/* Metrics includes */
+#include "modbus_metrics.h"
+
+/* type definitions */
+
+/* Counters are only ever updated with relaxed atomic adds and read with
+ * relaxed atomic loads: each value is individually consistent, which is
+ * all a scrape needs. */
+typedef uint64_t MetricsCounter_t;
+
+#define metricsINC( pxCounter, xValue ) \
+    ( void )__atomic_fetch_add( ( pxCounter ), ( MetricsCounter_t )( xValue ), __ATOMIC_RELAXED )
+#define metricsGET( pxCounter ) \
+    __atomic_load_n( ( pxCounter ), __ATOMIC_RELAXED )
+
+#if defined(__freertos__)
+#define metricsLATENCY_UNIT "cycles"
+#else
+#define metricsLATENCY_UNIT "nanoseconds"
+#endif
+
+/* static variable declarations */
+
+static MetricsCounter_t pxRequests[ metricsMAX_FUNCTION_CODE ];
+static MetricsCounter_t pxLatencyBuckets[ metricsNUM_BUCKETS + 1 ];
+static MetricsCounter_t xLatencySum;
+static MetricsCounter_t xBytesIn;
+static MetricsCounter_t xBytesOut;
+static MetricsCounter_t xConnections;
+static MetricsCounter_t xOverruns;
+static MetricsCounter_t xVerificationSuccesses;
+static MetricsCounter_t pxVerificationFailures[ NUM_VERIFICATION_FAILURES ];
+static MetricsCounter_t pxObjectCapsRestrictions[ metricsMAX_FUNCTION_CODE ];
+static MetricsCounter_t xObjectCapsNoAccess;
+
+/* Label values for the verification failure reasons */
+static const char *pcVerificationFailureNames[ NUM_VERIFICATION_FAILURES ] = {
+    "deserialise",
+    "too_many_caveats",
+    "exclusive_function_caveats",
+    "address_out_of_range",
+    "verifier_caveat",
+    "function_not_caveat",
+    "address_not_caveat",
+    "signature",
+    "unknown_key"
+};
+
+/*-----------------------------------------------------------*/
+
+static size_t prvFunctionSlot( int xFunction )
+{
+    if( xFunction < 0 || xFunction >= metricsMAX_FUNCTION_CODE )
+    {
+        return metricsMAX_FUNCTION_CODE - 1;
+    }
+
+    return ( size_t )xFunction;
+}
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Bucket 0 holds samples below 2^metricsFIRST_BUCKET_LOG2, bucket i holds
+ * samples below 2^(metricsFIRST_BUCKET_LOG2 + i), and the final slot holds
+ * everything else (+Inf).
+ */
+static size_t prvLatencyBucket( uint64_t ullLatency )
+{
+    size_t xLog2;
+
+    if( ullLatency < ( 1ULL << metricsFIRST_BUCKET_LOG2 ) )
+    {
+        return 0;
+    }
+
+    xLog2 = 63 - ( size_t )__builtin_clzll( ullLatency );
+    if( xLog2 - metricsFIRST_BUCKET_LOG2 + 1 >= metricsNUM_BUCKETS )
+    {
+        return metricsNUM_BUCKETS;
+    }
+
+    return xLog2 - metricsFIRST_BUCKET_LOG2 + 1;
+}
+
+/*-----------------------------------------------------------*/
+
+void vMetricsRequest( int xFunction, uint64_t ullLatency )
+{
+    metricsINC( &pxRequests[ prvFunctionSlot( xFunction ) ], 1 );
+    metricsINC( &pxLatencyBuckets[ prvLatencyBucket( ullLatency ) ], 1 );
+    metricsINC( &xLatencySum, ullLatency );
+}
+
+/*-----------------------------------------------------------*/
+
+void vMetricsBytes( int xIn, int xOut )
+{
+    if( xIn > 0 )
+    {
+        metricsINC( &xBytesIn, xIn );
+    }
+
+    if( xOut > 0 )
+    {
+        metricsINC( &xBytesOut, xOut );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void vMetricsConnection( void )
+{
+    metricsINC( &xConnections, 1 );
+}
+
+/*-----------------------------------------------------------*/
+
+void vMetricsOverrun( void )
+{
+    metricsINC( &xOverruns, 1 );
+}
+
+/*-----------------------------------------------------------*/
+
+void vMetricsVerificationSuccess( void )
+{
+    metricsINC( &xVerificationSuccesses, 1 );
+}
+
+/*-----------------------------------------------------------*/
+
+void vMetricsVerificationFailure( MetricsVerificationFailure_t xReason )
+{
+    if( xReason < NUM_VERIFICATION_FAILURES )
+    {
+        metricsINC( &pxVerificationFailures[ xReason ], 1 );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void vMetricsObjectCapsRestriction( int xFunction )
+{
+    metricsINC( &pxObjectCapsRestrictions[ prvFunctionSlot( xFunction ) ], 1 );
+}
+
+/*-----------------------------------------------------------*/
+
+void vMetricsObjectCapsNoAccess( void )
+{
+    metricsINC( &xObjectCapsNoAccess, 1 );
+}
+
+/*-----------------------------------------------------------*/
+
+/* Append to the render buffer, bailing out of xMetricsRender() on overflow */
+#define metricsAPPEND( ... )                                                        \
+    do {                                                                            \
+        int xWritten = snprintf( pcBuffer + xLength, xBufferLength - xLength,       \
+                __VA_ARGS__ );                                                      \
+        if( xWritten < 0 || ( size_t )xWritten >= xBufferLength - xLength )         \
+        {                                                                           \
+            return -1;                                                              \
+        }                                                                           \
+        xLength += ( size_t )xWritten;                                              \
+    } while( 0 )
+
+/*
+ * Render the non-zero entries of a per-function counter array.  The last
+ * slot collects out-of-range function codes and is labelled "other".
+ *
+ * Returns the new length, or xBufferLength on overflow.
+ */
+static size_t prvRenderPerFunction( char *pcBuffer, size_t xLength, size_t xBufferLength,
+        const char *pcName, MetricsCounter_t *pxCounters )
+{
+    char pcLabel[ 8 ];
+
+    for( size_t i = 0; i < metricsMAX_FUNCTION_CODE; ++i )
+    {
+        uint64_t ullValue = metricsGET( &pxCounters[ i ] );
+        if( ullValue == 0 )
+        {
+            continue;
+        }
+
+        if( i == metricsMAX_FUNCTION_CODE - 1 )
+        {
+            strcpy( pcLabel, "other" );
+        }
+        else
+        {
+            snprintf( pcLabel, sizeof( pcLabel ), "%u", ( unsigned int )i );
+        }
+
+        int xWritten = snprintf( pcBuffer + xLength, xBufferLength - xLength,
+                "%s{function_code=\"%s\"} %llu\n", pcName, pcLabel,
+                ( unsigned long long )ullValue );
+        if( xWritten < 0 || ( size_t )xWritten >= xBufferLength - xLength )
+        {
+            return xBufferLength;
+        }
+        xLength += ( size_t )xWritten;
+    }
+
+    return xLength;
+}
+
+/*-----------------------------------------------------------*/
+
+int xMetricsRender( char *pcBuffer, size_t xBufferLength )
+{
+    size_t xLength = 0;
+    uint64_t ullCumulative = 0;
+
+    if( pcBuffer == NULL || xBufferLength == 0 )
+    {
+        return -1;
+    }
+
+    metricsAPPEND( "# HELP modbus_requests_total Modbus requests processed, by function code.\n" );
+    metricsAPPEND( "# TYPE modbus_requests_total counter\n" );
+    xLength = prvRenderPerFunction( pcBuffer, xLength, xBufferLength,
+            "modbus_requests_total", pxRequests );
+    if( xLength >= xBufferLength )
+    {
+        return -1;
+    }
+
+    metricsAPPEND( "# HELP modbus_request_processing_%s Time to process a request.\n",
+            metricsLATENCY_UNIT );
+    metricsAPPEND( "# TYPE modbus_request_processing_%s histogram\n",
+            metricsLATENCY_UNIT );
+    for( size_t i = 0; i < metricsNUM_BUCKETS; ++i )
+    {
+        ullCumulative += metricsGET( &pxLatencyBuckets[ i ] );
+        metricsAPPEND( "modbus_request_processing_%s_bucket{le=\"%llu\"} %llu\n",
+                metricsLATENCY_UNIT,
+                1ULL << ( metricsFIRST_BUCKET_LOG2 + i ),
+                ( unsigned long long )ullCumulative );
+    }
+    ullCumulative += metricsGET( &pxLatencyBuckets[ metricsNUM_BUCKETS ] );
+    metricsAPPEND( "modbus_request_processing_%s_bucket{le=\"+Inf\"} %llu\n",
+            metricsLATENCY_UNIT, ( unsigned long long )ullCumulative );
+    metricsAPPEND( "modbus_request_processing_%s_sum %llu\n",
+            metricsLATENCY_UNIT, ( unsigned long long )metricsGET( &xLatencySum ) );
+    metricsAPPEND( "modbus_request_processing_%s_count %llu\n",
+            metricsLATENCY_UNIT, ( unsigned long long )ullCumulative );
+
+    metricsAPPEND( "# HELP modbus_received_bytes_total Bytes of Modbus requests received.\n" );
+    metricsAPPEND( "# TYPE modbus_received_bytes_total counter\n" );
+    metricsAPPEND( "modbus_received_bytes_total %llu\n",
+            ( unsigned long long )metricsGET( &xBytesIn ) );
+
+    metricsAPPEND( "# HELP modbus_sent_bytes_total Bytes of Modbus responses sent.\n" );
+    metricsAPPEND( "# TYPE modbus_sent_bytes_total counter\n" );
+    metricsAPPEND( "modbus_sent_bytes_total %llu\n",
+            ( unsigned long long )metricsGET( &xBytesOut ) );
+
+    metricsAPPEND( "# HELP modbus_connections_total Client connections accepted.\n" );
+    metricsAPPEND( "# TYPE modbus_connections_total counter\n" );
+    metricsAPPEND( "modbus_connections_total %llu\n",
+            ( unsigned long long )metricsGET( &xConnections ) );
+
+    metricsAPPEND( "# HELP modbus_overruns_total Execution periods overrun by the server task.\n" );
+    metricsAPPEND( "# TYPE modbus_overruns_total counter\n" );
+    metricsAPPEND( "modbus_overruns_total %llu\n",
+            ( unsigned long long )metricsGET( &xOverruns ) );
+
+    metricsAPPEND( "# HELP modbus_network_caps_verifications_total Macaroon verifications, by result.\n" );
+    metricsAPPEND( "# TYPE modbus_network_caps_verifications_total counter\n" );
+    metricsAPPEND( "modbus_network_caps_verifications_total{result=\"pass\"} %llu\n",
+            ( unsigned long long )metricsGET( &xVerificationSuccesses ) );
+    for( size_t i = 0; i < NUM_VERIFICATION_FAILURES; ++i )
+    {
+        metricsAPPEND( "modbus_network_caps_verifications_total{result=\"fail\",reason=\"%s\"} %llu\n",
+                pcVerificationFailureNames[ i ],
+                ( unsigned long long )metricsGET( &pxVerificationFailures[ i ] ) );
+    }
+
+    metricsAPPEND( "# HELP modbus_object_caps_restrictions_total Requests whose mapping was restricted, by function code.\n" );
+    metricsAPPEND( "# TYPE modbus_object_caps_restrictions_total counter\n" );
+    xLength = prvRenderPerFunction( pcBuffer, xLength, xBufferLength,
+            "modbus_object_caps_restrictions_total", pxObjectCapsRestrictions );
+    if( xLength >= xBufferLength )
+    {
+        return -1;
+    }
+
+    metricsAPPEND( "# HELP modbus_object_caps_no_access_total Requests given no access to the mapping.\n" );
+    metricsAPPEND( "# TYPE modbus_object_caps_no_access_total counter\n" );
+    metricsAPPEND( "modbus_object_caps_no_access_total %llu\n",
+            ( unsigned long long )metricsGET( &xObjectCapsNoAccess ) );
+
+    return ( int )xLength;
+}
+
+/*-----------------------------------------------------------*/
+
+#if !defined(__freertos__)
+
+static const char pcMetricsHttpHeader[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static void *prvMetricsEndpointThread( void *pvParameters )
+{
+    int xListeningSocket = ( int )( intptr_t )pvParameters;
+    static char pcRequest[ 512 ];
+    static char pcBody[ metricsRENDER_BUFFER_SIZE ];
+
+    for( ;; )
+    {
+        int xConnectedSocket = accept( xListeningSocket, NULL, NULL );
+        if( xConnectedSocket < 0 )
+        {
+            continue;
+        }
+
+        /* The request itself doesn't matter: every path gets the metrics */
+        ( void )recv( xConnectedSocket, pcRequest, sizeof( pcRequest ), 0 );
+
+        int xBodyLength = xMetricsRender( pcBody, sizeof( pcBody ) );
+        if( xBodyLength >= 0 )
+        {
+            ( void )send( xConnectedSocket, pcMetricsHttpHeader,
+                    sizeof( pcMetricsHttpHeader ) - 1, MSG_NOSIGNAL );
+            ( void )send( xConnectedSocket, pcBody, ( size_t )xBodyLength, MSG_NOSIGNAL );
+        }
+
+        close( xConnectedSocket );
+    }
+
+    return NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+int xMetricsStartEndpoint( uint16_t usPort )
+{
+    struct sockaddr_in xBindAddress;
+    pthread_t xThread;
+    int xEnable = 1;
+    int xSocket;
+
+    xSocket = socket( AF_INET, SOCK_STREAM, 0 );
+    if( xSocket < 0 )
+    {
+        perror( "metrics socket" );
+        return -1;
+    }
+
+    setsockopt( xSocket, SOL_SOCKET, SO_REUSEADDR, &xEnable, sizeof( xEnable ) );
+
+    memset( &xBindAddress, 0, sizeof( xBindAddress ) );
+    xBindAddress.sin_family = AF_INET;
+    xBindAddress.sin_addr.s_addr = htonl( INADDR_ANY );
+    xBindAddress.sin_port = htons( usPort );
+
+    if( bind( xSocket, ( struct sockaddr * )&xBindAddress, sizeof( xBindAddress ) ) < 0 ||
+        listen( xSocket, 4 ) < 0 )
+    {
+        perror( "metrics bind/listen" );
+        close( xSocket );
+        return -1;
+    }
+
+    if( pthread_create( &xThread, NULL, prvMetricsEndpointThread,
+                ( void * )( intptr_t )xSocket ) != 0 )
+    {
+        close( xSocket );
+        return -1;
+    }
+    pthread_detach( xThread );
+
+    return 0;
+}
+
+#endif /* !defined(__freertos__) */
+
+/*-----------------------------------------------------------*/
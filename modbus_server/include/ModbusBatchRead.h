@@ -0,0 +1,92 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_BATCH_READ_H_
+#define _MODBUS_BATCH_READ_H_
+
+/* Standard includes. */
+#include <stdint.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+
+/* Batch read protocol */
+#include "modbus_extensions.h"
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Batch reads (MODBUS_BATCH_READ), see modbus_extensions.h for the
+ * protocol.
+ *
+ * The server hands each request to xModbusBatchReadProcess() before the
+ * capability shims, which answers batch reads itself: every item is
+ * checked against the mapping, the whole batch is authorised with a
+ * single call to the verify function, then every item is read into the
+ * one reply.
+ */
+
+/*
+ * An item of a batch: xNb addresses from usAddr, read with xFunction.
+ */
+typedef struct _ModbusBatchItem_t {
+    int xFunction;
+    uint16_t usAddr;
+    int xNb;
+} ModbusBatchItem_t;
+
+/*
+ * Authorises a batch (e.g., verifies the network capability written
+ * before the request against every item).  Returns 0 if every read is
+ * allowed, a Modbus exception to answer the request with (e.g., if the
+ * batch can't be authorised by any capability), or -1 otherwise.
+ */
+typedef int ( *ModbusBatchReadVerify_t )( const ModbusBatchItem_t *pxItems, int xItems );
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Set up batch reads of mb_mapping.  The table pointers are copied, so
+ * call this before a capability shim restricts them.  xVerify may be
+ * NULL, to allow every batch.
+ */
+void vModbusBatchReadInit( modbus_t *ctx, const modbus_mapping_t *mb_mapping,
+        ModbusBatchReadVerify_t xVerify );
+
+/*
+ * If req is a batch read, answer it into rsp.
+ *
+ * Returns 1 if req was a batch read and rsp holds the reply, 0 if it
+ * wasn't (so should be processed as usual), or -1 if it wasn't
+ * authorised (treated as a failed shim).
+ */
+int xModbusBatchReadProcess( const uint8_t *req, int req_length,
+        uint8_t *rsp, int *rsp_length );
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_BATCH_READ_H_ */
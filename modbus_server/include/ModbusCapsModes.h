@@ -0,0 +1,162 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_CAPS_MODES_H_
+#define _MODBUS_CAPS_MODES_H_
+
+/* Standard includes. */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Capability modes selected at run time (MODBUS_RUNTIME_CAPS).
+ *
+ * Rather than compiling one server per configuration, a runtime server is
+ * compiled with every shim it supports and dispatches each request through
+ * the function table of the current mode:
+ *
+ * - base: no shims
+ * - objstubs: the empty object capabilities shim (MODBUS_OBJECT_CAPS only)
+ * - obj: object capabilities (MODBUS_OBJECT_CAPS only)
+ * - net: network capabilities (MODBUS_NETWORK_CAPS only)
+ * - obj_net: both (MODBUS_OBJECT_CAPS and MODBUS_NETWORK_CAPS only)
+ *
+ * The server works through a schedule of modes, switching to the next one
+ * after a fixed number of client sessions, so a single image can benchmark
+ * every configuration back to back.
+ */
+
+/* Maximum number of modes in a schedule. */
+#ifndef modbusCAPS_MAX_SCHEDULE
+#define modbusCAPS_MAX_SCHEDULE 16
+#endif
+
+/* Number of calls per CAPS_DISPATCH sample, since a single call is too
+ * short to time. */
+#ifndef modbusCAPS_DISPATCH_BATCH
+#define modbusCAPS_DISPATCH_BATCH 1000
+#endif
+
+/* Number of CAPS_DISPATCH samples recorded per call to
+ * vModbusCapsMeasureDispatch(). */
+#ifndef modbusCAPS_DISPATCH_SAMPLES
+#define modbusCAPS_DISPATCH_SAMPLES 10
+#endif
+
+/* Printed (followed by the mode name) whenever the server changes mode. */
+#define modbusCAPS_MODE_MARKER "MODBUS_CAPS_MODE"
+
+/* Printed (followed by the comma-separated modes) once the schedule is set. */
+#define modbusCAPS_SCHEDULE_MARKER "MODBUS_CAPS_SCHEDULE"
+
+/*-----------------------------------------------------------*/
+
+/* The signature shared by the request preprocessing shims. */
+typedef int ( *ModbusCapsShim_t )( modbus_t *ctx, uint8_t *req,
+        modbus_mapping_t *mb_mapping );
+
+typedef struct _ModbusCapsMode_t {
+    const char *pcName;
+    /* NULL if the mode doesn't use the shim */
+    ModbusCapsShim_t xObjectCapsShim;
+    ModbusCapsShim_t xNetworkCapsShim;
+    /* whether the object capabilities shim restricts mb_mapping */
+    int xRestrictsMapping;
+} ModbusCapsMode_t;
+
+/* The dispatch state for one Modbus context and its mapping. */
+typedef struct _ModbusCapsDispatch_t {
+    modbus_t *ctx;
+    modbus_mapping_t *mb_mapping;
+    const ModbusCapsMode_t *pxSchedule[ modbusCAPS_MAX_SCHEDULE ];
+    size_t xScheduleLength;
+    size_t xCurrent;
+    int xSessionsPerMode;
+    int xSessions;
+} ModbusCapsDispatch_t;
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Returns the mode called pcName, or NULL if it isn't compiled in.
+ */
+const ModbusCapsMode_t *pxModbusCapsFindMode( const char *pcName );
+
+/*
+ * Set up pxDispatch for ctx and mb_mapping and select the first mode.
+ *
+ * pcSchedule is a comma-separated list of mode names (e.g., "base,net"),
+ * or NULL or "" for every mode compiled in.  The server moves to the next
+ * mode (wrapping around) after xSessionsPerMode client sessions.
+ *
+ * Returns 0 on success, or -1 if a mode is unknown or the schedule is
+ * too long.
+ */
+int xModbusCapsInit( ModbusCapsDispatch_t *pxDispatch, modbus_t *ctx,
+        modbus_mapping_t *mb_mapping, const char *pcSchedule,
+        int xSessionsPerMode );
+
+/*
+ * Returns the current mode.
+ */
+const ModbusCapsMode_t *pxModbusCapsCurrentMode( const ModbusCapsDispatch_t *pxDispatch );
+
+/*
+ * Run the shims of the current mode on a request, in the same order as
+ * the compile-time configurations: first reduce permissions on state,
+ * then verify the network capability.
+ *
+ * Returns -1 if a shim failed, 0 otherwise.
+ */
+int xModbusCapsPreprocess( ModbusCapsDispatch_t *pxDispatch, uint8_t *req );
+
+/*
+ * Count the end of a client session, and move to the next mode in the
+ * schedule once the current one has had all its sessions.
+ *
+ * Must only be called between requests.
+ */
+void vModbusCapsSessionEnd( ModbusCapsDispatch_t *pxDispatch );
+
+/*
+ * Record the cost of dispatching through the function table as
+ * CAPS_DISPATCH microbenchmark samples: batches of direct and indirect
+ * calls to an empty shim, timed in cycles on FreeRTOS and nanoseconds on
+ * Linux hosts.  Only available with MODBUS_MICROBENCHMARK.
+ */
+#if defined( MODBUS_MICROBENCHMARK )
+void vModbusCapsMeasureDispatch( ModbusCapsDispatch_t *pxDispatch, uint8_t *req );
+#endif
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_CAPS_MODES_H_ */
@@ -0,0 +1,129 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_SERVER_EXTENSIONS_H_
+#define _MODBUS_SERVER_EXTENSIONS_H_
+
+/* Standard includes. */
+#include <stdint.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+
+/* Extension protocol */
+#include "modbus_extensions.h"
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Framing and mapping helpers shared by the server extensions
+ * (ModbusSubscriptions.h, ModbusBatchRead.h), which are write and read
+ * registers requests to the reserved addresses in modbus_extensions.h.
+ */
+
+/*
+ * An extension request, as parsed from a write and read registers request.
+ */
+typedef struct _ModbusExtensionRequest_t {
+    /* the header length, ahead of the function code */
+    int xOffset;
+    uint16_t usAddress;
+    int xReadNb;
+    int xWriteNb;
+    /* xWriteNb big-endian registers */
+    const uint8_t *pucParams;
+} ModbusExtensionRequest_t;
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Keep the mapping the extensions read tables from (called by each
+ * extension's init).
+ */
+void vModbusExtensionInit( const modbus_mapping_t *mb_mapping );
+
+const modbus_mapping_t *pxModbusExtensionMapping( void );
+
+/* Big-endian registers in requests and replies */
+uint16_t usModbusExtensionGetUint16( const uint8_t *pucBuf );
+
+void vModbusExtensionPutUint16( uint8_t *pucBuf, uint16_t usValue );
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Parse req if it is a request to usAddress.
+ *
+ * Returns 1 if it is and is well formed, 0 if it isn't a request to
+ * usAddress, or -1 if it is but is malformed.
+ */
+int xModbusExtensionParse( modbus_t *ctx, const uint8_t *req, int req_length,
+        uint16_t usAddress, ModbusExtensionRequest_t *pxRequest );
+
+/*
+ * The xReadNb registers of the reply to pxRequest, zeroed, to be filled
+ * in before calling vModbusExtensionReply().
+ */
+uint8_t *pucModbusExtensionResult( const ModbusExtensionRequest_t *pxRequest, uint8_t *rsp );
+
+/*
+ * Complete the reply to pxRequest in rsp, either with its result or, if
+ * xException isn't 0, with that exception.
+ */
+void vModbusExtensionReply( const uint8_t *req, const ModbusExtensionRequest_t *pxRequest,
+        uint8_t *rsp, int *rsp_length, int xException );
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Helpers for the tables of a mapping (MODBUS_SUBSCRIPTION_* table
+ * numbers).
+ */
+
+/* The read function for xTable (e.g., to authorise reading it) */
+int xModbusTableReadFunction( int xTable );
+
+int xModbusTableIsBits( int xTable );
+
+/* The number of registers xNb values of xTable take, packed as registers */
+int xModbusTablePackedLength( int xTable, int xNb );
+
+/* Returns 1 if xNb addresses from usAddr are within xTable of pxMapping */
+int xModbusTableInMapping( const modbus_mapping_t *pxMapping, int xTable,
+        uint16_t usAddr, int xNb );
+
+/*
+ * Write xNb values from usAddr in xTable of pxMapping to pucDest, as
+ * big-endian registers, with bits packed 16 to a register (bit i in bit
+ * i % 16 of register i / 16).
+ */
+void vModbusTablePack( const modbus_mapping_t *pxMapping, int xTable,
+        uint16_t usAddr, int xNb, uint8_t *pucDest );
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_SERVER_EXTENSIONS_H_ */
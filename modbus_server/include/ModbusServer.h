@@ -72,4 +72,8 @@
 
 void vStartModbusServerTask( uint16_t usStackSize, uint32_t ulPort, UBaseType_t uxPriority );
 
+#if defined( MODBUS_METRICS )
+void vStartModbusMetricsTask( uint16_t usStackSize, uint32_t ulPort, UBaseType_t uxPriority );
+#endif
+
 #endif /* MODBUS_SERVER_H */
@@ -0,0 +1,119 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+#ifndef _MODBUS_SUBSCRIPTIONS_H_
+#define _MODBUS_SUBSCRIPTIONS_H_
+
+/* Standard includes. */
+#include <stdint.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+
+/* Subscription protocol */
+#include "modbus_extensions.h"
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Report-by-exception subscriptions (MODBUS_SUBSCRIPTIONS), see
+ * modbus_extensions.h for the protocol.
+ *
+ * The server hands each request to xModbusSubscriptionsProcess() before the
+ * capability shims.  Subscription requests are answered there; every other
+ * request is processed as usual, then passed to
+ * vModbusSubscriptionsNoteRequest() so writes mark the subscriptions they
+ * touch as changed.  Application code that updates the mapping directly
+ * calls vModbusSubscriptionsNoteChange().
+ *
+ * Subscriptions belong to the connection that made them (xOwner, e.g.,
+ * its socket), and are released with vModbusSubscriptionsRelease() when it
+ * closes.  They're also released, when next polled, once the capability
+ * that authorised them may have been revoked (the epoch has changed).
+ */
+
+/* Maximum number of subscriptions, over all connections. */
+#ifndef modbusSUBSCRIPTIONS_MAX
+#define modbusSUBSCRIPTIONS_MAX 64
+#endif
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Authorises a subscription as a read of the range by function (e.g.,
+ * verifies the network capability written before the request).  Returns
+ * 0 if the read is allowed, -1 otherwise.
+ */
+typedef int ( *ModbusSubscriptionsVerify_t )( int function, uint16_t addr, int nb );
+
+/*
+ * Returns the epoch of the verifications (e.g., the network capabilities
+ * keyring's), which changes when one made before may no longer hold.
+ */
+typedef uint32_t ( *ModbusSubscriptionsEpoch_t )( void );
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Set up the subscriptions for mb_mapping.  The table pointers are copied,
+ * so call this before a capability shim restricts them.  xVerify may be
+ * NULL, to allow every subscription, and xEpoch NULL if verifications
+ * never lapse.
+ */
+void vModbusSubscriptionsInit( modbus_t *ctx, const modbus_mapping_t *mb_mapping,
+        ModbusSubscriptionsVerify_t xVerify, ModbusSubscriptionsEpoch_t xEpoch );
+
+/*
+ * If req is a subscription request, answer it into rsp.
+ *
+ * Returns 1 if req was a subscription request and rsp holds the reply,
+ * 0 if it wasn't (so should be processed as usual), or -1 if it wasn't
+ * authorised (treated as a failed shim).
+ */
+int xModbusSubscriptionsProcess( const uint8_t *req, int req_length,
+        uint8_t *rsp, int *rsp_length, int xOwner );
+
+/*
+ * Mark the subscriptions overlapping a write request as changed, once it
+ * has been processed into rsp (exception replies are ignored).
+ */
+void vModbusSubscriptionsNoteRequest( const uint8_t *req, const uint8_t *rsp );
+
+/*
+ * Mark the subscriptions overlapping nb addresses from addr in table
+ * (MODBUS_SUBSCRIPTION_*) as changed.
+ */
+void vModbusSubscriptionsNoteChange( int xTable, uint16_t usAddr, int xNb );
+
+/*
+ * Drop the subscriptions made by xOwner.
+ */
+void vModbusSubscriptionsRelease( int xOwner );
+
+/*-----------------------------------------------------------*/
+
+#endif /* _MODBUS_SUBSCRIPTIONS_H_ */
@@ -0,0 +1,143 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdint.h>
+#include <string.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+
+/* Batch read includes */
+#include "ModbusBatchRead.h"
+#include "ModbusExtensions.h"
+
+/* static variable declarations */
+
+static modbus_t *pxBatchReadCtx = NULL;
+
+static ModbusBatchReadVerify_t xBatchReadVerify = NULL;
+
+/*-----------------------------------------------------------*/
+
+void vModbusBatchReadInit( modbus_t *ctx, const modbus_mapping_t *mb_mapping,
+        ModbusBatchReadVerify_t xVerify )
+{
+    pxBatchReadCtx = ctx;
+    vModbusExtensionInit( mb_mapping );
+    xBatchReadVerify = xVerify;
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusBatchReadProcess( const uint8_t *req, int req_length,
+        uint8_t *rsp, int *rsp_length )
+{
+    ModbusExtensionRequest_t xRequest;
+    ModbusBatchItem_t pxItems[ MODBUS_MAX_BATCH_ITEMS ];
+    int xParsed = xModbusExtensionParse( pxBatchReadCtx, req, req_length,
+            MODBUS_BATCH_READ_ADDRESS, &xRequest );
+    int xItems;
+    int xLength = 0;
+
+    if( xParsed == 0 )
+    {
+        return 0;
+    }
+
+    xItems = xRequest.xWriteNb / MODBUS_BATCH_ITEM_NB;
+    if( xParsed == -1 || xItems < 1 || xItems > MODBUS_MAX_BATCH_ITEMS ||
+            xRequest.xWriteNb % MODBUS_BATCH_ITEM_NB != 0 )
+    {
+        vModbusExtensionReply( req, &xRequest, rsp, rsp_length, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE );
+        return 1;
+    }
+
+    /* check every item before reading any */
+    for( int i = 0; i < xItems; ++i )
+    {
+        const uint8_t *pucItem = xRequest.pucParams + 2 * MODBUS_BATCH_ITEM_NB * i;
+        int xTable = usModbusExtensionGetUint16( pucItem );
+        uint16_t usAddr = usModbusExtensionGetUint16( pucItem + 2 );
+        int xNb = usModbusExtensionGetUint16( pucItem + 4 );
+
+        if( xTable > MODBUS_SUBSCRIPTION_INPUT_REGISTERS || xNb < 1 )
+        {
+            vModbusExtensionReply( req, &xRequest, rsp, rsp_length, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE );
+            return 1;
+        }
+
+        xLength += xModbusTablePackedLength( xTable, xNb );
+        if( xLength > xRequest.xReadNb )
+        {
+            vModbusExtensionReply( req, &xRequest, rsp, rsp_length, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE );
+            return 1;
+        }
+
+        if( !xModbusTableInMapping( pxModbusExtensionMapping(), xTable, usAddr, xNb ) )
+        {
+            vModbusExtensionReply( req, &xRequest, rsp, rsp_length, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS );
+            return 1;
+        }
+
+        pxItems[ i ].xFunction = xModbusTableReadFunction( xTable );
+        pxItems[ i ].usAddr = usAddr;
+        pxItems[ i ].xNb = xNb;
+    }
+
+    /* one verification for the whole batch */
+    if( xBatchReadVerify != NULL )
+    {
+        int xVerified = xBatchReadVerify( pxItems, xItems );
+
+        if( xVerified > 0 )
+        {
+            vModbusExtensionReply( req, &xRequest, rsp, rsp_length, xVerified );
+            return 1;
+        }
+        if( xVerified != 0 )
+        {
+            return -1;
+        }
+    }
+
+    uint8_t *pucResult = pucModbusExtensionResult( &xRequest, rsp );
+    for( int i = 0; i < xItems; ++i )
+    {
+        int xTable = usModbusExtensionGetUint16( xRequest.pucParams + 2 * MODBUS_BATCH_ITEM_NB * i );
+
+        vModbusTablePack( pxModbusExtensionMapping(), xTable, pxItems[ i ].usAddr, pxItems[ i ].xNb,
+                pucResult );
+        pucResult += 2 * xModbusTablePackedLength( xTable, pxItems[ i ].xNb );
+    }
+
+    vModbusExtensionReply( req, &xRequest, rsp, rsp_length, 0 );
+
+    return 1;
+}
+
+/*-----------------------------------------------------------*/
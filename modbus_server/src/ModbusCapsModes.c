@@ -0,0 +1,316 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__freertos__)
+/* Kernel includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+#else
+#include <time.h>
+#endif
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+#include <modbus/modbus-helpers.h>
+
+/* Microbenchmark includes */
+#if defined( MODBUS_MICROBENCHMARK )
+#include "microbenchmark.h"
+#endif
+
+/* Span trace includes (markers are empty unless MODBUS_SPAN_TRACE) */
+#include "spantrace.h"
+
+/* Modbus object capability includes */
+#if defined( MODBUS_OBJECT_CAPS )
+#include "modbus_object_caps.h"
+#endif
+
+/* Modbus network capability includes */
+#if defined( MODBUS_NETWORK_CAPS )
+#include "modbus_network_caps.h"
+#endif
+
+/* Capability mode includes */
+#include "ModbusCapsModes.h"
+
+/* static variable declarations */
+
+/* Every mode compiled into this server, in the default schedule order. */
+static const ModbusCapsMode_t pxModbusCapsModes[] = {
+    { "base", NULL, NULL, 0 },
+#if defined( MODBUS_OBJECT_CAPS )
+    { "objstubs", modbus_preprocess_request_object_caps_stub, NULL, 0 },
+    { "obj", modbus_preprocess_request_object_caps, NULL, 1 },
+#endif
+#if defined( MODBUS_NETWORK_CAPS )
+    { "net", NULL, modbus_preprocess_request_network_caps, 0 },
+#endif
+#if defined( MODBUS_OBJECT_CAPS ) && defined( MODBUS_NETWORK_CAPS )
+    { "obj_net", modbus_preprocess_request_object_caps, modbus_preprocess_request_network_caps, 1 },
+#endif
+};
+
+#define modbusCAPS_NUM_MODES ( sizeof( pxModbusCapsModes ) / sizeof( pxModbusCapsModes[ 0 ] ) )
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Make the mode at xIndex of the schedule the current one, first giving
+ * mb_mapping back its full table pointers if the previous mode restricted
+ * them.
+ */
+static void prvSelectMode( ModbusCapsDispatch_t *pxDispatch, size_t xIndex )
+{
+    const ModbusCapsMode_t *pxPrevious = pxDispatch->pxSchedule[ pxDispatch->xCurrent ];
+
+#if defined( MODBUS_OBJECT_CAPS )
+    if( pxPrevious->xRestrictsMapping )
+    {
+        modbus_mapping_restore_object_caps( pxDispatch->ctx, pxDispatch->mb_mapping );
+    }
+#else
+    ( void ) pxPrevious;
+#endif
+
+    pxDispatch->xCurrent = xIndex;
+    pxDispatch->xSessions = 0;
+
+    printf( "%s %s\n", modbusCAPS_MODE_MARKER, pxDispatch->pxSchedule[ xIndex ]->pcName );
+    fflush( stdout );
+}
+
+/*-----------------------------------------------------------*/
+
+const ModbusCapsMode_t *pxModbusCapsFindMode( const char *pcName )
+{
+    for( size_t i = 0; i < modbusCAPS_NUM_MODES; ++i )
+    {
+        if( strcmp( pxModbusCapsModes[ i ].pcName, pcName ) == 0 )
+        {
+            return &pxModbusCapsModes[ i ];
+        }
+    }
+
+    return NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusCapsInit( ModbusCapsDispatch_t *pxDispatch, modbus_t *ctx,
+        modbus_mapping_t *mb_mapping, const char *pcSchedule,
+        int xSessionsPerMode )
+{
+    memset( pxDispatch, 0, sizeof( ModbusCapsDispatch_t ) );
+    pxDispatch->ctx = ctx;
+    pxDispatch->mb_mapping = mb_mapping;
+    pxDispatch->xSessionsPerMode = ( xSessionsPerMode > 0 ) ? xSessionsPerMode : 1;
+
+    if( pcSchedule == NULL || pcSchedule[ 0 ] == '\0' )
+    {
+        for( size_t i = 0; i < modbusCAPS_NUM_MODES; ++i )
+        {
+            pxDispatch->pxSchedule[ i ] = &pxModbusCapsModes[ i ];
+        }
+        pxDispatch->xScheduleLength = modbusCAPS_NUM_MODES;
+    }
+    else
+    {
+        const char *pcName = pcSchedule;
+
+        for( ;; )
+        {
+            char pcMode[ 16 ];
+            size_t xLength = strcspn( pcName, "," );
+            const ModbusCapsMode_t *pxMode = NULL;
+
+            if( xLength < sizeof( pcMode ) )
+            {
+                memcpy( pcMode, pcName, xLength );
+                pcMode[ xLength ] = '\0';
+                pxMode = pxModbusCapsFindMode( pcMode );
+            }
+
+            if( pxMode == NULL )
+            {
+                fprintf( stderr, "Unknown capability mode in schedule: %s\r\n", pcName );
+                return -1;
+            }
+
+            if( pxDispatch->xScheduleLength == modbusCAPS_MAX_SCHEDULE )
+            {
+                fprintf( stderr, "Capability mode schedule is too long: %s\r\n", pcSchedule );
+                return -1;
+            }
+
+            pxDispatch->pxSchedule[ pxDispatch->xScheduleLength ] = pxMode;
+            pxDispatch->xScheduleLength += 1;
+
+            if( pcName[ xLength ] == '\0' )
+            {
+                break;
+            }
+            pcName += xLength + 1;
+        }
+    }
+
+    printf( "%s ", modbusCAPS_SCHEDULE_MARKER );
+    for( size_t i = 0; i < pxDispatch->xScheduleLength; ++i )
+    {
+        printf( "%s%s", ( i == 0 ) ? "" : ",", pxDispatch->pxSchedule[ i ]->pcName );
+    }
+    printf( "\n" );
+
+    prvSelectMode( pxDispatch, 0 );
+
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+const ModbusCapsMode_t *pxModbusCapsCurrentMode( const ModbusCapsDispatch_t *pxDispatch )
+{
+    return pxDispatch->pxSchedule[ pxDispatch->xCurrent ];
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusCapsPreprocess( ModbusCapsDispatch_t *pxDispatch, uint8_t *req )
+{
+    const ModbusCapsMode_t *pxMode = pxDispatch->pxSchedule[ pxDispatch->xCurrent ];
+    int xReturned = 0;
+
+    if( pxMode->xObjectCapsShim != NULL )
+    {
+        SPAN_BEGIN( "object_caps_shim" );
+        xReturned = pxMode->xObjectCapsShim( pxDispatch->ctx, req, pxDispatch->mb_mapping );
+        SPAN_END( "object_caps_shim" );
+        if( xReturned == -1 )
+        {
+            return -1;
+        }
+    }
+
+    if( pxMode->xNetworkCapsShim != NULL )
+    {
+        SPAN_BEGIN( "network_caps_shim" );
+        xReturned = pxMode->xNetworkCapsShim( pxDispatch->ctx, req, pxDispatch->mb_mapping );
+        SPAN_END( "network_caps_shim" );
+        if( xReturned == -1 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+void vModbusCapsSessionEnd( ModbusCapsDispatch_t *pxDispatch )
+{
+    pxDispatch->xSessions += 1;
+
+    if( pxDispatch->xSessions >= pxDispatch->xSessionsPerMode )
+    {
+        prvSelectMode( pxDispatch,
+                ( pxDispatch->xCurrent + 1 ) % pxDispatch->xScheduleLength );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+#if defined( MODBUS_MICROBENCHMARK )
+
+/*
+ * Cycles on FreeRTOS and nanoseconds on Linux hosts.
+ */
+static uint64_t prvDispatchTimestamp( void )
+{
+#if defined(__freertos__)
+    return get_cycle_count();
+#else
+    struct timespec xNow;
+    clock_gettime( CLOCK_MONOTONIC, &xNow );
+    return ( uint64_t )xNow.tv_sec * 1000000000ULL + ( uint64_t )xNow.tv_nsec;
+#endif
+}
+
+/*
+ * An empty shim.  It must not be inlined, or the direct calls would be
+ * optimised away.
+ */
+static int __attribute__(( noinline )) prvEmptyShim( modbus_t *ctx, uint8_t *req,
+        modbus_mapping_t *mb_mapping )
+{
+    __asm__ volatile( "" ::: "memory" );
+    return 0;
+}
+
+void vModbusCapsMeasureDispatch( ModbusCapsDispatch_t *pxDispatch, uint8_t *req )
+{
+    /* volatile, so the compiler can't turn the indirect calls into direct ones */
+    ModbusCapsShim_t volatile xShim = prvEmptyShim;
+    uint64_t ullStart, ullDirect, ullIndirect;
+
+    for( int i = 0; i < modbusCAPS_DISPATCH_SAMPLES; ++i )
+    {
+#if defined(__freertos__)
+        taskENTER_CRITICAL();
+#endif
+
+        ullStart = prvDispatchTimestamp();
+        for( int j = 0; j < modbusCAPS_DISPATCH_BATCH; ++j )
+        {
+            prvEmptyShim( pxDispatch->ctx, req, pxDispatch->mb_mapping );
+        }
+        ullDirect = prvDispatchTimestamp() - ullStart;
+
+        ullStart = prvDispatchTimestamp();
+        for( int j = 0; j < modbusCAPS_DISPATCH_BATCH; ++j )
+        {
+            xShim( pxDispatch->ctx, req, pxDispatch->mb_mapping );
+        }
+        ullIndirect = prvDispatchTimestamp() - ullStart;
+
+#if defined(__freertos__)
+        taskEXIT_CRITICAL();
+#endif
+
+        xMicrobenchmarkSample( CAPS_DISPATCH, "direct_call", ullDirect, 1 );
+        xMicrobenchmarkSample( CAPS_DISPATCH, "indirect_call", ullIndirect, 1 );
+    }
+}
+
+#endif /* defined( MODBUS_MICROBENCHMARK ) */
+
+/*-----------------------------------------------------------*/
@@ -0,0 +1,253 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdint.h>
+#include <string.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+
+/* Extension includes */
+#include "ModbusExtensions.h"
+
+/* static variable declarations */
+
+/* A copy of the mapping as allocated, since the object capabilities shim
+ * may restrict the table pointers of the one the server processes with,
+ * and the extensions read tables outside the request being processed. */
+static modbus_mapping_t xExtensionMapping;
+
+/*-----------------------------------------------------------*/
+
+void vModbusExtensionInit( const modbus_mapping_t *mb_mapping )
+{
+    xExtensionMapping = *mb_mapping;
+}
+
+/*-----------------------------------------------------------*/
+
+const modbus_mapping_t *pxModbusExtensionMapping( void )
+{
+    return &xExtensionMapping;
+}
+
+/*-----------------------------------------------------------*/
+
+uint16_t usModbusExtensionGetUint16( const uint8_t *pucBuf )
+{
+    return ( uint16_t )( ( pucBuf[ 0 ] << 8 ) | pucBuf[ 1 ] );
+}
+
+/*-----------------------------------------------------------*/
+
+void vModbusExtensionPutUint16( uint8_t *pucBuf, uint16_t usValue )
+{
+    pucBuf[ 0 ] = usValue >> 8;
+    pucBuf[ 1 ] = usValue & 0xFF;
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusExtensionParse( modbus_t *ctx, const uint8_t *req, int req_length,
+        uint16_t usAddress, ModbusExtensionRequest_t *pxRequest )
+{
+    int xOffset = modbus_get_header_length( ctx );
+
+    /* function, read address and nb, write address and nb, byte count */
+    if( req_length < xOffset + 10 || req[ xOffset ] != MODBUS_FC_WRITE_AND_READ_REGISTERS )
+    {
+        return 0;
+    }
+
+    uint16_t usReadAddr = usModbusExtensionGetUint16( req + xOffset + 1 );
+    uint16_t usWriteAddr = usModbusExtensionGetUint16( req + xOffset + 5 );
+    if( usReadAddr != usAddress || usWriteAddr != usAddress )
+    {
+        return 0;
+    }
+
+    pxRequest->xOffset = xOffset;
+    pxRequest->usAddress = usAddress;
+    pxRequest->xReadNb = usModbusExtensionGetUint16( req + xOffset + 3 );
+    pxRequest->xWriteNb = usModbusExtensionGetUint16( req + xOffset + 7 );
+    pxRequest->pucParams = req + xOffset + 10;
+
+    int xByteCount = req[ xOffset + 9 ];
+    if( xByteCount != 2 * pxRequest->xWriteNb || req_length < xOffset + 10 + xByteCount ||
+            pxRequest->xReadNb < 1 || pxRequest->xReadNb > MODBUS_MAX_WR_READ_REGISTERS )
+    {
+        return -1;
+    }
+
+    return 1;
+}
+
+/*-----------------------------------------------------------*/
+
+uint8_t *pucModbusExtensionResult( const ModbusExtensionRequest_t *pxRequest, uint8_t *rsp )
+{
+    uint8_t *pucResult = rsp + pxRequest->xOffset + 2;
+
+    memset( pucResult, 0, 2 * pxRequest->xReadNb );
+
+    return pucResult;
+}
+
+/*-----------------------------------------------------------*/
+
+void vModbusExtensionReply( const uint8_t *req, const ModbusExtensionRequest_t *pxRequest,
+        uint8_t *rsp, int *rsp_length, int xException )
+{
+    int xOffset = pxRequest->xOffset;
+
+    memcpy( rsp, req, xOffset );
+
+    if( xException != 0 )
+    {
+        rsp[ xOffset ] = MODBUS_FC_WRITE_AND_READ_REGISTERS | 0x80;
+        rsp[ xOffset + 1 ] = xException;
+        *rsp_length = xOffset + 2;
+        return;
+    }
+
+    /* the reply has all the registers asked for, zero padded */
+    rsp[ xOffset ] = MODBUS_FC_WRITE_AND_READ_REGISTERS;
+    rsp[ xOffset + 1 ] = ( uint8_t )( 2 * pxRequest->xReadNb );
+    *rsp_length = xOffset + 2 + 2 * pxRequest->xReadNb;
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusTableReadFunction( int xTable )
+{
+    switch( xTable )
+    {
+        case MODBUS_SUBSCRIPTION_COILS:
+            return MODBUS_FC_READ_COILS;
+        case MODBUS_SUBSCRIPTION_DISCRETE_INPUTS:
+            return MODBUS_FC_READ_DISCRETE_INPUTS;
+        case MODBUS_SUBSCRIPTION_HOLDING_REGISTERS:
+            return MODBUS_FC_READ_HOLDING_REGISTERS;
+        default:
+            return MODBUS_FC_READ_INPUT_REGISTERS;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusTableIsBits( int xTable )
+{
+    return xTable == MODBUS_SUBSCRIPTION_COILS ||
+        xTable == MODBUS_SUBSCRIPTION_DISCRETE_INPUTS;
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusTablePackedLength( int xTable, int xNb )
+{
+    return xModbusTableIsBits( xTable ) ? ( xNb + 15 ) / 16 : xNb;
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusTableInMapping( const modbus_mapping_t *pxMapping, int xTable,
+        uint16_t usAddr, int xNb )
+{
+    int xStart;
+    int xLength;
+
+    switch( xTable )
+    {
+        case MODBUS_SUBSCRIPTION_COILS:
+            xStart = pxMapping->start_bits;
+            xLength = pxMapping->nb_bits;
+            break;
+        case MODBUS_SUBSCRIPTION_DISCRETE_INPUTS:
+            xStart = pxMapping->start_input_bits;
+            xLength = pxMapping->nb_input_bits;
+            break;
+        case MODBUS_SUBSCRIPTION_HOLDING_REGISTERS:
+            xStart = pxMapping->start_registers;
+            xLength = pxMapping->nb_registers;
+            break;
+        case MODBUS_SUBSCRIPTION_INPUT_REGISTERS:
+            xStart = pxMapping->start_input_registers;
+            xLength = pxMapping->nb_input_registers;
+            break;
+        default:
+            return 0;
+    }
+
+    return xNb >= 1 && usAddr >= xStart && usAddr + xNb <= xStart + xLength;
+}
+
+/*-----------------------------------------------------------*/
+
+void vModbusTablePack( const modbus_mapping_t *pxMapping, int xTable,
+        uint16_t usAddr, int xNb, uint8_t *pucDest )
+{
+    switch( xTable )
+    {
+        case MODBUS_SUBSCRIPTION_COILS:
+        case MODBUS_SUBSCRIPTION_DISCRETE_INPUTS:
+        {
+            const uint8_t *pucBits = ( xTable == MODBUS_SUBSCRIPTION_COILS ) ?
+                &pxMapping->tab_bits[ usAddr - pxMapping->start_bits ] :
+                &pxMapping->tab_input_bits[ usAddr - pxMapping->start_input_bits ];
+
+            memset( pucDest, 0, 2 * xModbusTablePackedLength( xTable, xNb ) );
+            for( int i = 0; i < xNb; ++i )
+            {
+                if( pucBits[ i ] )
+                {
+                    /* bit i % 16 of register i / 16, big-endian */
+                    int xBit = i % 16;
+                    pucDest[ 2 * ( i / 16 ) + ( ( xBit < 8 ) ? 1 : 0 ) ] |= 1 << ( xBit % 8 );
+                }
+            }
+            break;
+        }
+
+        case MODBUS_SUBSCRIPTION_HOLDING_REGISTERS:
+        case MODBUS_SUBSCRIPTION_INPUT_REGISTERS:
+        {
+            const uint16_t *pusRegisters = ( xTable == MODBUS_SUBSCRIPTION_HOLDING_REGISTERS ) ?
+                &pxMapping->tab_registers[ usAddr - pxMapping->start_registers ] :
+                &pxMapping->tab_input_registers[ usAddr - pxMapping->start_input_registers ];
+
+            for( int i = 0; i < xNb; ++i )
+            {
+                pucDest[ 2 * i ] = pusRegisters[ i ] >> 8;
+                pucDest[ 2 * i + 1 ] = pusRegisters[ i ] & 0xFF;
+            }
+            break;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
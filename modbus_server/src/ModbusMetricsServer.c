@@ -0,0 +1,161 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/******************************************************************************
+ * A minimal HTTP endpoint that serves the metrics registry (modbus_metrics.h)
+ * in the Prometheus text format on a port separate from the Modbus server, so
+ * the server can be watched without stopping it.
+ ******************************************************************************
+ */
+
+/* Standard includes. */
+#include <stdint.h>
+#include <stdio.h>
+
+/* FreeRTOS includes. */
+#include "FreeRTOSConfig.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* FreeRTOS+TCP includes. */
+#include "FreeRTOS_IP.h"
+#include "FreeRTOS_Sockets.h"
+
+/* Demo app includes. */
+#include "ModbusServer.h"
+
+/* Metrics includes */
+#include "modbus_metrics.h"
+
+/*-----------------------------------------------------------*/
+
+/* How long to wait for a scraper to send its request, or to close its end of
+ * the connection once the response has been sent. */
+#define metricsSOCKET_TIMEOUT_MS 2000
+
+/*-----------------------------------------------------------*/
+
+/*
+ * The task that serves scrapes.
+ */
+static void prvModbusMetricsTask( void *pvParameters );
+
+/*
+ * Send the HTTP response, then shut the connection down gracefully.
+ */
+static void prvServeScrape( Socket_t xConnectedSocket, char *pcBuffer );
+
+/*-----------------------------------------------------------*/
+
+static const char pcMetricsHttpHeader[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+/*-----------------------------------------------------------*/
+
+void vStartModbusMetricsTask( uint16_t usStackSize, uint32_t ulPort, UBaseType_t uxPriority )
+{
+    xTaskCreate( prvModbusMetricsTask, "ModbusMetrics", usStackSize, ( void * ) ulPort, uxPriority, NULL );
+}
+/*-----------------------------------------------------------*/
+
+static void prvModbusMetricsTask( void *pvParameters )
+{
+    struct freertos_sockaddr xBindAddress, xClient;
+    Socket_t xListeningSocket, xConnectedSocket;
+    socklen_t xSize = sizeof( xClient );
+    static const TickType_t xTimeOut = pdMS_TO_TICKS( metricsSOCKET_TIMEOUT_MS );
+    const BaseType_t xBacklog = 1;
+
+    /* The strange casting is to remove compiler warnings on 32-bit machines. */
+    uint16_t usPort = ( uint16_t ) ( ( uint32_t ) pvParameters ) & 0xffffUL;
+
+    /* The render buffer is allocated once, so a scrape never allocates. */
+    char *pcBuffer = ( char * )pvPortMalloc( metricsRENDER_BUFFER_SIZE * sizeof( char ) );
+    configASSERT( pcBuffer != NULL );
+
+    xListeningSocket = FreeRTOS_socket( FREERTOS_AF_INET, FREERTOS_SOCK_STREAM, FREERTOS_IPPROTO_TCP );
+    configASSERT( xListeningSocket != FREERTOS_INVALID_SOCKET );
+
+    xBindAddress.sin_port = FreeRTOS_htons( usPort );
+    FreeRTOS_bind( xListeningSocket, &xBindAddress, sizeof( xBindAddress ) );
+    FreeRTOS_listen( xListeningSocket, xBacklog );
+
+    for( ;; )
+    {
+        /* Wait for a scraper to connect. */
+        xConnectedSocket = FreeRTOS_accept( xListeningSocket, &xClient, &xSize );
+        if( xConnectedSocket == NULL || xConnectedSocket == FREERTOS_INVALID_SOCKET )
+        {
+            continue;
+        }
+
+        FreeRTOS_setsockopt( xConnectedSocket, 0, FREERTOS_SO_RCVTIMEO, &xTimeOut, sizeof( xTimeOut ) );
+        FreeRTOS_setsockopt( xConnectedSocket, 0, FREERTOS_SO_SNDTIMEO, &xTimeOut, sizeof( xTimeOut ) );
+
+        prvServeScrape( xConnectedSocket, pcBuffer );
+    }
+}
+/*-----------------------------------------------------------*/
+
+static void prvServeScrape( Socket_t xConnectedSocket, char *pcBuffer )
+{
+    BaseType_t xBodyLength;
+    TickType_t xTimeOnShutdown;
+
+    /* The request itself doesn't matter: every path gets the metrics, so
+     * just consume whatever has arrived. */
+    ( void ) FreeRTOS_recv( xConnectedSocket, pcBuffer, metricsRENDER_BUFFER_SIZE, 0 );
+
+    xBodyLength = xMetricsRender( pcBuffer, metricsRENDER_BUFFER_SIZE );
+    if( xBodyLength >= 0 )
+    {
+        FreeRTOS_send( xConnectedSocket, pcMetricsHttpHeader, sizeof( pcMetricsHttpHeader ) - 1, 0 );
+        FreeRTOS_send( xConnectedSocket, pcBuffer, xBodyLength, 0 );
+    }
+    else
+    {
+        FreeRTOS_debug_printf( ( "Metrics do not fit in %d bytes\r\n", metricsRENDER_BUFFER_SIZE ) );
+    }
+
+    /* Initiate a shutdown, then wait for the scraper to close its end. */
+    FreeRTOS_shutdown( xConnectedSocket, FREERTOS_SHUT_RDWR );
+    xTimeOnShutdown = xTaskGetTickCount();
+    while( FreeRTOS_recv( xConnectedSocket, pcBuffer, metricsRENDER_BUFFER_SIZE, 0 ) >= 0 )
+    {
+        if( ( xTaskGetTickCount() - xTimeOnShutdown ) >= pdMS_TO_TICKS( metricsSOCKET_TIMEOUT_MS ) )
+        {
+            break;
+        }
+        vTaskDelay( pdMS_TO_TICKS( 10 ) );
+    }
+
+    FreeRTOS_closesocket( xConnectedSocket );
+}
+/*-----------------------------------------------------------*/
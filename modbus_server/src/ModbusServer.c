@@ -95,6 +95,15 @@ mission critical applications that require provable dependability.
 #include "microbenchmark.h"
 #endif
 
+/* Span trace includes (markers are empty unless MODBUS_SPAN_TRACE) */
+#include "spantrace.h"
+
+/* Heap profile includes (markers are empty unless MODBUS_HEAP_PROFILE) */
+#include "heapprofile.h"
+
+/* Metrics includes (updates are empty unless MODBUS_METRICS) */
+#include "modbus_metrics.h"
+
 /* Modbus object capability includes */
 #if defined(MODBUS_OBJECT_CAPS) || defined(MODBUS_OBJECT_CAPS_STUBS)
 #include "modbus_object_caps.h"
@@ -105,6 +114,32 @@ mission critical applications that require provable dependability.
 #include "modbus_network_caps.h"
 #endif
 
+/* Capability modes selected at run time */
+#if defined( MODBUS_RUNTIME_CAPS )
+#include "ModbusCapsModes.h"
+
+/* The modes to run, in order (NULL = every mode compiled in) */
+#ifndef modbusCAPS_MODE_SCHEDULE
+#define modbusCAPS_MODE_SCHEDULE NULL
+#endif
+
+/* Client sessions per mode: by default, the discarded and the measured
+ * session of benchmark_scripts/run_microbench.sh */
+#ifndef modbusCAPS_SESSIONS_PER_MODE
+#define modbusCAPS_SESSIONS_PER_MODE 2
+#endif
+#endif
+
+/* Report-by-exception subscriptions */
+#if defined( MODBUS_SUBSCRIPTIONS )
+#include "ModbusSubscriptions.h"
+#endif
+
+/* Batch reads */
+#if defined( MODBUS_BATCH_READ )
+#include "ModbusBatchRead.h"
+#endif
+
 /*-----------------------------------------------------------*/
 
 /*
@@ -134,6 +169,20 @@ static BaseType_t prvProcessModbusRequest(const uint8_t *req, const int req_leng
  */
 static void prvGracefulShutdown( void );
 
+#if defined( MODBUS_SUBSCRIPTIONS )
+/*
+ * Authorises a subscription as a read of its range.
+ */
+static int prvVerifySubscription( int function, uint16_t addr, int nb );
+#endif
+
+#if defined( MODBUS_BATCH_READ )
+/*
+ * Authorises every read in a batch.
+ */
+static int prvVerifyBatchRead( const ModbusBatchItem_t *pxItems, int xItems );
+#endif
+
 /*-----------------------------------------------------------*/
 
 /* Structure to hold queue messages (requests and responses). */
@@ -149,6 +198,17 @@ static modbus_mapping_t *mb_mapping = NULL;
 /* The structure holding Modbus context. */
 static modbus_t *ctx = NULL;
 
+#if defined( MODBUS_RUNTIME_CAPS )
+/* The shims to call for each request */
+static ModbusCapsDispatch_t xCapsDispatch;
+#endif
+
+#if defined( MODBUS_SUBSCRIPTIONS ) || defined( MODBUS_BATCH_READ )
+/* The string table as allocated, since the object capabilities shim
+ * restricts (or clears) mb_mapping->tab_string while processing */
+static uint8_t *pucTabString = NULL;
+#endif
+
 /*-----------------------------------------------------------*/
 
 void vStartModbusServerTask( uint16_t usStackSize, uint32_t ulPort, UBaseType_t uxPriority )
@@ -194,10 +254,17 @@ void prvModbusServerTask( void *pvParameters )
             vTaskDelete( NULL );
         }
 
+#if defined( MODBUS_RUNTIME_CAPS ) && defined( MODBUS_MICROBENCHMARK )
+        /* Record the cost of calling the shims through the mode's function
+         * table, printed with this session's samples. */
+        vModbusCapsMeasureDispatch( &xCapsDispatch, req );
+#endif
+
         /* Wait for an incoming connection. */
         xConnectedSocket = modbus_tcp_accept( ctx, &xListeningSocket );
         configASSERT( xConnectedSocket != NULL &&
                 xConnectedSocket != FREERTOS_INVALID_SOCKET );
+        METRICS_CONNECTION();
 
         /* Receive a request from the Modbus client. */
         req_length = modbus_receive( ctx, req );
@@ -227,7 +294,9 @@ void prvModbusServerTask( void *pvParameters )
             ulCycleCountStart = get_cycle_count();
 
             /* Process the request. */
+            HEAP_PROFILE_BEGIN( pcModbusFunctionName );
             xReturned  = prvProcessModbusRequest( req, req_length, rsp, &rsp_length );
+            HEAP_PROFILE_END();
             configASSERT( xReturned != -1 );
 
             /* get the cycle count after processing the request. */
@@ -245,6 +314,8 @@ void prvModbusServerTask( void *pvParameters )
                     ulCycleCountDiff, pdTRUE );
 #endif
 
+            METRICS_REQUEST( modbus_get_function_code( ctx, req ), ulCycleCountDiff );
+
 #if defined( modbusNETWORK_DELAY_MS )
             /* For the macrobenchmark, we simulate network delay by blocking
              * after receiving a request and before sending a reply. */
@@ -254,6 +325,7 @@ void prvModbusServerTask( void *pvParameters )
             /* Reply to the Modbus client. */
             xReturned = modbus_reply( ctx, rsp, rsp_length );
             configASSERT( xReturned != -1 );
+            METRICS_BYTES( req_length, rsp_length );
 
 #if defined( modbusEXEC_PERIOD_MS )
             /* Check if we've overrun the execution period.  This might happen
@@ -274,6 +346,7 @@ void prvModbusServerTask( void *pvParameters )
                 FreeRTOS_debug_printf( ( "xTimeIncrement = %d\r\n", xTimeIncrement ) );
                 xPreviousWakeTime = xTaskGetTickCount();
                 ulOverrunCount += 1;
+                METRICS_OVERRUN();
 
                 ulCycleCountDiff = 0;
             }
@@ -317,10 +390,30 @@ void prvModbusServerTask( void *pvParameters )
         /* Close the socket correctly. */
         prvGracefulShutdown();
 
+#if defined( MODBUS_SUBSCRIPTIONS )
+        /* Subscriptions don't outlive the connection that made them */
+        vModbusSubscriptionsRelease( 0 );
+#endif
+
 #if defined( MODBUS_MICROBENCHMARK )
         /* Print microbenchmark samples to stdout and do not reopen the port */
         vPrintMicrobenchmarkSamples();
 #endif
+
+#if defined( MODBUS_SPAN_TRACE )
+        /* Print the per-stage spans for the most recent requests */
+        vPrintSpanTrace();
+#endif
+
+#if defined( MODBUS_HEAP_PROFILE )
+        /* Print heap usage per Modbus function and call site */
+        vPrintHeapProfile();
+#endif
+
+#if defined( MODBUS_RUNTIME_CAPS )
+        /* Move to the next capability mode, if this one is done */
+        vModbusCapsSessionEnd( &xCapsDispatch );
+#endif
     }
 }
 
@@ -408,6 +501,24 @@ static void prvModbusServerInitialization( uint16_t port )
         mb_mapping->tab_input_registers[i] = UT_INPUT_REGISTERS_TAB[i];
     }
 
+#if defined( MODBUS_SUBSCRIPTIONS ) || defined( MODBUS_BATCH_READ )
+    /* Before any shim restricts the mapping */
+    pucTabString = mb_mapping->tab_string;
+#endif
+
+#if defined( MODBUS_SUBSCRIPTIONS )
+    /* Subscriptions lapse when the key authorising them is retired */
+#if defined( MODBUS_NETWORK_CAPS )
+    vModbusSubscriptionsInit( ctx, mb_mapping, prvVerifySubscription, network_caps_keyring_epoch );
+#else
+    vModbusSubscriptionsInit( ctx, mb_mapping, prvVerifySubscription, NULL );
+#endif
+#endif
+
+#if defined( MODBUS_BATCH_READ )
+    vModbusBatchReadInit( ctx, mb_mapping, prvVerifyBatchRead );
+#endif
+
 #if defined(MODBUS_NETWORK_CAPS)
     /* Initialise Macaroon */
     BaseType_t xReturned = 0;
@@ -421,6 +532,17 @@ static void prvModbusServerInitialization( uint16_t port )
         _exit( 0 );
     }
 #endif
+
+#if defined( MODBUS_RUNTIME_CAPS )
+    /* Select the first capability mode */
+    if( xModbusCapsInit( &xCapsDispatch, ctx, mb_mapping,
+                modbusCAPS_MODE_SCHEDULE, modbusCAPS_SESSIONS_PER_MODE ) == -1 )
+    {
+        fprintf( stderr, "Failed to initialise the capability modes\r\n" );
+        modbus_free( ctx );
+        _exit( 0 );
+    }
+#endif
 }
 
 /*-----------------------------------------------------------*/
@@ -435,6 +557,41 @@ static BaseType_t prvProcessModbusRequest(const uint8_t *req, const int req_leng
 {
     BaseType_t xReturned;
 
+    SPAN_BEGIN( "prvProcessModbusRequest" );
+
+#if defined( MODBUS_SUBSCRIPTIONS )
+    /**
+     * Subscription requests are answered here, without the shims, having
+     * been authorised once when the subscription was made.  There is one
+     * connection at a time, so it owns every subscription.
+     * */
+    SPAN_BEGIN( "subscriptions" );
+    xReturned = xModbusSubscriptionsProcess( req, req_length, rsp, rsp_length, 0 );
+    SPAN_END( "subscriptions" );
+    configASSERT(xReturned != -1);
+    if( xReturned == 1 )
+    {
+        SPAN_END( "prvProcessModbusRequest" );
+        return 0;
+    }
+#endif
+
+#if defined( MODBUS_BATCH_READ )
+    /**
+     * Batch reads are verified once for every item, then answered here
+     * without the shims.
+     * */
+    SPAN_BEGIN( "batch_read" );
+    xReturned = xModbusBatchReadProcess( req, req_length, rsp, rsp_length );
+    SPAN_END( "batch_read" );
+    configASSERT(xReturned != -1);
+    if( xReturned == 1 )
+    {
+        SPAN_END( "prvProcessModbusRequest" );
+        return 0;
+    }
+#endif
+
     /**
      * Perform preprocessing for object or network capabilities
      * then perform the normal processing
@@ -445,25 +602,105 @@ static BaseType_t prvProcessModbusRequest(const uint8_t *req, const int req_leng
      * NB A configuration without object or network capabilities can still
      * be compiled for a CHERI system, it just wont restrict the state before
      * processing the request.
+     * NB With MODBUS_RUNTIME_CAPS, the shims of the current mode are
+     * called through its function table, in the same order.
      * */
-#if defined(MODBUS_OBJECT_CAPS_STUB)
+#if defined( MODBUS_RUNTIME_CAPS )
+    xReturned = xModbusCapsPreprocess( &xCapsDispatch, req );
+    configASSERT(xReturned != -1);
+#elif defined(MODBUS_OBJECT_CAPS_STUB)
     /* this is only used to evaluate the overhead of calling a function */
+    SPAN_BEGIN( "object_caps_shim" );
     xReturned = modbus_preprocess_request_object_caps_stub(ctx, req, mb_mapping);
+    SPAN_END( "object_caps_shim" );
     configASSERT(xReturned != -1);
 #elif defined(MODBUS_OBJECT_CAPS)
+    SPAN_BEGIN( "object_caps_shim" );
     xReturned = modbus_preprocess_request_object_caps(ctx, req, mb_mapping);
+    SPAN_END( "object_caps_shim" );
     configASSERT(xReturned != -1);
 #endif
 
-#if defined(MODBUS_NETWORK_CAPS)
+#if defined(MODBUS_NETWORK_CAPS) && !defined( MODBUS_RUNTIME_CAPS )
+    SPAN_BEGIN( "network_caps_shim" );
     xReturned = modbus_preprocess_request_network_caps(ctx, req, mb_mapping);
+    SPAN_END( "network_caps_shim" );
     configASSERT(xReturned != -1);
 #endif
 
+    SPAN_BEGIN( "modbus_process_request" );
     xReturned = modbus_process_request(ctx, req, req_length,
             rsp, rsp_length, mb_mapping);
+    SPAN_END( "modbus_process_request" );
+
+#if defined( MODBUS_SUBSCRIPTIONS )
+    if( xReturned != -1 )
+    {
+        vModbusSubscriptionsNoteRequest( req, rsp );
+    }
+#endif
+
+    SPAN_END( "prvProcessModbusRequest" );
 
     return xReturned;
 }
 
 /*-----------------------------------------------------------*/
+
+#if defined( MODBUS_SUBSCRIPTIONS )
+static int prvVerifySubscription( int function, uint16_t addr, int nb )
+{
+#if defined( MODBUS_RUNTIME_CAPS )
+    /* Only verify in the modes with network capabilities */
+    if( pxModbusCapsCurrentMode( &xCapsDispatch )->xNetworkCapsShim == NULL )
+    {
+        return 0;
+    }
+#endif
+
+#if defined(MODBUS_NETWORK_CAPS)
+    return modbus_verify_network_caps( ctx, pucTabString, function, addr, nb );
+#else
+    ( void ) pucTabString;
+    ( void ) function;
+    ( void ) addr;
+    ( void ) nb;
+    return 0;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+#endif
+
+#if defined( MODBUS_BATCH_READ )
+static int prvVerifyBatchRead( const ModbusBatchItem_t *pxItems, int xItems )
+{
+#if defined( MODBUS_RUNTIME_CAPS )
+    /* Only verify in the modes with network capabilities */
+    if( pxModbusCapsCurrentMode( &xCapsDispatch )->xNetworkCapsShim == NULL )
+    {
+        return 0;
+    }
+#endif
+
+#if defined(MODBUS_NETWORK_CAPS)
+    network_caps_range_t pxRanges[ MODBUS_MAX_BATCH_ITEMS ];
+
+    for( int i = 0; i < xItems; i++ )
+    {
+        pxRanges[ i ].function = pxItems[ i ].xFunction;
+        pxRanges[ i ].addr = pxItems[ i ].usAddr;
+        pxRanges[ i ].nb = pxItems[ i ].xNb;
+    }
+
+    return modbus_verify_batch_network_caps( ctx, pucTabString, pxRanges, xItems );
+#else
+    ( void ) pucTabString;
+    ( void ) pxItems;
+    ( void ) xItems;
+    return 0;
+#endif
+}
+
+/*-----------------------------------------------------------*/
+#endif
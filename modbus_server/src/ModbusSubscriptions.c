@@ -0,0 +1,394 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/* Standard includes. */
+#include <stdint.h>
+#include <string.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+
+/* Subscription includes */
+#include "ModbusSubscriptions.h"
+#include "ModbusExtensions.h"
+
+/* type definitions */
+
+typedef struct _ModbusSubscription_t {
+    int xInUse;
+    int xOwner;
+    int xTable;
+    uint16_t usAddr;
+    uint16_t usNb;
+    /* the sequence number of the last change to the range */
+    uint32_t ulChanged;
+    /* the epoch the subscription was verified in */
+    uint32_t ulEpoch;
+} ModbusSubscription_t;
+
+/* static variable declarations */
+
+static modbus_t *pxSubscriptionsCtx = NULL;
+
+static ModbusSubscriptionsVerify_t xSubscriptionsVerify = NULL;
+static ModbusSubscriptionsEpoch_t xSubscriptionsEpoch = NULL;
+
+static ModbusSubscription_t pxSubscriptions[ modbusSUBSCRIPTIONS_MAX ];
+static uint32_t ulSubscriptionsSequence = 0;
+
+/*-----------------------------------------------------------*/
+
+static uint32_t prvEpoch( void )
+{
+    return ( xSubscriptionsEpoch != NULL ) ? xSubscriptionsEpoch() : 0;
+}
+
+/*-----------------------------------------------------------*/
+
+/*
+ * Subscribe xOwner to the range in pucParams, writing the id and current
+ * sequence number to pucResult.
+ */
+static int prvSubscribe( const uint8_t *pucParams, int xOwner, uint8_t *pucResult,
+        int *pxException )
+{
+    int xTable = usModbusExtensionGetUint16( pucParams );
+    uint16_t usAddr = usModbusExtensionGetUint16( pucParams + 2 );
+    int xNb = usModbusExtensionGetUint16( pucParams + 4 );
+    int xMaxNb = xModbusTableIsBits( xTable ) ? MODBUS_MAX_SUBSCRIBE_BITS : MODBUS_MAX_SUBSCRIBE_REGISTERS;
+    int xId;
+    /* before verifying, so a key retired meanwhile releases it */
+    uint32_t ulEpoch = prvEpoch();
+
+    if( xTable > MODBUS_SUBSCRIPTION_INPUT_REGISTERS || xNb < 1 || xNb > xMaxNb )
+    {
+        *pxException = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+        return 0;
+    }
+
+    if( !xModbusTableInMapping( pxModbusExtensionMapping(), xTable, usAddr, xNb ) )
+    {
+        *pxException = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+        return 0;
+    }
+
+    /* the one verification for the lifetime of the subscription (or
+     * until the epoch changes) */
+    if( xSubscriptionsVerify != NULL &&
+            xSubscriptionsVerify( xModbusTableReadFunction( xTable ), usAddr, xNb ) != 0 )
+    {
+        return -1;
+    }
+
+    for( xId = 0; xId < modbusSUBSCRIPTIONS_MAX; ++xId )
+    {
+        if( !pxSubscriptions[ xId ].xInUse )
+        {
+            break;
+        }
+    }
+
+    if( xId == modbusSUBSCRIPTIONS_MAX )
+    {
+        *pxException = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+        return 0;
+    }
+
+    /* a new subscription counts as changed, so its first poll returns it */
+    ulSubscriptionsSequence += 1;
+
+    pxSubscriptions[ xId ].xInUse = 1;
+    pxSubscriptions[ xId ].xOwner = xOwner;
+    pxSubscriptions[ xId ].xTable = xTable;
+    pxSubscriptions[ xId ].usAddr = usAddr;
+    pxSubscriptions[ xId ].usNb = ( uint16_t )xNb;
+    pxSubscriptions[ xId ].ulChanged = ulSubscriptionsSequence;
+    pxSubscriptions[ xId ].ulEpoch = ulEpoch;
+
+    vModbusExtensionPutUint16( pucResult, ( uint16_t )xId );
+    vModbusExtensionPutUint16( pucResult + 2, ( uint16_t )( ulSubscriptionsSequence >> 16 ) );
+    vModbusExtensionPutUint16( pucResult + 4, ( uint16_t )( ulSubscriptionsSequence & 0xFFFF ) );
+
+    return 0;
+}
+
+static void prvUnsubscribe( const uint8_t *pucParams, int xOwner, uint8_t *pucResult,
+        int *pxException )
+{
+    int xId = usModbusExtensionGetUint16( pucParams );
+
+    if( xId >= modbusSUBSCRIPTIONS_MAX || !pxSubscriptions[ xId ].xInUse ||
+            pxSubscriptions[ xId ].xOwner != xOwner )
+    {
+        *pxException = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+        return;
+    }
+
+    pxSubscriptions[ xId ].xInUse = 0;
+    vModbusExtensionPutUint16( pucResult, ( uint16_t )xId );
+}
+
+/*
+ * Write xOwner's subscriptions changed since the sequence number in
+ * pucParams to pucResult (xResultNb registers).  Subscriptions verified
+ * in an earlier epoch are released instead, and the request answered with
+ * ILLEGAL_DATA_ADDRESS so the client subscribes again.
+ */
+static void prvChangesSince( const uint8_t *pucParams, int xOwner, uint8_t *pucResult,
+        int xResultNb, int *pxException )
+{
+    uint32_t ulSince = ( ( uint32_t )usModbusExtensionGetUint16( pucParams ) << 16 ) |
+        usModbusExtensionGetUint16( pucParams + 2 );
+    uint32_t ulSequence = ulSubscriptionsSequence;
+    int xUsed = MODBUS_CHANGES_HEADER_NB;
+    int xCount = 0;
+    int xMore = 0;
+    int xReleased = 0;
+    uint32_t ulEpoch = prvEpoch();
+
+    for( int i = 0; i < modbusSUBSCRIPTIONS_MAX; ++i )
+    {
+        ModbusSubscription_t *pxSubscription = &pxSubscriptions[ i ];
+
+        if( !pxSubscription->xInUse || pxSubscription->xOwner != xOwner )
+        {
+            continue;
+        }
+
+        /* its capability may have been revoked */
+        if( pxSubscription->ulEpoch != ulEpoch )
+        {
+            pxSubscription->xInUse = 0;
+            xReleased = 1;
+            continue;
+        }
+
+        if( pxSubscription->ulChanged <= ulSince )
+        {
+            continue;
+        }
+
+        int xEntryNb = 1 + xModbusTablePackedLength( pxSubscription->xTable, pxSubscription->usNb );
+        if( xUsed + xEntryNb > xResultNb )
+        {
+            /* left for the next request: report the sequence from just
+             * before the oldest change left out */
+            if( pxSubscription->ulChanged - 1 < ulSequence )
+            {
+                ulSequence = pxSubscription->ulChanged - 1;
+            }
+            xMore = 1;
+            continue;
+        }
+
+        vModbusExtensionPutUint16( pucResult + 2 * xUsed, ( uint16_t )i );
+        vModbusTablePack( pxModbusExtensionMapping(), pxSubscription->xTable,
+                pxSubscription->usAddr, pxSubscription->usNb, pucResult + 2 * ( xUsed + 1 ) );
+        xUsed += xEntryNb;
+        xCount += 1;
+    }
+
+    if( xReleased )
+    {
+        *pxException = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+        return;
+    }
+
+    vModbusExtensionPutUint16( pucResult, ( uint16_t )( ulSequence >> 16 ) );
+    vModbusExtensionPutUint16( pucResult + 2, ( uint16_t )( ulSequence & 0xFFFF ) );
+    vModbusExtensionPutUint16( pucResult + 4, ( uint16_t )xCount );
+    vModbusExtensionPutUint16( pucResult + 6, ( uint16_t )xMore );
+}
+
+/*-----------------------------------------------------------*/
+
+void vModbusSubscriptionsInit( modbus_t *ctx, const modbus_mapping_t *mb_mapping,
+        ModbusSubscriptionsVerify_t xVerify, ModbusSubscriptionsEpoch_t xEpoch )
+{
+    pxSubscriptionsCtx = ctx;
+    vModbusExtensionInit( mb_mapping );
+    xSubscriptionsVerify = xVerify;
+    xSubscriptionsEpoch = xEpoch;
+    ulSubscriptionsSequence = 0;
+    memset( pxSubscriptions, 0, sizeof( pxSubscriptions ) );
+}
+
+/*-----------------------------------------------------------*/
+
+int xModbusSubscriptionsProcess( const uint8_t *req, int req_length,
+        uint8_t *rsp, int *rsp_length, int xOwner )
+{
+    static const uint16_t pusAddresses[] = {
+        MODBUS_SUBSCRIBE_ADDRESS,
+        MODBUS_UNSUBSCRIBE_ADDRESS,
+        MODBUS_CHANGES_SINCE_ADDRESS
+    };
+    ModbusExtensionRequest_t xRequest;
+    int xParsed = 0;
+    int xException = 0;
+
+    for( size_t i = 0; i < sizeof( pusAddresses ) / sizeof( pusAddresses[ 0 ] ) && xParsed == 0; ++i )
+    {
+        xParsed = xModbusExtensionParse( pxSubscriptionsCtx, req, req_length, pusAddresses[ i ], &xRequest );
+    }
+
+    if( xParsed == 0 )
+    {
+        return 0;
+    }
+
+    if( xParsed == -1 || xRequest.xReadNb > MODBUS_CHANGES_RESULT_NB )
+    {
+        vModbusExtensionReply( req, &xRequest, rsp, rsp_length, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE );
+        return 1;
+    }
+
+    uint8_t *pucResult = pucModbusExtensionResult( &xRequest, rsp );
+
+    switch( xRequest.usAddress )
+    {
+        case MODBUS_SUBSCRIBE_ADDRESS:
+            if( xRequest.xWriteNb != MODBUS_SUBSCRIBE_PARAMS_NB || xRequest.xReadNb < MODBUS_SUBSCRIBE_RESULT_NB )
+            {
+                xException = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+            }
+            else if( prvSubscribe( xRequest.pucParams, xOwner, pucResult, &xException ) == -1 )
+            {
+                return -1;
+            }
+            break;
+
+        case MODBUS_UNSUBSCRIBE_ADDRESS:
+            if( xRequest.xWriteNb != 1 )
+            {
+                xException = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+            }
+            else
+            {
+                prvUnsubscribe( xRequest.pucParams, xOwner, pucResult, &xException );
+            }
+            break;
+
+        case MODBUS_CHANGES_SINCE_ADDRESS:
+            if( xRequest.xWriteNb != MODBUS_CHANGES_SINCE_PARAMS_NB || xRequest.xReadNb < MODBUS_CHANGES_HEADER_NB )
+            {
+                xException = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+            }
+            else
+            {
+                prvChangesSince( xRequest.pucParams, xOwner, pucResult, xRequest.xReadNb, &xException );
+            }
+            break;
+    }
+
+    vModbusExtensionReply( req, &xRequest, rsp, rsp_length, xException );
+
+    return 1;
+}
+
+/*-----------------------------------------------------------*/
+
+void vModbusSubscriptionsNoteRequest( const uint8_t *req, const uint8_t *rsp )
+{
+    int xOffset = modbus_get_header_length( pxSubscriptionsCtx );
+    uint16_t usAddr = usModbusExtensionGetUint16( req + xOffset + 1 );
+
+    /* the write was refused */
+    if( rsp[ xOffset ] & 0x80 )
+    {
+        return;
+    }
+
+    switch( req[ xOffset ] )
+    {
+        case MODBUS_FC_WRITE_SINGLE_COIL:
+            vModbusSubscriptionsNoteChange( MODBUS_SUBSCRIPTION_COILS, usAddr, 1 );
+            break;
+        case MODBUS_FC_WRITE_MULTIPLE_COILS:
+            vModbusSubscriptionsNoteChange( MODBUS_SUBSCRIPTION_COILS, usAddr,
+                    usModbusExtensionGetUint16( req + xOffset + 3 ) );
+            break;
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        case MODBUS_FC_MASK_WRITE_REGISTER:
+            vModbusSubscriptionsNoteChange( MODBUS_SUBSCRIPTION_HOLDING_REGISTERS, usAddr, 1 );
+            break;
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+            vModbusSubscriptionsNoteChange( MODBUS_SUBSCRIPTION_HOLDING_REGISTERS, usAddr,
+                    usModbusExtensionGetUint16( req + xOffset + 3 ) );
+            break;
+        case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+            /* the write address and nb follow the read's */
+            vModbusSubscriptionsNoteChange( MODBUS_SUBSCRIPTION_HOLDING_REGISTERS,
+                    usModbusExtensionGetUint16( req + xOffset + 5 ),
+                    usModbusExtensionGetUint16( req + xOffset + 7 ) );
+            break;
+        default:
+            break;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void vModbusSubscriptionsNoteChange( int xTable, uint16_t usAddr, int xNb )
+{
+    int xBumped = 0;
+
+    for( int i = 0; i < modbusSUBSCRIPTIONS_MAX; ++i )
+    {
+        ModbusSubscription_t *pxSubscription = &pxSubscriptions[ i ];
+
+        if( !pxSubscription->xInUse || pxSubscription->xTable != xTable ||
+                usAddr + xNb <= pxSubscription->usAddr ||
+                usAddr >= pxSubscription->usAddr + pxSubscription->usNb )
+        {
+            continue;
+        }
+
+        /* one sequence number per change, however many ranges it touches */
+        if( !xBumped )
+        {
+            ulSubscriptionsSequence += 1;
+            xBumped = 1;
+        }
+        pxSubscription->ulChanged = ulSubscriptionsSequence;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void vModbusSubscriptionsRelease( int xOwner )
+{
+    for( int i = 0; i < modbusSUBSCRIPTIONS_MAX; ++i )
+    {
+        if( pxSubscriptions[ i ].xOwner == xOwner )
+        {
+            pxSubscriptions[ i ].xInUse = 0;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
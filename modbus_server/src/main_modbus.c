@@ -102,6 +102,11 @@
 #define mainMODBUS_SERVER_TASK_PRIORITY               ( tskIDLE_PRIORITY )
 #define mainMODBUS_SERVER_PORT_NUMBER                 ( 502UL )
 
+/* Metrics endpoint task parameters.  Scrapes are served in the Prometheus text
+ * format on a separate port so they never queue behind Modbus requests. */
+#define mainMODBUS_METRICS_TASK_PRIORITY              ( tskIDLE_PRIORITY )
+#define mainMODBUS_METRICS_PORT_NUMBER                ( 9502UL )
+
 /* Dimensions the buffer used to send UDP print and debug messages. */
 #define cmdPRINTF_BUFFER_SIZE                         512
 
@@ -350,6 +355,11 @@ void vApplicationIPNetworkEventHook( eIPCallbackEvent_t eNetworkEvent )
                 {
                     /* Modbus TCP server on port specified by mainMODBUS_SERVER_PORT_NUMBER */
                     vStartModbusServerTask( configMINIMAL_STACK_SIZE, mainMODBUS_SERVER_PORT_NUMBER, mainMODBUS_SERVER_TASK_PRIORITY );
+
+                    #if defined( MODBUS_METRICS )
+                        /* Metrics endpoint on port specified by mainMODBUS_METRICS_PORT_NUMBER */
+                        vStartModbusMetricsTask( configMINIMAL_STACK_SIZE, mainMODBUS_METRICS_PORT_NUMBER, mainMODBUS_METRICS_TASK_PRIORITY );
+                    #endif
                 }
             #endif /* mainCREATE_MODBUS_SERVER_TASKS */
 
@@ -0,0 +1,796 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Copyright (c) 2021 Michael Dodson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+*/
+
+/*
+ * A Modbus server for Linux hosts, so the benchmarks can be run over
+ * loopback without the FPGA.
+ *
+ * Requests are processed exactly as in ModbusServer.c (object capabilities,
+ * then network capabilities, then modbus_process_request()), with the same
+ * compile-time options.  The execution period and simulated network delay,
+ * which are build options on FreeRTOS, are command line options here.
+ *
+ * Unlike the FreeRTOS server, several clients may be connected at once;
+ * sockets are multiplexed with select().  A request is received from every
+ * client with one before any is processed, and with network capabilities,
+ * their Macaroons are verified together (see verify_requests()).  Benchmark
+ * samples, span traces and heap profiles are printed whenever the last open
+ * connection closes, i.e., at the end of each client session.
+ *
+ * With -w, every request received is also recorded to a traffic trace (see
+ * traffictrace.h), which modbus_trace_replay can play back to a server.
+ *
+ * Built with MODBUS_RUNTIME_CAPS, the capability configuration is selected
+ * at run time instead (see ModbusCapsModes.h): -c gives the schedule of
+ * modes and -s the number of client sessions to run in each.
+ *
+ * Built with MODBUS_SUBSCRIPTIONS, clients may also subscribe to address
+ * ranges and poll for the ones that changed (see ModbusSubscriptions.h).
+ * Subscriptions belong to the connection that made them.  Built with
+ * MODBUS_BATCH_READ, clients may read several ranges with one request,
+ * authorised by one Macaroon (see ModbusBatchRead.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* Modbus includes. */
+#include <modbus/modbus.h>
+#include <modbus/modbus-helpers.h>
+
+/* Demo app includes. */
+#include "ModbusDemoConstants.h"
+
+/* Microbenchmark includes */
+#if defined(MODBUS_MICROBENCHMARK)
+#include "microbenchmark.h"
+#endif
+
+/* Span trace includes (markers are empty unless MODBUS_SPAN_TRACE) */
+#include "spantrace.h"
+
+/* Heap profile includes (markers are empty unless MODBUS_HEAP_PROFILE) */
+#include "heapprofile.h"
+
+/* Traffic trace includes */
+#include "traffictrace.h"
+
+/* Metrics includes (updates are empty unless MODBUS_METRICS) */
+#include "modbus_metrics.h"
+
+/* Modbus object capability includes */
+#if defined(MODBUS_OBJECT_CAPS)
+#include "modbus_object_caps.h"
+#endif
+
+/* Modbus network capability includes */
+#if defined(MODBUS_NETWORK_CAPS)
+#include "modbus_network_caps.h"
+#endif
+
+/* Capability mode includes */
+#if defined(MODBUS_RUNTIME_CAPS)
+#include "ModbusCapsModes.h"
+#endif
+
+/* Subscription includes */
+#if defined(MODBUS_SUBSCRIPTIONS)
+#include "ModbusSubscriptions.h"
+#endif
+
+/* Batch read includes */
+#if defined(MODBUS_BATCH_READ)
+#include "ModbusBatchRead.h"
+#endif
+
+/*************
+ * DEFINITIONS
+ ************/
+
+#define DEFAULT_PORT 1502
+#define DEFAULT_BACKLOG 16
+
+/* the warm-up and the measured session, as run by run_loopback_bench.sh */
+#define DEFAULT_SESSIONS_PER_MODE 2
+
+/* printed once the server is listening, and after each client session */
+#define SERVER_READY_MARKER "MODBUS_HOST_SERVER_READY"
+#define SESSION_END_MARKER "MODBUS_HOST_SERVER_SESSION_END"
+
+/**
+ * With network capabilities, the Macaroon a client writes is held in
+ * mb_mapping->tab_string until its next request.  Each connection keeps
+ * its own copy, which is swapped in whenever the server switches to
+ * a different connection, so interleaved clients can't clobber each
+ * other's tokens.
+ * */
+typedef struct {
+    int socket;
+    /* the connection number in the traffic trace */
+    uint16_t trace_id;
+    uint8_t tab_string[MODBUS_MAX_STRING_LENGTH];
+    /* the request received, until it's processed */
+    uint8_t req[MODBUS_MAX_STRING_LENGTH];
+    int req_length;
+} connection_t;
+
+/* The structure holding Modbus state information. */
+static modbus_mapping_t *mb_mapping = NULL;
+
+/* The structure holding Modbus context. */
+static modbus_t *ctx = NULL;
+
+/* The string table as allocated, with full permissions, since the object
+ * capabilities shim restricts mb_mapping->tab_string while processing */
+static uint8_t *tab_string = NULL;
+
+static connection_t connections[FD_SETSIZE];
+static int current_socket = -1;
+
+/* The traffic trace being recorded (-w), if any */
+static FILE *trace = NULL;
+static uint64_t trace_start = 0;
+static uint16_t next_trace_id = 0;
+
+#if defined(MODBUS_RUNTIME_CAPS)
+/* The shims to call for each request */
+static ModbusCapsDispatch_t caps_dispatch;
+#endif
+
+/******************
+ * HELPER FUNCTIONS
+ *****************/
+
+#if defined(MODBUS_SUBSCRIPTIONS)
+/**
+ * Authorise a subscription as a read of its range, with the current
+ * connection's network capability (if network capabilities are in use)
+ * */
+static int verify_subscription(int function, uint16_t addr, int nb)
+{
+#if defined(MODBUS_RUNTIME_CAPS)
+    if (pxModbusCapsCurrentMode(&caps_dispatch)->xNetworkCapsShim == NULL) {
+        return 0;
+    }
+#endif
+
+#if defined(MODBUS_NETWORK_CAPS)
+    return modbus_verify_network_caps(ctx, tab_string, function, addr, nb);
+#else
+    (void)function;
+    (void)addr;
+    (void)nb;
+    return 0;
+#endif
+}
+#endif
+
+#if defined(MODBUS_BATCH_READ)
+/**
+ * Authorise every read in a batch with the current connection's network
+ * capability (if network capabilities are in use)
+ * */
+static int verify_batch_read(const ModbusBatchItem_t *items, int nb_items)
+{
+#if defined(MODBUS_RUNTIME_CAPS)
+    if (pxModbusCapsCurrentMode(&caps_dispatch)->xNetworkCapsShim == NULL) {
+        return 0;
+    }
+#endif
+
+#if defined(MODBUS_NETWORK_CAPS)
+    network_caps_range_t ranges[MODBUS_MAX_BATCH_ITEMS];
+
+    for (int i = 0; i < nb_items; i++) {
+        ranges[i].function = items[i].xFunction;
+        ranges[i].addr = items[i].usAddr;
+        ranges[i].nb = items[i].xNb;
+    }
+
+    return modbus_verify_batch_network_caps(ctx, tab_string, ranges, nb_items);
+#else
+    (void)items;
+    (void)nb_items;
+    return 0;
+#endif
+}
+#endif
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-p <port>] [-e <execution period ms>] [-d <network delay ms>]"
+            " [-n <sessions>] [-m <metrics port>] [-w <trace file>]\r\n", name);
+    printf("-n exits after the given number of client sessions (default: run forever)\r\n");
+    printf("-w records the requests received to a traffic trace\r\n");
+#if defined(MODBUS_RUNTIME_CAPS)
+    printf("-c <modes> runs the comma-separated capability modes in turn (default: all)\r\n");
+    printf("-s <sessions> client sessions per mode (default: %d)\r\n", DEFAULT_SESSIONS_PER_MODE);
+#endif
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec delay;
+
+    if (ms <= 0) {
+        return;
+    }
+
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (long)(ms % 1000) * 1000000;
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR) {
+    }
+}
+
+static void server_initialisation(int port, const char *modes, int sessions_per_mode)
+{
+    /* Pass NULL for the ip to listen on all interfaces */
+    ctx = modbus_new_tcp(NULL, port);
+    if (ctx == NULL) {
+        fprintf(stderr, "Failed to allocate ctx: %s\r\n", modbus_strerror(errno));
+        exit(1);
+    }
+
+#ifdef NDEBUG
+    modbus_set_debug(ctx, FALSE);
+#else
+    modbus_set_debug(ctx, TRUE);
+#endif
+
+    /* initialise state (mb_mapping) */
+#if defined(MODBUS_OBJECT_CAPS)
+    mb_mapping = modbus_mapping_new_start_address_object_caps(
+            ctx,
+            UT_BITS_ADDRESS, UT_BITS_NB,
+            UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB,
+            UT_REGISTERS_ADDRESS, UT_REGISTERS_NB_MAX,
+            UT_INPUT_REGISTERS_ADDRESS, UT_INPUT_REGISTERS_NB);
+#else
+    mb_mapping = modbus_mapping_new_start_address(
+            UT_BITS_ADDRESS, UT_BITS_NB,
+            UT_INPUT_BITS_ADDRESS, UT_INPUT_BITS_NB,
+            UT_REGISTERS_ADDRESS, UT_REGISTERS_NB_MAX,
+            UT_INPUT_REGISTERS_ADDRESS, UT_INPUT_REGISTERS_NB);
+#endif
+
+    if (mb_mapping == NULL) {
+        fprintf(stderr, "Failed to allocate the mapping: %s\r\n", modbus_strerror(errno));
+        modbus_free(ctx);
+        exit(1);
+    }
+
+    tab_string = mb_mapping->tab_string;
+
+    if (modbus_get_debug(ctx)) {
+        print_mb_mapping(mb_mapping);
+    }
+
+    /* Initialize coils */
+    modbus_set_bits_from_bytes(mb_mapping->tab_input_bits, 0, UT_INPUT_BITS_NB,
+            UT_INPUT_BITS_TAB);
+
+    /* Initialize discrete inputs */
+    for (int i = 0; i < UT_INPUT_REGISTERS_NB; i++) {
+        mb_mapping->tab_input_registers[i] = UT_INPUT_REGISTERS_TAB[i];
+    }
+
+#if defined(MODBUS_SUBSCRIPTIONS)
+    /* before any shim restricts the mapping; subscriptions lapse when
+     * the key authorising them is retired */
+#if defined(MODBUS_NETWORK_CAPS)
+    vModbusSubscriptionsInit(ctx, mb_mapping, verify_subscription, network_caps_keyring_epoch);
+#else
+    vModbusSubscriptionsInit(ctx, mb_mapping, verify_subscription, NULL);
+#endif
+#endif
+
+#if defined(MODBUS_BATCH_READ)
+    vModbusBatchReadInit(ctx, mb_mapping, verify_batch_read);
+#endif
+
+#if defined(MODBUS_NETWORK_CAPS)
+    /* Initialise Macaroon */
+    char *key = "a bad secret";
+    char *id = "id for a bad secret";
+    char *location = "https://www.modbus.com/macaroons/";
+    if (initialise_server_network_caps(ctx, location, key, id) == -1) {
+        fprintf(stderr, "Failed to initialise server macaroon\r\n");
+        modbus_free(ctx);
+        exit(1);
+    }
+#endif
+
+#if defined(MODBUS_RUNTIME_CAPS)
+    if (xModbusCapsInit(&caps_dispatch, ctx, mb_mapping, modes, sessions_per_mode) == -1) {
+        modbus_free(ctx);
+        exit(1);
+    }
+#if defined(MODBUS_MICROBENCHMARK)
+    vModbusCapsMeasureDispatch(&caps_dispatch, NULL);
+#endif
+#else
+    (void)modes;
+    (void)sessions_per_mode;
+#endif
+}
+
+/**
+ * Process a Modbus request from a client (cf. prvProcessModbusRequest()).
+ * */
+static int process_modbus_request(uint8_t *req, int req_length,
+        uint8_t *rsp, int *rsp_length)
+{
+    int rc;
+
+    SPAN_BEGIN("prvProcessModbusRequest");
+
+#if defined(MODBUS_SUBSCRIPTIONS)
+    /* subscription requests are answered without the shims, having been
+     * authorised once when the subscription was made */
+    SPAN_BEGIN("subscriptions");
+    rc = xModbusSubscriptionsProcess(req, req_length, rsp, rsp_length, current_socket);
+    SPAN_END("subscriptions");
+    if (rc != 0) {
+        SPAN_END("prvProcessModbusRequest");
+        return (rc == -1) ? -1 : *rsp_length;
+    }
+#endif
+
+#if defined(MODBUS_BATCH_READ)
+    /* batch reads are verified once for every item, then answered
+     * without the shims */
+    SPAN_BEGIN("batch_read");
+    rc = xModbusBatchReadProcess(req, req_length, rsp, rsp_length);
+    SPAN_END("batch_read");
+    if (rc != 0) {
+        SPAN_END("prvProcessModbusRequest");
+        return (rc == -1) ? -1 : *rsp_length;
+    }
+#endif
+
+    /* NB order matters: first reduce permissions on state, then verify the
+     * network capability, then perform the normal processing */
+#if defined(MODBUS_RUNTIME_CAPS)
+    rc = xModbusCapsPreprocess(&caps_dispatch, req);
+    if (rc == -1) {
+        SPAN_END("prvProcessModbusRequest");
+        return -1;
+    }
+#else
+#if defined(MODBUS_OBJECT_CAPS)
+    SPAN_BEGIN("object_caps_shim");
+    rc = modbus_preprocess_request_object_caps(ctx, req, mb_mapping);
+    SPAN_END("object_caps_shim");
+    if (rc == -1) {
+        SPAN_END("prvProcessModbusRequest");
+        return -1;
+    }
+#endif
+
+#if defined(MODBUS_NETWORK_CAPS)
+    SPAN_BEGIN("network_caps_shim");
+    rc = modbus_preprocess_request_network_caps(ctx, req, mb_mapping);
+    SPAN_END("network_caps_shim");
+    if (rc == -1) {
+        SPAN_END("prvProcessModbusRequest");
+        return -1;
+    }
+#endif
+#endif
+
+    SPAN_BEGIN("modbus_process_request");
+    rc = modbus_process_request(ctx, req, req_length, rsp, rsp_length, mb_mapping);
+    SPAN_END("modbus_process_request");
+
+#if defined(MODBUS_SUBSCRIPTIONS)
+    if (rc != -1) {
+        vModbusSubscriptionsNoteRequest(req, rsp);
+    }
+#endif
+
+    SPAN_END("prvProcessModbusRequest");
+
+    return rc;
+}
+
+/* append a request received on socket to the traffic trace */
+static void record_request(int socket, uint8_t *req, int req_length)
+{
+    TrafficTraceRecord_t record;
+    uint64_t now = now_ns();
+
+    if (trace == NULL) {
+        return;
+    }
+
+    if (trace_start == 0) {
+        trace_start = now;
+    }
+
+    record.ullTimestamp = now - trace_start;
+    record.usConnection = connections[socket].trace_id;
+    record.usLength = (uint16_t)req_length;
+    memcpy(record.pucAdu, req, (req_length < trafficMAX_ADU_LENGTH) ? req_length : trafficMAX_ADU_LENGTH);
+
+    if (xTrafficTraceWrite(trace, &record) != 0) {
+        fprintf(stderr, "Failed to write the traffic trace, recording stopped\r\n");
+        fclose(trace);
+        trace = NULL;
+    }
+}
+
+/* make socket the current connection, swapping in its token */
+static void switch_connection(int socket)
+{
+    if (socket == current_socket) {
+        return;
+    }
+
+#if defined(MODBUS_NETWORK_CAPS)
+    if (current_socket != -1) {
+        memcpy(connections[current_socket].tab_string, tab_string, MODBUS_MAX_STRING_LENGTH);
+    }
+    memcpy(tab_string, connections[socket].tab_string, MODBUS_MAX_STRING_LENGTH);
+#endif
+
+    modbus_set_socket(ctx, socket);
+    current_socket = socket;
+}
+
+#if defined(MODBUS_NETWORK_CAPS) && !defined(MODBUS_RUNTIME_CAPS)
+/**
+ * Verify the Macaroons of the requests received on sockets together (see
+ * modbus_verify_requests_network_caps()), so those that are authorised
+ * then pass the network capabilities shim from its cache.  With
+ * MODBUS_RUNTIME_CAPS, the mode decides whether tokens are verified at
+ * all, so they are only verified by the shim.
+ * */
+static void verify_requests(fd_set *sockets, int fd_max, int server_socket)
+{
+    static network_caps_request_t requests[FD_SETSIZE];
+    static int verdicts[FD_SETSIZE];
+    int nb_requests = 0;
+
+    for (int socket = 0; socket <= fd_max; ++socket) {
+        if (socket == server_socket || !FD_ISSET(socket, sockets) ||
+                connections[socket].req_length <= 0) {
+            continue;
+        }
+
+        if (network_caps_request_range(ctx, connections[socket].req, &requests[nb_requests].range) != 0) {
+            continue;
+        }
+
+        /* the current connection's token is the one swapped in */
+        requests[nb_requests].tab_string = (socket == current_socket) ?
+            tab_string : connections[socket].tab_string;
+        nb_requests += 1;
+    }
+
+    /* a request on its own gains nothing */
+    if (nb_requests > 1) {
+        SPAN_BEGIN("verify_requests");
+        modbus_verify_requests_network_caps(ctx, requests, nb_requests, verdicts);
+        SPAN_END("verify_requests");
+    }
+}
+#endif
+
+static void close_connection(int socket)
+{
+#if defined(MODBUS_SUBSCRIPTIONS)
+    vModbusSubscriptionsRelease(socket);
+#endif
+
+    close(socket);
+    memset(&connections[socket], 0, sizeof(connection_t));
+    connections[socket].socket = -1;
+
+    if (socket == current_socket) {
+        current_socket = -1;
+    }
+}
+
+/* print everything recorded during the session (cf. ModbusServer.c) */
+static void end_session(int session)
+{
+#if defined(MODBUS_MICROBENCHMARK)
+    vPrintMicrobenchmarkSamples();
+#endif
+
+#if defined(MODBUS_SPAN_TRACE)
+    vPrintSpanTrace();
+#endif
+
+#if defined(MODBUS_HEAP_PROFILE)
+    vPrintHeapProfile();
+#endif
+
+    if (trace != NULL) {
+        fflush(trace);
+    }
+
+    printf("%s %d\n", SESSION_END_MARKER, session);
+    fflush(stdout);
+
+#if defined(MODBUS_RUNTIME_CAPS)
+    vModbusCapsSessionEnd(&caps_dispatch);
+#if defined(MODBUS_MICROBENCHMARK)
+    /* printed with the next session's samples */
+    vModbusCapsMeasureDispatch(&caps_dispatch, NULL);
+#endif
+#endif
+}
+
+/***********
+ * FUNCTIONS
+ **********/
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int port = DEFAULT_PORT;
+    int exec_period_ms = 0;
+    int network_delay_ms = 0;
+    int max_sessions = 0;
+    int metrics_port = 0;
+    int sessions = 0;
+    char *modes = NULL;
+    int sessions_per_mode = DEFAULT_SESSIONS_PER_MODE;
+    int num_open = 0;
+    int server_socket;
+    int fd_max;
+    fd_set refset, rdset;
+    uint8_t *req;
+    uint8_t rsp[MODBUS_MAX_STRING_LENGTH];
+    int req_length, rsp_length;
+    char *function_name;
+    uint64_t start, end, diff, next_period = 0;
+
+    while ((opt = getopt(argc, argv, "p:e:d:n:m:w:c:s:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'e':
+                exec_period_ms = atoi(optarg);
+                break;
+            case 'd':
+                network_delay_ms = atoi(optarg);
+                break;
+            case 'n':
+                max_sessions = atoi(optarg);
+                break;
+            case 'm':
+                metrics_port = atoi(optarg);
+                break;
+            case 'w':
+                trace = pxTrafficTraceCreate(optarg);
+                if (trace == NULL) {
+                    fprintf(stderr, "Failed to create %s: %s\r\n", optarg, strerror(errno));
+                    exit(1);
+                }
+                break;
+#if defined(MODBUS_RUNTIME_CAPS)
+            case 'c':
+                modes = optarg;
+                break;
+            case 's':
+                sessions_per_mode = atoi(optarg);
+                break;
+#endif
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    server_initialisation(port, modes, sessions_per_mode);
+
+#if defined(MODBUS_METRICS)
+    if (metrics_port > 0 && xMetricsStartEndpoint((uint16_t)metrics_port) != 0) {
+        fprintf(stderr, "Failed to start the metrics endpoint\r\n");
+    }
+#else
+    (void)metrics_port;
+#endif
+
+    for (int i = 0; i < FD_SETSIZE; ++i) {
+        connections[i].socket = -1;
+    }
+
+    server_socket = modbus_tcp_listen(ctx, DEFAULT_BACKLOG);
+    if (server_socket == -1) {
+        fprintf(stderr, "Unable to listen on port %d: %s\r\n", port, modbus_strerror(errno));
+        exit(1);
+    }
+
+    FD_ZERO(&refset);
+    FD_SET(server_socket, &refset);
+    fd_max = server_socket;
+
+    printf("%s %d\n", SERVER_READY_MARKER, port);
+    fflush(stdout);
+
+    while (max_sessions == 0 || sessions < max_sessions) {
+        rdset = refset;
+        if (select(fd_max + 1, &rdset, NULL, NULL, NULL) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("select");
+            break;
+        }
+
+        for (int socket = 0; socket <= fd_max; ++socket) {
+            if (!FD_ISSET(socket, &rdset)) {
+                continue;
+            }
+
+            if (socket == server_socket) {
+                /* A client is asking for a new connection */
+                struct sockaddr_in client_addr;
+                socklen_t addr_length = sizeof(client_addr);
+                int new_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_length);
+
+                if (new_socket == -1) {
+                    perror("accept");
+                } else if (new_socket >= FD_SETSIZE) {
+                    fprintf(stderr, "Too many connections\r\n");
+                    close(new_socket);
+                } else {
+                    FD_SET(new_socket, &refset);
+                    if (new_socket > fd_max) {
+                        fd_max = new_socket;
+                    }
+                    connections[new_socket].socket = new_socket;
+                    connections[new_socket].trace_id = next_trace_id++;
+                    num_open += 1;
+                    /* the wait for a client isn't an overrun */
+                    next_period = 0;
+                    METRICS_CONNECTION();
+                }
+                continue;
+            }
+
+            switch_connection(socket);
+            connections[socket].req_length = modbus_receive(ctx, connections[socket].req);
+        }
+
+#if defined(MODBUS_NETWORK_CAPS) && !defined(MODBUS_RUNTIME_CAPS)
+        verify_requests(&rdset, fd_max, server_socket);
+#endif
+
+        for (int socket = 0; socket <= fd_max; ++socket) {
+            if (!FD_ISSET(socket, &rdset) || socket == server_socket) {
+                continue;
+            }
+
+            switch_connection(socket);
+            req = connections[socket].req;
+            req_length = connections[socket].req_length;
+
+            if (req_length == 0) {
+                /* not for this server; nothing to reply */
+                continue;
+            }
+
+            if (req_length > 0) {
+                record_request(socket, req, req_length);
+
+                sleep_ms(network_delay_ms);
+
+                function_name = modbus_get_function_name(ctx, req);
+
+                start = now_ns();
+                HEAP_PROFILE_BEGIN(function_name);
+                int rc = process_modbus_request(req, req_length, rsp, &rsp_length);
+                HEAP_PROFILE_END();
+                end = now_ns();
+                diff = end - start;
+
+#if defined(MODBUS_MICROBENCHMARK)
+                /* nanoseconds, rather than cycles as on FreeRTOS */
+                xMicrobenchmarkSample(REQUEST_PROCESSING, function_name, diff, 1);
+#endif
+                METRICS_REQUEST(modbus_get_function_code(ctx, req), diff);
+
+                sleep_ms(network_delay_ms);
+
+                if (rc != -1 && modbus_reply(ctx, rsp, rsp_length) != -1) {
+                    METRICS_BYTES(req_length, rsp_length);
+
+                    if (exec_period_ms > 0) {
+                        /* Block until the next, fixed execution period, or
+                         * record an overrun as a spare processing time of 0 */
+                        uint64_t period_ns = (uint64_t)exec_period_ms * 1000000ULL;
+
+                        end = now_ns();
+                        if (next_period == 0) {
+                            /* the first request of a connection starts the periods */
+                            next_period = end;
+                        }
+                        if (end > next_period + period_ns) {
+                            next_period = end;
+                            diff = 0;
+                            METRICS_OVERRUN();
+                        } else {
+                            next_period += period_ns;
+                            struct timespec t = {
+                                .tv_sec = (time_t)(next_period / 1000000000ULL),
+                                .tv_nsec = (long)(next_period % 1000000000ULL)
+                            };
+                            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR) {
+                            }
+                            diff = now_ns() - end;
+                        }
+#if defined(MODBUS_MICROBENCHMARK)
+                        xMicrobenchmarkSample(SPARE_PROCESSING, function_name, diff, 1);
+#endif
+                    }
+                    continue;
+                }
+            }
+
+            /* The client closed the connection, or the request failed
+             * (e.g., the network capability did not verify) */
+            FD_CLR(socket, &refset);
+            close_connection(socket);
+            num_open -= 1;
+
+            if (num_open == 0) {
+                sessions += 1;
+                end_session(sessions);
+            }
+        }
+    }
+
+    /* mb_mapping is not freed, since the object capabilities shim may have
+     * restricted its pointers (nor is it on FreeRTOS) */
+    if (trace != NULL) {
+        fclose(trace);
+    }
+
+    close(server_socket);
+    modbus_free(ctx);
+
+    return 0;
+}